@@ -0,0 +1,82 @@
+#ifndef TEENSY_41_SQLITE_HOST_ARDUINO
+#define TEENSY_41_SQLITE_HOST_ARDUINO
+
+/*
+** The few parts of the Teensy core used by the library, for the host build (env:native in platformio.ini).
+** Only the library and host_main.cpp are built against it, not the sketches of the Teensy environments.
+*/
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+using std::max;
+using std::min;
+
+#define FLASHMEM
+#define PROGMEM
+#define FASTRUN
+#define DMAMEM
+#define EXTMEM
+
+uint32_t micros();
+uint32_t millis();
+void delay(uint32_t in_milliseconds);
+void delayMicroseconds(uint32_t in_microseconds);
+void yield();
+
+// there is no PSRAM on the host
+inline void* extmem_malloc(size_t in_size) { return malloc(in_size); }
+inline void* extmem_realloc(void* io_pointer, size_t in_size) { return realloc(io_pointer, in_size); }
+inline void extmem_free(void* io_pointer) { free(io_pointer); }
+
+class String
+{
+  private:
+    std::string m_string;
+
+  public:
+    String(const char* in_string = "") : m_string(in_string ? in_string : "") {}
+
+    const char* c_str() const { return m_string.c_str(); }
+    unsigned int length() const { return static_cast<unsigned int>(m_string.length()); }
+
+    String& append(const char* in_string) { m_string.append(in_string); return *this; }
+    String& append(const String& in_string) { m_string.append(in_string.m_string); return *this; }
+
+    String operator+(const char* in_string) const { return String(*this).append(in_string); }
+    String operator+(const String& in_string) const { return String(*this).append(in_string); }
+    bool operator==(const String& in_string) const { return m_string == in_string.m_string; }
+};
+
+class HostSerial
+{
+  public:
+    void begin(unsigned long) {}
+    explicit operator bool() const { return true; }
+
+    size_t print(const char* in_string) { return fputs(in_string, stdout) >= 0 ? strlen(in_string) : 0; }
+    size_t print(const String& in_string) { return print(in_string.c_str()); }
+    size_t print(long in_value) { return static_cast<size_t>(::printf("%ld", in_value)); }
+    size_t print(unsigned long in_value) { return static_cast<size_t>(::printf("%lu", in_value)); }
+    size_t print(int in_value) { return print(static_cast<long>(in_value)); }
+    size_t print(unsigned int in_value) { return print(static_cast<unsigned long>(in_value)); }
+    size_t print(double in_value) { return static_cast<size_t>(::printf("%.2f", in_value)); }
+    size_t println() { return print("\n"); }
+    template <typename T> size_t println(T in_value) { return print(in_value) + println(); }
+
+    template <typename... T> int printf(const char* in_format, T... in_args) { return ::printf(in_format, in_args...); }
+};
+
+extern HostSerial Serial;
+
+// included by Arduino.h of the Teensy core as well
+#include <elapsedMillis.h>
+
+#endif // TEENSY_41_SQLITE_HOST_ARDUINO
@@ -0,0 +1,9 @@
+#ifndef TEENSY_41_SQLITE_HOST_TIME_LIB
+#define TEENSY_41_SQLITE_HOST_TIME_LIB
+
+#include <time.h>
+
+// now() of TimeLib: seconds since 1970
+time_t now();
+
+#endif // TEENSY_41_SQLITE_HOST_TIME_LIB
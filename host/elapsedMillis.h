@@ -0,0 +1,29 @@
+#ifndef TEENSY_41_SQLITE_HOST_ELAPSED_MILLIS
+#define TEENSY_41_SQLITE_HOST_ELAPSED_MILLIS
+
+#include <Arduino.h>
+
+// elapsedMillis and elapsedMicros of the Teensy core
+class elapsedMillis
+{
+  private:
+    uint32_t m_start;
+
+  public:
+    elapsedMillis() : m_start(millis()) {}
+    operator uint32_t() const { return millis() - m_start; }
+    elapsedMillis& operator=(uint32_t in_value) { m_start = millis() - in_value; return *this; }
+};
+
+class elapsedMicros
+{
+  private:
+    uint32_t m_start;
+
+  public:
+    elapsedMicros() : m_start(micros()) {}
+    operator uint32_t() const { return micros() - m_start; }
+    elapsedMicros& operator=(uint32_t in_value) { m_start = micros() - in_value; return *this; }
+};
+
+#endif // TEENSY_41_SQLITE_HOST_ELAPSED_MILLIS
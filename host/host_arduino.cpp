@@ -0,0 +1,41 @@
+#include <Arduino.h>
+#include <TimeLib.h>
+
+#include <chrono>
+#include <thread>
+
+HostSerial Serial;
+
+static const std::chrono::steady_clock::time_point s_start = std::chrono::steady_clock::now();
+
+uint32_t micros()
+{
+  auto elapsed = std::chrono::steady_clock::now() - s_start;
+  return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
+
+uint32_t millis()
+{
+  auto elapsed = std::chrono::steady_clock::now() - s_start;
+  return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
+}
+
+void delay(uint32_t in_milliseconds)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(in_milliseconds));
+}
+
+void delayMicroseconds(uint32_t in_microseconds)
+{
+  std::this_thread::sleep_for(std::chrono::microseconds(in_microseconds));
+}
+
+void yield()
+{
+  std::this_thread::yield();
+}
+
+time_t now()
+{
+  return time(nullptr);
+}
@@ -0,0 +1,883 @@
+#include <Arduino.h>
+
+#include "teensy41SQLite.hpp"
+#include "teensy41SQLiteCipher.hpp"
+#include "teensy41SQLiteIngest.hpp"
+#include "teensy41SQLiteMutex.hpp"
+#include "teensy41SQLiteTimeSeries.hpp"
+
+#include <elapsedMillis.h>
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+
+/*
+** Host build of the library (env:native in platformio.ini): the POSIX storage backend, the pthread mutex
+** backend and the SQLite library of the host. pio run -e native -t exec [-a <directory>] runs it, the
+** databases are created in <directory> (default: host_db/).
+*/
+
+const char* dbName = "host.db";
+
+T41SQLitePosixFilesystem posixFilesystem;
+
+void removeDatabase(const char* in_name)
+{
+  const char* suffixes[] = { "", "-journal", "-wal", "-shm" };
+
+  for (const char* suffix : suffixes)
+  {
+    String path = T41SQLite::getInstance().getDBDirFullPath();
+    path.append(in_name);
+    path.append(suffix);
+    T41SQLiteStorage::remove(&posixFilesystem, path.c_str());
+  }
+}
+
+bool checkSQLiteError(sqlite3* in_db, int in_rc, const char* in_label)
+{
+  if (in_rc == SQLITE_OK || in_rc == SQLITE_DONE || in_rc == SQLITE_ROW)
+  {
+    return true;
+  }
+
+  Serial.printf("%s: (%d) %s\n", in_label, in_rc, in_db ? sqlite3_errmsg(in_db) : sqlite3_errstr(in_rc));
+  return false;
+}
+
+int64_t queryInt(sqlite3* in_db, const char* in_sql)
+{
+  sqlite3_stmt* stmt = nullptr;
+  int64_t value = -1;
+
+  if (sqlite3_prepare_v2(in_db, in_sql, -1, &stmt, nullptr) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    value = sqlite3_column_int64(stmt, 0);
+  }
+
+  sqlite3_finalize(stmt);
+  return value;
+}
+
+/*
+** Inserts in_rows rows in one transaction and reads them back, in the journal mode in_journalMode.
+*/
+bool testSQLite(const char* in_journalMode, int in_rows = 10000)
+{
+  removeDatabase(dbName);
+
+  sqlite3* db = nullptr;
+  int rc = sqlite3_open(dbName, &db);
+  String pragma = "PRAGMA journal_mode=";
+  pragma.append(in_journalMode);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, pragma.c_str(), nullptr, nullptr, nullptr);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, "CREATE TABLE Samples(id INTEGER PRIMARY KEY, value REAL); BEGIN;", nullptr, nullptr, nullptr);
+  }
+
+  elapsedMicros insertTime;
+  sqlite3_stmt* stmt = nullptr;
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_prepare_v2(db, "INSERT INTO Samples(value) VALUES (?1);", -1, &stmt, nullptr);
+  }
+
+  for (int i = 0; i < in_rows && rc == SQLITE_OK; ++i)
+  {
+    sqlite3_bind_double(stmt, 1, i * 0.5);
+    rc = sqlite3_step(stmt) == SQLITE_DONE ? sqlite3_reset(stmt) : sqlite3_errcode(db);
+  }
+
+  sqlite3_finalize(stmt);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+  }
+
+  uint32_t insertMicros = insertTime;
+  bool isOk = checkSQLiteError(db, rc, in_journalMode) && queryInt(db, "SELECT count(*) FROM Samples;") == in_rows &&
+              queryInt(db, "SELECT sum(id) FROM Samples;") == static_cast<int64_t>(in_rows) * (in_rows + 1) / 2;
+
+  Serial.printf("testSQLite %-6s %d rows: %lu us, %s\n", in_journalMode, in_rows, static_cast<unsigned long>(insertMicros),
+                isOk ? "ok" : "FAILED");
+  sqlite3_close(db);
+
+  return isOk;
+}
+
+/*
+** A time series table (its own file, see teensy41SQLiteTimeSeries.hpp) on the POSIX backend.
+*/
+bool testTimeSeries(int in_rows = 10000)
+{
+  removeDatabase(dbName);
+
+  String tsPath = T41SQLite::getInstance().getDBDirFullPath();
+  tsPath.append("Series.ts");
+  T41SQLiteStorage::remove(&posixFilesystem, tsPath.c_str());
+
+  sqlite3* db = nullptr;
+  int rc = sqlite3_open(dbName, &db);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = T41SQLiteTimeSeries::registerModule(db);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, "CREATE VIRTUAL TABLE Series USING timeseries(value REAL);", nullptr, nullptr, nullptr);
+  }
+
+  char* insert = sqlite3_mprintf("BEGIN; WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < %d) "
+                                 "INSERT INTO Series SELECT x * 10, x * 0.5 FROM c; COMMIT;", in_rows);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = insert ? sqlite3_exec(db, insert, nullptr, nullptr, nullptr) : SQLITE_NOMEM;
+  }
+
+  sqlite3_free(insert);
+
+  bool isOk = checkSQLiteError(db, rc, "timeseries") && queryInt(db, "SELECT count(*) FROM Series;") == in_rows &&
+              queryInt(db, "SELECT count(*) FROM Series WHERE ts BETWEEN 100 AND 190;") == 10;
+
+  Serial.printf("testTimeSeries %d rows: %s\n", in_rows, isOk ? "ok" : "FAILED");
+  sqlite3_exec(db, "DROP TABLE Series;", nullptr, nullptr, nullptr);
+  sqlite3_close(db);
+
+  return isOk;
+}
+
+/*
+** The maintenance scheduler (T41SQLite::runMaintenance): a rolling delete, the incremental vacuum of the
+** freed pages and the ANALYZE of in_tables indexed tables run in calls of in_budgetMicros. A call may only
+** exceed the budget by its last slice, Optimize has to take one slice per table.
+*/
+bool testMaintenance(int in_tables = 4, int in_rows = 5000, uint32_t in_budgetMicros = 2000)
+{
+  removeDatabase(dbName);
+
+  sqlite3* db = nullptr;
+  int rc = sqlite3_open(dbName, &db);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, "PRAGMA auto_vacuum=INCREMENTAL; CREATE TABLE Log(time INTEGER, text TEXT); BEGIN;",
+                      nullptr, nullptr, nullptr);
+  }
+
+  for (int t = 0; t < in_tables && rc == SQLITE_OK; ++t)
+  {
+    char* sql = sqlite3_mprintf("CREATE TABLE Data%d(id INTEGER PRIMARY KEY, value INTEGER); "
+                                "CREATE INDEX DataValue%d ON Data%d(value); "
+                                "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < %d) "
+                                "INSERT INTO Data%d(value) SELECT x %% 97 FROM c; "
+                                "INSERT INTO Log SELECT value, hex(randomblob(16)) FROM Data%d;",
+                                t, t, t, in_rows, t, t);
+    rc = sql ? sqlite3_exec(db, sql, nullptr, nullptr, nullptr) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+  }
+
+  T41SQLite& t41SQLite = T41SQLite::getInstance();
+  const int taskCount = 3;
+  int ids[taskCount] = {};
+
+  if (rc == SQLITE_OK)
+  {
+    rc = t41SQLite.addMaintenanceTask(db, T41SQLite::MaintenanceTask::Sql, 0,
+                                      "DELETE FROM Log WHERE rowid IN (SELECT rowid FROM Log WHERE time < 90 LIMIT 50);",
+                                      &ids[0]);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = t41SQLite.addMaintenanceTask(db, T41SQLite::MaintenanceTask::IncrementalVacuum, 0, nullptr, &ids[1]);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = t41SQLite.addMaintenanceTask(db, T41SQLite::MaintenanceTask::Optimize, 0, nullptr, &ids[2]);
+  }
+
+  bool isOk = checkSQLiteError(db, rc, "maintenance");
+  bool isDone = false;
+  int calls = 0;
+  uint32_t maxCallMicros = 0;
+  uint32_t maxOverrunMicros = 0;
+
+  while (isOk && not isDone && calls < 10000)
+  {
+    elapsedMicros callTime;
+    rc = t41SQLite.runMaintenance(in_budgetMicros);
+    uint32_t callMicros = callTime;
+    uint32_t maxSliceMicros = 0;
+    isDone = true;
+    ++calls;
+
+    for (int id : ids)
+    {
+      const T41SQLite::MaintenanceStats* stats = t41SQLite.getMaintenanceStats(id);
+      maxSliceMicros = max(maxSliceMicros, stats->maxMicros);
+      isDone = isDone && stats->completions > 0;
+    }
+
+    isOk = checkSQLiteError(db, rc, "runMaintenance") && callMicros <= in_budgetMicros + maxSliceMicros;
+    maxCallMicros = max(maxCallMicros, callMicros);
+    maxOverrunMicros = max(maxOverrunMicros, callMicros > in_budgetMicros ? callMicros - in_budgetMicros : 0);
+  }
+
+  const T41SQLite::MaintenanceStats* optimizeStats = t41SQLite.getMaintenanceStats(ids[2]);
+  isOk = isOk && isDone && optimizeStats->slices > static_cast<uint32_t>(in_tables) &&
+         queryInt(db, "SELECT count(*) FROM Log WHERE time < 90;") == 0 &&
+         queryInt(db, "PRAGMA freelist_count;") == 0 &&
+         queryInt(db, "SELECT count(DISTINCT tbl) FROM sqlite_stat1 WHERE tbl LIKE 'Data%';") == in_tables;
+
+  Serial.printf("testMaintenance budget %lu us: %d calls, max %lu us (over budget %lu us), optimize %lu slices "
+                "max %lu us, %s\n", static_cast<unsigned long>(in_budgetMicros), calls,
+                static_cast<unsigned long>(maxCallMicros), static_cast<unsigned long>(maxOverrunMicros),
+                static_cast<unsigned long>(optimizeStats ? optimizeStats->slices : 0),
+                static_cast<unsigned long>(optimizeStats ? optimizeStats->maxMicros : 0), isOk ? "ok" : "FAILED");
+  t41SQLite.removeMaintenanceTasks(db);
+  sqlite3_close(db);
+
+  return isOk;
+}
+
+/*
+** benchmarkLocking of the sketch: a writer commits batches of rows, reader connections to the same file
+** query between its inserts (SHARED next to RESERVED), the commit waits for them (PENDING, EXCLUSIVE).
+*/
+bool benchmarkLocking(int in_batches = 100, int in_batchRows = 50)
+{
+  const int readerCounts[] = { 0, 3 };
+  bool isOk = true;
+
+  for (int readerCount : readerCounts)
+  {
+    removeDatabase("locking.db");
+
+    sqlite3* writer = nullptr;
+    int rc = sqlite3_open("locking.db", &writer);
+
+    if (rc == SQLITE_OK)
+    {
+      rc = sqlite3_exec(writer, "CREATE TABLE Samples (ts INTEGER PRIMARY KEY, temperature REAL);", nullptr, nullptr, nullptr);
+    }
+
+    if (not checkSQLiteError(writer, rc, "benchmarkLocking"))
+    {
+      sqlite3_close(writer);
+      return false;
+    }
+
+    sqlite3* readers[3];
+    sqlite3_stmt* queries[3];
+
+    for (int i = 0; i < readerCount; ++i)
+    {
+      sqlite3_open("locking.db", &readers[i]);
+      sqlite3_prepare_v2(readers[i], "SELECT count(*), avg(temperature) FROM Samples WHERE ts > ?1;", -1, &queries[i], nullptr);
+    }
+
+    sqlite3_stmt* insert = nullptr;
+    sqlite3_prepare_v2(writer, "INSERT INTO Samples VALUES (?1, ?2);", -1, &insert, nullptr);
+    int queryCount = 0;
+    int busyCount = 0;
+    int64_t lastCount = 0;
+    bool isConsistent = true;
+    elapsedMicros runTime;
+
+    for (int batch = 0; batch < in_batches; ++batch)
+    {
+      sqlite3_exec(writer, "BEGIN;", nullptr, nullptr, nullptr);
+
+      for (int row = 0; row < in_batchRows; ++row)
+      {
+        sqlite3_bind_int(insert, 1, batch * in_batchRows + row);
+        sqlite3_bind_double(insert, 2, 20.0 + row * 0.05);
+        sqlite3_step(insert);
+        sqlite3_reset(insert);
+      }
+
+      // the readers see the committed batches only
+      for (int i = 0; i < readerCount; ++i)
+      {
+        sqlite3_bind_int(queries[i], 1, -1);
+
+        if (sqlite3_step(queries[i]) == SQLITE_ROW)
+        {
+          ++queryCount;
+          lastCount = sqlite3_column_int64(queries[i], 0);
+          isConsistent = isConsistent && lastCount == static_cast<int64_t>(batch) * in_batchRows;
+        }
+
+        sqlite3_reset(queries[i]);
+      }
+
+      while ((rc = sqlite3_exec(writer, "COMMIT;", nullptr, nullptr, nullptr)) == SQLITE_BUSY)
+      {
+        ++busyCount;
+      }
+    }
+
+    uint32_t runMicros = runTime;
+    sqlite3_finalize(insert);
+
+    for (int i = 0; i < readerCount; ++i)
+    {
+      sqlite3_finalize(queries[i]);
+      sqlite3_close(readers[i]);
+    }
+
+    bool isRunOk = rc == SQLITE_OK && isConsistent && queryCount == readerCount * in_batches &&
+                   queryInt(writer, "SELECT count(*) FROM Samples;") == static_cast<int64_t>(in_batches) * in_batchRows &&
+                   queryInt(writer, "SELECT count(*) FROM pragma_integrity_check WHERE integrity_check <> 'ok';") == 0;
+    sqlite3_close(writer);
+
+    Serial.printf("benchmarkLocking %d readers: %.1f ms per commit, %d queries, %d busy commits, %s\n", readerCount,
+                  runMicros / 1000.0 / in_batches, queryCount, busyCount, isRunOk ? "ok" : "FAILED");
+    isOk = isOk && isRunOk;
+  }
+
+  removeDatabase("locking.db");
+
+  return isOk;
+}
+
+struct ThreadsBenchmark
+{
+  std::atomic<bool> stop{false};
+  std::atomic<uint32_t> queryCount{0};
+  std::atomic<uint32_t> commitCount{0};
+  std::atomic<uint32_t> errorCount{0};
+};
+
+void benchmarkThreadsWriter(ThreadsBenchmark* io_benchmark)
+{
+  sqlite3* db;
+  sqlite3_open("threads.db", &db);
+  sqlite3_busy_timeout(db, 1000);
+  sqlite3_stmt* insert;
+  sqlite3_prepare_v2(db, "INSERT INTO Samples (temperature) VALUES (?1);", -1, &insert, nullptr);
+
+  while (not io_benchmark->stop)
+  {
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+      ++io_benchmark->errorCount;
+      continue;
+    }
+
+    for (int row = 0; row < 10; ++row)
+    {
+      sqlite3_bind_double(insert, 1, 20.0 + row * 0.05);
+      sqlite3_step(insert);
+      sqlite3_reset(insert);
+    }
+
+    if (sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr) == SQLITE_OK)
+    {
+      ++io_benchmark->commitCount;
+    }
+    else
+    {
+      ++io_benchmark->errorCount;
+      sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+    }
+  }
+
+  sqlite3_finalize(insert);
+  sqlite3_close(db);
+}
+
+void benchmarkThreadsReader(ThreadsBenchmark* io_benchmark)
+{
+  sqlite3* db;
+  sqlite3_open("threads.db", &db);
+  sqlite3_busy_timeout(db, 1000);
+  sqlite3_stmt* query;
+  sqlite3_prepare_v2(db, "SELECT count(*), avg(temperature) FROM Samples WHERE ts > (SELECT max(ts) FROM Samples) - 500;",
+                     -1, &query, nullptr);
+
+  if (not query)
+  {
+    ++io_benchmark->errorCount;
+  }
+
+  while (query && not io_benchmark->stop)
+  {
+    if (sqlite3_step(query) == SQLITE_ROW)
+    {
+      ++io_benchmark->queryCount;
+    }
+    else
+    {
+      ++io_benchmark->errorCount;
+    }
+
+    sqlite3_reset(query);
+  }
+
+  sqlite3_finalize(query);
+  sqlite3_close(db);
+}
+
+/*
+** benchmarkThreads of the sketch on std::thread and the pthread mutex backend: each thread has its own
+** connection, the VFS serializes the file access. Every commit of the writer adds 10 rows, so the rows
+** counted afterwards show, that no commit was lost or torn.
+*/
+bool benchmarkThreads(uint32_t in_runMillis = 1000)
+{
+  const char* journalModes[] = { "DELETE", "WAL" };
+  const int readerCounts[] = { 0, 1, 2, 4 };
+  bool isOk = true;
+
+  for (const char* journalMode : journalModes)
+  {
+    removeDatabase("threads.db");
+
+    sqlite3* db;
+    sqlite3_open("threads.db", &db);
+    String setup = "PRAGMA journal_mode=";
+    setup.append(journalMode);
+    setup.append(";CREATE TABLE Samples (ts INTEGER PRIMARY KEY, temperature REAL);"
+                 "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 5000) "
+                 "INSERT INTO Samples (temperature) SELECT 20.0 + i % 100 * 0.05 FROM n;");
+    int rc = sqlite3_exec(db, setup.c_str(), nullptr, nullptr, nullptr);
+    int64_t rowCount = 5000;
+
+    for (int readerCount : readerCounts)
+    {
+      if (not checkSQLiteError(db, rc, "benchmarkThreads"))
+      {
+        isOk = false;
+        break;
+      }
+
+      ThreadsBenchmark benchmark;
+      std::thread writer(benchmarkThreadsWriter, &benchmark);
+      std::thread readers[4];
+
+      for (int i = 0; i < readerCount; ++i)
+      {
+        readers[i] = std::thread(benchmarkThreadsReader, &benchmark);
+      }
+
+      delay(in_runMillis);
+      benchmark.stop = true;
+      writer.join();
+
+      for (int i = 0; i < readerCount; ++i)
+      {
+        readers[i].join();
+      }
+
+      rowCount += 10 * static_cast<int64_t>(benchmark.commitCount);
+      bool isRunOk = benchmark.errorCount == 0 && benchmark.commitCount > 0 &&
+                     (readerCount == 0 || benchmark.queryCount > 0) &&
+                     queryInt(db, "SELECT count(*) FROM Samples;") == rowCount;
+
+      Serial.printf("benchmarkThreads %-6s 1 writer + %d readers: %.1f queries/s, %.1f commits/s, %lu errors, %s\n",
+                    journalMode, readerCount, benchmark.queryCount * 1000.0 / in_runMillis,
+                    benchmark.commitCount * 1000.0 / in_runMillis, static_cast<unsigned long>(benchmark.errorCount.load()),
+                    isRunOk ? "ok" : "FAILED");
+      isOk = isOk && isRunOk;
+    }
+
+    isOk = isOk && queryInt(db, "SELECT count(*) FROM pragma_integrity_check WHERE integrity_check <> 'ok';") == 0;
+    sqlite3_exec(db, "PRAGMA journal_mode=DELETE;", nullptr, nullptr, nullptr);
+    sqlite3_close(db);
+  }
+
+  removeDatabase("threads.db");
+
+  return isOk;
+}
+
+struct IngestSample
+{
+  uint32_t time;
+  uint32_t sequence;
+};
+
+int bindIngestSample(sqlite3_stmt* io_stmt, const IngestSample& in_sample)
+{
+  sqlite3_bind_int64(io_stmt, 1, in_sample.time);
+  return sqlite3_bind_int64(io_stmt, 2, in_sample.sequence);
+}
+
+/*
+** One run of benchmarkIngest: a producer thread in place of the IntervalTimer pushes in_rateHz samples per
+** second, the main thread drains. The table rejects every 10000th sample (CHECK), so failing records are
+** reported and skipped instead of stalling the ingest. Returns false, if the counts do not add up.
+*/
+bool runIngest(uint32_t in_rateHz, uint32_t in_seconds, uint32_t& out_overflowCount)
+{
+  removeDatabase(dbName);
+
+  std::unique_ptr<T41SQLiteIngest<IngestSample, 4096>> ingest(new T41SQLiteIngest<IngestSample, 4096>());
+  sqlite3* db = nullptr;
+  int rc = sqlite3_open(dbName, &db);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL; "
+                          "CREATE TABLE Ingest (time INTEGER, sequence INTEGER CHECK (sequence % 10000 <> 9999));",
+                      nullptr, nullptr, nullptr);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = ingest->begin(db, "INSERT INTO Ingest VALUES (?1, ?2);", bindIngestSample, 1024);
+  }
+
+  if (not checkSQLiteError(db, rc, "benchmarkIngest"))
+  {
+    sqlite3_close(db);
+    return false;
+  }
+
+  std::atomic<bool> isRunning{true};
+  uint32_t produced = 0;
+  std::thread producer([&]()
+  {
+    elapsedMicros runTime;
+
+    while (isRunning.load(std::memory_order_relaxed))
+    {
+      uint64_t due = static_cast<uint64_t>(static_cast<uint32_t>(runTime)) * in_rateHz / 1000000;
+
+      for (; produced < due; ++produced)
+      {
+        ingest->push({ micros(), produced });
+      }
+
+      std::this_thread::yield();
+    }
+  });
+
+  elapsedMillis runTime;
+
+  while (runTime < in_seconds * 1000)
+  {
+    ingest->drain(2000);
+  }
+
+  isRunning = false;
+  producer.join();
+  rc = ingest->end();
+
+  int64_t rows = queryInt(db, "SELECT count(*) FROM Ingest;");
+  bool isOk = rc == SQLITE_OK && rows == ingest->getInsertedCount() &&
+              produced == ingest->getInsertedCount() + ingest->getFailedCount() + ingest->getOverflowCount();
+  out_overflowCount = ingest->getOverflowCount();
+
+  Serial.printf("benchmarkIngest %6lu Hz: produced %lu, inserted %lu, failed %lu, overflows %lu, batches %lu, "
+                "longest drain %lu us, high water mark %lu, %s\n",
+                static_cast<unsigned long>(in_rateHz), static_cast<unsigned long>(produced),
+                static_cast<unsigned long>(ingest->getInsertedCount()), static_cast<unsigned long>(ingest->getFailedCount()),
+                static_cast<unsigned long>(ingest->getOverflowCount()), static_cast<unsigned long>(ingest->getBatchCount()),
+                static_cast<unsigned long>(ingest->getMaxDrainMicros()),
+                static_cast<unsigned long>(ingest->getBuffer().getHighWaterMark()),
+                not isOk ? "FAILED" : out_overflowCount > 0 ? "samples lost" : "no loss");
+  sqlite3_close(db);
+
+  return isOk;
+}
+
+/*
+** benchmarkIngest of the sketch: doubles the rate from in_minRateHz until samples are lost and reports the
+** highest rate without loss. Fails, if samples are lost at in_minRateHz already.
+*/
+bool benchmarkIngest(uint32_t in_minRateHz = 10000, uint32_t in_maxRateHz = 320000, uint32_t in_seconds = 2)
+{
+  uint32_t sustainedRateHz = 0;
+  bool isOk = true;
+
+  for (uint32_t rateHz = in_minRateHz; rateHz <= in_maxRateHz; rateHz *= 2)
+  {
+    uint32_t overflowCount = 0;
+    isOk = runIngest(rateHz, in_seconds, overflowCount) && isOk;
+
+    if (overflowCount > 0)
+    {
+      break;
+    }
+
+    sustainedRateHz = rateHz;
+  }
+
+  isOk = sustainedRateHz > 0 && isOk;
+  Serial.printf("benchmarkIngest: %lu Hz sustained without sample loss, %s\n",
+                static_cast<unsigned long>(sustainedRateHz), isOk ? "ok" : "FAILED");
+
+  return isOk;
+}
+
+/*
+** benchmarkCompression of the sketch: the same rows in a plain and a compressed database, the ratio of the
+** page bytes to the file size, the write rate, the time of the open (a container is scanned) and cold lookups.
+*/
+bool benchmarkCompression(int in_rows = 20000, int in_lookups = 1000)
+{
+  const char* names[] = { "plain.db", "packed.db" };
+  const char* uris[] = { "plain.db", "file:packed.db?compress=1" };
+  bool isOk = true;
+
+  for (int i = 0; i < 2; ++i)
+  {
+    removeDatabase(names[i]);
+
+    sqlite3* db = nullptr;
+    int rc = sqlite3_open(uris[i], &db);
+    char* insert = sqlite3_mprintf("CREATE TABLE Samples (ts INTEGER PRIMARY KEY, temperature REAL, pressure REAL, "
+                                   "state TEXT); BEGIN; "
+                                   "WITH RECURSIVE c(x) AS (SELECT 0 UNION ALL SELECT x + 1 FROM c WHERE x < %d) "
+                                   "INSERT INTO Samples SELECT 1700000000000 + x * 1000, 20.0 + (x %% 100) * 0.05, "
+                                   "1013.0 - (x %% 50) * 0.1, CASE WHEN x %% 10 = 0 THEN 'heating' ELSE 'idle' END "
+                                   "FROM c; COMMIT;", in_rows - 1);
+    elapsedMicros insertTime;
+
+    if (rc == SQLITE_OK)
+    {
+      rc = insert ? sqlite3_exec(db, insert, nullptr, nullptr, nullptr) : SQLITE_NOMEM;
+    }
+
+    uint32_t insertMicros = insertTime;
+    sqlite3_free(insert);
+    int64_t logicalSize = queryInt(db, "SELECT page_count * page_size FROM pragma_page_count, pragma_page_size;");
+    sqlite3_close(db);
+
+    // lookups with a cold page cache
+    sqlite3_stmt* stmt = nullptr;
+    int found = 0;
+    elapsedMicros openTime;
+
+    if (rc == SQLITE_OK)
+    {
+      rc = sqlite3_open(uris[i], &db);
+    }
+
+    if (rc == SQLITE_OK)
+    {
+      rc = sqlite3_exec(db, "PRAGMA cache_size=8;", nullptr, nullptr, nullptr);
+    }
+
+    uint32_t openMicros = openTime;
+
+    if (rc == SQLITE_OK)
+    {
+      rc = sqlite3_prepare_v2(db, "SELECT temperature FROM Samples WHERE ts = ?1;", -1, &stmt, nullptr);
+    }
+
+    elapsedMicros lookupTime;
+
+    for (int lookup = 0; rc == SQLITE_OK && lookup < in_lookups; ++lookup)
+    {
+      sqlite3_bind_int64(stmt, 1, 1700000000000LL + ((lookup * 7919LL) % in_rows) * 1000LL);
+      found += sqlite3_step(stmt) == SQLITE_ROW ? 1 : 0;
+      sqlite3_reset(stmt);
+    }
+
+    uint32_t lookupMicros = lookupTime;
+    sqlite3_finalize(stmt);
+    bool isRunOk = checkSQLiteError(db, rc, "benchmarkCompression") && found == in_lookups &&
+                   queryInt(db, "SELECT count(*) FROM Samples;") == in_rows;
+    sqlite3_close(db);
+
+    String path = T41SQLite::getInstance().getDBDirFullPath();
+    path.append(names[i]);
+    struct stat fileStat;
+    uint64_t fileSize = stat(path.c_str(), &fileStat) == 0 ? static_cast<uint64_t>(fileStat.st_size) : 0;
+
+    Serial.printf("benchmarkCompression %-25s %lld bytes of pages in %llu bytes (ratio %.2f), write %.2f MB/s, "
+                  "open %lu us, lookup %.1f us, %s\n",
+                  uris[i], static_cast<long long>(logicalSize), static_cast<unsigned long long>(fileSize),
+                  fileSize ? static_cast<double>(logicalSize) / fileSize : 0.0,
+                  static_cast<double>(logicalSize) / insertMicros, static_cast<unsigned long>(openMicros),
+                  static_cast<double>(lookupMicros) / in_lookups, isRunOk ? "ok" : "FAILED");
+    isOk = isOk && isRunOk;
+    removeDatabase(names[i]);
+  }
+
+  return isOk;
+}
+
+/*
+** benchmarkEncryption of the sketch with the software cipher: the known answer of FIPS-197 (appendix C.1),
+** the throughput of the cipher and inserts and cold lookups of an encrypted database. The host has no TRNG,
+** so setCipher refuses the unseeded cipher until it is seeded from std::random_device.
+*/
+bool benchmarkEncryption(int in_pages = 1024, int in_rows = 20000, int in_lookups = 1000)
+{
+  static const uint8_t key[T41SQLiteCipher::KEY_SIZE] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                                                          0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+  static const uint8_t plain[T41SQLiteCipher::BLOCK_SIZE] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+                                                              0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+  static const uint8_t expected[T41SQLiteCipher::BLOCK_SIZE] = { 0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+                                                                 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a };
+  static T41SQLiteSoftwareCipher cipher;
+  static uint8_t page[4096];
+
+  uint8_t block[T41SQLiteCipher::BLOCK_SIZE];
+  cipher.setKey(key, sizeof(key));
+  cipher.encryptBlock(plain, block);
+  bool isOk = memcmp(block, expected, sizeof(block)) == 0;
+
+  isOk = T41SQLite::getInstance().setCipher(&cipher) == SQLITE_MISUSE && isOk;
+
+  std::random_device random;
+  uint32_t seed[4] = { random(), random(), random(), random() };
+  cipher.seedNonces(seed, sizeof(seed));
+  isOk = T41SQLite::getInstance().setCipher(&cipher) == SQLITE_OK && isOk;
+
+  uint8_t nonce[T41SQLiteCipher::NONCE_SIZE];
+  elapsedMicros cryptTime;
+
+  for (int i = 0; i < in_pages; ++i)
+  {
+    cipher.generateNonce(nonce);
+    cipher.crypt(nonce, page, sizeof(page));
+  }
+
+  uint32_t cryptMicros = cryptTime;
+
+  removeDatabase("secret.db");
+  sqlite3* db = nullptr;
+  int rc = sqlite3_open("file:secret.db?encrypt=1", &db);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = T41SQLite::getInstance().prepareEncryption(db);
+  }
+
+  char* insert = sqlite3_mprintf("CREATE TABLE Samples (ts INTEGER PRIMARY KEY, temperature REAL, state TEXT); BEGIN; "
+                                 "WITH RECURSIVE c(x) AS (SELECT 0 UNION ALL SELECT x + 1 FROM c WHERE x < %d) "
+                                 "INSERT INTO Samples SELECT 1700000000000 + x * 1000, 20.0 + (x %% 100) * 0.05, "
+                                 "CASE WHEN x %% 10 = 0 THEN 'heating' ELSE 'idle' END FROM c; COMMIT;", in_rows - 1);
+  elapsedMicros insertTime;
+
+  if (rc == SQLITE_OK)
+  {
+    rc = insert ? sqlite3_exec(db, insert, nullptr, nullptr, nullptr) : SQLITE_NOMEM;
+  }
+
+  uint32_t insertMicros = insertTime;
+  sqlite3_free(insert);
+  sqlite3_close(db);
+
+  // lookups with a cold page cache, every page read is decrypted
+  sqlite3_stmt* stmt = nullptr;
+  int found = 0;
+  elapsedMicros lookupTime;
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_open("file:secret.db?encrypt=1", &db);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    sqlite3_exec(db, "PRAGMA cache_size=8;", nullptr, nullptr, nullptr);
+    rc = sqlite3_prepare_v2(db, "SELECT temperature FROM Samples WHERE ts = ?1;", -1, &stmt, nullptr);
+  }
+
+  for (int lookup = 0; rc == SQLITE_OK && lookup < in_lookups; ++lookup)
+  {
+    sqlite3_bind_int64(stmt, 1, 1700000000000LL + ((lookup * 7919LL) % in_rows) * 1000LL);
+    found += sqlite3_step(stmt) == SQLITE_ROW ? 1 : 0;
+    sqlite3_reset(stmt);
+  }
+
+  uint32_t lookupMicros = lookupTime;
+  sqlite3_finalize(stmt);
+  isOk = checkSQLiteError(db, rc, "benchmarkEncryption") && found == in_lookups &&
+         queryInt(db, "SELECT count(*) FROM Samples WHERE state = 'heating';") == (in_rows + 9) / 10 && isOk;
+  sqlite3_close(db);
+
+  // the plain text must not be in the file
+  String path = T41SQLite::getInstance().getDBDirFullPath();
+  path.append("secret.db");
+  FILE* file = fopen(path.c_str(), "rb");
+  std::string content;
+  char buffer[4096];
+  size_t nRead;
+
+  while (file && (nRead = fread(buffer, 1, sizeof(buffer), file)) > 0)
+  {
+    content.append(buffer, nRead);
+  }
+
+  isOk = file && not content.empty() && content.find("heating") == std::string::npos && isOk;
+
+  if (file)
+  {
+    fclose(file);
+  }
+
+  Serial.printf("benchmarkEncryption %s cipher: %.2f MB/s, %d rows: insert %.1f ms, lookup %.1f us, %s\n",
+                cipher.getName(), static_cast<double>(in_pages) * sizeof(page) / cryptMicros, in_rows,
+                insertMicros / 1000.0, static_cast<double>(lookupMicros) / in_lookups, isOk ? "ok" : "FAILED");
+  T41SQLite::getInstance().setCipher(nullptr);
+  removeDatabase("secret.db");
+
+  return isOk;
+}
+
+int main(int argc, char** argv)
+{
+  String dbDir = argc > 1 ? argv[1] : "host_db";
+  dbDir.append("/");
+  mkdir(dbDir.c_str(), 0755);
+
+  T41SQLite& t41SQLite = T41SQLite::getInstance();
+  t41SQLite.setDBDirFullPath(dbDir);
+  int rc = t41SQLite.begin(&posixFilesystem);
+
+  if (rc != SQLITE_OK)
+  {
+    Serial.printf("T41SQLite::begin: (%d) %s\n", rc, sqlite3_errstr(rc));
+    return 1;
+  }
+
+  Serial.printf("SQLite %s, vfs %s, storage %s, mutex %s, threadsafe %d, databases in %s\n", sqlite3_libversion(),
+                sqlite3_vfs_find(nullptr)->zName, T41SQLiteStorage::NAME, T41SQLiteMutex::getName(), sqlite3_threadsafe(),
+                dbDir.c_str());
+
+  bool isOk = testSQLite("DELETE");
+  isOk = testSQLite("WAL") && isOk;
+  isOk = testTimeSeries() && isOk;
+  isOk = testMaintenance() && isOk;
+  isOk = benchmarkIngest() && isOk;
+  isOk = benchmarkLocking() && isOk;
+  isOk = benchmarkThreads() && isOk;
+  isOk = benchmarkCompression() && isOk;
+  isOk = benchmarkEncryption() && isOk;
+
+  removeDatabase(dbName);
+  t41SQLite.end();
+
+  Serial.println(isOk ? "host tests: ok" : "host tests: FAILED");
+  return isOk ? 0 : 1;
+}
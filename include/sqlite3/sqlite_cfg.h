@@ -0,0 +1,29 @@
+#ifndef TEENSY_41_SQLITE_CFG
+#define TEENSY_41_SQLITE_CFG
+
+/*
+** Options of sqlite3.c, which follow from the options of the library. library.json defines
+** _HAVE_SQLITE_CONFIG_H, so sqlite3.c includes this file before anything else. Plain C, the preprocessor only.
+**
+** SQLITE_THREADSAFE is 0 (no mutexes), unless a mutex backend is chosen with TEENSY_41_SQLITE_MUTEX_BACKEND
+** (see teensy41SQLiteMutex.hpp), which opts in to 1. A SQLITE_THREADSAFE in the build_flags of the project
+** takes precedence.
+*/
+#define TEENSY_41_SQLITE_MUTEX_NONE 0
+#define TEENSY_41_SQLITE_MUTEX_TEENSYTHREADS 1
+#define TEENSY_41_SQLITE_MUTEX_FREERTOS 2
+#define TEENSY_41_SQLITE_MUTEX_PTHREAD 3
+
+#ifndef TEENSY_41_SQLITE_MUTEX_BACKEND
+  #define TEENSY_41_SQLITE_MUTEX_BACKEND TEENSY_41_SQLITE_MUTEX_NONE
+#endif
+
+#ifndef SQLITE_THREADSAFE
+  #if TEENSY_41_SQLITE_MUTEX_BACKEND == TEENSY_41_SQLITE_MUTEX_NONE
+    #define SQLITE_THREADSAFE 0
+  #else
+    #define SQLITE_THREADSAFE 1
+  #endif
+#endif
+
+#endif // TEENSY_41_SQLITE_CFG
@@ -3,13 +3,185 @@
 
 #include "sqlite3.h"
 
-#include <FS.h>
+#include "teensy41SQLiteStorage.hpp"
+
+#include <Arduino.h>
+
+/*
+** Statically sized buffers placed in DTCM (section .bss.t41sqlite.dtcm.*, see imxrt1062_t41_sqlite3.ld).
+** They are part of .bss, so the startup code zeroes them. A count of 0 reserves no memory and disables the
+** feature.
+**
+** TEENSY_41_SQLITE_DTCM_LOOKASIDE_*: lookaside pool for one connection (see T41SQLite::useDTCMLookaside)
+** TEENSY_41_SQLITE_DTCM_JOURNAL_BUFFERS: write buffers for journal files (SQLITE_VFS_JOURNAL_BUFFERSZ each)
+** TEENSY_41_SQLITE_DTCM_PAGE_*: page cache slots (SQLITE_CONFIG_PAGECACHE), the page cache takes
+**   slots from this pool first: the first pages loaded into any page cache get them (usually the schema and
+**   the pages of the first queries) and keep them until they are evicted, the pool does not pick root or
+**   interior pages
+*/
+#ifndef TEENSY_41_SQLITE_DTCM_LOOKASIDE_SLOT_SIZE
+  #define TEENSY_41_SQLITE_DTCM_LOOKASIDE_SLOT_SIZE 128
+#endif
+
+#ifndef TEENSY_41_SQLITE_DTCM_LOOKASIDE_SLOT_COUNT
+  #define TEENSY_41_SQLITE_DTCM_LOOKASIDE_SLOT_COUNT 0
+#endif
+
+#ifndef TEENSY_41_SQLITE_DTCM_JOURNAL_BUFFERS
+  #define TEENSY_41_SQLITE_DTCM_JOURNAL_BUFFERS 0
+#endif
+
+#ifndef TEENSY_41_SQLITE_DTCM_PAGE_SIZE
+  #define TEENSY_41_SQLITE_DTCM_PAGE_SIZE 4096
+#endif
+
+// must be at least the value reported by SQLITE_CONFIG_PCACHE_HDRSZ
+#ifndef TEENSY_41_SQLITE_DTCM_PAGE_HEADER_SIZE
+  #define TEENSY_41_SQLITE_DTCM_PAGE_HEADER_SIZE 256
+#endif
+
+#ifndef TEENSY_41_SQLITE_DTCM_PAGE_SLOTS
+  #define TEENSY_41_SQLITE_DTCM_PAGE_SLOTS 0
+#endif
+
+/*
+** Maximum number of memory images (see T41SQLite::addMemoryImage).
+*/
+#ifndef TEENSY_41_SQLITE_MAX_MEMORY_IMAGES
+  #define TEENSY_41_SQLITE_MAX_MEMORY_IMAGES 4
+#endif
+
+/*
+** Maximum number of maintenance tasks (see T41SQLite::addMaintenanceTask)
+** and the number of free pages released by one incremental vacuum slice.
+*/
+#ifndef TEENSY_41_SQLITE_MAX_MAINTENANCE_TASKS
+  #define TEENSY_41_SQLITE_MAX_MAINTENANCE_TASKS 8
+#endif
+
+#ifndef TEENSY_41_SQLITE_MAINTENANCE_VACUUM_PAGES
+  #define TEENSY_41_SQLITE_MAINTENANCE_VACUUM_PAGES 16
+#endif
+
+/*
+** Maximum number of prepared statements in the statement cache (see T41SQLite::getStatement).
+*/
+#ifndef TEENSY_41_SQLITE_MAX_CACHED_STATEMENTS
+  #define TEENSY_41_SQLITE_MAX_CACHED_STATEMENTS 16
+#endif
+
+/*
+** Maximum size of the redo log of a batch atomic write in bytes (URI parameter "batch_atomic",
+** see teensy41SQLite_vfs.cpp). Larger transactions are committed with the rollback journal.
+*/
+#ifndef TEENSY_41_SQLITE_BATCH_ATOMIC_MAX_SIZE
+  #define TEENSY_41_SQLITE_BATCH_ATOMIC_MAX_SIZE (1024 * 1024)
+#endif
+
+/*
+** Compressed database files (URI parameter "compress", see teensy41SQLite_vfs.cpp): size of the allocation
+** units of the container in bytes (a multiple of 64, the sector size avoids partial sector writes) and the
+** number of decompressed pages cached per database file.
+*/
+#ifndef TEENSY_41_SQLITE_COMPRESS_UNIT_SIZE
+  #define TEENSY_41_SQLITE_COMPRESS_UNIT_SIZE 512
+#endif
+
+#ifndef TEENSY_41_SQLITE_COMPRESS_CACHE_PAGES
+  #define TEENSY_41_SQLITE_COMPRESS_CACHE_PAGES 8
+#endif
+
+/*
+** Hot page prefetch (URI parameter "prefetch", see teensy41SQLite_vfs.cpp): maximum number of pages in the
+** hot page list of a database file and maximum size of one prefetch read in bytes.
+*/
+#ifndef TEENSY_41_SQLITE_PREFETCH_MAX_PAGES
+  #define TEENSY_41_SQLITE_PREFETCH_MAX_PAGES 64
+#endif
+
+#ifndef TEENSY_41_SQLITE_PREFETCH_READ_SIZE
+  #define TEENSY_41_SQLITE_PREFETCH_READ_SIZE (32 * 1024)
+#endif
+
+/*
+** Database images generated by tools/db2image.py are placed in program flash (section .sqliteImages,
+** see imxrt1062_t41_sqlite3.ld). Without that linker script they end up with the other PROGMEM data.
+*/
+#define TEENSY_41_SQLITE_FLASH_IMAGE __attribute__((section(".progmem.t41sqlite.image"), aligned(8)))
+
+// name of the VFS, which only serves memory images (e.g. "file:calib.db?vfs=T41_IMAGE_VFS&immutable=1")
+#define TEENSY_41_SQLITE_IMAGE_VFS_NAME "T41_IMAGE_VFS"
+
+// sqlite3_file_control() verb making a RAM mirror durable (see T41SQLite::checkpointMirror)
+#define TEENSY_41_SQLITE_FCNTL_MIRROR_CHECKPOINT 0x54340001
+
+// sqlite3_file_control() verbs of the hot page prefetch (see T41SQLite::prefetchHotPages and saveHotPages)
+#define TEENSY_41_SQLITE_FCNTL_PREFETCH 0x54340002
+#define TEENSY_41_SQLITE_FCNTL_SAVE_HOT_PAGES 0x54340003
+
+#define TEENSY_41_SQLITE_DTCM(name) __attribute__((section(".bss.t41sqlite.dtcm." #name), aligned(32)))
+
+/*
+** The VFS of teensy41SQLite_vfs.cpp. sqlite3_teensy_os_init registers it, a build with SQLITE_OS_OTHER calls
+** it from sqlite3_os_init. The SQLite library of a host build has an operating system layer of its own,
+** there T41SQLite::begin calls it (and T41SQLite::end sqlite3_teensy_os_end).
+*/
+sqlite3_vfs* sqlite3_teensy_vfs(void);
+sqlite3_vfs* sqlite3_teensy_image_vfs(void);
+int sqlite3_teensy_os_init(void);
+int sqlite3_teensy_os_end(void);
+
+class T41SQLiteCipher;
 
 class T41SQLite
 {
   public:
     using LogCallback = void (*)(void* pArg, int iErrCode, const char* zMsg);
 
+    /*
+    ** A read-only database file, which is resident in addressable memory (e.g. PSRAM or program flash).
+    ** It is read with memcpy and supports zero-copy page access (PRAGMA mmap_size).
+    */
+    struct MemoryImage
+    {
+      const char* name = nullptr;
+      const unsigned char* data = nullptr;
+      size_t size = 0;
+    };
+
+    /*
+    ** Work done by runMaintenance in slices. Tasks are due every in_intervalMillis and stay due
+    ** until they are complete:
+    **   IncrementalVacuum: PRAGMA incremental_vacuum(TEENSY_41_SQLITE_MAINTENANCE_VACUUM_PAGES) until the
+    **                      freelist is empty (only for auto_vacuum=INCREMENTAL)
+    **   CacheFlush:        sqlite3_db_cacheflush (also runs inside of a transaction)
+    **   Optimize:          ANALYZE of one table with indexes per slice with PRAGMA analysis_limit=400 (the previous
+    **                      limit is restored), instead of one PRAGMA optimize over the whole schema
+    **   WalCheckpoint:     passive checkpoint of a WAL database
+    **   Sql:               executes in_sql until it changes no rows, e.g. a rolling delete
+    **                      "DELETE FROM Log WHERE rowid IN (SELECT rowid FROM Log WHERE time < ... LIMIT 50);"
+    **   Prefetch:          reads the hot pages of a database opened with "prefetch=1", one span per slice
+    */
+    enum class MaintenanceTask
+    {
+      IncrementalVacuum,
+      CacheFlush,
+      Optimize,
+      WalCheckpoint,
+      Sql,
+      Prefetch
+    };
+
+    struct MaintenanceStats
+    {
+      uint32_t slices = 0;
+      uint32_t completions = 0;
+      uint32_t lastMicros = 0;
+      uint32_t maxMicros = 0;
+      uint64_t totalMicros = 0;
+      int lastResult = SQLITE_OK;
+    };
+
   public:
     static const int IS_DEFAULT_VFS = 1;
     static const int ACCESS_FAILED = 0;
@@ -18,8 +190,47 @@ class T41SQLite
   private:
     int m_sectorSize = 0;
     int m_deviceCharacteristics = 0;
-    FS* m_filesystem = nullptr;
+    T41SQLiteStorage::Filesystem* m_filesystem = nullptr;
     String m_dbDirFullpath = "/";
+    bool m_useDTCMPageCache = true;
+    bool m_useDTCMJournalBuffers = true;
+    sqlite3* m_dtcmLookasideOwner = nullptr;
+    MemoryImage m_memoryImages[TEENSY_41_SQLITE_MAX_MEMORY_IMAGES];
+    T41SQLiteCipher* m_cipher = nullptr;
+    bool m_isExclusiveOwner = false;
+
+    struct MaintenanceTaskState
+    {
+      sqlite3* db = nullptr;
+      MaintenanceTask task = MaintenanceTask::CacheFlush;
+      const char* sql = nullptr;
+      uint32_t intervalMillis = 0;
+      uint32_t lastCompletionMillis = 0;
+      bool isInProgress = false;
+      int64_t optimizeRowid = 0;
+      MaintenanceStats stats;
+    };
+
+    MaintenanceTaskState m_maintenanceTasks[TEENSY_41_SQLITE_MAX_MAINTENANCE_TASKS];
+    int m_nextMaintenanceTask = 0;
+
+    struct CachedStatement
+    {
+      sqlite3* db = nullptr;
+      sqlite3_stmt* stmt = nullptr;
+      uint32_t hash = 0;
+      size_t length = 0;
+      uint32_t lastUse = 0;
+      bool isInUse = false; // handed out by getStatement, not released yet
+      bool isDiscarded = false; // cleared or removed from the cache while in use, finalized by releaseStatement
+    };
+
+    CachedStatement m_statementCache[TEENSY_41_SQLITE_MAX_CACHED_STATEMENTS];
+    size_t m_statementCacheCapacity = TEENSY_41_SQLITE_MAX_CACHED_STATEMENTS;
+    uint32_t m_statementCacheClock = 0;
+    uint32_t m_statementCacheHits = 0;
+    uint32_t m_statementCacheMisses = 0;
+    uint32_t m_statementCacheEvictions = 0;
 
   private:
     T41SQLite() = default;
@@ -35,10 +246,10 @@ class T41SQLite
       return instance;
     }
 
-    int begin(FS* io_filesystem);
+    int begin(T41SQLiteStorage::Filesystem* io_filesystem);
     int end();
     
-    FS* getFilesystem();
+    T41SQLiteStorage::Filesystem* getFilesystem();
     
     void setDBDirFullPath(const String& in_dbDirFullpath);
     const String& getDBDirFullPath() const;
@@ -53,6 +264,51 @@ class T41SQLite
     void resetDeviceCharacteristics();
     void setDeviceCharacteristics(int in_ioCap);
     int getDeviceCharacteristics() const;
+
+    void setUseDTCMPageCache(bool in_use); // must be called before begin()
+    bool getUseDTCMPageCache() const;
+    void setUseDTCMJournalBuffers(bool in_use);
+    bool getUseDTCMJournalBuffers() const;
+    int useDTCMLookaside(sqlite3* io_db);
+    bool isDTCMLookasideInUse() const;
+
+    int addMemoryImage(const char* in_name, const void* in_data, size_t in_size);
+    int addMemoryImage(const MemoryImage& in_image);
+    int removeMemoryImage(const char* in_name);
+    const MemoryImage* findMemoryImage(const char* in_path) const;
+
+    int checkpointMirror(sqlite3* io_db, const char* in_schema = "main");
+
+    int prefetchHotPages(sqlite3* io_db, const char* in_schema = "main");
+    int saveHotPages(sqlite3* io_db, const char* in_schema = "main");
+
+    // used by databases opened with "encrypt=1" afterwards, SQLITE_MISUSE: the nonces are not seeded
+    int setCipher(T41SQLiteCipher* io_cipher);
+    T41SQLiteCipher* getCipher() const;
+    int prepareEncryption(sqlite3* io_db, const char* in_schema = "main");
+
+    void setExclusiveOwner(bool in_isExclusiveOwner); // used by database files opened afterwards
+    bool isExclusiveOwner() const;
+
+    int addMaintenanceTask(sqlite3* io_db, MaintenanceTask in_task, uint32_t in_intervalMillis,
+                           const char* in_sql = nullptr, int* out_id = nullptr);
+    int removeMaintenanceTasks(sqlite3* io_db); // must be called before io_db is closed
+    int runMaintenance(uint32_t in_budgetMicros);
+    const MaintenanceStats* getMaintenanceStats(int in_id) const;
+
+    sqlite3_stmt* getStatement(sqlite3* io_db, const char* in_sql, int* out_result = nullptr);
+    int releaseStatement(sqlite3_stmt* in_stmt);
+    void setStatementCacheCapacity(size_t in_capacity); // at most TEENSY_41_SQLITE_MAX_CACHED_STATEMENTS
+    size_t getStatementCacheCapacity() const;
+    // must be called before io_db is closed, SQLITE_BUSY: statements of io_db are still in use
+    int clearStatementCache(sqlite3* io_db = nullptr);
+    uint32_t getStatementCacheHits() const;
+    uint32_t getStatementCacheMisses() const;
+    uint32_t getStatementCacheEvictions() const;
+
+  private:
+    bool isMaintenanceTaskDue(const MaintenanceTaskState& in_state, uint32_t in_nowMillis) const;
+    int runMaintenanceSlice(MaintenanceTaskState& io_state, bool& out_isComplete);
 };
 
 //#define TEENSY_41_SQLITE_DEBUG
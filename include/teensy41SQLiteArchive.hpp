@@ -0,0 +1,56 @@
+#ifndef TEENSY_41_SQLITE_ARCHIVE
+#define TEENSY_41_SQLITE_ARCHIVE
+
+#include "sqlite3.h"
+
+#include <Arduino.h>
+
+/*
+** Number of rows of a row group. Each column of a row group is encoded and read as one piece, so this
+** bounds the RAM needed to write and to read an archive.
+*/
+#ifndef TEENSY_41_SQLITE_ARCHIVE_GROUP_ROWS
+  #define TEENSY_41_SQLITE_ARCHIVE_GROUP_ROWS 1024
+#endif
+
+/*
+** Maximum number of columns of an archive.
+*/
+#ifndef TEENSY_41_SQLITE_ARCHIVE_MAX_COLUMNS
+  #define TEENSY_41_SQLITE_ARCHIVE_MAX_COLUMNS 32
+#endif
+
+/*
+** Columnar archives of cold data. append() stores the result of a query (e.g. a closed time range of a
+** table) column by column in an archive file, the virtual table module "archive" reads it:
+**
+**   T41SQLiteArchive::append(db, "history.arc", "SELECT ts, temperature, state FROM Samples WHERE ts < 1000000;");
+**   DELETE FROM Samples WHERE ts < 1000000;
+**   CREATE VIRTUAL TABLE History USING archive(history.arc);
+**   SELECT avg(temperature) FROM History WHERE ts BETWEEN ?1 AND ?2;
+**
+** The rows are stored in row groups of TEENSY_41_SQLITE_ARCHIVE_GROUP_ROWS rows, each column of a row group
+** as a separate chunk. The type of a column is the type of its first value, which is not NULL:
+**   INTEGER: delta-of-delta, zigzag varints, runs of equal deltas (e.g. a regular timestamp) in 2 bytes
+**   REAL: XOR with the previous value (Gorilla), an unchanged value in 1 bit
+**   TEXT, BLOB: dictionary of the distinct values of the row group, varint indexes
+** Values of another type are converted to the column type. NULL values are stored in a bitmap.
+**
+** A query reads only the chunks of the columns it uses. For an INTEGER first column (e.g. a timestamp) the
+** minimum and maximum of each row group are stored, a constraint on it (=, <, <=, >, >=, BETWEEN) skips the
+** other row groups.
+**
+** The archive file is opened with the filesystem of T41SQLite, a relative path is relative to
+** the database directory (T41SQLite::getDBDirFullPath). append() adds row groups to an existing archive
+** (the columns must match). The new rows become visible with a commit record written at the end, after a
+** power loss during append() the archive holds the rows of the previous append(). An archive table is
+** read-only, a connection reads the archive as it was when the table was connected.
+*/
+class T41SQLiteArchive
+{
+  public:
+    static int registerModule(sqlite3* io_db);
+    static int append(sqlite3* io_db, const char* in_path, const char* in_selectSql, uint32_t* out_rowCount = nullptr);
+};
+
+#endif // TEENSY_41_SQLITE_ARCHIVE
@@ -0,0 +1,101 @@
+#ifndef TEENSY_41_SQLITE_ARRAY
+#define TEENSY_41_SQLITE_ARRAY
+
+#include "sqlite3.h"
+
+#include <Arduino.h>
+
+/*
+** Maximum number of columns of an array (struct-of-arrays or array-of-structs).
+*/
+#ifndef TEENSY_41_SQLITE_ARRAY_MAX_COLUMNS
+  #define TEENSY_41_SQLITE_ARRAY_MAX_COLUMNS 8
+#endif
+
+/*
+** Table-valued function "carray", which reads C arrays directly from memory (see registerModule).
+**
+** One column:
+**   T41SQLiteArray ids(count);
+**   ids.addColumn(idValues); // const int64_t*
+**   ids.bind(stmt, 1); // SELECT * FROM Samples WHERE id IN carray(?1);
+**
+** Several columns (struct-of-arrays, or array-of-structs with member pointers) need a virtual table declaring
+** the column names, which are then returned by SELECT * in the order of addColumn:
+**   CREATE VIRTUAL TABLE temp.SampleArray USING carray(time, value);
+**   T41SQLiteArray samples(count);
+**   samples.addColumn(times); // or samples.addColumn(rows, &Sample::time)
+**   samples.addColumn(values);
+**   samples.bind(stmt, 1); // INSERT INTO Samples SELECT * FROM SampleArray(?1);
+**
+** The arrays and the T41SQLiteArray are not copied: they have to stay valid until the statement is reset.
+**
+** Arrays bound with sqlite3_bind_pointer(stmt, index, pointer, "carray", nullptr) (the pointer type of the
+** SQLite carray extension) are supported as well: carray(?1, count [, 'int32' | 'int64' | 'double' | 'char*']).
+*/
+class T41SQLiteArray
+{
+  public:
+    enum class Type
+    {
+      Int32,
+      Int64,
+      Float,
+      Double,
+      Text // const char* elements (nullptr: NULL)
+    };
+
+    struct Column
+    {
+      Type type;
+      const void* data;
+      size_t stride;
+    };
+
+    static const char* const POINTER_TYPE;
+
+  private:
+    Column m_columns[TEENSY_41_SQLITE_ARRAY_MAX_COLUMNS];
+    int m_columnCount = 0;
+    size_t m_count = 0;
+
+  public:
+    explicit T41SQLiteArray(size_t in_count = 0);
+
+    // Registers the eponymous virtual table "carray" and the module for CREATE VIRTUAL TABLE ... USING carray.
+    static int registerModule(sqlite3* io_db);
+
+    // Contiguous arrays (struct-of-arrays). Returns SQLITE_FULL, if there are too many columns.
+    int addColumn(const int32_t* in_values);
+    int addColumn(const int64_t* in_values);
+    int addColumn(const float* in_values);
+    int addColumn(const double* in_values);
+    int addColumn(const char* const* in_values);
+    int addColumn(Type in_type, const void* in_data, size_t in_stride);
+
+    // A member of an array of structs.
+    template <typename Row, typename Value>
+    int addColumn(const Row* in_rows, const Value Row::* in_member)
+    {
+      const Value* first = &(in_rows->*in_member);
+      return addColumn(typeOf(first), first, sizeof(Row));
+    }
+
+    void clearColumns();
+    void setCount(size_t in_count); // number of elements (rows)
+
+    int bind(sqlite3_stmt* io_stmt, int in_index) const;
+
+    size_t getCount() const;
+    int getColumnCount() const;
+    const Column& getColumn(int in_index) const;
+
+  private:
+    static Type typeOf(const int32_t*) { return Type::Int32; }
+    static Type typeOf(const int64_t*) { return Type::Int64; }
+    static Type typeOf(const float*) { return Type::Float; }
+    static Type typeOf(const double*) { return Type::Double; }
+    static Type typeOf(const char* const*) { return Type::Text; }
+};
+
+#endif // TEENSY_41_SQLITE_ARRAY
@@ -0,0 +1,90 @@
+#ifndef TEENSY_41_SQLITE_CIPHER
+#define TEENSY_41_SQLITE_CIPHER
+
+#include <Arduino.h>
+
+/*
+** Cipher of encrypted database files (URI parameter "encrypt", see ENCRYPTED DATABASES in
+** teensy41SQLite_vfs.cpp). Pages are encrypted with AES-128 in counter mode (CTR): the key stream of a page
+** is the encryption of the counter blocks nonce || 0, nonce || 1, ... (12 byte nonce, 32 bit big-endian block
+** counter), so encryption and decryption are the same operation and every page is processed on its own.
+**
+** A backend implements the block cipher:
+**   T41SQLiteSoftwareCipher: portable implementation, runs everywhere (e.g. a host build)
+**   T41SQLiteDCPCipher:      data co-processor (DCP) of the i.MX RT1062, only on Teensy 4.x
+**
+**   static T41SQLiteDCPCipher cipher;
+**   cipher.setKey(key, T41SQLiteCipher::KEY_SIZE);
+**   cipher.seedNoncesFromTRNG();
+**   T41SQLite::getInstance().setCipher(&cipher);
+**   sqlite3_open("file:secret.db?encrypt=1", &db);
+**   T41SQLite::getInstance().prepareEncryption(db); // before the first table of a new database is created
+**
+** A nonce must never be used twice with the same key. Nonces are 8 seed bytes followed by a 32 bit counter,
+** so the seed must be different on every start: seed the nonces from the TRNG of the i.MX RT1062
+** (seedNoncesFromTRNG) or with seedNonces from another source of entropy. An unseeded cipher would repeat the
+** nonces of the last start, so T41SQLite::setCipher seeds it from the TRNG and returns SQLITE_MISUSE, if that
+** fails, and a database with "encrypt=1" does not open (SQLITE_MISUSE) with an unseeded cipher.
+*/
+class T41SQLiteCipher
+{
+  public:
+    static constexpr size_t KEY_SIZE = 16;
+    static constexpr size_t BLOCK_SIZE = 16;
+    static constexpr size_t NONCE_SIZE = 12;
+
+  private:
+    uint8_t m_nonceSeed[8] = {};
+    uint32_t m_nonceCounter = 0;
+    bool m_isSeeded = false;
+
+  public:
+    virtual ~T41SQLiteCipher() = default;
+
+    virtual int setKey(const uint8_t* in_key, size_t in_size) = 0;
+    // XOR io_data with the key stream of in_nonce (NONCE_SIZE bytes), starting with block counter 0
+    virtual int crypt(const uint8_t* in_nonce, uint8_t* io_data, size_t in_size) = 0;
+    virtual const char* getName() const = 0;
+
+    void seedNonces(const void* in_seed, size_t in_size);
+    int seedNoncesFromTRNG(); // SQLITE_ERROR without a TRNG
+    bool isSeeded() const { return m_isSeeded; }
+    void generateNonce(uint8_t* out_nonce);
+};
+
+class T41SQLiteSoftwareCipher : public T41SQLiteCipher
+{
+  private:
+    uint8_t m_roundKeys[176] = {};
+
+  public:
+    int setKey(const uint8_t* in_key, size_t in_size) override;
+    int crypt(const uint8_t* in_nonce, uint8_t* io_data, size_t in_size) override;
+    const char* getName() const override { return "software"; }
+
+    void encryptBlock(const uint8_t* in_block, uint8_t* out_block) const;
+};
+
+#if defined(__IMXRT1062__)
+/*
+** The DCP encrypts the counter blocks of a whole page with one work packet (AES-128 ECB), the CPU adds the
+** key stream to the data. setKey runs a known answer test against the software implementation.
+*/
+class T41SQLiteDCPCipher : public T41SQLiteCipher
+{
+  private:
+    uint8_t m_key[KEY_SIZE] = {};
+    uint32_t m_keySwap = 0;
+    bool m_hasKey = false;
+
+  public:
+    int setKey(const uint8_t* in_key, size_t in_size) override;
+    int crypt(const uint8_t* in_nonce, uint8_t* io_data, size_t in_size) override;
+    const char* getName() const override { return "DCP"; }
+
+  private:
+    int encryptBlocks(const uint8_t* in_blocks, uint8_t* out_blocks, size_t in_size, uint32_t in_keySwap);
+};
+#endif
+
+#endif // TEENSY_41_SQLITE_CIPHER
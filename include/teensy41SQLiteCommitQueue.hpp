@@ -0,0 +1,104 @@
+#ifndef TEENSY_41_SQLITE_COMMIT_QUEUE
+#define TEENSY_41_SQLITE_COMMIT_QUEUE
+
+#include "sqlite3.h"
+
+#include <Arduino.h>
+
+#ifndef TEENSY_41_SQLITE_COMMIT_QUEUE_LOST_RANGES
+  #define TEENSY_41_SQLITE_COMMIT_QUEUE_LOST_RANGES 8
+#endif
+
+/*
+** Group commit: many small writes (e.g. one sensor row each) share one transaction and therefore one
+** journal and one set of syncs. Submitted statements are executed at once inside a transaction, which
+** is committed when in_maxPending submissions are pending, when the oldest pending submission is older
+** than in_maxDelayMillis (checked by submit() and poll()) or when flush() is called.
+**
+** Every accepted submission gets a sequence number. getDurableSequence() is the last committed sequence
+** number, getDurability() also tells the ranges lost by a failed commit before it. The newest
+** TEENSY_41_SQLITE_COMMIT_QUEUE_LOST_RANGES lost ranges are kept. When an older one is dropped, the
+** sequence numbers up to its end (getLowWaterSequence()) are reported as Durability::Unknown, not as lost,
+** and isDurable() is false for them. The commit callback reports each committed (or lost) range of
+** sequence numbers, it is the record of their outcome that does not overflow.
+**
+** Usage:
+**   T41SQLiteCommitQueue queue;
+**   queue.begin(db, 100, 250);
+**   loop: bind values, queue.submit(insertStmt); queue.poll();
+**   queue.end();
+**
+** The connection must not be used for other transactions while submissions are pending
+** (reads on the connection see the pending rows).
+*/
+class T41SQLiteCommitQueue
+{
+  public:
+    enum class Durability
+    {
+      Pending,  // not committed yet
+      Durable,
+      Lost,     // its commit failed
+      Unknown   // at or below getLowWaterSequence(), the lost range it might be in is no longer kept
+    };
+
+    // in_result is SQLITE_OK if the submissions in_firstSequence to in_lastSequence are durable
+    using CommitCallback = void (*)(void* pArg, uint32_t in_firstSequence, uint32_t in_lastSequence, int in_result);
+
+  private:
+    struct LostRange
+    {
+      uint32_t firstSequence = 0;
+      uint32_t lastSequence = 0;
+    };
+
+    sqlite3* m_db = nullptr;
+    uint32_t m_maxPending = 100;
+    uint32_t m_maxDelayMillis = 250;
+    CommitCallback m_commitCallback = nullptr;
+    void* m_commitCallbackArg = nullptr;
+
+    bool m_isInTransaction = false;
+    uint32_t m_transactionBeginMillis = 0;
+    uint32_t m_pendingCount = 0;
+    uint32_t m_lastSequence = 0;
+    uint32_t m_durableSequence = 0;
+    uint32_t m_commitCount = 0;
+    LostRange m_lostRanges[TEENSY_41_SQLITE_COMMIT_QUEUE_LOST_RANGES];
+    uint32_t m_lostRangeCount = 0; // all lost ranges, the newest are kept in m_lostRanges
+    uint32_t m_lowWaterSequence = 0; // end of the newest lost range no longer kept
+
+  public:
+    T41SQLiteCommitQueue() = default;
+    ~T41SQLiteCommitQueue();
+
+    T41SQLiteCommitQueue(const T41SQLiteCommitQueue&) = delete;
+    T41SQLiteCommitQueue& operator=(const T41SQLiteCommitQueue&) = delete;
+
+    int begin(sqlite3* io_db, uint32_t in_maxPending = 100, uint32_t in_maxDelayMillis = 250);
+    int end(); // commits the pending submissions
+
+    void setCommitCallback(CommitCallback in_callback, void* in_forUseInCallback = nullptr);
+
+    // Executes the (bound) statement inside the group transaction and resets it.
+    int submit(sqlite3_stmt* io_stmt, uint32_t* out_sequence = nullptr);
+    int submit(const char* in_sql, uint32_t* out_sequence = nullptr);
+
+    int poll(); // commits, if the time threshold is reached
+    int flush(); // commits now
+
+    uint32_t getPendingCount() const;
+    uint32_t getLastSequence() const;
+    uint32_t getDurableSequence() const;
+    Durability getDurability(uint32_t in_sequence) const;
+    bool isDurable(uint32_t in_sequence) const;
+    uint32_t getLowWaterSequence() const;
+    uint32_t getCommitCount() const;
+
+  private:
+    int beginTransaction();
+    int accept(uint32_t* out_sequence);
+    void finishTransaction(int in_result);
+};
+
+#endif // TEENSY_41_SQLITE_COMMIT_QUEUE
@@ -0,0 +1,82 @@
+#ifndef TEENSY_41_SQLITE_CURSOR
+#define TEENSY_41_SQLITE_CURSOR
+
+#include "sqlite3.h"
+
+#include <Arduino.h>
+
+/*
+** Default size of the stack a cursor runs sqlite3_step on in bytes.
+*/
+#ifndef TEENSY_41_SQLITE_CURSOR_STACK_SIZE
+  #define TEENSY_41_SQLITE_CURSOR_STACK_SIZE (16 * 1024)
+#endif
+
+/*
+** Number of virtual machine instructions between two checks of the time budget
+** (see sqlite3_progress_handler).
+*/
+#ifndef TEENSY_41_SQLITE_CURSOR_PROGRESS_OPS
+  #define TEENSY_41_SQLITE_CURSOR_PROGRESS_OPS 100
+#endif
+
+/*
+** Time-sliced statement execution. step(in_budgetMicros) returns after about in_budgetMicros,
+** even if sqlite3_step has not produced a row yet (e.g. an aggregate over a large table). Then it returns
+** T41SQLiteCursor::STEP_PENDING and continues where it stopped with the next call of step.
+**
+** sqlite3_step runs on a separate stack (a coroutine). A progress handler switches back to the caller,
+** when the budget is used up. Therefore:
+**   - the connection of the statement must not be used while a step is pending,
+**   - the progress handler of the connection is replaced while a step is pending,
+**   - the stack must be large enough for sqlite3_step and for interrupts occurring while it runs.
+**
+** The budget is checked every TEENSY_41_SQLITE_CURSOR_PROGRESS_OPS virtual machine instructions. A single
+** instruction is not split, e.g. sorting the rows of an ORDER BY or GROUP BY can exceed the budget.
+**
+** Usage (in loop()):
+**   int rc = cursor.step(500);
+**   if (rc == SQLITE_ROW) { read columns } else if (rc != T41SQLiteCursor::STEP_PENDING) { done or error }
+*/
+class T41SQLiteCursor
+{
+  public:
+    static const int STEP_PENDING = 0x5400;
+
+  private:
+    struct Context;
+
+    Context* m_context = nullptr;
+    size_t m_stackSize = 0;
+    sqlite3_stmt* m_stmt = nullptr;
+    bool m_isStepPending = false;
+    bool m_isCancelRequested = false;
+    int m_stepResult = SQLITE_OK;
+    uint32_t m_sliceBeginMicros = 0;
+    uint32_t m_budgetMicros = 0;
+    uint32_t m_sliceCount = 0;
+
+  public:
+    explicit T41SQLiteCursor(size_t in_stackSize = TEENSY_41_SQLITE_CURSOR_STACK_SIZE);
+    ~T41SQLiteCursor();
+
+    T41SQLiteCursor(const T41SQLiteCursor&) = delete;
+    T41SQLiteCursor& operator=(const T41SQLiteCursor&) = delete;
+
+    int begin(sqlite3_stmt* io_stmt); // the statement is not finalized by the cursor
+    int step(uint32_t in_budgetMicros); // SQLITE_ROW, SQLITE_DONE, STEP_PENDING or an error code
+    int cancel(); // ends a pending step with SQLITE_INTERRUPT
+    int end(); // cancels a pending step and detaches the statement
+
+    bool isStepPending() const;
+    sqlite3_stmt* getStatement() const;
+    uint32_t getSliceCount() const; // number of returned STEP_PENDING of the current step
+
+  private:
+    static void run();
+    static int progressHandler(void* io_cursor);
+    void switchToCaller();
+    void switchToCursor();
+};
+
+#endif // TEENSY_41_SQLITE_CURSOR
@@ -0,0 +1,201 @@
+#ifndef TEENSY_41_SQLITE_DATABASE
+#define TEENSY_41_SQLITE_DATABASE
+
+#include "sqlite3.h"
+#include "teensy41SQLiteSchema.hpp"
+
+#include <Arduino.h>
+
+/*
+** RAII wrappers of connections, statements, transactions and savepoints. The wrappers do not allocate:
+** values are bound with SQLITE_STATIC (the bound buffers must stay valid until the statement is stepped) and
+** text/blob columns are returned as views (T41SQLiteText/T41SQLiteBlob) into the statement, which are valid
+** until the next step/reset/finalize. Errors are returned as SQLite result codes.
+**
+** Usage:
+**   T41SQLiteDatabase db;
+**   db.open("test.db");
+**   T41SQLiteStatement insert;
+**   db.prepare("INSERT INTO Samples VALUES (?1, ?2);", insert, SQLITE_PREPARE_PERSISTENT);
+**   {
+**     T41SQLiteTransaction transaction(db);
+**     insert.bindValues(time, value);
+**     insert.execute();
+**     transaction.commit(); // rolled back by the destructor otherwise
+**   }
+*/
+
+class T41SQLiteStatement;
+
+class T41SQLiteDatabase
+{
+  private:
+    sqlite3* m_db = nullptr;
+
+  public:
+    T41SQLiteDatabase() = default;
+    ~T41SQLiteDatabase();
+
+    T41SQLiteDatabase(const T41SQLiteDatabase&) = delete;
+    T41SQLiteDatabase& operator=(const T41SQLiteDatabase&) = delete;
+    T41SQLiteDatabase(T41SQLiteDatabase&& io_other) noexcept;
+    T41SQLiteDatabase& operator=(T41SQLiteDatabase&& io_other) noexcept;
+
+    int open(const char* in_filename, int in_flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+             const char* in_vfsName = nullptr);
+    int close(); // the statements of the connection have to be finalized before
+
+    int execute(const char* in_sql);
+    int prepare(const char* in_sql, T41SQLiteStatement& out_statement, unsigned int in_prepareFlags = 0);
+
+    bool isOpen() const;
+    sqlite3* getHandle() const;
+    const char* getErrorMessage() const;
+    sqlite3_int64 getLastInsertRowId() const;
+    int getChanges() const;
+};
+
+class T41SQLiteStatement
+{
+  private:
+    sqlite3_stmt* m_stmt = nullptr;
+
+  public:
+    T41SQLiteStatement() = default;
+    ~T41SQLiteStatement();
+
+    T41SQLiteStatement(const T41SQLiteStatement&) = delete;
+    T41SQLiteStatement& operator=(const T41SQLiteStatement&) = delete;
+    T41SQLiteStatement(T41SQLiteStatement&& io_other) noexcept;
+    T41SQLiteStatement& operator=(T41SQLiteStatement&& io_other) noexcept;
+
+    int prepare(sqlite3* io_db, const char* in_sql, unsigned int in_prepareFlags = 0);
+    int finalize();
+
+    int step(); // SQLITE_ROW, SQLITE_DONE or an error code
+    int execute(); // steps to the end and resets, returns SQLITE_OK if done
+    int reset();
+    int clearBindings();
+
+    // Parameter indexes start at 1. See teensy41SQLiteSchema.hpp for the supported value types.
+    template <typename Value>
+    int bind(int in_index, const Value& in_value)
+    {
+      return T41SQLiteColumnType<Value>::bind(m_stmt, in_index, in_value);
+    }
+
+    int bind(int in_index, const char* in_text, int in_size = -1);
+    int bind(int in_index, const void* in_blob, int in_size);
+    int bind(int in_index, decltype(nullptr));
+
+    // Binds in_values to the parameters 1...n.
+    template <typename... Values>
+    int bindValues(const Values&... in_values)
+    {
+      int result = SQLITE_OK;
+      int index = 0;
+      ((result = result == SQLITE_OK ? bind(++index, in_values) : result), ...);
+      return result;
+    }
+
+    // Binds the columns of a table row (see T41SQLiteRow).
+    template <typename Row>
+    int bindRow(const Row& in_row)
+    {
+      return T41SQLiteRow<Row>::bind(m_stmt, in_row);
+    }
+
+    // Column indexes start at 0.
+    template <typename Value>
+    Value getColumn(int in_index) const
+    {
+      Value value;
+      T41SQLiteColumnType<Value>::read(m_stmt, in_index, value);
+      return value;
+    }
+
+    template <typename Row>
+    void readRow(Row& out_row) const
+    {
+      T41SQLiteRow<Row>::read(m_stmt, out_row);
+    }
+
+    int getInt(int in_index) const;
+    sqlite3_int64 getInt64(int in_index) const;
+    double getDouble(int in_index) const;
+    T41SQLiteText getText(int in_index) const;
+    T41SQLiteBlob getBlob(int in_index) const;
+    bool isNull(int in_index) const;
+    int getColumnType(int in_index) const;
+    int getColumnCount() const;
+
+    bool isPrepared() const;
+    sqlite3_stmt* getHandle() const;
+};
+
+/*
+** Transaction, rolled back by the destructor, if it is neither committed nor rolled back before.
+*/
+class T41SQLiteTransaction
+{
+  public:
+    enum class Type
+    {
+      Deferred,
+      Immediate,
+      Exclusive
+    };
+
+  private:
+    sqlite3* m_db = nullptr;
+    int m_beginResult = SQLITE_MISUSE;
+
+  public:
+    explicit T41SQLiteTransaction(sqlite3* io_db, Type in_type = Type::Deferred);
+    explicit T41SQLiteTransaction(T41SQLiteDatabase& io_db, Type in_type = Type::Deferred);
+    ~T41SQLiteTransaction();
+
+    T41SQLiteTransaction(const T41SQLiteTransaction&) = delete;
+    T41SQLiteTransaction& operator=(const T41SQLiteTransaction&) = delete;
+    T41SQLiteTransaction(T41SQLiteTransaction&& io_other) noexcept;
+    T41SQLiteTransaction& operator=(T41SQLiteTransaction&&) = delete;
+
+    int commit();
+    int rollback();
+
+    bool isActive() const;
+    int getBeginResult() const;
+};
+
+/*
+** Savepoint (a nestable transaction), rolled back by the destructor, if it is neither released nor rolled
+** back before. The name is not copied, it must stay valid for the lifetime of the savepoint.
+*/
+class T41SQLiteSavepoint
+{
+  private:
+    sqlite3* m_db = nullptr;
+    const char* m_name = nullptr;
+    int m_beginResult = SQLITE_MISUSE;
+
+  public:
+    T41SQLiteSavepoint(sqlite3* io_db, const char* in_name);
+    T41SQLiteSavepoint(T41SQLiteDatabase& io_db, const char* in_name);
+    ~T41SQLiteSavepoint();
+
+    T41SQLiteSavepoint(const T41SQLiteSavepoint&) = delete;
+    T41SQLiteSavepoint& operator=(const T41SQLiteSavepoint&) = delete;
+    T41SQLiteSavepoint(T41SQLiteSavepoint&& io_other) noexcept;
+    T41SQLiteSavepoint& operator=(T41SQLiteSavepoint&&) = delete;
+
+    int release();
+    int rollback();
+
+    bool isActive() const;
+    int getBeginResult() const;
+
+  private:
+    int executeWithName(const char* in_format);
+};
+
+#endif // TEENSY_41_SQLITE_DATABASE
@@ -0,0 +1,377 @@
+#ifndef TEENSY_41_SQLITE_INGEST
+#define TEENSY_41_SQLITE_INGEST
+
+#include "sqlite3.h"
+
+#include <Arduino.h>
+#include <atomic>
+
+/*
+** Lock-free single-producer/single-consumer ring buffer of fixed-size records.
+** push() may be called from one interrupt handler (the producer), peek()/release() from the main context
+** (the consumer). in_capacity must be a power of two.
+*/
+template <typename Record, uint32_t in_capacity>
+class T41SQLiteRingBuffer
+{
+  static_assert((in_capacity & (in_capacity - 1)) == 0 && in_capacity > 0, "in_capacity must be a power of two");
+
+  private:
+    Record m_records[in_capacity];
+    std::atomic<uint32_t> m_head{0}; // written by the producer
+    std::atomic<uint32_t> m_tail{0}; // written by the consumer
+    volatile uint32_t m_overflowCount = 0;
+    volatile uint32_t m_highWaterMark = 0;
+
+  public:
+    // Returns false (and counts an overflow), if the buffer is full. The record is dropped then.
+    bool push(const Record& in_record)
+    {
+      uint32_t head = m_head.load(std::memory_order_relaxed);
+      uint32_t used = head - m_tail.load(std::memory_order_acquire);
+
+      if (used >= in_capacity)
+      {
+        m_overflowCount = m_overflowCount + 1;
+        return false;
+      }
+
+      m_records[head & (in_capacity - 1)] = in_record;
+      m_head.store(head + 1, std::memory_order_release);
+
+      if (used + 1 > m_highWaterMark)
+      {
+        m_highWaterMark = used + 1;
+      }
+
+      return true;
+    }
+
+    // Reads the in_index-th oldest record without removing it.
+    bool peek(uint32_t in_index, Record& out_record) const
+    {
+      uint32_t tail = m_tail.load(std::memory_order_relaxed);
+
+      if (in_index >= m_head.load(std::memory_order_acquire) - tail)
+      {
+        return false;
+      }
+
+      out_record = m_records[(tail + in_index) & (in_capacity - 1)];
+      return true;
+    }
+
+    // Removes the in_count oldest records.
+    void release(uint32_t in_count)
+    {
+      m_tail.store(m_tail.load(std::memory_order_relaxed) + min(in_count, getSize()), std::memory_order_release);
+    }
+
+    uint32_t getSize() const
+    {
+      return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+    }
+
+    uint32_t getCapacity() const
+    {
+      return in_capacity;
+    }
+
+    uint32_t getOverflowCount() const
+    {
+      return m_overflowCount;
+    }
+
+    uint32_t getHighWaterMark() const
+    {
+      return m_highWaterMark;
+    }
+};
+
+/*
+** Ingestion of records produced by an interrupt handler. push() is called from the interrupt handler,
+** drain() from loop(). drain() inserts up to in_batchSize buffered records in one transaction with the
+** prepared insert statement, binding each record with the bind callback. Records are removed from the
+** ring buffer only after the commit succeeded, so a failed commit is retried by the next drain().
+** in_batchSize should not exceed half of in_capacity, because the records of a batch occupy the ring
+** buffer until they are committed.
+**
+** A record, which cannot be inserted, is dropped and reported to the failure callback (e.g. to park it in
+** a file): a statement error is skipped within the batch, an error, which rolls the batch back (e.g. ON
+** CONFLICT ROLLBACK), or a failed commit (e.g. a deferred foreign key) retry the batch in smaller parts
+** until the failing record is found. Temporary errors (busy, locked, I/O, full, out of memory) keep all
+** records buffered. A skipped record is reported again, if the commit of its batch fails.
+**
+** Usage:
+**   T41SQLiteIngest<Sample, 4096> ingest;
+**   ingest.begin(db, "INSERT INTO Samples VALUES (?1, ?2);", bindSample, 512);
+**   ISR:    ingest.push(sample);
+**   loop(): ingest.drain(2000);
+*/
+template <typename Record, uint32_t in_capacity>
+class T41SQLiteIngest
+{
+  public:
+    using BindCallback = int (*)(sqlite3_stmt* io_stmt, const Record& in_record);
+    using FailureCallback = void (*)(void* pArg, const Record& in_record, int in_result);
+
+  private:
+    T41SQLiteRingBuffer<Record, in_capacity> m_buffer;
+    sqlite3* m_db = nullptr;
+    sqlite3_stmt* m_stmt = nullptr;
+    BindCallback m_bind = nullptr;
+    uint32_t m_batchSize = 0;
+    uint32_t m_retryLimit = 0; // records of the next batch while a failing record is searched, 0 if none
+    FailureCallback m_failureCallback = nullptr;
+    void* m_failureCallbackArg = nullptr;
+
+    uint32_t m_insertedCount = 0;
+    uint32_t m_failedCount = 0;
+    uint32_t m_batchCount = 0;
+    uint32_t m_lastDrainMicros = 0;
+    uint32_t m_maxDrainMicros = 0;
+
+  public:
+    T41SQLiteIngest() = default;
+    ~T41SQLiteIngest()
+    {
+      end();
+    }
+
+    T41SQLiteIngest(const T41SQLiteIngest&) = delete;
+    T41SQLiteIngest& operator=(const T41SQLiteIngest&) = delete;
+
+    int begin(sqlite3* io_db, const char* in_insertSql, BindCallback in_bind, uint32_t in_batchSize = in_capacity / 2)
+    {
+      if (m_db || not io_db || not in_bind || in_batchSize == 0 || in_batchSize > in_capacity)
+      {
+        return SQLITE_MISUSE;
+      }
+
+      int rc = sqlite3_prepare_v3(io_db, in_insertSql, -1, SQLITE_PREPARE_PERSISTENT, &m_stmt, nullptr);
+
+      if (rc != SQLITE_OK)
+      {
+        return rc;
+      }
+
+      m_db = io_db;
+      m_bind = in_bind;
+      m_batchSize = in_batchSize;
+
+      return SQLITE_OK;
+    }
+
+    // Drains the buffer and finalizes the insert statement. Records are left buffered after a temporary error.
+    int end()
+    {
+      if (not m_db)
+      {
+        return SQLITE_OK;
+      }
+
+      int rc = SQLITE_OK;
+
+      // every drain, which fails without a temporary error, drops a record or shrinks the next batch
+      while (m_buffer.getSize() > 0 && not (rc != SQLITE_OK && isTemporaryError(rc)))
+      {
+        rc = drain();
+      }
+
+      sqlite3_finalize(m_stmt);
+      m_stmt = nullptr;
+      m_db = nullptr;
+
+      return rc;
+    }
+
+    void setFailureCallback(FailureCallback in_callback, void* in_forUseInCallback = nullptr)
+    {
+      m_failureCallback = in_callback;
+      m_failureCallbackArg = in_forUseInCallback;
+    }
+
+    // Called from the interrupt handler. Returns false, if the record was dropped (buffer full).
+    bool push(const Record& in_record)
+    {
+      return m_buffer.push(in_record);
+    }
+
+    /*
+    ** Inserts one batch. With in_budgetMicros > 0 the batch is committed early, when the budget is used up.
+    ** The budget is checked between the inserts and bounds only them: the COMMIT afterwards (journal or WAL
+    ** writes, the sync, an automatic checkpoint) is not part of it and may take far longer, so a drain can
+    ** exceed the budget by a whole commit (getMaxDrainMicros includes the commit). Records, which cannot be
+    ** inserted (bind or step error, e.g. a constraint), are counted, reported and skipped (see above).
+    */
+    int drain(uint32_t in_budgetMicros = 0)
+    {
+      if (not m_db)
+      {
+        return SQLITE_MISUSE;
+      }
+
+      if (m_buffer.getSize() == 0)
+      {
+        return SQLITE_OK;
+      }
+
+      elapsedMicros drainTime;
+      int rc = sqlite3_exec(m_db, "BEGIN;", nullptr, nullptr, nullptr);
+
+      if (rc != SQLITE_OK)
+      {
+        return rc;
+      }
+
+      uint32_t batchSize = m_retryLimit > 0 ? min(m_batchSize, m_retryLimit) : m_batchSize;
+      uint32_t count = 0;
+      uint32_t failedCount = 0;
+      Record record;
+
+      while (count < batchSize && m_buffer.peek(count, record))
+      {
+        rc = m_bind(m_stmt, record);
+
+        if (rc == SQLITE_OK)
+        {
+          rc = sqlite3_step(m_stmt);
+        }
+
+        sqlite3_reset(m_stmt);
+        sqlite3_clear_bindings(m_stmt);
+
+        if (rc != SQLITE_DONE)
+        {
+          if (sqlite3_get_autocommit(m_db))
+          {
+            // the error rolled the batch back, the records before this one are inserted by the next drain
+            return retryWithout(count, rc);
+          }
+
+          ++failedCount;
+          reportFailure(record, rc);
+        }
+
+        ++count;
+
+        if (in_budgetMicros > 0 && drainTime >= in_budgetMicros)
+        {
+          break;
+        }
+      }
+
+      rc = sqlite3_exec(m_db, "COMMIT;", nullptr, nullptr, nullptr);
+
+      if (rc != SQLITE_OK)
+      {
+        if (not sqlite3_get_autocommit(m_db))
+        {
+          sqlite3_exec(m_db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        }
+
+        // the failing record is unknown: halve the batch until it is the only one
+        return retryWithout(count > 1 ? (count + 1) / 2 : 0, rc);
+      }
+
+      m_retryLimit = 0;
+      m_buffer.release(count);
+      m_insertedCount += count - failedCount;
+      m_failedCount += failedCount;
+      ++m_batchCount;
+      m_lastDrainMicros = drainTime;
+      m_maxDrainMicros = max(m_maxDrainMicros, m_lastDrainMicros);
+
+      return SQLITE_OK;
+    }
+
+    const T41SQLiteRingBuffer<Record, in_capacity>& getBuffer() const
+    {
+      return m_buffer;
+    }
+
+    uint32_t getOverflowCount() const
+    {
+      return m_buffer.getOverflowCount();
+    }
+
+    uint32_t getInsertedCount() const
+    {
+      return m_insertedCount;
+    }
+
+    uint32_t getFailedCount() const
+    {
+      return m_failedCount;
+    }
+
+    uint32_t getBatchCount() const
+    {
+      return m_batchCount;
+    }
+
+    uint32_t getLastDrainMicros() const
+    {
+      return m_lastDrainMicros;
+    }
+
+    uint32_t getMaxDrainMicros() const
+    {
+      return m_maxDrainMicros;
+    }
+
+  private:
+    static bool isTemporaryError(int in_result)
+    {
+      switch (in_result & 0xff)
+      {
+        case SQLITE_BUSY:
+        case SQLITE_LOCKED:
+        case SQLITE_NOMEM:
+        case SQLITE_IOERR:
+        case SQLITE_FULL:
+        case SQLITE_INTERRUPT:
+          return true;
+        default:
+          return false;
+      }
+    }
+
+    void reportFailure(const Record& in_record, int in_result)
+    {
+      if (m_failureCallback)
+      {
+        m_failureCallback(m_failureCallbackArg, in_record, in_result);
+      }
+    }
+
+    /*
+    ** A batch failed with in_result and was rolled back. The next batch stops before the record at
+    ** in_index, the oldest record is dropped, if it is the failing one (in_index 0).
+    */
+    int retryWithout(uint32_t in_index, int in_result)
+    {
+      Record record;
+
+      if (isTemporaryError(in_result))
+      {
+        return in_result;
+      }
+
+      if (in_index > 0)
+      {
+        m_retryLimit = in_index;
+      }
+      else if (m_buffer.peek(0, record))
+      {
+        m_buffer.release(1);
+        ++m_failedCount;
+        m_retryLimit = 0;
+        reportFailure(record, in_result);
+      }
+
+      return in_result;
+    }
+};
+
+#endif // TEENSY_41_SQLITE_INGEST
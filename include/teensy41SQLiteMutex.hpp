@@ -0,0 +1,43 @@
+#ifndef TEENSY_41_SQLITE_MUTEX
+#define TEENSY_41_SQLITE_MUTEX
+
+#include "sqlite_cfg.h"
+#include "sqlite3.h"
+
+/*
+** Mutex backends for a build with SQLITE_THREADSAFE=1 or 2. The backend is chosen at compile time with
+** TEENSY_41_SQLITE_MUTEX_BACKEND:
+**
+**   TEENSY_41_SQLITE_MUTEX_NONE:          no mutexes, the default for SQLITE_THREADSAFE=0
+**   TEENSY_41_SQLITE_MUTEX_TEENSYTHREADS: Threads::Mutex of TeensyThreads
+**   TEENSY_41_SQLITE_MUTEX_FREERTOS:      mutex semaphores of FreeRTOS (needs INCLUDE_xTaskGetCurrentTaskHandle)
+**   TEENSY_41_SQLITE_MUTEX_PTHREAD:       pthread mutexes of a host build
+**
+**   build_flags = -D TEENSY_41_SQLITE_MUTEX_BACKEND=TEENSY_41_SQLITE_MUTEX_TEENSYTHREADS
+**
+** The library builds SQLite with SQLITE_THREADSAFE=0. Choosing a backend opts in to SQLITE_THREADSAFE=1
+** (sqlite_cfg.h, included by sqlite3.c through _HAVE_SQLITE_CONFIG_H of library.json), SQLITE_THREADSAFE=2
+** is set in the build_flags next to the backend. The VFS checks sqlite3_threadsafe() at run time and only
+** takes its own mutex, when SQLite was built with mutexes.
+**
+** T41SQLite::begin installs the backend with SQLITE_CONFIG_MUTEX before sqlite3_initialize. A build with
+** SQLITE_OS_OTHER compiles the no-op mutexes of SQLite (SQLITE_MUTEX_NOOP) instead of the mutexes of an
+** operating system, SQLITE_CONFIG_MUTEX replaces them at run time the way SQLITE_MUTEX_APPDEF would at
+** compile time, without changing how sqlite3.c is built.
+**
+** The locks of all backends are not recursive, the recursion of SQLITE_MUTEX_RECURSIVE and the owner checked
+** by sqlite3_mutex_held are kept in the sqlite3_mutex object.
+**
+** The VFS serializes its methods, which use the storage backend, with a mutex of its own (see THREADS in
+** teensy41SQLite_vfs.cpp). The helpers of T41SQLite (statement cache, maintenance tasks, commit queue) and
+** the archive and time series tables are not thread-safe: use each of them from one thread only.
+*/
+class T41SQLiteMutex
+{
+  public:
+    // nullptr for TEENSY_41_SQLITE_MUTEX_NONE
+    static const sqlite3_mutex_methods* getMethods();
+    static const char* getName();
+};
+
+#endif // TEENSY_41_SQLITE_MUTEX
@@ -0,0 +1,37 @@
+#ifndef TEENSY_41_SQLITE_PROFILE
+#define TEENSY_41_SQLITE_PROFILE
+
+#ifdef USE_TEENSY_41_SQLITE_PROFILE
+
+#include <Arduino.h>
+
+/*
+** Function level profiler used to find the hot SQLite functions,
+** which should be placed in ITCM instead of the .sqliteFlash section.
+**
+** Usage:
+**   1. Build with -D USE_TEENSY_41_SQLITE_PROFILE and compile the SQLite sources with
+**      -finstrument-functions (see [env:teensy41_profile] in platformio.ini).
+**   2. Run a representative workload between T41SQLiteProfile::start() and T41SQLiteProfile::stop().
+**   3. Capture the output of T41SQLiteProfile::print(Serial) into a file.
+**   4. Run tools/itcm_hotlist.py with the capture and the firmware.elf of the profile build,
+**      which (re)generates linkerScript/imxrt1062_t41_sqlite3_itcm.ld.
+**   5. Rebuild the normal environment.
+*/
+namespace T41SQLiteProfile
+{
+  void reset();
+  void start();
+  void stop();
+  bool isRunning();
+
+  // Prints one line "T41SQLITE_PROFILE <function address> <calls> <exclusive cycles>" per function.
+  void print(Print& io_output);
+
+  // Number of functions, which did not fit into the table (see TEENSY_41_SQLITE_PROFILE_SLOTS).
+  uint32_t getDroppedCount();
+}
+
+#endif // USE_TEENSY_41_SQLITE_PROFILE
+
+#endif // TEENSY_41_SQLITE_PROFILE
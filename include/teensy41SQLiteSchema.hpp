@@ -0,0 +1,377 @@
+#ifndef TEENSY_41_SQLITE_SCHEMA
+#define TEENSY_41_SQLITE_SCHEMA
+
+#include "sqlite3.h"
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <tuple>
+#include <type_traits>
+
+/*
+** Compile-time table descriptions. A table is a struct plus a specialization of T41SQLiteTable:
+**
+**   struct Sample
+**   {
+**     int64_t time;
+**     double value;
+**     char unit[8];
+**   };
+**
+**   template <>
+**   struct T41SQLiteTable<Sample>
+**   {
+**     static constexpr const char* name = "Samples";
+**     static constexpr auto columns = std::make_tuple(
+**       T41SQLiteColumn<Sample, int64_t>("time", &Sample::time, "PRIMARY KEY"),
+**       T41SQLiteColumn<Sample, double>("value", &Sample::value),
+**       T41SQLiteColumn<Sample, char[8]>("unit", &Sample::unit));
+**   };
+**
+** T41SQLiteSql<Sample>::create/insert/select are generated at compile time (static constexpr char arrays),
+** T41SQLiteRow<Sample>::bind/read bind and decode a row without heap allocations. The SQL type of a column
+** follows from the type of its member. Members of unsupported types do not compile.
+**
+** Column types:
+**   integral types (bool, int8_t ... int64_t, uint8_t ... uint32_t): INTEGER
+**   float, double: REAL
+**   char[N]: TEXT, bound in place, copied (truncated and terminated) into the member when read
+**   T41SQLiteText, T41SQLiteBlob: TEXT, BLOB, views bound with SQLITE_STATIC, when read they point into
+**     the statement and are valid until the next step/reset/finalize
+*/
+
+struct T41SQLiteText
+{
+  const char* data = nullptr;
+  int size = 0;
+};
+
+struct T41SQLiteBlob
+{
+  const void* data = nullptr;
+  int size = 0;
+};
+
+template <typename Value, typename Enable = void>
+struct T41SQLiteColumnType
+{
+  static_assert(sizeof(Value) == 0, "unsupported column type (see teensy41SQLiteSchema.hpp)");
+};
+
+template <typename Value>
+struct T41SQLiteColumnType<Value, typename std::enable_if<std::is_integral<Value>::value>::type>
+{
+  static_assert(sizeof(Value) < 8 || std::is_signed<Value>::value, "uint64_t does not fit into INTEGER");
+  static constexpr const char* declaredType = "INTEGER";
+
+  static int bind(sqlite3_stmt* io_stmt, int in_index, const Value& in_value)
+  {
+    return sqlite3_bind_int64(io_stmt, in_index, static_cast<sqlite3_int64>(in_value));
+  }
+
+  static void read(sqlite3_stmt* io_stmt, int in_index, Value& out_value)
+  {
+    out_value = static_cast<Value>(sqlite3_column_int64(io_stmt, in_index));
+  }
+};
+
+template <typename Value>
+struct T41SQLiteColumnType<Value, typename std::enable_if<std::is_floating_point<Value>::value>::type>
+{
+  static constexpr const char* declaredType = "REAL";
+
+  static int bind(sqlite3_stmt* io_stmt, int in_index, const Value& in_value)
+  {
+    return sqlite3_bind_double(io_stmt, in_index, static_cast<double>(in_value));
+  }
+
+  static void read(sqlite3_stmt* io_stmt, int in_index, Value& out_value)
+  {
+    out_value = static_cast<Value>(sqlite3_column_double(io_stmt, in_index));
+  }
+};
+
+template <size_t in_size>
+struct T41SQLiteColumnType<char[in_size]>
+{
+  static constexpr const char* declaredType = "TEXT";
+
+  static int bind(sqlite3_stmt* io_stmt, int in_index, const char (&in_value)[in_size])
+  {
+    return sqlite3_bind_text(io_stmt, in_index, in_value, static_cast<int>(strnlen(in_value, in_size)), SQLITE_STATIC);
+  }
+
+  static void read(sqlite3_stmt* io_stmt, int in_index, char (&out_value)[in_size])
+  {
+    const unsigned char* text = sqlite3_column_text(io_stmt, in_index);
+    size_t length = min(static_cast<size_t>(sqlite3_column_bytes(io_stmt, in_index)), in_size - 1);
+
+    if (text != nullptr)
+    {
+      memcpy(out_value, text, length);
+    }
+
+    out_value[text != nullptr ? length : 0] = '\0';
+  }
+};
+
+template <>
+struct T41SQLiteColumnType<T41SQLiteText>
+{
+  static constexpr const char* declaredType = "TEXT";
+
+  static int bind(sqlite3_stmt* io_stmt, int in_index, const T41SQLiteText& in_value)
+  {
+    return sqlite3_bind_text(io_stmt, in_index, in_value.data, in_value.size, SQLITE_STATIC);
+  }
+
+  static void read(sqlite3_stmt* io_stmt, int in_index, T41SQLiteText& out_value)
+  {
+    out_value.data = reinterpret_cast<const char*>(sqlite3_column_text(io_stmt, in_index));
+    out_value.size = sqlite3_column_bytes(io_stmt, in_index);
+  }
+};
+
+template <>
+struct T41SQLiteColumnType<T41SQLiteBlob>
+{
+  static constexpr const char* declaredType = "BLOB";
+
+  static int bind(sqlite3_stmt* io_stmt, int in_index, const T41SQLiteBlob& in_value)
+  {
+    return sqlite3_bind_blob(io_stmt, in_index, in_value.data, in_value.size, SQLITE_STATIC);
+  }
+
+  static void read(sqlite3_stmt* io_stmt, int in_index, T41SQLiteBlob& out_value)
+  {
+    out_value.data = sqlite3_column_blob(io_stmt, in_index);
+    out_value.size = sqlite3_column_bytes(io_stmt, in_index);
+  }
+};
+
+template <typename Row, typename Value>
+struct T41SQLiteColumn
+{
+  using RowType = Row;
+  using ValueType = Value;
+  using Type = T41SQLiteColumnType<Value>;
+
+  const char* name;
+  Value Row::* member;
+  const char* constraint;
+
+  constexpr T41SQLiteColumn(const char* in_name, Value Row::* in_member, const char* in_constraint = "") :
+    name(in_name), member(in_member), constraint(in_constraint)
+  {}
+};
+
+// Specialize for each table (see above).
+template <typename Row>
+struct T41SQLiteTable;
+
+namespace T41SQLiteSchemaDetail
+{
+  // First pass counts the characters, second pass writes them.
+  struct SqlLength
+  {
+    size_t length = 0;
+
+    constexpr void append(const char* in_text)
+    {
+      while (*in_text++ != '\0')
+      {
+        ++length;
+      }
+    }
+  };
+
+  template <size_t in_size>
+  struct SqlText
+  {
+    char text[in_size] = {};
+    size_t length = 0;
+
+    constexpr void append(const char* in_text)
+    {
+      while (*in_text != '\0')
+      {
+        text[length++] = *in_text++;
+      }
+    }
+  };
+
+  template <typename Row, typename Function>
+  constexpr void forEachColumn(Function in_function)
+  {
+    std::apply([&](const auto&... in_columns)
+    {
+      size_t index = 0;
+      (in_function(index++, in_columns), ...);
+    }, T41SQLiteTable<Row>::columns);
+  }
+
+  template <typename Row, typename Sink>
+  constexpr void writeCreate(Sink& io_sink)
+  {
+    io_sink.append("CREATE TABLE IF NOT EXISTS ");
+    io_sink.append(T41SQLiteTable<Row>::name);
+    io_sink.append(" (");
+    forEachColumn<Row>([&](size_t in_index, const auto& in_column)
+    {
+      using Column = typename std::decay<decltype(in_column)>::type;
+      io_sink.append(in_index > 0 ? ", " : "");
+      io_sink.append(in_column.name);
+      io_sink.append(" ");
+      io_sink.append(Column::Type::declaredType);
+      io_sink.append(in_column.constraint[0] != '\0' ? " " : "");
+      io_sink.append(in_column.constraint);
+    });
+    io_sink.append(");");
+  }
+
+  template <typename Row, typename Sink>
+  constexpr void writeInsert(Sink& io_sink)
+  {
+    io_sink.append("INSERT INTO ");
+    io_sink.append(T41SQLiteTable<Row>::name);
+    io_sink.append(" (");
+    forEachColumn<Row>([&](size_t in_index, const auto& in_column)
+    {
+      io_sink.append(in_index > 0 ? ", " : "");
+      io_sink.append(in_column.name);
+    });
+    io_sink.append(") VALUES (");
+    forEachColumn<Row>([&](size_t in_index, const auto&)
+    {
+      io_sink.append(in_index > 0 ? ", ?" : "?");
+    });
+    io_sink.append(");");
+  }
+
+  template <typename Row, typename Sink>
+  constexpr void writeSelect(Sink& io_sink)
+  {
+    io_sink.append("SELECT ");
+    forEachColumn<Row>([&](size_t in_index, const auto& in_column)
+    {
+      io_sink.append(in_index > 0 ? ", " : "");
+      io_sink.append(in_column.name);
+    });
+    io_sink.append(" FROM ");
+    io_sink.append(T41SQLiteTable<Row>::name);
+  }
+
+  template <typename Row, void (*in_write)(SqlLength&)>
+  constexpr size_t sqlLength()
+  {
+    SqlLength sink;
+    in_write(sink);
+    return sink.length;
+  }
+
+  template <size_t in_size, void (*in_write)(SqlText<in_size>&)>
+  constexpr SqlText<in_size> sqlText()
+  {
+    SqlText<in_size> sink;
+    in_write(sink);
+    return sink;
+  }
+
+  template <typename Row>
+  constexpr bool hasColumnsOf()
+  {
+    bool isValid = true;
+    forEachColumn<Row>([&](size_t, const auto& in_column)
+    {
+      using Column = typename std::decay<decltype(in_column)>::type;
+      isValid = isValid && std::is_same<typename Column::RowType, Row>::value;
+    });
+    return isValid;
+  }
+}
+
+/*
+** SQL statements of a table, generated at compile time:
+**   create: CREATE TABLE IF NOT EXISTS name (column TYPE constraint, ...);
+**   insert: INSERT INTO name (column, ...) VALUES (?, ...);
+**   select: SELECT column, ... FROM name (without ';', append WHERE/ORDER BY when preparing)
+*/
+template <typename Row>
+struct T41SQLiteSql
+{
+  static_assert(T41SQLiteSchemaDetail::hasColumnsOf<Row>(), "all columns must be members of the table row");
+
+  static constexpr size_t columnCount = std::tuple_size<decltype(T41SQLiteTable<Row>::columns)>::value;
+
+  private:
+    static constexpr size_t createLength =
+      T41SQLiteSchemaDetail::sqlLength<Row, T41SQLiteSchemaDetail::writeCreate<Row, T41SQLiteSchemaDetail::SqlLength>>();
+    static constexpr size_t insertLength =
+      T41SQLiteSchemaDetail::sqlLength<Row, T41SQLiteSchemaDetail::writeInsert<Row, T41SQLiteSchemaDetail::SqlLength>>();
+    static constexpr size_t selectLength =
+      T41SQLiteSchemaDetail::sqlLength<Row, T41SQLiteSchemaDetail::writeSelect<Row, T41SQLiteSchemaDetail::SqlLength>>();
+
+    static constexpr auto createText = T41SQLiteSchemaDetail::sqlText<createLength + 1,
+      T41SQLiteSchemaDetail::writeCreate<Row, T41SQLiteSchemaDetail::SqlText<createLength + 1>>>();
+    static constexpr auto insertText = T41SQLiteSchemaDetail::sqlText<insertLength + 1,
+      T41SQLiteSchemaDetail::writeInsert<Row, T41SQLiteSchemaDetail::SqlText<insertLength + 1>>>();
+    static constexpr auto selectText = T41SQLiteSchemaDetail::sqlText<selectLength + 1,
+      T41SQLiteSchemaDetail::writeSelect<Row, T41SQLiteSchemaDetail::SqlText<selectLength + 1>>>();
+
+  public:
+    static constexpr const char* create = createText.text;
+    static constexpr const char* insert = insertText.text;
+    static constexpr const char* select = selectText.text;
+};
+
+/*
+** Binding and decoding of rows. bind() binds the columns in their order as parameters 1...n (the order of
+** T41SQLiteSql::insert), read() decodes the result columns 0...n-1 (the order of T41SQLiteSql::select).
+** Text and blob members are bound with SQLITE_STATIC: in_row must stay valid until the statement is stepped.
+*/
+template <typename Row>
+struct T41SQLiteRow
+{
+  static int bind(sqlite3_stmt* io_stmt, const Row& in_row)
+  {
+    int result = SQLITE_OK;
+    T41SQLiteSchemaDetail::forEachColumn<Row>([&](size_t in_index, const auto& in_column)
+    {
+      using Column = typename std::decay<decltype(in_column)>::type;
+
+      if (result == SQLITE_OK)
+      {
+        result = Column::Type::bind(io_stmt, static_cast<int>(in_index) + 1, in_row.*(in_column.member));
+      }
+    });
+    return result;
+  }
+
+  static void read(sqlite3_stmt* io_stmt, Row& out_row)
+  {
+    T41SQLiteSchemaDetail::forEachColumn<Row>([&](size_t in_index, const auto& in_column)
+    {
+      using Column = typename std::decay<decltype(in_column)>::type;
+      Column::Type::read(io_stmt, static_cast<int>(in_index), out_row.*(in_column.member));
+    });
+  }
+
+  // Binds in_row to a statement prepared from T41SQLiteSql<Row>::insert, steps and resets it.
+  static int insert(sqlite3_stmt* io_stmt, const Row& in_row)
+  {
+    int result = bind(io_stmt, in_row);
+
+    if (result == SQLITE_OK)
+    {
+      result = sqlite3_step(io_stmt);
+    }
+
+    sqlite3_reset(io_stmt);
+
+    return result == SQLITE_DONE ? SQLITE_OK : result;
+  }
+};
+
+#endif // TEENSY_41_SQLITE_SCHEMA
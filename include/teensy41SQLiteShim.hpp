@@ -0,0 +1,323 @@
+#ifndef TEENSY_41_SQLITE_SHIM
+#define TEENSY_41_SQLITE_SHIM
+
+#include "sqlite3.h"
+
+#include <Arduino.h>
+#include <new>
+
+/*
+** VFS shims add behavior to the files of another VFS (by default "T41_VFS") without changing it. A shim is a
+** layer template, which derives from the layer below and hides the methods it changes:
+**
+**   template <typename Lower>
+**   class CountingShim : public Lower
+**   {
+**     public:
+**       uint32_t reads = 0;
+**
+**       int read(void* out_data, int in_size, sqlite3_int64 in_offset)
+**       {
+**         ++reads;
+**         return Lower::read(out_data, in_size, in_offset);
+**       }
+**   };
+**
+**   using Stack = CountingShim<T41SQLiteStatsShim<T41SQLiteShimBase>>;
+**   T41SQLiteShim::registerVfs<Stack>("T41_COUNTING", "T41_VFS", false, &stats);
+**   sqlite3_open_v2("data.db", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "T41_COUNTING");
+**
+** The layers of a stack are fixed at compile time. The io methods of a stack call the methods of its top
+** layer, which call the methods of the layers below directly (inlined), only T41SQLiteShimBase calls the file
+** of the underlying VFS through its io methods. A stack object is part of each open file, so layers keep
+** per-file state in members. State shared by all files of a shim VFS is passed as in_context to registerVfs
+** (see context()).
+**
+** Stacks are combined at run time by name: the base of a shim VFS can be any registered VFS, also another shim
+** VFS. registerVfs<CountingShim<T41SQLiteShimBase>>("T41_COUNT_TRACE", "T41_TRACE") puts the counting layer on
+** top of the stack of "T41_TRACE", which costs one indirect call per method.
+**
+** The io methods of a shim file have the version of the file below, so a shim file offers no wal-index or
+** memory mapping (xShmMap, xFetch), if the file below does not (e.g. an encrypted database). The other methods
+** of a shim VFS (xDelete, xAccess, ...) are passed to the base VFS.
+*/
+class T41SQLiteShimBase
+{
+  private:
+    sqlite3_file* m_lower = nullptr;
+    void* m_context = nullptr;
+
+  public:
+    void attach(sqlite3_file* io_lower, void* io_context) { m_lower = io_lower; m_context = io_context; }
+    sqlite3_file* lower() const { return m_lower; }
+    void* context() const { return m_context; }
+
+    int open(sqlite3_vfs* io_lowerVfs, const char* in_name, int in_flags, int* out_flags)
+    {
+      return io_lowerVfs->xOpen(io_lowerVfs, in_name, m_lower, in_flags, out_flags);
+    }
+
+    int close() { return m_lower->pMethods->xClose(m_lower); }
+
+    int read(void* out_data, int in_size, sqlite3_int64 in_offset)
+    {
+      return m_lower->pMethods->xRead(m_lower, out_data, in_size, in_offset);
+    }
+
+    int write(const void* in_data, int in_size, sqlite3_int64 in_offset)
+    {
+      return m_lower->pMethods->xWrite(m_lower, in_data, in_size, in_offset);
+    }
+
+    int truncate(sqlite3_int64 in_size) { return m_lower->pMethods->xTruncate(m_lower, in_size); }
+    int sync(int in_flags) { return m_lower->pMethods->xSync(m_lower, in_flags); }
+    int fileSize(sqlite3_int64* out_size) { return m_lower->pMethods->xFileSize(m_lower, out_size); }
+    int lock(int in_lock) { return m_lower->pMethods->xLock(m_lower, in_lock); }
+    int unlock(int in_lock) { return m_lower->pMethods->xUnlock(m_lower, in_lock); }
+    int checkReservedLock(int* out_result) { return m_lower->pMethods->xCheckReservedLock(m_lower, out_result); }
+    int fileControl(int in_op, void* io_arg) { return m_lower->pMethods->xFileControl(m_lower, in_op, io_arg); }
+    int sectorSize() { return m_lower->pMethods->xSectorSize(m_lower); }
+    int deviceCharacteristics() { return m_lower->pMethods->xDeviceCharacteristics(m_lower); }
+
+    int shmMap(int in_region, int in_regionSize, int in_extend, void volatile** out_region)
+    {
+      return m_lower->pMethods->xShmMap(m_lower, in_region, in_regionSize, in_extend, out_region);
+    }
+
+    int shmLock(int in_offset, int in_count, int in_flags)
+    {
+      return m_lower->pMethods->xShmLock(m_lower, in_offset, in_count, in_flags);
+    }
+
+    void shmBarrier() { m_lower->pMethods->xShmBarrier(m_lower); }
+    int shmUnmap(int in_deleteFlag) { return m_lower->pMethods->xShmUnmap(m_lower, in_deleteFlag); }
+
+    int fetch(sqlite3_int64 in_offset, int in_size, void** out_data)
+    {
+      return m_lower->pMethods->xFetch(m_lower, in_offset, in_size, out_data);
+    }
+
+    int unfetch(sqlite3_int64 in_offset, void* in_data) { return m_lower->pMethods->xUnfetch(m_lower, in_offset, in_data); }
+};
+
+/*
+** A layer, which changes nothing.
+*/
+template <typename Lower>
+class T41SQLiteShimLayer : public Lower
+{
+};
+
+/*
+** Counts the calls and the bytes of the I/O methods and measures their time in microseconds. All files of a
+** shim VFS add to the T41SQLiteShimStats passed as in_context to registerVfs (required).
+*/
+struct T41SQLiteShimStats
+{
+  uint32_t opens = 0;
+  uint32_t reads = 0;
+  uint32_t writes = 0;
+  uint32_t syncs = 0;
+  uint64_t bytesRead = 0;
+  uint64_t bytesWritten = 0;
+  uint64_t readMicros = 0;
+  uint64_t writeMicros = 0;
+  uint64_t syncMicros = 0;
+};
+
+template <typename Lower>
+class T41SQLiteStatsShim : public Lower
+{
+  private:
+    T41SQLiteShimStats* stats() const { return static_cast<T41SQLiteShimStats*>(this->context()); }
+
+  public:
+    int open(sqlite3_vfs* io_lowerVfs, const char* in_name, int in_flags, int* out_flags)
+    {
+      ++stats()->opens;
+      return Lower::open(io_lowerVfs, in_name, in_flags, out_flags);
+    }
+
+    int read(void* out_data, int in_size, sqlite3_int64 in_offset)
+    {
+      uint32_t start = micros();
+      int rc = Lower::read(out_data, in_size, in_offset);
+      T41SQLiteShimStats* pStats = stats();
+      pStats->readMicros += micros() - start;
+      pStats->bytesRead += static_cast<uint32_t>(in_size);
+      ++pStats->reads;
+      return rc;
+    }
+
+    int write(const void* in_data, int in_size, sqlite3_int64 in_offset)
+    {
+      uint32_t start = micros();
+      int rc = Lower::write(in_data, in_size, in_offset);
+      T41SQLiteShimStats* pStats = stats();
+      pStats->writeMicros += micros() - start;
+      pStats->bytesWritten += static_cast<uint32_t>(in_size);
+      ++pStats->writes;
+      return rc;
+    }
+
+    int sync(int in_flags)
+    {
+      uint32_t start = micros();
+      int rc = Lower::sync(in_flags);
+      stats()->syncMicros += micros() - start;
+      ++stats()->syncs;
+      return rc;
+    }
+};
+
+/*
+** An open file of a shim VFS: the stack, followed by the file of the base VFS.
+*/
+template <typename Stack>
+struct T41SQLiteShimFile
+{
+  sqlite3_file base; // must be first
+  Stack stack;
+
+  static constexpr int lowerOffset = static_cast<int>((sizeof(T41SQLiteShimFile) + 7) & ~static_cast<size_t>(7));
+
+  sqlite3_file* lower() { return reinterpret_cast<sqlite3_file*>(reinterpret_cast<char*>(this) + lowerOffset); }
+};
+
+// a registered shim VFS
+struct T41SQLiteShimVfs
+{
+  sqlite3_vfs vfs; // must be first
+  sqlite3_vfs* lower;
+  void* context;
+};
+
+/*
+** The io methods of a stack, one table per version of the io methods of the file below.
+*/
+template <typename Stack>
+class T41SQLiteShimMethods
+{
+  private:
+    using File = T41SQLiteShimFile<Stack>;
+
+    static Stack& stack(sqlite3_file* io_file) { return reinterpret_cast<File*>(io_file)->stack; }
+
+    static int xClose(sqlite3_file* io_file)
+    {
+      int rc = stack(io_file).close();
+      stack(io_file).~Stack();
+      return rc;
+    }
+
+    static int xRead(sqlite3_file* io_file, void* out_data, int in_size, sqlite3_int64 in_offset)
+    {
+      return stack(io_file).read(out_data, in_size, in_offset);
+    }
+
+    static int xWrite(sqlite3_file* io_file, const void* in_data, int in_size, sqlite3_int64 in_offset)
+    {
+      return stack(io_file).write(in_data, in_size, in_offset);
+    }
+
+    static int xTruncate(sqlite3_file* io_file, sqlite3_int64 in_size) { return stack(io_file).truncate(in_size); }
+    static int xSync(sqlite3_file* io_file, int in_flags) { return stack(io_file).sync(in_flags); }
+    static int xFileSize(sqlite3_file* io_file, sqlite3_int64* out_size) { return stack(io_file).fileSize(out_size); }
+    static int xLock(sqlite3_file* io_file, int in_lock) { return stack(io_file).lock(in_lock); }
+    static int xUnlock(sqlite3_file* io_file, int in_lock) { return stack(io_file).unlock(in_lock); }
+    static int xCheckReservedLock(sqlite3_file* io_file, int* out_result) { return stack(io_file).checkReservedLock(out_result); }
+    static int xFileControl(sqlite3_file* io_file, int in_op, void* io_arg) { return stack(io_file).fileControl(in_op, io_arg); }
+    static int xSectorSize(sqlite3_file* io_file) { return stack(io_file).sectorSize(); }
+    static int xDeviceCharacteristics(sqlite3_file* io_file) { return stack(io_file).deviceCharacteristics(); }
+
+    static int xShmMap(sqlite3_file* io_file, int in_region, int in_regionSize, int in_extend, void volatile** out_region)
+    {
+      return stack(io_file).shmMap(in_region, in_regionSize, in_extend, out_region);
+    }
+
+    static int xShmLock(sqlite3_file* io_file, int in_offset, int in_count, int in_flags)
+    {
+      return stack(io_file).shmLock(in_offset, in_count, in_flags);
+    }
+
+    static void xShmBarrier(sqlite3_file* io_file) { stack(io_file).shmBarrier(); }
+    static int xShmUnmap(sqlite3_file* io_file, int in_deleteFlag) { return stack(io_file).shmUnmap(in_deleteFlag); }
+
+    static int xFetch(sqlite3_file* io_file, sqlite3_int64 in_offset, int in_size, void** out_data)
+    {
+      return stack(io_file).fetch(in_offset, in_size, out_data);
+    }
+
+    static int xUnfetch(sqlite3_file* io_file, sqlite3_int64 in_offset, void* in_data)
+    {
+      return stack(io_file).unfetch(in_offset, in_data);
+    }
+
+    static const sqlite3_io_methods* ioMethods(int in_version)
+    {
+      static const sqlite3_io_methods methods[3] = {
+        { 1, xClose, xRead, xWrite, xTruncate, xSync, xFileSize, xLock, xUnlock, xCheckReservedLock, xFileControl,
+          xSectorSize, xDeviceCharacteristics, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr },
+        { 2, xClose, xRead, xWrite, xTruncate, xSync, xFileSize, xLock, xUnlock, xCheckReservedLock, xFileControl,
+          xSectorSize, xDeviceCharacteristics, xShmMap, xShmLock, xShmBarrier, xShmUnmap, nullptr, nullptr },
+        { 3, xClose, xRead, xWrite, xTruncate, xSync, xFileSize, xLock, xUnlock, xCheckReservedLock, xFileControl,
+          xSectorSize, xDeviceCharacteristics, xShmMap, xShmLock, xShmBarrier, xShmUnmap, xFetch, xUnfetch }
+      };
+
+      return &methods[min(max(in_version, 1), 3) - 1];
+    }
+
+  public:
+    /*
+    ** A file gets no io methods, if the base VFS failed to open it (the base file is closed here, if it has
+    ** io methods), so SQLite does not call xClose.
+    */
+    static int xOpen(sqlite3_vfs* io_vfs, const char* in_name, sqlite3_file* io_file, int in_flags, int* out_flags)
+    {
+      T41SQLiteShimVfs* shimVfs = reinterpret_cast<T41SQLiteShimVfs*>(io_vfs);
+      File* file = reinterpret_cast<File*>(io_file);
+      sqlite3_file* lowerFile = file->lower();
+
+      io_file->pMethods = nullptr;
+      lowerFile->pMethods = nullptr;
+      new (&file->stack) Stack();
+      file->stack.attach(lowerFile, shimVfs->context);
+
+      int rc = file->stack.open(shimVfs->lower, in_name, in_flags, out_flags);
+
+      if (rc != SQLITE_OK || lowerFile->pMethods == nullptr)
+      {
+        if (lowerFile->pMethods != nullptr)
+        {
+          lowerFile->pMethods->xClose(lowerFile);
+        }
+
+        file->stack.~Stack();
+        return rc != SQLITE_OK ? rc : SQLITE_CANTOPEN;
+      }
+
+      io_file->pMethods = ioMethods(lowerFile->pMethods->iVersion);
+
+      return SQLITE_OK;
+    }
+};
+
+class T41SQLiteShim
+{
+  public:
+    template <typename Stack>
+    static int registerVfs(const char* in_name, const char* in_baseName = "T41_VFS", bool in_makeDefault = false,
+                           void* in_context = nullptr)
+    {
+      return registerVfs(in_name, in_baseName, in_makeDefault, in_context, T41SQLiteShimFile<Stack>::lowerOffset,
+                         T41SQLiteShimMethods<Stack>::xOpen);
+    }
+
+    static int unregisterVfs(const char* in_name);
+
+  private:
+    static int registerVfs(const char* in_name, const char* in_baseName, bool in_makeDefault, void* in_context,
+                           int in_lowerOffset, int (*in_open)(sqlite3_vfs*, const char*, sqlite3_file*, int, int*));
+};
+
+#endif // TEENSY_41_SQLITE_SHIM
@@ -0,0 +1,345 @@
+#ifndef TEENSY_41_SQLITE_STORAGE
+#define TEENSY_41_SQLITE_STORAGE
+
+/*
+** Storage backends. The backend is chosen at compile time with TEENSY_41_SQLITE_STORAGE_BACKEND. The VFS
+** and the modules, which keep their own files (time series, archives), use the file and filesystem types
+** of T41SQLiteStorage and call them directly:
+**
+**   TEENSY_41_SQLITE_BACKEND_FS:       Arduino FS/File (e.g. SD, default), T41SQLite::begin(&SD)
+**   TEENSY_41_SQLITE_BACKEND_SDFAT:    SdFat SdFs/FsFile without the File wrapper, T41SQLite::begin(&SD.sdfs)
+**   TEENSY_41_SQLITE_BACKEND_LITTLEFS: LittleFS of Teensy (e.g. LittleFS_QSPIFlash), T41SQLite::begin(&myfs)
+**   TEENSY_41_SQLITE_BACKEND_POSIX:    open/pread/pwrite of a host build (env:native, see host/host_main.cpp),
+**                                      T41SQLite::begin(&posixFilesystem)
+**
+** Each call of an Arduino File goes through the virtual methods of its FileImpl (and for SD through the
+** SdFat file below it), the SdFat and the POSIX backend have no virtual calls. The file types of all
+** backends offer the methods of File used by the library (read, write, seek, position, size, flush,
+** truncate, close, operator bool). Features only some backends have are static methods of the backend:
+**   preallocate:     reserve the clusters of an empty file as one contiguous range and zero them (SdFat)
+**   contiguousRange: first and last sector of a contiguous file (SdFat)
+** The other backends return false.
+*/
+#define TEENSY_41_SQLITE_BACKEND_FS 1
+#define TEENSY_41_SQLITE_BACKEND_SDFAT 2
+#define TEENSY_41_SQLITE_BACKEND_LITTLEFS 3
+#define TEENSY_41_SQLITE_BACKEND_POSIX 4
+
+#ifndef TEENSY_41_SQLITE_STORAGE_BACKEND
+  #define TEENSY_41_SQLITE_STORAGE_BACKEND TEENSY_41_SQLITE_BACKEND_FS
+#endif
+
+#if TEENSY_41_SQLITE_STORAGE_BACKEND == TEENSY_41_SQLITE_BACKEND_POSIX
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the open modes and seek modes of FS.h
+#ifndef FILE_READ
+  #define FILE_READ 0
+  #define FILE_WRITE 1
+  #define FILE_WRITE_BEGIN 2
+
+  enum SeekMode
+  {
+    SeekSet = 0,
+    SeekCur = 1,
+    SeekEnd = 2
+  };
+#endif
+
+class T41SQLitePosixFile
+{
+  private:
+    int m_fd = -1;
+    uint64_t m_position = 0;
+
+  public:
+    T41SQLitePosixFile() = default;
+    explicit T41SQLitePosixFile(int in_fd) : m_fd(in_fd) {}
+    T41SQLitePosixFile(const T41SQLitePosixFile&) = delete;
+    T41SQLitePosixFile& operator=(const T41SQLitePosixFile&) = delete;
+
+    T41SQLitePosixFile(T41SQLitePosixFile&& io_other) : m_fd(io_other.m_fd), m_position(io_other.m_position)
+    {
+      io_other.m_fd = -1;
+    }
+
+    T41SQLitePosixFile& operator=(T41SQLitePosixFile&& io_other)
+    {
+      if (this != &io_other)
+      {
+        close();
+        m_fd = io_other.m_fd;
+        m_position = io_other.m_position;
+        io_other.m_fd = -1;
+      }
+
+      return *this;
+    }
+
+    ~T41SQLitePosixFile() { close(); }
+
+    size_t read(void* out_data, size_t in_size)
+    {
+      ssize_t nRead = pread(m_fd, out_data, in_size, static_cast<off_t>(m_position));
+
+      if (nRead <= 0)
+      {
+        return 0;
+      }
+
+      m_position += static_cast<uint64_t>(nRead);
+      return static_cast<size_t>(nRead);
+    }
+
+    size_t write(const void* in_data, size_t in_size)
+    {
+      ssize_t nWritten = pwrite(m_fd, in_data, in_size, static_cast<off_t>(m_position));
+
+      if (nWritten <= 0)
+      {
+        return 0;
+      }
+
+      m_position += static_cast<uint64_t>(nWritten);
+      return static_cast<size_t>(nWritten);
+    }
+
+    bool seek(uint64_t in_position, int in_mode = SeekSet)
+    {
+      if (m_fd < 0)
+      {
+        return false;
+      }
+
+      switch (in_mode)
+      {
+        case SeekSet: m_position = in_position; break;
+        case SeekCur: m_position += in_position; break;
+        case SeekEnd: m_position = size() + in_position; break;
+        default: return false;
+      }
+
+      return true;
+    }
+
+    uint64_t position() const { return m_position; }
+
+    uint64_t size() const
+    {
+      struct stat fileStat;
+      return m_fd >= 0 && fstat(m_fd, &fileStat) == 0 ? static_cast<uint64_t>(fileStat.st_size) : 0;
+    }
+
+    void flush() { fsync(m_fd); }
+    bool truncate(uint64_t in_size) { return ftruncate(m_fd, static_cast<off_t>(in_size)) == 0; }
+
+    void close()
+    {
+      if (m_fd >= 0)
+      {
+        ::close(m_fd);
+        m_fd = -1;
+      }
+    }
+
+    operator bool() const { return m_fd >= 0; }
+};
+
+// paths are passed to the operating system as they are
+struct T41SQLitePosixFilesystem
+{
+};
+
+struct T41SQLitePosixStorage
+{
+  using Filesystem = T41SQLitePosixFilesystem;
+  using File = T41SQLitePosixFile;
+
+  static constexpr const char* NAME = "POSIX";
+
+  static File open(Filesystem*, const char* in_path, uint8_t in_mode)
+  {
+    File file(::open(in_path, in_mode == FILE_READ ? O_RDONLY : O_RDWR | O_CREAT, 0644));
+
+    if (in_mode == FILE_WRITE)
+    {
+      file.seek(0, SeekEnd);
+    }
+
+    return file;
+  }
+
+  static bool exists(Filesystem*, const char* in_path) { return access(in_path, F_OK) == 0; }
+  static bool remove(Filesystem*, const char* in_path) { return unlink(in_path) == 0; }
+  static bool rename(Filesystem*, const char* in_from, const char* in_to) { return ::rename(in_from, in_to) == 0; }
+  static bool preallocate(File&, uint64_t) { return false; }
+  static bool contiguousRange(File&, uint32_t*, uint32_t*) { return false; }
+};
+
+using T41SQLiteStorage = T41SQLitePosixStorage;
+
+#else // Arduino filesystems
+
+#include <Arduino.h>
+#include <FS.h>
+
+#if TEENSY_41_SQLITE_STORAGE_BACKEND == TEENSY_41_SQLITE_BACKEND_LITTLEFS
+  #include <LittleFS.h>
+#endif
+
+template <typename Fs>
+struct T41SQLiteArduinoStorage
+{
+  using Filesystem = Fs;
+  using File = ::File;
+
+  static constexpr const char* NAME = "Arduino FS";
+
+  static File open(Filesystem* io_filesystem, const char* in_path, uint8_t in_mode)
+  {
+    return io_filesystem->open(in_path, in_mode);
+  }
+
+  static bool exists(Filesystem* io_filesystem, const char* in_path) { return io_filesystem->exists(in_path); }
+  static bool remove(Filesystem* io_filesystem, const char* in_path) { return io_filesystem->remove(in_path); }
+
+  static bool rename(Filesystem* io_filesystem, const char* in_from, const char* in_to)
+  {
+    return io_filesystem->rename(in_from, in_to);
+  }
+
+  static bool preallocate(File&, uint64_t) { return false; }
+  static bool contiguousRange(File&, uint32_t*, uint32_t*) { return false; }
+};
+
+#if __has_include(<SdFat.h>)
+
+#include <SdFat.h>
+
+/*
+** FsFile with the methods of File. A copy is a separate SdFat file object of the same file (position, size
+** and cache are not shared), the library only copies temporaries.
+*/
+class T41SQLiteSdFatFile
+{
+  private:
+    FsFile m_file;
+
+  public:
+    FsFile& file() { return m_file; }
+
+    size_t read(void* out_data, size_t in_size)
+    {
+      int nRead = m_file.read(out_data, in_size);
+      return nRead > 0 ? static_cast<size_t>(nRead) : 0;
+    }
+
+    size_t write(const void* in_data, size_t in_size) { return m_file.write(in_data, in_size); }
+
+    bool seek(uint64_t in_position, int in_mode = SeekSet)
+    {
+      switch (in_mode)
+      {
+        case SeekSet: return m_file.seekSet(in_position);
+        case SeekCur: return m_file.seekCur(static_cast<int64_t>(in_position));
+        case SeekEnd: return m_file.seekEnd(static_cast<int64_t>(in_position));
+        default: return false;
+      }
+    }
+
+    uint64_t position() { return m_file.curPosition(); }
+    uint64_t size() { return m_file.fileSize(); }
+    void flush() { m_file.sync(); }
+    bool truncate(uint64_t in_size) { return m_file.truncate(in_size); }
+    void close() { m_file.close(); }
+    operator bool() const { return m_file.isOpen(); }
+};
+
+struct T41SQLiteSdFatStorage
+{
+  using Filesystem = SdFs;
+  using File = T41SQLiteSdFatFile;
+
+  static constexpr const char* NAME = "SdFat";
+
+  // the flags of SD.open
+  static File open(Filesystem* io_filesystem, const char* in_path, uint8_t in_mode)
+  {
+    File file;
+    oflag_t flags = O_RDONLY;
+
+    if (in_mode == FILE_WRITE)
+    {
+      flags = O_RDWR | O_CREAT | O_AT_END;
+    }
+    else if (in_mode == FILE_WRITE_BEGIN)
+    {
+      flags = O_RDWR | O_CREAT;
+    }
+
+    file.file().open(io_filesystem, in_path, flags);
+    return file;
+  }
+
+  static bool exists(Filesystem* io_filesystem, const char* in_path) { return io_filesystem->exists(in_path); }
+  static bool remove(Filesystem* io_filesystem, const char* in_path) { return io_filesystem->remove(in_path); }
+
+  static bool rename(Filesystem* io_filesystem, const char* in_from, const char* in_to)
+  {
+    return io_filesystem->rename(in_from, in_to);
+  }
+
+  /*
+  ** preAllocate sets the size of the file to in_size, the clusters still hold old data of the card, which
+  ** would be file content after a crash. They are zeroed before the directory entry is written by a sync.
+  */
+  static bool preallocate(File& io_file, uint64_t in_size)
+  {
+    if (io_file.size() != 0 || not io_file.file().preAllocate(in_size))
+    {
+      return false;
+    }
+
+    uint8_t zeros[512] = {};
+    bool isZeroed = io_file.seek(0, SeekSet);
+
+    for (uint64_t offset = 0; isZeroed && offset < in_size; offset += sizeof(zeros))
+    {
+      size_t toWrite = static_cast<size_t>(min(static_cast<uint64_t>(sizeof(zeros)), in_size - offset));
+      isZeroed = io_file.write(zeros, toWrite) == toWrite;
+    }
+
+    if (not isZeroed)
+    {
+      io_file.truncate(0);
+      return false;
+    }
+
+    return io_file.seek(0, SeekSet);
+  }
+
+  static bool contiguousRange(File& io_file, uint32_t* out_firstSector, uint32_t* out_lastSector)
+  {
+    return io_file.file().contiguousRange(out_firstSector, out_lastSector);
+  }
+};
+
+#endif // __has_include(<SdFat.h>)
+
+#if TEENSY_41_SQLITE_STORAGE_BACKEND == TEENSY_41_SQLITE_BACKEND_SDFAT
+  using T41SQLiteStorage = T41SQLiteSdFatStorage;
+#elif TEENSY_41_SQLITE_STORAGE_BACKEND == TEENSY_41_SQLITE_BACKEND_LITTLEFS
+  using T41SQLiteStorage = T41SQLiteArduinoStorage<LittleFS>;
+#else
+  using T41SQLiteStorage = T41SQLiteArduinoStorage<FS>;
+#endif
+
+#endif // TEENSY_41_SQLITE_STORAGE_BACKEND == TEENSY_41_SQLITE_BACKEND_POSIX
+
+#endif // TEENSY_41_SQLITE_STORAGE
@@ -0,0 +1,56 @@
+#ifndef TEENSY_41_SQLITE_TIME_SERIES
+#define TEENSY_41_SQLITE_TIME_SERIES
+
+#include "sqlite3.h"
+
+#include <Arduino.h>
+
+/*
+** Size of the blocks of a time series file in bytes (a multiple of the sector size, 512).
+*/
+#ifndef TEENSY_41_SQLITE_TIMESERIES_BLOCK_SIZE
+  #define TEENSY_41_SQLITE_TIMESERIES_BLOCK_SIZE 4096
+#endif
+
+/*
+** Maximum number of value columns of a time series table (the ts column not included).
+*/
+#ifndef TEENSY_41_SQLITE_TIMESERIES_MAX_COLUMNS
+  #define TEENSY_41_SQLITE_TIMESERIES_MAX_COLUMNS 16
+#endif
+
+/*
+** Virtual table module "timeseries": an append-only table of fixed-size records, stored in a binary file
+** next to the database ("<database>-<table>.ts", through the filesystem of T41SQLite) instead of a B-tree.
+**
+**   CREATE VIRTUAL TABLE Samples USING timeseries(temperature FLOAT, pressure REAL, count INTEGER);
+**   INSERT INTO Samples VALUES (ts, temperature, pressure, count);
+**   SELECT avg(temperature) FROM Samples WHERE ts BETWEEN ?1 AND ?2;
+**
+** The first column "ts" (INTEGER, e.g. a timestamp in milliseconds) is followed by the declared value
+** columns of type REAL (double), FLOAT (float), INTEGER (int64) or INT (int32). NULL values are stored as
+** NaN (REAL, FLOAT) or 0 (INTEGER, INT), ts must not be NULL. Rows can only be inserted, the rowid is the
+** number of the record (1, 2, ...).
+**
+** File layout: a header block with two alternating commit records (number of committed records), followed
+** by blocks of records, each with a footer holding the number of records and their minimum and maximum ts.
+** Records are appended to the last block in RAM. A full block is written in one piece, the partly filled
+** last block is written (the new records and its footer) when a transaction commits. So inserting writes
+** sequentially, one block at a time. Insert many rows per transaction: each commit writes the last block and
+** a commit record.
+**
+** The minimum and maximum ts of all blocks are held in RAM (16 bytes per block). A constraint on ts
+** (=, <, <=, >, >=, BETWEEN) reads only the blocks, whose range overlaps. If the ts values were inserted
+** in ascending order, the first block is found by binary search.
+**
+** After a power loss, the records of the last committed transaction are kept, records of an uncommitted
+** transaction are dropped when the table is connected again. Savepoints are supported: a statement, which
+** fails after inserting some of its rows inside a transaction, leaves none of them.
+*/
+class T41SQLiteTimeSeries
+{
+  public:
+    static int registerModule(sqlite3* io_db);
+};
+
+#endif // TEENSY_41_SQLITE_TIME_SERIES
@@ -1,19 +1,72 @@
 #include "teensy41SQLite.hpp"
+#include "teensy41SQLiteCipher.hpp"
+#include "teensy41SQLiteMutex.hpp"
+#include "teensy41SQLite_util.hpp"
 
-int T41SQLite::begin(FS* io_filesystem)
+#include <elapsedMillis.h>
+
+#if TEENSY_41_SQLITE_DTCM_LOOKASIDE_SLOT_COUNT > 0
+static char s_dtcmLookaside[TEENSY_41_SQLITE_DTCM_LOOKASIDE_SLOT_SIZE * TEENSY_41_SQLITE_DTCM_LOOKASIDE_SLOT_COUNT]
+  TEENSY_41_SQLITE_DTCM(lookaside);
+#endif
+
+#if TEENSY_41_SQLITE_DTCM_PAGE_SLOTS > 0
+static const int DTCM_PAGE_SLOT_SIZE = TEENSY_41_SQLITE_DTCM_PAGE_SIZE + TEENSY_41_SQLITE_DTCM_PAGE_HEADER_SIZE;
+static char s_dtcmPageCache[DTCM_PAGE_SLOT_SIZE * TEENSY_41_SQLITE_DTCM_PAGE_SLOTS] TEENSY_41_SQLITE_DTCM(pagecache);
+#endif
+
+int T41SQLite::begin(T41SQLiteStorage::Filesystem* io_filesystem)
 {
   m_filesystem = io_filesystem;
-  return sqlite3_initialize();
+
+#if TEENSY_41_SQLITE_DTCM_PAGE_SLOTS > 0
+  int pageHeaderSize = 0;
+  sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &pageHeaderSize);
+
+  if (m_useDTCMPageCache && pageHeaderSize <= TEENSY_41_SQLITE_DTCM_PAGE_HEADER_SIZE)
+  {
+    sqlite3_config(SQLITE_CONFIG_PAGECACHE, s_dtcmPageCache, DTCM_PAGE_SLOT_SIZE, TEENSY_41_SQLITE_DTCM_PAGE_SLOTS);
+  }
+  else
+  {
+    sqlite3_config(SQLITE_CONFIG_PAGECACHE, nullptr, 0, 0);
+  }
+#endif
+
+  if (T41SQLiteMutex::getMethods() != nullptr)
+  {
+    int result = sqlite3_config(SQLITE_CONFIG_MUTEX, T41SQLiteMutex::getMethods());
+
+    if (result != SQLITE_OK)
+    {
+      return result;
+    }
+  }
+
+  int result = sqlite3_initialize();
+
+#if not defined(SQLITE_OS_OTHER) || SQLITE_OS_OTHER == 0
+  if (result == SQLITE_OK)
+  {
+    result = sqlite3_teensy_os_init();
+  }
+#endif
+
+  return result;
 }
 
 int T41SQLite::end()
 {
+#if not defined(SQLITE_OS_OTHER) || SQLITE_OS_OTHER == 0
+  sqlite3_teensy_os_end();
+#endif
+
   int result = sqlite3_shutdown();
   m_filesystem = nullptr;
   return result;
 }
 
-FS* T41SQLite::getFilesystem()
+T41SQLiteStorage::Filesystem* T41SQLite::getFilesystem()
 {
   return m_filesystem;
 }
@@ -110,3 +163,729 @@ int T41SQLite::getDeviceCharacteristics() const
 {
   return m_deviceCharacteristics;
 }
+
+void T41SQLite::setUseDTCMPageCache(bool in_use)
+{
+  m_useDTCMPageCache = in_use;
+}
+
+bool T41SQLite::getUseDTCMPageCache() const
+{
+  return m_useDTCMPageCache && TEENSY_41_SQLITE_DTCM_PAGE_SLOTS > 0;
+}
+
+void T41SQLite::setUseDTCMJournalBuffers(bool in_use)
+{
+  m_useDTCMJournalBuffers = in_use;
+}
+
+bool T41SQLite::getUseDTCMJournalBuffers() const
+{
+  return m_useDTCMJournalBuffers && TEENSY_41_SQLITE_DTCM_JOURNAL_BUFFERS > 0;
+}
+
+/*
+** Hands the DTCM lookaside pool to io_db. Must be called directly after sqlite3_open
+** (before any lookaside memory is in use). The pool is released, when io_db is closed.
+** Returns SQLITE_BUSY if the pool is in use by another connection
+** and SQLITE_MISUSE if no pool is reserved (TEENSY_41_SQLITE_DTCM_LOOKASIDE_SLOT_COUNT is 0).
+*/
+int T41SQLite::useDTCMLookaside(sqlite3* io_db)
+{
+#if TEENSY_41_SQLITE_DTCM_LOOKASIDE_SLOT_COUNT > 0
+  if (m_dtcmLookasideOwner != nullptr)
+  {
+    return m_dtcmLookasideOwner == io_db ? SQLITE_OK : SQLITE_BUSY;
+  }
+
+  int rc = sqlite3_db_config(io_db, SQLITE_DBCONFIG_LOOKASIDE, s_dtcmLookaside,
+                             TEENSY_41_SQLITE_DTCM_LOOKASIDE_SLOT_SIZE, TEENSY_41_SQLITE_DTCM_LOOKASIDE_SLOT_COUNT);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  rc = sqlite3_set_clientdata(io_db, "t41sqlite_dtcm_lookaside", io_db, [](void*)
+  {
+    T41SQLite::getInstance().m_dtcmLookasideOwner = nullptr;
+  });
+
+  if (rc != SQLITE_OK)
+  {
+    sqlite3_db_config(io_db, SQLITE_DBCONFIG_LOOKASIDE, nullptr, 0, 0);
+    return rc;
+  }
+
+  m_dtcmLookasideOwner = io_db;
+
+  return SQLITE_OK;
+#else
+  return SQLITE_MISUSE;
+#endif
+}
+
+bool T41SQLite::isDTCMLookasideInUse() const
+{
+  return m_dtcmLookasideOwner != nullptr;
+}
+
+/*
+** Registers a database file, which is resident in memory. Opening in_name (relative to getDBDirFullPath()
+** or as full path) serves the file from in_data instead of the filesystem. The file is read-only.
+** in_name and in_data must stay valid until removeMemoryImage is called.
+** Returns SQLITE_FULL if TEENSY_41_SQLITE_MAX_MEMORY_IMAGES images are registered.
+*/
+int T41SQLite::addMemoryImage(const char* in_name, const void* in_data, size_t in_size)
+{
+  if (in_name == nullptr || in_data == nullptr)
+  {
+    return SQLITE_MISUSE;
+  }
+
+  removeMemoryImage(in_name);
+
+  for (MemoryImage& image : m_memoryImages)
+  {
+    if (image.name == nullptr)
+    {
+      image.name = in_name;
+      image.data = static_cast<const unsigned char*>(in_data);
+      image.size = in_size;
+
+      return SQLITE_OK;
+    }
+  }
+
+  return SQLITE_FULL;
+}
+
+int T41SQLite::addMemoryImage(const MemoryImage& in_image)
+{
+  return addMemoryImage(in_image.name, in_image.data, in_image.size);
+}
+
+int T41SQLite::removeMemoryImage(const char* in_name)
+{
+  for (MemoryImage& image : m_memoryImages)
+  {
+    if (image.name != nullptr && strcmp(image.name, in_name) == 0)
+    {
+      image = MemoryImage();
+      return SQLITE_OK;
+    }
+  }
+
+  return SQLITE_NOTFOUND;
+}
+
+const T41SQLite::MemoryImage* T41SQLite::findMemoryImage(const char* in_path) const
+{
+  const char* relativePath = nullptr;
+
+  if (strncmp(in_path, m_dbDirFullpath.c_str(), m_dbDirFullpath.length()) == 0)
+  {
+    relativePath = in_path + m_dbDirFullpath.length();
+  }
+
+  for (const MemoryImage& image : m_memoryImages)
+  {
+    if (image.name != nullptr &&
+        (strcmp(image.name, in_path) == 0 || (relativePath != nullptr && strcmp(image.name, relativePath) == 0)))
+    {
+      return &image;
+    }
+  }
+
+  return nullptr;
+}
+
+/*
+** Makes the RAM mirror of a database opened with the URI parameter "mirror" durable
+** (see MIRRORED DATABASES in teensy41SQLite_vfs.cpp). Returns SQLITE_BUSY inside of a transaction,
+** because the image would contain uncommitted changes, and SQLITE_NOTFOUND if the database is not mirrored.
+*/
+int T41SQLite::checkpointMirror(sqlite3* io_db, const char* in_schema)
+{
+  if (not sqlite3_get_autocommit(io_db))
+  {
+    return SQLITE_BUSY;
+  }
+
+  return sqlite3_file_control(io_db, in_schema, TEENSY_41_SQLITE_FCNTL_MIRROR_CHECKPOINT, nullptr);
+}
+
+/*
+** Reads the hot pages of a database opened with the URI parameter "prefetch" (see HOT PAGES in
+** teensy41SQLite_vfs.cpp) with a few large reads, so the first queries after a power cycle find them in
+** memory. Use the maintenance task Prefetch to read them in slices instead. Returns SQLITE_NOTFOUND
+** if the database is not opened with "prefetch".
+*/
+int T41SQLite::prefetchHotPages(sqlite3* io_db, const char* in_schema)
+{
+  int spansLeft = 0;
+  int rc = SQLITE_OK;
+
+  do
+  {
+    rc = sqlite3_file_control(io_db, in_schema, TEENSY_41_SQLITE_FCNTL_PREFETCH, &spansLeft);
+  }
+  while (rc == SQLITE_OK && spansLeft > 0);
+
+  return rc;
+}
+
+/*
+** Saves the hot page list of a database opened with "prefetch" now. It is also saved, when the last
+** connection to the database file is closed. Returns SQLITE_NOTFOUND if the database is not opened with
+** "prefetch".
+*/
+int T41SQLite::saveHotPages(sqlite3* io_db, const char* in_schema)
+{
+  return sqlite3_file_control(io_db, in_schema, TEENSY_41_SQLITE_FCNTL_SAVE_HOT_PAGES, nullptr);
+}
+
+/*
+** A cipher, whose nonces are not seeded yet, is seeded from the TRNG. Without a TRNG the application has to
+** call seedNonces first, otherwise the cipher is not set.
+*/
+int T41SQLite::setCipher(T41SQLiteCipher* io_cipher)
+{
+  if (io_cipher && not io_cipher->isSeeded() && io_cipher->seedNoncesFromTRNG() != SQLITE_OK)
+  {
+    return SQLITE_MISUSE;
+  }
+
+  m_cipher = io_cipher;
+  return SQLITE_OK;
+}
+
+T41SQLiteCipher* T41SQLite::getCipher() const
+{
+  return m_cipher;
+}
+
+/*
+** Reserves the bytes for the nonces at the end of each page of an encrypted database (see ENCRYPTED
+** DATABASES in teensy41SQLite_vfs.cpp). This takes effect on a new database, before its first table is
+** created, and on the copy written by a following VACUUM INTO.
+*/
+int T41SQLite::prepareEncryption(sqlite3* io_db, const char* in_schema)
+{
+  int reserve = static_cast<int>(T41SQLiteCipher::NONCE_SIZE);
+
+  return sqlite3_file_control(io_db, in_schema, SQLITE_FCNTL_RESERVE_BYTES, &reserve);
+}
+
+/*
+** Declares that the database files on the card are changed by this library only (no second device, no card
+** swap while a database is open). The VFS then keeps the database header and whether the journal and the
+** WAL file exist with the lock of each file (see LOCKING in teensy41SQLite_vfs.cpp), so the checks of SQLite
+** at the start of a transaction are answered from memory and the page cache stays valid without a card
+** access, like locking_mode=EXCLUSIVE, but connections of this process still share the file.
+*/
+void T41SQLite::setExclusiveOwner(bool in_isExclusiveOwner)
+{
+  m_isExclusiveOwner = in_isExclusiveOwner;
+}
+
+bool T41SQLite::isExclusiveOwner() const
+{
+  return m_isExclusiveOwner;
+}
+
+static int queryMaintenanceInt(sqlite3* io_db, const char* in_sql, int& out_value)
+{
+  sqlite3_stmt* stmt = nullptr;
+  int rc = sqlite3_prepare_v2(io_db, in_sql, -1, &stmt, nullptr);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  out_value = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+
+  return sqlite3_finalize(stmt);
+}
+
+/*
+** One slice of MaintenanceTask::Optimize: ANALYZE of the next table with indexes after the table with the
+** rowid io_rowid in sqlite_schema (0: the first one). out_isComplete is set and io_rowid is reset to 0,
+** when no table is left.
+*/
+static int analyzeNextMaintenanceTable(sqlite3* io_db, int64_t& io_rowid, bool& out_isComplete)
+{
+  sqlite3_stmt* stmt = nullptr;
+  int rc = sqlite3_prepare_v2(io_db, "SELECT t.rowid, t.name FROM sqlite_schema t WHERE t.type = 'table' AND "
+                              "t.rowid > ?1 AND EXISTS (SELECT 1 FROM sqlite_schema i WHERE i.type = 'index' AND "
+                              "i.tbl_name = t.name) ORDER BY t.rowid LIMIT 1;", -1, &stmt, nullptr);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  sqlite3_bind_int64(stmt, 1, io_rowid);
+  rc = sqlite3_step(stmt);
+  out_isComplete = rc != SQLITE_ROW;
+
+  if (rc == SQLITE_ROW)
+  {
+    io_rowid = sqlite3_column_int64(stmt, 0);
+    char* sql = sqlite3_mprintf("ANALYZE main.\"%w\";", reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)));
+    rc = sql != nullptr ? sqlite3_exec(io_db, sql, nullptr, nullptr, nullptr) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+  }
+  else
+  {
+    io_rowid = 0;
+    rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+  }
+
+  int rcFinalize = sqlite3_finalize(stmt);
+
+  return rc == SQLITE_OK ? rcFinalize : rc;
+}
+
+/*
+** Registers a maintenance task for io_db, which is run by runMaintenance (see MaintenanceTask).
+** in_sql is required for MaintenanceTask::Sql and must stay valid until the task is removed.
+** Returns SQLITE_FULL if TEENSY_41_SQLITE_MAX_MAINTENANCE_TASKS tasks are registered.
+*/
+int T41SQLite::addMaintenanceTask(sqlite3* io_db, MaintenanceTask in_task, uint32_t in_intervalMillis,
+                                  const char* in_sql, int* out_id)
+{
+  if (io_db == nullptr || (in_task == MaintenanceTask::Sql && in_sql == nullptr))
+  {
+    return SQLITE_MISUSE;
+  }
+
+  for (int id = 0; id < TEENSY_41_SQLITE_MAX_MAINTENANCE_TASKS; ++id)
+  {
+    MaintenanceTaskState& state = m_maintenanceTasks[id];
+
+    if (state.db == nullptr)
+    {
+      state = MaintenanceTaskState();
+      state.db = io_db;
+      state.task = in_task;
+      state.sql = in_sql;
+      state.intervalMillis = in_intervalMillis;
+      state.lastCompletionMillis = millis();
+
+      if (out_id != nullptr)
+      {
+        *out_id = id;
+      }
+
+      return SQLITE_OK;
+    }
+  }
+
+  return SQLITE_FULL;
+}
+
+int T41SQLite::removeMaintenanceTasks(sqlite3* io_db)
+{
+  for (MaintenanceTaskState& state : m_maintenanceTasks)
+  {
+    if (state.db == io_db)
+    {
+      state = MaintenanceTaskState();
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Runs due maintenance tasks slice by slice (round robin) until in_budgetMicros are used up.
+** Call it when the application is idle, e.g. from loop(). A slice is not interrupted, so the budget
+** can be exceeded by one slice. A slice is only started, if its last duration fits into the remaining
+** budget (the first slice of a call is always started). Tasks not completed in one call are continued
+** in the next call. Returns the result of the last failed slice or SQLITE_OK.
+*/
+int T41SQLite::runMaintenance(uint32_t in_budgetMicros)
+{
+  elapsedMicros elapsed;
+  bool isCompletedInThisCall[TEENSY_41_SQLITE_MAX_MAINTENANCE_TASKS] = {};
+  bool hasRunSlice = false;
+  int skippedTasks = 0;
+  int result = SQLITE_OK;
+
+  while (skippedTasks < TEENSY_41_SQLITE_MAX_MAINTENANCE_TASKS)
+  {
+    // read once, so the remaining budget cannot wrap around after a slice overran it
+    uint32_t usedMicros = elapsed;
+
+    if (usedMicros >= in_budgetMicros)
+    {
+      break;
+    }
+
+    uint32_t remainingMicros = in_budgetMicros - usedMicros;
+    int id = m_nextMaintenanceTask;
+    MaintenanceTaskState& state = m_maintenanceTasks[id];
+    m_nextMaintenanceTask = (m_nextMaintenanceTask + 1) % TEENSY_41_SQLITE_MAX_MAINTENANCE_TASKS;
+
+    if (isCompletedInThisCall[id] || not isMaintenanceTaskDue(state, millis()) ||
+        (hasRunSlice && state.stats.lastMicros > remainingMicros))
+    {
+      ++skippedTasks;
+      continue;
+    }
+
+    bool isComplete = false;
+    elapsedMicros sliceTime;
+    int rc = runMaintenanceSlice(state, isComplete);
+    uint32_t sliceMicros = sliceTime;
+
+    state.stats.slices += 1;
+    state.stats.lastMicros = sliceMicros;
+    state.stats.maxMicros = max(state.stats.maxMicros, sliceMicros);
+    state.stats.totalMicros += sliceMicros;
+    state.stats.lastResult = rc;
+
+    if (rc != SQLITE_OK)
+    {
+      // retry after the next interval instead of failing in every call
+      result = rc;
+      isComplete = true;
+    }
+    else if (isComplete)
+    {
+      state.stats.completions += 1;
+    }
+
+    state.isInProgress = not isComplete;
+
+    if (isComplete)
+    {
+      state.lastCompletionMillis = millis();
+      isCompletedInThisCall[id] = true;
+    }
+
+    hasRunSlice = true;
+    skippedTasks = 0;
+  }
+
+  return result;
+}
+
+const T41SQLite::MaintenanceStats* T41SQLite::getMaintenanceStats(int in_id) const
+{
+  if (in_id < 0 || in_id >= TEENSY_41_SQLITE_MAX_MAINTENANCE_TASKS || m_maintenanceTasks[in_id].db == nullptr)
+  {
+    return nullptr;
+  }
+
+  return &m_maintenanceTasks[in_id].stats;
+}
+
+bool T41SQLite::isMaintenanceTaskDue(const MaintenanceTaskState& in_state, uint32_t in_nowMillis) const
+{
+  if (in_state.db == nullptr)
+  {
+    return false;
+  }
+
+  // do not run inside of a transaction of the application (the flush of its dirty pages is the exception)
+  if (not sqlite3_get_autocommit(in_state.db) && in_state.task != MaintenanceTask::CacheFlush)
+  {
+    return false;
+  }
+
+  return in_state.isInProgress || in_nowMillis - in_state.lastCompletionMillis >= in_state.intervalMillis;
+}
+
+int T41SQLite::runMaintenanceSlice(MaintenanceTaskState& io_state, bool& out_isComplete)
+{
+  sqlite3* db = io_state.db;
+  int rc = SQLITE_OK;
+  out_isComplete = true;
+
+  switch (io_state.task)
+  {
+    case MaintenanceTask::IncrementalVacuum:
+    {
+      int autoVacuum = 0;
+      rc = queryMaintenanceInt(db, "PRAGMA auto_vacuum;", autoVacuum);
+
+      if (rc != SQLITE_OK || autoVacuum != 2) // 2: INCREMENTAL
+      {
+        break;
+      }
+
+      char sql[48];
+      snprintf(sql, sizeof(sql), "PRAGMA incremental_vacuum(%d);", TEENSY_41_SQLITE_MAINTENANCE_VACUUM_PAGES);
+      rc = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
+
+      int freePages = 0;
+
+      if (rc == SQLITE_OK)
+      {
+        rc = queryMaintenanceInt(db, "PRAGMA freelist_count;", freePages);
+      }
+
+      out_isComplete = freePages == 0;
+    }
+    break;
+
+    case MaintenanceTask::CacheFlush:
+      rc = sqlite3_db_cacheflush(db);
+    break;
+
+    case MaintenanceTask::Optimize:
+    {
+      // the limit is a setting of the connection of the application, it is restored afterwards
+      int analysisLimit = 0;
+      rc = queryMaintenanceInt(db, "PRAGMA analysis_limit;", analysisLimit);
+
+      if (rc != SQLITE_OK)
+      {
+        break;
+      }
+
+      rc = sqlite3_exec(db, "PRAGMA analysis_limit=400;", nullptr, nullptr, nullptr);
+
+      if (rc == SQLITE_OK)
+      {
+        rc = analyzeNextMaintenanceTable(db, io_state.optimizeRowid, out_isComplete);
+      }
+
+      char sql[40];
+      snprintf(sql, sizeof(sql), "PRAGMA analysis_limit=%d;", analysisLimit);
+      int rcRestore = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
+      rc = rc == SQLITE_OK ? rcRestore : rc;
+
+      if (rc != SQLITE_OK)
+      {
+        io_state.optimizeRowid = 0;
+      }
+    }
+    break;
+
+    case MaintenanceTask::WalCheckpoint:
+      rc = sqlite3_wal_checkpoint_v2(db, nullptr, SQLITE_CHECKPOINT_PASSIVE, nullptr, nullptr);
+    break;
+
+    case MaintenanceTask::Sql:
+      rc = sqlite3_exec(db, io_state.sql, nullptr, nullptr, nullptr);
+      out_isComplete = sqlite3_changes(db) == 0;
+    break;
+
+    case MaintenanceTask::Prefetch:
+    {
+      int spansLeft = 0;
+      rc = sqlite3_file_control(db, "main", TEENSY_41_SQLITE_FCNTL_PREFETCH, &spansLeft);
+      out_isComplete = rc != SQLITE_OK || spansLeft == 0;
+      rc = rc == SQLITE_NOTFOUND ? SQLITE_OK : rc;
+    }
+    break;
+  }
+
+  return rc;
+}
+
+static uint32_t hashStatementSql(const char* in_sql, size_t& out_length)
+{
+  out_length = strlen(in_sql);
+
+  return teensyChecksum(in_sql, out_length);
+}
+
+/*
+** Returns a prepared statement for in_sql from the statement cache (prepared with SQLITE_PREPARE_PERSISTENT
+** on a miss). The statement is reset and its bindings are cleared. It belongs to the cache: do not finalize it,
+** hand it back with releaseStatement. Until then it is in use and not handed out again, a second statement
+** for in_sql is prepared instead (e.g. a nested query with the same SQL). If the cache is full, the least
+** recently used statement, which is not in use, is finalized. If all cached statements are in use, in_sql is
+** prepared outside the cache, releaseStatement finalizes it. Returns nullptr and sets *out_result, if in_sql
+** cannot be prepared.
+*/
+sqlite3_stmt* T41SQLite::getStatement(sqlite3* io_db, const char* in_sql, int* out_result)
+{
+  size_t length = 0;
+  uint32_t hash = hashStatementSql(in_sql, length);
+  CachedStatement* leastRecentlyUsed = nullptr;
+  int result = SQLITE_OK;
+
+  for (size_t i = 0; i < m_statementCacheCapacity; ++i)
+  {
+    CachedStatement& entry = m_statementCache[i];
+
+    if (entry.isInUse)
+    {
+      continue;
+    }
+
+    if (entry.stmt != nullptr && entry.db == io_db && entry.hash == hash && entry.length == length &&
+        strcmp(sqlite3_sql(entry.stmt), in_sql) == 0)
+    {
+      ++m_statementCacheHits;
+      entry.lastUse = ++m_statementCacheClock;
+      entry.isInUse = true;
+      sqlite3_reset(entry.stmt);
+      sqlite3_clear_bindings(entry.stmt);
+
+      if (out_result != nullptr)
+      {
+        *out_result = SQLITE_OK;
+      }
+
+      return entry.stmt;
+    }
+
+    // free slots first, then the least recently used statement
+    if (leastRecentlyUsed == nullptr ||
+        (leastRecentlyUsed->stmt != nullptr && (entry.stmt == nullptr || entry.lastUse < leastRecentlyUsed->lastUse)))
+    {
+      leastRecentlyUsed = &entry;
+    }
+  }
+
+  ++m_statementCacheMisses;
+  sqlite3_stmt* stmt = nullptr;
+
+  if (leastRecentlyUsed == nullptr)
+  {
+    result = sqlite3_prepare_v2(io_db, in_sql, static_cast<int>(length) + 1, &stmt, nullptr);
+  }
+  else
+  {
+    result = sqlite3_prepare_v3(io_db, in_sql, static_cast<int>(length) + 1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr);
+  }
+
+  if (result == SQLITE_OK && stmt != nullptr && leastRecentlyUsed != nullptr)
+  {
+    if (leastRecentlyUsed->stmt != nullptr)
+    {
+      ++m_statementCacheEvictions;
+      sqlite3_finalize(leastRecentlyUsed->stmt);
+    }
+
+    leastRecentlyUsed->db = io_db;
+    leastRecentlyUsed->stmt = stmt;
+    leastRecentlyUsed->hash = hash;
+    leastRecentlyUsed->length = length;
+    leastRecentlyUsed->lastUse = ++m_statementCacheClock;
+    leastRecentlyUsed->isInUse = true;
+  }
+  else if (result == SQLITE_OK && stmt == nullptr)
+  {
+    result = SQLITE_MISUSE; // in_sql contains no statement
+  }
+
+  if (out_result != nullptr)
+  {
+    *out_result = result;
+  }
+
+  return result == SQLITE_OK ? stmt : nullptr;
+}
+
+/*
+** Hands a statement returned by getStatement back to the cache. It is reset, so it does not hold locks
+** of the connection. A statement, which is not in the cache (prepared outside of it or discarded by
+** clearStatementCache or setStatementCacheCapacity while in use), is finalized.
+*/
+int T41SQLite::releaseStatement(sqlite3_stmt* in_stmt)
+{
+  if (in_stmt == nullptr)
+  {
+    return SQLITE_OK;
+  }
+
+  for (CachedStatement& entry : m_statementCache)
+  {
+    if (entry.stmt == in_stmt)
+    {
+      if (entry.isDiscarded)
+      {
+        sqlite3_finalize(entry.stmt);
+        entry = CachedStatement();
+        return SQLITE_OK;
+      }
+
+      sqlite3_reset(entry.stmt);
+      entry.isInUse = false;
+      return SQLITE_OK;
+    }
+  }
+
+  return sqlite3_finalize(in_stmt);
+}
+
+/*
+** Statements beyond the new capacity are finalized, those in use when they are released.
+*/
+void T41SQLite::setStatementCacheCapacity(size_t in_capacity)
+{
+  in_capacity = min(in_capacity, static_cast<size_t>(TEENSY_41_SQLITE_MAX_CACHED_STATEMENTS));
+
+  for (size_t i = in_capacity; i < m_statementCacheCapacity; ++i)
+  {
+    CachedStatement& entry = m_statementCache[i];
+
+    if (entry.isInUse)
+    {
+      entry.isDiscarded = true;
+      continue;
+    }
+
+    sqlite3_finalize(entry.stmt);
+    entry = CachedStatement();
+  }
+
+  m_statementCacheCapacity = in_capacity;
+}
+
+size_t T41SQLite::getStatementCacheCapacity() const
+{
+  return m_statementCacheCapacity;
+}
+
+/*
+** Finalizes the cached statements of io_db (all statements, if io_db is nullptr). Statements in use are
+** finalized when they are released, returns SQLITE_BUSY if there are any.
+*/
+int T41SQLite::clearStatementCache(sqlite3* io_db)
+{
+  int result = SQLITE_OK;
+
+  for (CachedStatement& entry : m_statementCache)
+  {
+    if (entry.stmt == nullptr || (io_db != nullptr && entry.db != io_db))
+    {
+      continue;
+    }
+
+    if (entry.isInUse)
+    {
+      entry.isDiscarded = true;
+      result = SQLITE_BUSY;
+      continue;
+    }
+
+    sqlite3_finalize(entry.stmt);
+    entry = CachedStatement();
+  }
+
+  return result;
+}
+
+uint32_t T41SQLite::getStatementCacheHits() const
+{
+  return m_statementCacheHits;
+}
+
+uint32_t T41SQLite::getStatementCacheMisses() const
+{
+  return m_statementCacheMisses;
+}
+
+uint32_t T41SQLite::getStatementCacheEvictions() const
+{
+  return m_statementCacheEvictions;
+}
@@ -0,0 +1,1535 @@
+#include "teensy41SQLiteArchive.hpp"
+#include "teensy41SQLite.hpp"
+#include "teensy41SQLite_util.hpp"
+
+using TeensyFile = T41SQLiteStorage::File;
+
+static const uint32_t TEENSY_ARC_MAGIC = 0x41343154; // "T41A"
+static const uint32_t TEENSY_ARC_HEADER_SIZE = 2 * TEENSY_COMMIT_SECTOR_SIZE;
+static const uint32_t TEENSY_ARC_GROUP_ROWS = TEENSY_41_SQLITE_ARCHIVE_GROUP_ROWS;
+static const int TEENSY_ARC_MAX_COLUMNS = TEENSY_41_SQLITE_ARCHIVE_MAX_COLUMNS;
+static const int TEENSY_ARC_NAME_SIZE = 48;
+
+static const unsigned char TEENSY_ARC_CHUNK_HAS_NULLS = 0x01;
+
+enum TeensyArcType
+{
+  TEENSY_ARC_UNKNOWN, // only NULL values so far
+  TEENSY_ARC_INTEGER,
+  TEENSY_ARC_REAL,
+  TEENSY_ARC_TEXT,
+  TEENSY_ARC_BLOB
+};
+
+// commit record, in sector 0 or 1 of the file (generation % 2)
+struct TeensyArcHeader
+{
+  uint32_t magic;
+  uint32_t directorySize;
+  uint64_t generation;
+  uint64_t directoryOffset;
+  uint32_t directoryChecksum;
+  uint32_t checksum;
+};
+
+struct TeensyArcChunk
+{
+  uint64_t offset;
+  uint32_t size;
+};
+
+struct TeensyArcGroup
+{
+  uint64_t firstRow;
+  uint32_t rowCount;
+  int64_t minFirst; // range of the first column, if it is INTEGER
+  int64_t maxFirst;
+};
+
+struct TeensyArcDirectory
+{
+  int nColumn;
+  uint8_t aType[TEENSY_41_SQLITE_ARCHIVE_MAX_COLUMNS];
+  char azName[TEENSY_41_SQLITE_ARCHIVE_MAX_COLUMNS][TEENSY_ARC_NAME_SIZE];
+  uint32_t nGroup;
+  uint32_t nGroupAlloc;
+  TeensyArcGroup* aGroup;
+  TeensyArcChunk* aChunk; // nColumn per group
+  uint64_t nRow;
+  uint64_t generation;
+};
+
+struct TeensyArcBuffer
+{
+  unsigned char* a;
+  uint32_t n;
+  uint32_t nAlloc;
+  bool isOom;
+};
+
+struct TeensyArcBitWriter
+{
+  TeensyArcBuffer* pBuf;
+  unsigned char cur;
+  int nCur;
+};
+
+/*
+** Encoder state of one column of the current row group.
+*/
+struct TeensyArcColumnWriter
+{
+  TeensyArcBuffer payload;
+  unsigned char aNull[(TEENSY_41_SQLITE_ARCHIVE_GROUP_ROWS + 7) / 8];
+  bool hasNull;
+  bool hasValue;
+  // INTEGER
+  uint64_t prev;
+  uint64_t prevDelta;
+  uint32_t nRun;
+  int64_t minValue;
+  int64_t maxValue;
+  // REAL
+  TeensyArcBitWriter bits;
+  uint64_t prevBits;
+  int prevLead;
+  int prevTrail;
+  // TEXT
+  TeensyArcBuffer dict;
+  uint32_t nEntry;
+  uint32_t* aEntryOffset; // into dict, of the bytes
+  uint32_t* aEntryLength;
+  uint32_t* aHash; // entry + 1, 0: empty
+};
+
+/*
+** Decoder state of one column of the current row group.
+*/
+struct TeensyArcColumnReader
+{
+  unsigned char* aChunk;
+  uint32_t nAlloc;
+  uint32_t nChunk;
+  const unsigned char* aNull;
+  uint32_t iPos;
+  // INTEGER
+  uint64_t prev;
+  uint64_t prevDelta;
+  uint32_t nRun;
+  // REAL
+  unsigned char cur;
+  int nBitsLeft;
+  uint64_t prevBits;
+  int prevLead;
+  int prevTrail;
+  bool isFirst;
+  // TEXT
+  uint32_t* aDictOffset;
+  uint32_t* aDictLength;
+  uint32_t nDict;
+  uint32_t nDictAlloc;
+  // current value
+  bool isNull;
+  int64_t iValue;
+  double rValue;
+  const char* zText;
+  uint32_t nText;
+};
+
+struct TeensyArcTable
+{
+  sqlite3_vtab base;
+  TeensyFile* file;
+  TeensyArcDirectory dir;
+};
+
+struct TeensyArcCursor
+{
+  sqlite3_vtab_cursor base;
+  TeensyArcColumnReader aReader[TEENSY_41_SQLITE_ARCHIVE_MAX_COLUMNS];
+  uint64_t colUsed;
+  int64_t lower;
+  int64_t upper;
+  uint32_t iGroup;
+  uint32_t iRow;
+  bool isEof;
+};
+
+static uint64_t teensyArcZigzag(int64_t value)
+{
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+static int64_t teensyArcUnzigzag(uint64_t value)
+{
+  return static_cast<int64_t>((value >> 1) ^ (~(value & 1) + 1));
+}
+
+static bool teensyArcBufferReserve(TeensyArcBuffer* pBuf, uint32_t nMore)
+{
+  if (pBuf->isOom)
+  {
+    return false;
+  }
+
+  if (pBuf->n + nMore <= pBuf->nAlloc)
+  {
+    return true;
+  }
+
+  uint32_t nAlloc = max(pBuf->n + nMore, pBuf->nAlloc * 2 + 256);
+  unsigned char* a = static_cast<unsigned char*>(sqlite3_realloc(pBuf->a, static_cast<int>(nAlloc)));
+
+  if (not a)
+  {
+    pBuf->isOom = true;
+    return false;
+  }
+
+  pBuf->a = a;
+  pBuf->nAlloc = nAlloc;
+
+  return true;
+}
+
+static void teensyArcBufferAppend(TeensyArcBuffer* pBuf, const void* pData, uint32_t nData)
+{
+  if (nData > 0 && teensyArcBufferReserve(pBuf, nData))
+  {
+    memcpy(pBuf->a + pBuf->n, pData, nData);
+    pBuf->n += nData;
+  }
+}
+
+static void teensyArcBufferPutVarint(TeensyArcBuffer* pBuf, uint64_t value)
+{
+  unsigned char aVarint[10];
+  uint32_t n = 0;
+
+  do
+  {
+    aVarint[n] = static_cast<unsigned char>(value & 0x7f);
+    value >>= 7;
+    aVarint[n] |= value ? 0x80 : 0;
+    ++n;
+  }
+  while (value);
+
+  teensyArcBufferAppend(pBuf, aVarint, n);
+}
+
+static bool teensyArcGetVarint(const unsigned char* a, uint32_t n, uint32_t* piPos, uint64_t* pValue)
+{
+  uint64_t value = 0;
+
+  for (int shift = 0; shift < 64 && *piPos < n; shift += 7)
+  {
+    unsigned char byte = a[(*piPos)++];
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+    if (not (byte & 0x80))
+    {
+      *pValue = value;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void teensyArcBitsWrite(TeensyArcBitWriter* pBits, uint64_t value, int nBits)
+{
+  while (nBits > 0)
+  {
+    int nTake = min(nBits, 8 - pBits->nCur);
+    unsigned char part = static_cast<unsigned char>((value >> (nBits - nTake)) & ((1u << nTake) - 1));
+    pBits->cur = static_cast<unsigned char>((pBits->cur << nTake) | part);
+    pBits->nCur += nTake;
+    nBits -= nTake;
+
+    if (pBits->nCur == 8)
+    {
+      teensyArcBufferAppend(pBits->pBuf, &pBits->cur, 1);
+      pBits->cur = 0;
+      pBits->nCur = 0;
+    }
+  }
+}
+
+static void teensyArcBitsFlush(TeensyArcBitWriter* pBits)
+{
+  if (pBits->nCur > 0)
+  {
+    teensyArcBitsWrite(pBits, 0, 8 - pBits->nCur);
+  }
+}
+
+static bool teensyArcBitsRead(TeensyArcColumnReader* pReader, int nBits, uint64_t* pValue)
+{
+  uint64_t value = 0;
+
+  while (nBits > 0)
+  {
+    if (pReader->nBitsLeft == 0)
+    {
+      if (pReader->iPos >= pReader->nChunk)
+      {
+        return false;
+      }
+
+      pReader->cur = pReader->aChunk[pReader->iPos++];
+      pReader->nBitsLeft = 8;
+    }
+
+    int nTake = min(nBits, pReader->nBitsLeft);
+    value = (value << nTake) | ((pReader->cur >> (pReader->nBitsLeft - nTake)) & ((1u << nTake) - 1));
+    pReader->nBitsLeft -= nTake;
+    nBits -= nTake;
+  }
+
+  *pValue = value;
+
+  return true;
+}
+
+/*
+** Directory: varint column count, per column type byte, varint name length, name, then varint group count,
+** per group varint row count, zigzag varint minimum and maximum of the first column and per column varint
+** chunk offset and size.
+*/
+static void teensyArcDirectoryFree(TeensyArcDirectory* pDir)
+{
+  sqlite3_free(pDir->aGroup);
+  sqlite3_free(pDir->aChunk);
+  pDir->aGroup = nullptr;
+  pDir->aChunk = nullptr;
+  pDir->nGroup = 0;
+  pDir->nGroupAlloc = 0;
+}
+
+static int teensyArcDirectoryReserve(TeensyArcDirectory* pDir, uint32_t nGroup)
+{
+  if (nGroup <= pDir->nGroupAlloc)
+  {
+    return SQLITE_OK;
+  }
+
+  uint32_t nAlloc = max(nGroup, pDir->nGroupAlloc * 2 + 16);
+  TeensyArcGroup* aGroup = static_cast<TeensyArcGroup*>(sqlite3_realloc64(pDir->aGroup, nAlloc * sizeof(TeensyArcGroup)));
+
+  if (not aGroup)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  pDir->aGroup = aGroup;
+
+  TeensyArcChunk* aChunk = static_cast<TeensyArcChunk*>(
+    sqlite3_realloc64(pDir->aChunk, static_cast<uint64_t>(nAlloc) * max(pDir->nColumn, 1) * sizeof(TeensyArcChunk)));
+
+  if (not aChunk)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  pDir->aChunk = aChunk;
+  pDir->nGroupAlloc = nAlloc;
+
+  return SQLITE_OK;
+}
+
+static void teensyArcDirectorySerialize(const TeensyArcDirectory* pDir, TeensyArcBuffer* pBuf)
+{
+  teensyArcBufferPutVarint(pBuf, static_cast<uint64_t>(pDir->nColumn));
+
+  for (int i = 0; i < pDir->nColumn; ++i)
+  {
+    uint32_t nName = static_cast<uint32_t>(strlen(pDir->azName[i]));
+    teensyArcBufferAppend(pBuf, &pDir->aType[i], 1);
+    teensyArcBufferPutVarint(pBuf, nName);
+    teensyArcBufferAppend(pBuf, pDir->azName[i], nName);
+  }
+
+  teensyArcBufferPutVarint(pBuf, pDir->nGroup);
+
+  for (uint32_t g = 0; g < pDir->nGroup; ++g)
+  {
+    teensyArcBufferPutVarint(pBuf, pDir->aGroup[g].rowCount);
+    teensyArcBufferPutVarint(pBuf, teensyArcZigzag(pDir->aGroup[g].minFirst));
+    teensyArcBufferPutVarint(pBuf, teensyArcZigzag(pDir->aGroup[g].maxFirst));
+
+    for (int i = 0; i < pDir->nColumn; ++i)
+    {
+      const TeensyArcChunk& chunk = pDir->aChunk[g * pDir->nColumn + i];
+      teensyArcBufferPutVarint(pBuf, chunk.offset);
+      teensyArcBufferPutVarint(pBuf, chunk.size);
+    }
+  }
+}
+
+static int teensyArcDirectoryParse(TeensyArcDirectory* pDir, const unsigned char* a, uint32_t n)
+{
+  uint32_t iPos = 0;
+  uint64_t value;
+
+  if (not teensyArcGetVarint(a, n, &iPos, &value) || value == 0 || value > TEENSY_ARC_MAX_COLUMNS)
+  {
+    return SQLITE_CORRUPT;
+  }
+
+  pDir->nColumn = static_cast<int>(value);
+
+  for (int i = 0; i < pDir->nColumn; ++i)
+  {
+    if (iPos >= n || a[iPos] > TEENSY_ARC_BLOB)
+    {
+      return SQLITE_CORRUPT;
+    }
+
+    pDir->aType[i] = a[iPos++];
+
+    if (not teensyArcGetVarint(a, n, &iPos, &value) || value >= TEENSY_ARC_NAME_SIZE || iPos + value > n)
+    {
+      return SQLITE_CORRUPT;
+    }
+
+    memcpy(pDir->azName[i], a + iPos, value);
+    pDir->azName[i][value] = '\0';
+    iPos += static_cast<uint32_t>(value);
+  }
+
+  if (not teensyArcGetVarint(a, n, &iPos, &value) || value > UINT32_MAX)
+  {
+    return SQLITE_CORRUPT;
+  }
+
+  uint32_t nGroup = static_cast<uint32_t>(value);
+  int rc = teensyArcDirectoryReserve(pDir, nGroup);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  pDir->nRow = 0;
+
+  for (uint32_t g = 0; g < nGroup; ++g)
+  {
+    uint64_t rowCount;
+    uint64_t minFirst;
+    uint64_t maxFirst;
+
+    if (not teensyArcGetVarint(a, n, &iPos, &rowCount) || rowCount == 0 || rowCount > TEENSY_ARC_GROUP_ROWS ||
+        not teensyArcGetVarint(a, n, &iPos, &minFirst) || not teensyArcGetVarint(a, n, &iPos, &maxFirst))
+    {
+      return SQLITE_CORRUPT;
+    }
+
+    TeensyArcGroup& group = pDir->aGroup[g];
+    group.firstRow = pDir->nRow;
+    group.rowCount = static_cast<uint32_t>(rowCount);
+    group.minFirst = teensyArcUnzigzag(minFirst);
+    group.maxFirst = teensyArcUnzigzag(maxFirst);
+    pDir->nRow += group.rowCount;
+
+    for (int i = 0; i < pDir->nColumn; ++i)
+    {
+      uint64_t offset;
+      uint64_t size;
+
+      if (not teensyArcGetVarint(a, n, &iPos, &offset) || not teensyArcGetVarint(a, n, &iPos, &size) ||
+          size > UINT32_MAX)
+      {
+        return SQLITE_CORRUPT;
+      }
+
+      pDir->aChunk[g * pDir->nColumn + i].offset = offset;
+      pDir->aChunk[g * pDir->nColumn + i].size = static_cast<uint32_t>(size);
+    }
+  }
+
+  pDir->nGroup = nGroup;
+
+  return SQLITE_OK;
+}
+
+/*
+** Reads the directory of the newest commit record, whose directory is intact.
+*/
+static int teensyArcDirectoryRead(TeensyFile& io_file, TeensyArcDirectory* pDir)
+{
+  TeensyArcHeader aHeader[2];
+  bool aIsValid[2];
+  int iFirst = max(teensyCommitRecordRead(io_file, TEENSY_ARC_MAGIC, aHeader, aIsValid), 0);
+  int rc = SQLITE_CORRUPT;
+
+  for (int k = 0; k < 2 && rc == SQLITE_CORRUPT; ++k)
+  {
+    const TeensyArcHeader& header = aHeader[(iFirst + k) % 2];
+
+    if (not aIsValid[(iFirst + k) % 2])
+    {
+      continue;
+    }
+
+    unsigned char* a = static_cast<unsigned char*>(sqlite3_malloc64(max(header.directorySize, 1u)));
+
+    if (not a)
+    {
+      return SQLITE_NOMEM;
+    }
+
+    if (io_file.seek(header.directoryOffset, SeekSet) &&
+        io_file.read(a, header.directorySize) == header.directorySize &&
+        teensyChecksum(a, header.directorySize) == header.directoryChecksum)
+    {
+      rc = teensyArcDirectoryParse(pDir, a, header.directorySize);
+      pDir->generation = header.generation;
+    }
+
+    sqlite3_free(a);
+  }
+
+  return rc;
+}
+
+/*
+** Writes the directory at the end of the file, then the commit record pointing to it.
+*/
+static int teensyArcDirectoryWrite(TeensyFile& io_file, TeensyArcDirectory* pDir)
+{
+  TeensyArcBuffer buf;
+  memset(&buf, 0, sizeof(buf));
+  teensyArcDirectorySerialize(pDir, &buf);
+
+  if (buf.isOom)
+  {
+    sqlite3_free(buf.a);
+    return SQLITE_NOMEM;
+  }
+
+  uint64_t iOfst = io_file.size();
+  bool isWritten = io_file.seek(iOfst, SeekSet) && io_file.write(buf.a, buf.n) == buf.n;
+  io_file.flush();
+
+  TeensyArcHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = TEENSY_ARC_MAGIC;
+  header.directorySize = buf.n;
+  header.generation = pDir->generation + 1;
+  header.directoryOffset = iOfst;
+  header.directoryChecksum = teensyChecksum(buf.a, buf.n);
+  sqlite3_free(buf.a);
+
+  int rc = isWritten ? teensyCommitRecordWrite(io_file, &header) : SQLITE_IOERR_WRITE;
+
+  if (rc == SQLITE_OK)
+  {
+    pDir->generation = header.generation;
+  }
+
+  return rc;
+}
+
+static String teensyArcFullPath(const char* in_path)
+{
+  if (in_path[0] == '/')
+  {
+    return String(in_path);
+  }
+
+  return T41SQLite::getInstance().getDBDirFullPath() + in_path;
+}
+
+// ---- writer ----
+
+static void teensyArcWriterReset(TeensyArcColumnWriter* pWriter)
+{
+  pWriter->payload.n = 0;
+  memset(pWriter->aNull, 0, sizeof(pWriter->aNull));
+  pWriter->hasNull = false;
+  pWriter->hasValue = false;
+  pWriter->prev = 0;
+  pWriter->prevDelta = 0;
+  pWriter->nRun = 0;
+  pWriter->minValue = INT64_MAX;
+  pWriter->maxValue = INT64_MIN;
+  pWriter->bits.pBuf = &pWriter->payload;
+  pWriter->bits.cur = 0;
+  pWriter->bits.nCur = 0;
+  pWriter->prevBits = 0;
+  pWriter->prevLead = -1;
+  pWriter->prevTrail = 0;
+  pWriter->dict.n = 0;
+  pWriter->nEntry = 0;
+
+  if (pWriter->aHash)
+  {
+    memset(pWriter->aHash, 0, 2 * TEENSY_ARC_GROUP_ROWS * sizeof(uint32_t));
+  }
+}
+
+static void teensyArcWriterFree(TeensyArcColumnWriter* pWriter)
+{
+  sqlite3_free(pWriter->payload.a);
+  sqlite3_free(pWriter->dict.a);
+  sqlite3_free(pWriter->aEntryOffset);
+  sqlite3_free(pWriter->aEntryLength);
+  sqlite3_free(pWriter->aHash);
+}
+
+static void teensyArcFlushRun(TeensyArcColumnWriter* pWriter)
+{
+  if (pWriter->nRun > 0)
+  {
+    teensyArcBufferPutVarint(&pWriter->payload, 0);
+    teensyArcBufferPutVarint(&pWriter->payload, pWriter->nRun);
+    pWriter->nRun = 0;
+  }
+}
+
+static void teensyArcEncodeInteger(TeensyArcColumnWriter* pWriter, int64_t value)
+{
+  uint64_t delta = static_cast<uint64_t>(value) - pWriter->prev;
+  uint64_t deltaOfDelta = delta - pWriter->prevDelta;
+  pWriter->prev = static_cast<uint64_t>(value);
+  pWriter->prevDelta = delta;
+  pWriter->minValue = min(pWriter->minValue, value);
+  pWriter->maxValue = max(pWriter->maxValue, value);
+
+  if (deltaOfDelta == 0)
+  {
+    ++pWriter->nRun;
+    return;
+  }
+
+  teensyArcFlushRun(pWriter);
+  teensyArcBufferPutVarint(&pWriter->payload, teensyArcZigzag(static_cast<int64_t>(deltaOfDelta)));
+}
+
+static void teensyArcEncodeReal(TeensyArcColumnWriter* pWriter, double value)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  if (not pWriter->hasValue)
+  {
+    teensyArcBitsWrite(&pWriter->bits, bits, 64);
+    pWriter->prevBits = bits;
+    return;
+  }
+
+  uint64_t x = bits ^ pWriter->prevBits;
+  pWriter->prevBits = bits;
+
+  if (x == 0)
+  {
+    teensyArcBitsWrite(&pWriter->bits, 0, 1);
+    return;
+  }
+
+  int lead = __builtin_clzll(x);
+  int trail = __builtin_ctzll(x);
+  teensyArcBitsWrite(&pWriter->bits, 1, 1);
+
+  if (pWriter->prevLead >= 0 && lead >= pWriter->prevLead && trail >= pWriter->prevTrail)
+  {
+    // inside the window of the previous value
+    teensyArcBitsWrite(&pWriter->bits, 0, 1);
+    teensyArcBitsWrite(&pWriter->bits, x >> pWriter->prevTrail, 64 - pWriter->prevLead - pWriter->prevTrail);
+    return;
+  }
+
+  int length = 64 - lead - trail;
+  teensyArcBitsWrite(&pWriter->bits, 1, 1);
+  teensyArcBitsWrite(&pWriter->bits, static_cast<uint64_t>(lead), 6);
+  teensyArcBitsWrite(&pWriter->bits, static_cast<uint64_t>(length - 1), 6);
+  teensyArcBitsWrite(&pWriter->bits, x >> trail, length);
+  pWriter->prevLead = lead;
+  pWriter->prevTrail = trail;
+}
+
+static int teensyArcEncodeText(TeensyArcColumnWriter* pWriter, const unsigned char* zText, uint32_t nText)
+{
+  if (not pWriter->aHash)
+  {
+    pWriter->aHash = static_cast<uint32_t*>(sqlite3_malloc(2 * TEENSY_ARC_GROUP_ROWS * sizeof(uint32_t)));
+    pWriter->aEntryOffset = static_cast<uint32_t*>(sqlite3_malloc(TEENSY_ARC_GROUP_ROWS * sizeof(uint32_t)));
+    pWriter->aEntryLength = static_cast<uint32_t*>(sqlite3_malloc(TEENSY_ARC_GROUP_ROWS * sizeof(uint32_t)));
+
+    if (not pWriter->aHash || not pWriter->aEntryOffset || not pWriter->aEntryLength)
+    {
+      return SQLITE_NOMEM;
+    }
+
+    memset(pWriter->aHash, 0, 2 * TEENSY_ARC_GROUP_ROWS * sizeof(uint32_t));
+  }
+
+  uint32_t mask = 2 * TEENSY_ARC_GROUP_ROWS - 1;
+  uint32_t iSlot = teensyChecksum(zText, nText) & mask;
+
+  while (pWriter->aHash[iSlot] != 0)
+  {
+    uint32_t iEntry = pWriter->aHash[iSlot] - 1;
+
+    if (pWriter->aEntryLength[iEntry] == nText && memcmp(pWriter->dict.a + pWriter->aEntryOffset[iEntry], zText, nText) == 0)
+    {
+      teensyArcBufferPutVarint(&pWriter->payload, iEntry);
+      return SQLITE_OK;
+    }
+
+    iSlot = (iSlot + 1) & mask;
+  }
+
+  uint32_t iEntry = pWriter->nEntry++;
+  pWriter->aHash[iSlot] = iEntry + 1;
+  pWriter->aEntryOffset[iEntry] = pWriter->dict.n;
+  pWriter->aEntryLength[iEntry] = nText;
+  teensyArcBufferAppend(&pWriter->dict, zText, nText);
+  teensyArcBufferPutVarint(&pWriter->payload, iEntry);
+
+  return SQLITE_OK;
+}
+
+static int teensyArcEncode(TeensyArcColumnWriter* pWriter, uint8_t* pType, sqlite3_value* pValue, uint32_t iRow)
+{
+  int valueType = sqlite3_value_type(pValue);
+
+  if (valueType == SQLITE_NULL)
+  {
+    pWriter->aNull[iRow / 8] |= static_cast<unsigned char>(1 << (iRow % 8));
+    pWriter->hasNull = true;
+    return SQLITE_OK;
+  }
+
+  if (*pType == TEENSY_ARC_UNKNOWN)
+  {
+    switch (valueType)
+    {
+      case SQLITE_INTEGER:
+        *pType = TEENSY_ARC_INTEGER;
+        break;
+      case SQLITE_FLOAT:
+        *pType = TEENSY_ARC_REAL;
+        break;
+      case SQLITE_BLOB:
+        *pType = TEENSY_ARC_BLOB;
+        break;
+      default:
+        *pType = TEENSY_ARC_TEXT;
+        break;
+    }
+  }
+
+  int rc = SQLITE_OK;
+
+  switch (*pType)
+  {
+    case TEENSY_ARC_INTEGER:
+      teensyArcEncodeInteger(pWriter, sqlite3_value_int64(pValue));
+      break;
+    case TEENSY_ARC_REAL:
+      teensyArcEncodeReal(pWriter, sqlite3_value_double(pValue));
+      break;
+    case TEENSY_ARC_BLOB:
+      {
+        const unsigned char* zBlob = static_cast<const unsigned char*>(sqlite3_value_blob(pValue));
+        rc = teensyArcEncodeText(pWriter, zBlob ? zBlob : reinterpret_cast<const unsigned char*>(""),
+                                 static_cast<uint32_t>(sqlite3_value_bytes(pValue)));
+      }
+      break;
+    default:
+      {
+        const unsigned char* zText = sqlite3_value_text(pValue);
+        rc = teensyArcEncodeText(pWriter, zText ? zText : reinterpret_cast<const unsigned char*>(""),
+                                 static_cast<uint32_t>(sqlite3_value_bytes(pValue)));
+      }
+      break;
+  }
+
+  pWriter->hasValue = true;
+
+  return rc;
+}
+
+/*
+** Chunk: flags byte, null bitmap (if there are NULL values), encoded values.
+*/
+static int teensyArcWriteChunk(TeensyFile& io_file, TeensyArcColumnWriter* pWriter, uint8_t type, uint32_t nRow,
+                               TeensyArcChunk* pChunk)
+{
+  TeensyArcBuffer* pPayload = &pWriter->payload;
+
+  if (type == TEENSY_ARC_INTEGER)
+  {
+    teensyArcFlushRun(pWriter);
+  }
+  else if (type == TEENSY_ARC_REAL)
+  {
+    teensyArcBitsFlush(&pWriter->bits);
+  }
+  else if (type == TEENSY_ARC_TEXT || type == TEENSY_ARC_BLOB)
+  {
+    // dictionary in front of the indexes
+    TeensyArcBuffer text;
+    memset(&text, 0, sizeof(text));
+    teensyArcBufferPutVarint(&text, pWriter->nEntry);
+
+    for (uint32_t i = 0; i < pWriter->nEntry; ++i)
+    {
+      teensyArcBufferPutVarint(&text, pWriter->aEntryLength[i]);
+      teensyArcBufferAppend(&text, pWriter->dict.a + pWriter->aEntryOffset[i], pWriter->aEntryLength[i]);
+    }
+
+    teensyArcBufferAppend(&text, pPayload->a, pPayload->n);
+    sqlite3_free(pPayload->a);
+    *pPayload = text;
+  }
+
+  if (pPayload->isOom || pWriter->dict.isOom)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  unsigned char flags = pWriter->hasNull ? TEENSY_ARC_CHUNK_HAS_NULLS : 0;
+  uint32_t nNull = pWriter->hasNull ? (nRow + 7) / 8 : 0;
+
+  pChunk->offset = io_file.size();
+  pChunk->size = 1 + nNull + pPayload->n;
+
+  if (not io_file.seek(pChunk->offset, SeekSet) || io_file.write(&flags, 1) != 1 ||
+      (nNull > 0 && io_file.write(pWriter->aNull, nNull) != nNull) ||
+      (pPayload->n > 0 && io_file.write(pPayload->a, pPayload->n) != pPayload->n))
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  return SQLITE_OK;
+}
+
+static int teensyArcWriteGroup(TeensyFile& io_file, TeensyArcDirectory* pDir, TeensyArcColumnWriter* aWriter, uint32_t nRow)
+{
+  int rc = teensyArcDirectoryReserve(pDir, pDir->nGroup + 1);
+
+  for (int i = 0; i < pDir->nColumn && rc == SQLITE_OK; ++i)
+  {
+    rc = teensyArcWriteChunk(io_file, &aWriter[i], pDir->aType[i], nRow, &pDir->aChunk[pDir->nGroup * pDir->nColumn + i]);
+  }
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  TeensyArcGroup& group = pDir->aGroup[pDir->nGroup++];
+  group.firstRow = pDir->nRow;
+  group.rowCount = nRow;
+  group.minFirst = pDir->aType[0] == TEENSY_ARC_INTEGER ? aWriter[0].minValue : INT64_MIN;
+  group.maxFirst = pDir->aType[0] == TEENSY_ARC_INTEGER ? aWriter[0].maxValue : INT64_MAX;
+  pDir->nRow += nRow;
+
+  for (int i = 0; i < pDir->nColumn; ++i)
+  {
+    teensyArcWriterReset(&aWriter[i]);
+  }
+
+  return SQLITE_OK;
+}
+
+int T41SQLiteArchive::append(sqlite3* io_db, const char* in_path, const char* in_selectSql, uint32_t* out_rowCount)
+{
+  T41SQLiteStorage::Filesystem* filesystem = T41SQLite::getInstance().getFilesystem();
+
+  if (out_rowCount)
+  {
+    *out_rowCount = 0;
+  }
+
+  if (not filesystem || not io_db || not in_path || not in_selectSql)
+  {
+    return SQLITE_MISUSE;
+  }
+
+  sqlite3_stmt* stmt;
+  int rc = sqlite3_prepare_v2(io_db, in_selectSql, -1, &stmt, nullptr);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  int nColumn = sqlite3_column_count(stmt);
+
+  if (nColumn == 0 || nColumn > TEENSY_ARC_MAX_COLUMNS)
+  {
+    sqlite3_finalize(stmt);
+    return SQLITE_RANGE;
+  }
+
+  String path = teensyArcFullPath(in_path);
+  TeensyFile file = T41SQLiteStorage::open(filesystem, path.c_str(), FILE_WRITE);
+  TeensyArcDirectory* pDir = static_cast<TeensyArcDirectory*>(sqlite3_malloc(sizeof(TeensyArcDirectory)));
+  TeensyArcColumnWriter* aWriter = static_cast<TeensyArcColumnWriter*>(sqlite3_malloc(nColumn * sizeof(TeensyArcColumnWriter)));
+
+  if (not pDir || not aWriter)
+  {
+    rc = SQLITE_NOMEM;
+  }
+  else if (not file)
+  {
+    rc = SQLITE_CANTOPEN;
+  }
+  else
+  {
+    memset(pDir, 0, sizeof(TeensyArcDirectory));
+    memset(aWriter, 0, nColumn * sizeof(TeensyArcColumnWriter));
+
+    if (file.size() == 0)
+    {
+      // new archive: header sectors, columns named after the result columns
+      unsigned char aZero[TEENSY_ARC_HEADER_SIZE];
+      memset(aZero, 0, sizeof(aZero));
+      rc = file.write(aZero, sizeof(aZero)) == sizeof(aZero) ? SQLITE_OK : SQLITE_IOERR_WRITE;
+      pDir->nColumn = nColumn;
+
+      for (int i = 0; i < nColumn; ++i)
+      {
+        strncpy(pDir->azName[i], sqlite3_column_name(stmt, i), TEENSY_ARC_NAME_SIZE - 1);
+      }
+    }
+    else
+    {
+      rc = teensyArcDirectoryRead(file, pDir);
+
+      if (rc == SQLITE_OK && pDir->nColumn != nColumn)
+      {
+        rc = SQLITE_MISMATCH;
+      }
+    }
+  }
+
+  for (int i = 0; i < nColumn && aWriter; ++i)
+  {
+    teensyArcWriterReset(&aWriter[i]);
+  }
+
+  uint32_t nRow = 0;
+  uint32_t nTotal = 0;
+
+  while (rc == SQLITE_OK)
+  {
+    int rcStep = sqlite3_step(stmt);
+
+    if (rcStep != SQLITE_ROW)
+    {
+      rc = rcStep == SQLITE_DONE ? SQLITE_OK : rcStep;
+      break;
+    }
+
+    for (int i = 0; i < nColumn && rc == SQLITE_OK; ++i)
+    {
+      rc = teensyArcEncode(&aWriter[i], &pDir->aType[i], sqlite3_column_value(stmt, i), nRow);
+    }
+
+    ++nTotal;
+
+    if (rc == SQLITE_OK && ++nRow == TEENSY_ARC_GROUP_ROWS)
+    {
+      rc = teensyArcWriteGroup(file, pDir, aWriter, nRow);
+      nRow = 0;
+    }
+  }
+
+  if (rc == SQLITE_OK && nRow > 0)
+  {
+    rc = teensyArcWriteGroup(file, pDir, aWriter, nRow);
+  }
+
+  if (rc == SQLITE_OK && nTotal > 0)
+  {
+    rc = teensyArcDirectoryWrite(file, pDir);
+  }
+
+  if (rc == SQLITE_OK && out_rowCount)
+  {
+    *out_rowCount = nTotal;
+  }
+
+  for (int i = 0; i < nColumn && aWriter; ++i)
+  {
+    teensyArcWriterFree(&aWriter[i]);
+  }
+
+  if (pDir)
+  {
+    teensyArcDirectoryFree(pDir);
+  }
+
+  sqlite3_free(aWriter);
+  sqlite3_free(pDir);
+  file.close();
+  sqlite3_finalize(stmt);
+
+  return rc;
+}
+
+// ---- reader (virtual table) ----
+
+static int teensyArcConnect(sqlite3* db, void*, int argc, const char* const* argv, sqlite3_vtab** ppVtab, char** pzErr)
+{
+  static const char* const aTypeName[] = { "", " INTEGER", " REAL", " TEXT", " BLOB" };
+
+  T41SQLiteStorage::Filesystem* filesystem = T41SQLite::getInstance().getFilesystem();
+
+  if (argc != 4 || not filesystem)
+  {
+    *pzErr = sqlite3_mprintf("archive: the path of an archive file expected");
+    return SQLITE_ERROR;
+  }
+
+  // the path may be quoted
+  char zPath[256];
+  const char* zArg = argv[3];
+  size_t nArg = strlen(zArg);
+
+  if (nArg >= 2 && (zArg[0] == '\'' || zArg[0] == '"') && zArg[nArg - 1] == zArg[0])
+  {
+    ++zArg;
+    nArg -= 2;
+  }
+
+  if (nArg >= sizeof(zPath))
+  {
+    return SQLITE_CANTOPEN;
+  }
+
+  memcpy(zPath, zArg, nArg);
+  zPath[nArg] = '\0';
+
+  TeensyArcTable* pTab = static_cast<TeensyArcTable*>(sqlite3_malloc(sizeof(TeensyArcTable)));
+
+  if (not pTab)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  memset(pTab, 0, sizeof(TeensyArcTable));
+  pTab->file = new TeensyFile(T41SQLiteStorage::open(filesystem, teensyArcFullPath(zPath).c_str(), FILE_READ));
+  int rc = pTab->file && *pTab->file ? teensyArcDirectoryRead(*pTab->file, &pTab->dir) : SQLITE_CANTOPEN;
+
+  if (rc == SQLITE_OK)
+  {
+    sqlite3_str* pSchema = sqlite3_str_new(db);
+    sqlite3_str_appendall(pSchema, "CREATE TABLE x(");
+
+    for (int i = 0; i < pTab->dir.nColumn; ++i)
+    {
+      sqlite3_str_appendf(pSchema, "%s\"%w\"%s", i > 0 ? ", " : "", pTab->dir.azName[i], aTypeName[pTab->dir.aType[i]]);
+    }
+
+    sqlite3_str_appendall(pSchema, ")");
+    char* zSql = sqlite3_str_finish(pSchema);
+    rc = zSql ? sqlite3_declare_vtab(db, zSql) : SQLITE_NOMEM;
+    sqlite3_free(zSql);
+  }
+  else
+  {
+    *pzErr = sqlite3_mprintf("archive: cannot read %s", zPath);
+  }
+
+  if (rc != SQLITE_OK)
+  {
+    if (pTab->file)
+    {
+      pTab->file->close();
+      delete pTab->file;
+    }
+
+    teensyArcDirectoryFree(&pTab->dir);
+    sqlite3_free(pTab);
+    return rc;
+  }
+
+  *ppVtab = &pTab->base;
+
+  return SQLITE_OK;
+}
+
+static int teensyArcDisconnect(sqlite3_vtab* pVtab)
+{
+  TeensyArcTable* pTab = reinterpret_cast<TeensyArcTable*>(pVtab);
+  pTab->file->close();
+  delete pTab->file;
+  teensyArcDirectoryFree(&pTab->dir);
+  sqlite3_free(pTab);
+  return SQLITE_OK;
+}
+
+/*
+** Range constraints on the first column, if it is INTEGER (see teensyRangeBestIndex). idxStr: the used
+** columns (hex), the chunks of the other columns are not read.
+*/
+static int teensyArcBestIndex(sqlite3_vtab* pVtab, sqlite3_index_info* pInfo)
+{
+  TeensyArcTable* pTab = reinterpret_cast<TeensyArcTable*>(pVtab);
+  int iArgv = 0;
+  pInfo->idxNum = 0;
+
+  if (pTab->dir.aType[0] == TEENSY_ARC_INTEGER)
+  {
+    iArgv = teensyRangeBestIndex(pInfo, 0);
+  }
+
+  uint64_t colUsed = static_cast<uint64_t>(pInfo->colUsed);
+  int nUsed = 0;
+
+  for (int i = 0; i < pTab->dir.nColumn; ++i)
+  {
+    nUsed += (colUsed >> min(i, 63)) & 1;
+  }
+
+  pInfo->idxStr = sqlite3_mprintf("%llx", static_cast<unsigned long long>(colUsed));
+  pInfo->needToFreeIdxStr = 1;
+
+  double nRow = static_cast<double>(pTab->dir.nRow) + 1.0;
+  double fraction = (pInfo->idxNum & 4) ? 0.001 : (iArgv == 2 ? 0.0625 : (iArgv == 1 ? 0.25 : 1.0));
+  pInfo->estimatedRows = static_cast<sqlite3_int64>(nRow * fraction) + 1;
+  pInfo->estimatedCost = nRow * fraction * (nUsed + 1) * 0.05 + 10.0;
+
+  return SQLITE_OK;
+}
+
+static int teensyArcOpen(sqlite3_vtab*, sqlite3_vtab_cursor** ppCursor)
+{
+  TeensyArcCursor* pCur = static_cast<TeensyArcCursor*>(sqlite3_malloc(sizeof(TeensyArcCursor)));
+
+  if (not pCur)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  memset(pCur, 0, sizeof(TeensyArcCursor));
+  pCur->isEof = true;
+  *ppCursor = &pCur->base;
+
+  return SQLITE_OK;
+}
+
+static int teensyArcClose(sqlite3_vtab_cursor* pCursor)
+{
+  TeensyArcCursor* pCur = reinterpret_cast<TeensyArcCursor*>(pCursor);
+
+  for (int i = 0; i < TEENSY_ARC_MAX_COLUMNS; ++i)
+  {
+    sqlite3_free(pCur->aReader[i].aChunk);
+    sqlite3_free(pCur->aReader[i].aDictOffset);
+    sqlite3_free(pCur->aReader[i].aDictLength);
+  }
+
+  sqlite3_free(pCur);
+
+  return SQLITE_OK;
+}
+
+static bool teensyArcIsUsed(const TeensyArcCursor* pCur, int iColumn)
+{
+  return (pCur->colUsed >> min(iColumn, 63)) & 1;
+}
+
+static int teensyArcLoadChunk(TeensyArcCursor* pCur, int iColumn)
+{
+  TeensyArcTable* pTab = reinterpret_cast<TeensyArcTable*>(pCur->base.pVtab);
+  TeensyArcColumnReader* pReader = &pCur->aReader[iColumn];
+  const TeensyArcChunk& chunk = pTab->dir.aChunk[pCur->iGroup * pTab->dir.nColumn + iColumn];
+  uint32_t nRow = pTab->dir.aGroup[pCur->iGroup].rowCount;
+
+  if (chunk.size > pReader->nAlloc)
+  {
+    unsigned char* aChunk = static_cast<unsigned char*>(sqlite3_realloc(pReader->aChunk, static_cast<int>(chunk.size)));
+
+    if (not aChunk)
+    {
+      return SQLITE_NOMEM;
+    }
+
+    pReader->aChunk = aChunk;
+    pReader->nAlloc = chunk.size;
+  }
+
+  if (chunk.size == 0 || not pTab->file->seek(chunk.offset, SeekSet) ||
+      pTab->file->read(pReader->aChunk, chunk.size) != chunk.size)
+  {
+    return SQLITE_IOERR_READ;
+  }
+
+  pReader->nChunk = chunk.size;
+  pReader->iPos = 1;
+  pReader->aNull = nullptr;
+
+  if (pReader->aChunk[0] & TEENSY_ARC_CHUNK_HAS_NULLS)
+  {
+    pReader->aNull = pReader->aChunk + 1;
+    pReader->iPos += (nRow + 7) / 8;
+  }
+
+  pReader->prev = 0;
+  pReader->prevDelta = 0;
+  pReader->nRun = 0;
+  pReader->nBitsLeft = 0;
+  pReader->prevBits = 0;
+  pReader->prevLead = 0;
+  pReader->prevTrail = 0;
+  pReader->isFirst = true;
+  pReader->nDict = 0;
+
+  if (pTab->dir.aType[iColumn] != TEENSY_ARC_TEXT && pTab->dir.aType[iColumn] != TEENSY_ARC_BLOB)
+  {
+    return pReader->iPos <= pReader->nChunk ? SQLITE_OK : SQLITE_CORRUPT;
+  }
+
+  uint64_t nDict;
+
+  if (not teensyArcGetVarint(pReader->aChunk, pReader->nChunk, &pReader->iPos, &nDict) || nDict > nRow)
+  {
+    return SQLITE_CORRUPT;
+  }
+
+  if (nDict > pReader->nDictAlloc)
+  {
+    sqlite3_free(pReader->aDictOffset);
+    sqlite3_free(pReader->aDictLength);
+    pReader->aDictOffset = static_cast<uint32_t*>(sqlite3_malloc(TEENSY_ARC_GROUP_ROWS * sizeof(uint32_t)));
+    pReader->aDictLength = static_cast<uint32_t*>(sqlite3_malloc(TEENSY_ARC_GROUP_ROWS * sizeof(uint32_t)));
+    pReader->nDictAlloc = TEENSY_ARC_GROUP_ROWS;
+
+    if (not pReader->aDictOffset || not pReader->aDictLength)
+    {
+      pReader->nDictAlloc = 0;
+      return SQLITE_NOMEM;
+    }
+  }
+
+  for (uint32_t i = 0; i < nDict; ++i)
+  {
+    uint64_t nText;
+
+    if (not teensyArcGetVarint(pReader->aChunk, pReader->nChunk, &pReader->iPos, &nText) ||
+        pReader->iPos + nText > pReader->nChunk)
+    {
+      return SQLITE_CORRUPT;
+    }
+
+    pReader->aDictOffset[i] = pReader->iPos;
+    pReader->aDictLength[i] = static_cast<uint32_t>(nText);
+    pReader->iPos += static_cast<uint32_t>(nText);
+  }
+
+  pReader->nDict = static_cast<uint32_t>(nDict);
+
+  return SQLITE_OK;
+}
+
+/*
+** Decodes the value of row pCur->iRow of a used column.
+*/
+static int teensyArcDecode(TeensyArcCursor* pCur, int iColumn)
+{
+  TeensyArcTable* pTab = reinterpret_cast<TeensyArcTable*>(pCur->base.pVtab);
+  TeensyArcColumnReader* pReader = &pCur->aReader[iColumn];
+  uint32_t iRow = pCur->iRow;
+
+  pReader->isNull = pReader->aNull && (pReader->aNull[iRow / 8] & (1 << (iRow % 8)));
+
+  if (pReader->isNull)
+  {
+    return SQLITE_OK;
+  }
+
+  switch (pTab->dir.aType[iColumn])
+  {
+    case TEENSY_ARC_INTEGER:
+      {
+        uint64_t deltaOfDelta = 0;
+
+        if (pReader->nRun == 0)
+        {
+          uint64_t token;
+
+          if (not teensyArcGetVarint(pReader->aChunk, pReader->nChunk, &pReader->iPos, &token))
+          {
+            return SQLITE_CORRUPT;
+          }
+
+          if (token == 0)
+          {
+            uint64_t nRun;
+
+            if (not teensyArcGetVarint(pReader->aChunk, pReader->nChunk, &pReader->iPos, &nRun) || nRun == 0 ||
+                nRun > TEENSY_ARC_GROUP_ROWS)
+            {
+              return SQLITE_CORRUPT;
+            }
+
+            pReader->nRun = static_cast<uint32_t>(nRun);
+          }
+          else
+          {
+            deltaOfDelta = static_cast<uint64_t>(teensyArcUnzigzag(token));
+          }
+        }
+
+        if (pReader->nRun > 0)
+        {
+          --pReader->nRun;
+        }
+
+        pReader->prevDelta += deltaOfDelta;
+        pReader->prev += pReader->prevDelta;
+        pReader->iValue = static_cast<int64_t>(pReader->prev);
+      }
+      break;
+    case TEENSY_ARC_REAL:
+      {
+        uint64_t bits;
+
+        if (pReader->isFirst)
+        {
+          if (not teensyArcBitsRead(pReader, 64, &bits))
+          {
+            return SQLITE_CORRUPT;
+          }
+
+          pReader->isFirst = false;
+        }
+        else
+        {
+          uint64_t isChanged;
+          uint64_t isNewWindow;
+          uint64_t x = 0;
+
+          if (not teensyArcBitsRead(pReader, 1, &isChanged))
+          {
+            return SQLITE_CORRUPT;
+          }
+
+          if (isChanged)
+          {
+            if (not teensyArcBitsRead(pReader, 1, &isNewWindow))
+            {
+              return SQLITE_CORRUPT;
+            }
+
+            if (isNewWindow)
+            {
+              uint64_t lead;
+              uint64_t length;
+
+              if (not teensyArcBitsRead(pReader, 6, &lead) || not teensyArcBitsRead(pReader, 6, &length) ||
+                  lead + length + 1 > 64)
+              {
+                return SQLITE_CORRUPT;
+              }
+
+              pReader->prevLead = static_cast<int>(lead);
+              pReader->prevTrail = static_cast<int>(64 - lead - (length + 1));
+            }
+
+            if (not teensyArcBitsRead(pReader, 64 - pReader->prevLead - pReader->prevTrail, &x))
+            {
+              return SQLITE_CORRUPT;
+            }
+
+            x <<= pReader->prevTrail;
+          }
+
+          bits = pReader->prevBits ^ x;
+        }
+
+        pReader->prevBits = bits;
+        memcpy(&pReader->rValue, &bits, sizeof(bits));
+      }
+      break;
+    case TEENSY_ARC_TEXT:
+    case TEENSY_ARC_BLOB:
+      {
+        uint64_t iEntry;
+
+        if (not teensyArcGetVarint(pReader->aChunk, pReader->nChunk, &pReader->iPos, &iEntry) || iEntry >= pReader->nDict)
+        {
+          return SQLITE_CORRUPT;
+        }
+
+        pReader->zText = reinterpret_cast<const char*>(pReader->aChunk + pReader->aDictOffset[iEntry]);
+        pReader->nText = pReader->aDictLength[iEntry];
+      }
+      break;
+    default:
+      pReader->isNull = true;
+      break;
+  }
+
+  return SQLITE_OK;
+}
+
+static bool teensyArcGroupOverlaps(const TeensyArcCursor* pCur, const TeensyArcGroup& in_group)
+{
+  return in_group.maxFirst >= pCur->lower && in_group.minFirst <= pCur->upper;
+}
+
+/*
+** Moves to the next overlapping row group, starting at pCur->iGroup, and loads the chunks of the used columns.
+*/
+static int teensyArcLoadGroup(TeensyArcCursor* pCur)
+{
+  TeensyArcTable* pTab = reinterpret_cast<TeensyArcTable*>(pCur->base.pVtab);
+
+  while (pCur->iGroup < pTab->dir.nGroup && not teensyArcGroupOverlaps(pCur, pTab->dir.aGroup[pCur->iGroup]))
+  {
+    ++pCur->iGroup;
+  }
+
+  if (pCur->iGroup >= pTab->dir.nGroup)
+  {
+    pCur->isEof = true;
+    return SQLITE_OK;
+  }
+
+  pCur->iRow = 0;
+
+  for (int i = 0; i < pTab->dir.nColumn; ++i)
+  {
+    if (teensyArcIsUsed(pCur, i) && pTab->dir.aType[i] != TEENSY_ARC_UNKNOWN)
+    {
+      int rc = teensyArcLoadChunk(pCur, i);
+
+      if (rc != SQLITE_OK)
+      {
+        return rc;
+      }
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+static int teensyArcDecodeRow(TeensyArcCursor* pCur)
+{
+  TeensyArcTable* pTab = reinterpret_cast<TeensyArcTable*>(pCur->base.pVtab);
+
+  for (int i = 0; i < pTab->dir.nColumn; ++i)
+  {
+    if (teensyArcIsUsed(pCur, i))
+    {
+      int rc = teensyArcDecode(pCur, i);
+
+      if (rc != SQLITE_OK)
+      {
+        return rc;
+      }
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+static int teensyArcFilter(sqlite3_vtab_cursor* pCursor, int idxNum, const char* idxStr, int argc, sqlite3_value** argv)
+{
+  TeensyArcCursor* pCur = reinterpret_cast<TeensyArcCursor*>(pCursor);
+
+  pCur->colUsed = idxStr ? strtoull(idxStr, nullptr, 16) : ~0ULL;
+  teensyRangeFilter(idxNum, argc, argv, &pCur->lower, &pCur->upper);
+
+  pCur->isEof = false;
+  pCur->iGroup = 0;
+
+  int rc = teensyArcLoadGroup(pCur);
+
+  return rc == SQLITE_OK && not pCur->isEof ? teensyArcDecodeRow(pCur) : rc;
+}
+
+static int teensyArcNext(sqlite3_vtab_cursor* pCursor)
+{
+  TeensyArcCursor* pCur = reinterpret_cast<TeensyArcCursor*>(pCursor);
+  TeensyArcTable* pTab = reinterpret_cast<TeensyArcTable*>(pCursor->pVtab);
+
+  if (++pCur->iRow >= pTab->dir.aGroup[pCur->iGroup].rowCount)
+  {
+    ++pCur->iGroup;
+    int rc = teensyArcLoadGroup(pCur);
+
+    if (rc != SQLITE_OK || pCur->isEof)
+    {
+      return rc;
+    }
+  }
+
+  return teensyArcDecodeRow(pCur);
+}
+
+static int teensyArcEof(sqlite3_vtab_cursor* pCursor)
+{
+  return reinterpret_cast<TeensyArcCursor*>(pCursor)->isEof;
+}
+
+static int teensyArcColumn(sqlite3_vtab_cursor* pCursor, sqlite3_context* pContext, int iColumn)
+{
+  TeensyArcCursor* pCur = reinterpret_cast<TeensyArcCursor*>(pCursor);
+  TeensyArcTable* pTab = reinterpret_cast<TeensyArcTable*>(pCursor->pVtab);
+  const TeensyArcColumnReader& reader = pCur->aReader[iColumn];
+
+  if (not teensyArcIsUsed(pCur, iColumn) || reader.isNull)
+  {
+    return SQLITE_OK;
+  }
+
+  switch (pTab->dir.aType[iColumn])
+  {
+    case TEENSY_ARC_INTEGER:
+      sqlite3_result_int64(pContext, reader.iValue);
+      break;
+    case TEENSY_ARC_REAL:
+      sqlite3_result_double(pContext, reader.rValue);
+      break;
+    case TEENSY_ARC_TEXT:
+      // the chunk is replaced by the next row group
+      sqlite3_result_text(pContext, reader.zText, static_cast<int>(reader.nText), SQLITE_TRANSIENT);
+      break;
+    case TEENSY_ARC_BLOB:
+      sqlite3_result_blob(pContext, reader.zText, static_cast<int>(reader.nText), SQLITE_TRANSIENT);
+      break;
+    default:
+      break;
+  }
+
+  return SQLITE_OK;
+}
+
+static int teensyArcRowid(sqlite3_vtab_cursor* pCursor, sqlite3_int64* pRowid)
+{
+  TeensyArcCursor* pCur = reinterpret_cast<TeensyArcCursor*>(pCursor);
+  TeensyArcTable* pTab = reinterpret_cast<TeensyArcTable*>(pCursor->pVtab);
+  *pRowid = static_cast<sqlite3_int64>(pTab->dir.aGroup[pCur->iGroup].firstRow + pCur->iRow + 1);
+  return SQLITE_OK;
+}
+
+static sqlite3_module teensyArcModule =
+{
+  0,                      // iVersion
+  teensyArcConnect,       // xCreate
+  teensyArcConnect,       // xConnect
+  teensyArcBestIndex,     // xBestIndex
+  teensyArcDisconnect,    // xDisconnect
+  teensyArcDisconnect,    // xDestroy (the archive file is kept)
+  teensyArcOpen,          // xOpen
+  teensyArcClose,         // xClose
+  teensyArcFilter,        // xFilter
+  teensyArcNext,          // xNext
+  teensyArcEof,           // xEof
+  teensyArcColumn,        // xColumn
+  teensyArcRowid          // xRowid
+};
+
+int T41SQLiteArchive::registerModule(sqlite3* io_db)
+{
+  return sqlite3_create_module(io_db, "archive", &teensyArcModule, nullptr);
+}
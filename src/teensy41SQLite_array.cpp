@@ -0,0 +1,429 @@
+#include "teensy41SQLiteArray.hpp"
+
+#include <new>
+
+const char* const T41SQLiteArray::POINTER_TYPE = "t41array";
+
+// pointer type and element types of the SQLite carray extension
+static const char* const CARRAY_POINTER_TYPE = "carray";
+static const char* const CARRAY_TYPE_NAMES[] = { "int32", "int64", "double", "char*" };
+static const T41SQLiteArray::Type CARRAY_TYPES[] =
+{
+  T41SQLiteArray::Type::Int32, T41SQLiteArray::Type::Int64, T41SQLiteArray::Type::Double, T41SQLiteArray::Type::Text
+};
+
+// hidden columns following the value columns
+static const int ARRAY_HIDDEN_POINTER = 0;
+static const int ARRAY_HIDDEN_COUNT = 1;
+static const int ARRAY_HIDDEN_TYPE = 2;
+static const int ARRAY_HIDDEN_COLUMNS = 3;
+
+struct TeensyArrayTable
+{
+  sqlite3_vtab base;
+  int nColumn; // value columns
+};
+
+struct TeensyArrayCursor
+{
+  sqlite3_vtab_cursor base;
+  T41SQLiteArray array; // copy of the bound descriptor, or built from a carray pointer
+  int iCarrayType; // index into CARRAY_TYPE_NAMES, -1 for a T41SQLiteArray
+  sqlite3_int64 iRowid; // 1-based
+};
+
+/*
+** xCreate and xConnect. Without module arguments ("carray", eponymous) there is one column "value",
+** otherwise the arguments are the column names.
+*/
+static int teensyArrayConnect(sqlite3* db, void*, int argc, const char* const* argv, sqlite3_vtab** ppVtab, char**)
+{
+  int nColumn = argc > 3 ? argc - 3 : 1;
+
+  if (nColumn > TEENSY_41_SQLITE_ARRAY_MAX_COLUMNS)
+  {
+    return SQLITE_ERROR;
+  }
+
+  sqlite3_str* pSchema = sqlite3_str_new(db);
+  sqlite3_str_appendall(pSchema, "CREATE TABLE x(");
+
+  for (int i = 0; i < nColumn; ++i)
+  {
+    sqlite3_str_appendf(pSchema, "%s, ", argc > 3 ? argv[3 + i] : "value");
+  }
+
+  sqlite3_str_appendall(pSchema, "pointer HIDDEN, count HIDDEN, ctype TEXT HIDDEN)");
+
+  char* zSql = sqlite3_str_finish(pSchema);
+
+  if (not zSql)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  int rc = sqlite3_declare_vtab(db, zSql);
+  sqlite3_free(zSql);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  TeensyArrayTable* pTable = static_cast<TeensyArrayTable*>(sqlite3_malloc(sizeof(TeensyArrayTable)));
+
+  if (not pTable)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  memset(pTable, 0, sizeof(TeensyArrayTable));
+  pTable->nColumn = nColumn;
+  sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+  *ppVtab = &pTable->base;
+
+  return SQLITE_OK;
+}
+
+static int teensyArrayDisconnect(sqlite3_vtab* pVtab)
+{
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
+
+static int teensyArrayOpen(sqlite3_vtab*, sqlite3_vtab_cursor** ppCursor)
+{
+  TeensyArrayCursor* pCur = static_cast<TeensyArrayCursor*>(sqlite3_malloc(sizeof(TeensyArrayCursor)));
+
+  if (not pCur)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  new (pCur) TeensyArrayCursor();
+  pCur->iCarrayType = -1;
+  *ppCursor = &pCur->base;
+
+  return SQLITE_OK;
+}
+
+static int teensyArrayClose(sqlite3_vtab_cursor* pCursor)
+{
+  sqlite3_free(pCursor);
+  return SQLITE_OK;
+}
+
+/*
+** idxNum is a bit mask of the constrained hidden columns, which are passed to xFilter in the order
+** pointer, count, ctype.
+*/
+static int teensyArrayBestIndex(sqlite3_vtab* pVtab, sqlite3_index_info* pInfo)
+{
+  TeensyArrayTable* pTable = reinterpret_cast<TeensyArrayTable*>(pVtab);
+  int aConstraint[ARRAY_HIDDEN_COLUMNS] = { -1, -1, -1 };
+
+  for (int i = 0; i < pInfo->nConstraint; ++i)
+  {
+    const sqlite3_index_info::sqlite3_index_constraint& constraint = pInfo->aConstraint[i];
+    int iHidden = constraint.iColumn - pTable->nColumn;
+
+    if (iHidden < 0 || constraint.op != SQLITE_INDEX_CONSTRAINT_EQ)
+    {
+      continue;
+    }
+
+    if (not constraint.usable)
+    {
+      // the pointer is only known later in the join order, try another plan
+      return SQLITE_CONSTRAINT;
+    }
+
+    aConstraint[iHidden] = i;
+  }
+
+  if (aConstraint[ARRAY_HIDDEN_POINTER] < 0)
+  {
+    pInfo->estimatedCost = 2147483647.0;
+    pInfo->estimatedRows = 2147483647;
+    pInfo->idxNum = 0;
+    return SQLITE_OK;
+  }
+
+  int iArgv = 0;
+  pInfo->idxNum = 0;
+
+  for (int iHidden = 0; iHidden < ARRAY_HIDDEN_COLUMNS; ++iHidden)
+  {
+    if (aConstraint[iHidden] >= 0)
+    {
+      pInfo->aConstraintUsage[aConstraint[iHidden]].argvIndex = ++iArgv;
+      pInfo->aConstraintUsage[aConstraint[iHidden]].omit = 1;
+      pInfo->idxNum |= 1 << iHidden;
+    }
+  }
+
+  pInfo->estimatedCost = 1.0;
+  pInfo->estimatedRows = 100;
+
+  return SQLITE_OK;
+}
+
+static int teensyArrayFilter(sqlite3_vtab_cursor* pCursor, int idxNum, const char*, int argc, sqlite3_value** argv)
+{
+  TeensyArrayCursor* pCur = reinterpret_cast<TeensyArrayCursor*>(pCursor);
+  TeensyArrayTable* pTable = reinterpret_cast<TeensyArrayTable*>(pCursor->pVtab);
+
+  pCur->array = T41SQLiteArray();
+  pCur->iCarrayType = -1;
+  pCur->iRowid = 1;
+
+  if (idxNum == 0 || argc == 0)
+  {
+    return SQLITE_OK;
+  }
+
+  int iArgv = 0;
+  sqlite3_value* pPointer = argv[iArgv++];
+  sqlite3_value* pCount = (idxNum & (1 << ARRAY_HIDDEN_COUNT)) ? argv[iArgv++] : nullptr;
+  sqlite3_value* pType = (idxNum & (1 << ARRAY_HIDDEN_TYPE)) ? argv[iArgv++] : nullptr;
+
+  const T41SQLiteArray* pArray =
+    static_cast<const T41SQLiteArray*>(sqlite3_value_pointer(pPointer, T41SQLiteArray::POINTER_TYPE));
+
+  if (pArray)
+  {
+    if (pArray->getColumnCount() < pTable->nColumn)
+    {
+      pCursor->pVtab->zErrMsg = sqlite3_mprintf("carray: %d columns bound, %d declared",
+                                                pArray->getColumnCount(), pTable->nColumn);
+      return SQLITE_ERROR;
+    }
+
+    pCur->array = *pArray;
+
+    if (pCount)
+    {
+      pCur->array.setCount(min(pArray->getCount(), static_cast<size_t>(max(sqlite3_value_int64(pCount), 0LL))));
+    }
+
+    return SQLITE_OK;
+  }
+
+  const void* pData = sqlite3_value_pointer(pPointer, CARRAY_POINTER_TYPE);
+
+  if (not pData)
+  {
+    return SQLITE_OK; // NULL or a pointer of another type: no rows
+  }
+
+  if (pTable->nColumn != 1)
+  {
+    pCursor->pVtab->zErrMsg = sqlite3_mprintf("carray: a carray pointer has one column");
+    return SQLITE_ERROR;
+  }
+
+  int iType = 0;
+
+  if (pType)
+  {
+    const char* zType = reinterpret_cast<const char*>(sqlite3_value_text(pType));
+
+    for (iType = 0; iType < 4; ++iType)
+    {
+      if (zType && sqlite3_stricmp(zType, CARRAY_TYPE_NAMES[iType]) == 0)
+      {
+        break;
+      }
+    }
+
+    if (iType == 4)
+    {
+      pCursor->pVtab->zErrMsg = sqlite3_mprintf("carray: unknown datatype: '%s'", zType ? zType : "");
+      return SQLITE_ERROR;
+    }
+  }
+
+  size_t stride[] = { sizeof(int32_t), sizeof(int64_t), sizeof(double), sizeof(const char*) };
+  pCur->array.addColumn(CARRAY_TYPES[iType], pData, stride[iType]);
+  pCur->array.setCount(pCount ? static_cast<size_t>(max(sqlite3_value_int64(pCount), 0LL)) : 0);
+  pCur->iCarrayType = iType;
+
+  return SQLITE_OK;
+}
+
+static int teensyArrayNext(sqlite3_vtab_cursor* pCursor)
+{
+  reinterpret_cast<TeensyArrayCursor*>(pCursor)->iRowid++;
+  return SQLITE_OK;
+}
+
+static int teensyArrayEof(sqlite3_vtab_cursor* pCursor)
+{
+  TeensyArrayCursor* pCur = reinterpret_cast<TeensyArrayCursor*>(pCursor);
+  return pCur->iRowid > static_cast<sqlite3_int64>(pCur->array.getCount());
+}
+
+static int teensyArrayColumn(sqlite3_vtab_cursor* pCursor, sqlite3_context* pContext, int iColumn)
+{
+  TeensyArrayCursor* pCur = reinterpret_cast<TeensyArrayCursor*>(pCursor);
+  TeensyArrayTable* pTable = reinterpret_cast<TeensyArrayTable*>(pCursor->pVtab);
+
+  if (iColumn >= pTable->nColumn)
+  {
+    switch (iColumn - pTable->nColumn)
+    {
+      case ARRAY_HIDDEN_COUNT:
+        sqlite3_result_int64(pContext, static_cast<sqlite3_int64>(pCur->array.getCount()));
+        break;
+      case ARRAY_HIDDEN_TYPE:
+        if (pCur->iCarrayType >= 0)
+        {
+          sqlite3_result_text(pContext, CARRAY_TYPE_NAMES[pCur->iCarrayType], -1, SQLITE_STATIC);
+        }
+        break;
+      default: // the pointer is not readable from SQL
+        break;
+    }
+
+    return SQLITE_OK;
+  }
+
+  const T41SQLiteArray::Column& column = pCur->array.getColumn(iColumn);
+  const char* pElement = static_cast<const char*>(column.data) + (pCur->iRowid - 1) * column.stride;
+
+  switch (column.type)
+  {
+    case T41SQLiteArray::Type::Int32:
+      sqlite3_result_int(pContext, *reinterpret_cast<const int32_t*>(pElement));
+      break;
+    case T41SQLiteArray::Type::Int64:
+      sqlite3_result_int64(pContext, *reinterpret_cast<const int64_t*>(pElement));
+      break;
+    case T41SQLiteArray::Type::Float:
+      sqlite3_result_double(pContext, *reinterpret_cast<const float*>(pElement));
+      break;
+    case T41SQLiteArray::Type::Double:
+      sqlite3_result_double(pContext, *reinterpret_cast<const double*>(pElement));
+      break;
+    case T41SQLiteArray::Type::Text:
+      {
+        const char* zText = *reinterpret_cast<const char* const*>(pElement);
+
+        if (zText)
+        {
+          sqlite3_result_text(pContext, zText, -1, SQLITE_STATIC);
+        }
+      }
+      break;
+  }
+
+  return SQLITE_OK;
+}
+
+static int teensyArrayRowid(sqlite3_vtab_cursor* pCursor, sqlite3_int64* pRowid)
+{
+  *pRowid = reinterpret_cast<TeensyArrayCursor*>(pCursor)->iRowid;
+  return SQLITE_OK;
+}
+
+static sqlite3_module teensyArrayModule =
+{
+  0,                      // iVersion
+  teensyArrayConnect,     // xCreate (same as xConnect: eponymous and CREATE VIRTUAL TABLE)
+  teensyArrayConnect,     // xConnect
+  teensyArrayBestIndex,   // xBestIndex
+  teensyArrayDisconnect,  // xDisconnect
+  teensyArrayDisconnect,  // xDestroy
+  teensyArrayOpen,        // xOpen
+  teensyArrayClose,       // xClose
+  teensyArrayFilter,      // xFilter
+  teensyArrayNext,        // xNext
+  teensyArrayEof,         // xEof
+  teensyArrayColumn,      // xColumn
+  teensyArrayRowid,       // xRowid
+  nullptr,                // xUpdate
+  nullptr,                // xBegin
+  nullptr,                // xSync
+  nullptr,                // xCommit
+  nullptr,                // xRollback
+  nullptr,                // xFindMethod
+  nullptr,                // xRename
+  nullptr,                // xSavepoint
+  nullptr,                // xRelease
+  nullptr                 // xRollbackTo
+};
+
+T41SQLiteArray::T41SQLiteArray(size_t in_count) : m_count(in_count)
+{}
+
+int T41SQLiteArray::registerModule(sqlite3* io_db)
+{
+  return sqlite3_create_module(io_db, "carray", &teensyArrayModule, nullptr);
+}
+
+int T41SQLiteArray::addColumn(const int32_t* in_values)
+{
+  return addColumn(Type::Int32, in_values, sizeof(int32_t));
+}
+
+int T41SQLiteArray::addColumn(const int64_t* in_values)
+{
+  return addColumn(Type::Int64, in_values, sizeof(int64_t));
+}
+
+int T41SQLiteArray::addColumn(const float* in_values)
+{
+  return addColumn(Type::Float, in_values, sizeof(float));
+}
+
+int T41SQLiteArray::addColumn(const double* in_values)
+{
+  return addColumn(Type::Double, in_values, sizeof(double));
+}
+
+int T41SQLiteArray::addColumn(const char* const* in_values)
+{
+  return addColumn(Type::Text, in_values, sizeof(const char*));
+}
+
+int T41SQLiteArray::addColumn(Type in_type, const void* in_data, size_t in_stride)
+{
+  if (m_columnCount >= TEENSY_41_SQLITE_ARRAY_MAX_COLUMNS)
+  {
+    return SQLITE_FULL;
+  }
+
+  m_columns[m_columnCount++] = { in_type, in_data, in_stride };
+
+  return SQLITE_OK;
+}
+
+void T41SQLiteArray::clearColumns()
+{
+  m_columnCount = 0;
+}
+
+void T41SQLiteArray::setCount(size_t in_count)
+{
+  m_count = in_count;
+}
+
+int T41SQLiteArray::bind(sqlite3_stmt* io_stmt, int in_index) const
+{
+  return sqlite3_bind_pointer(io_stmt, in_index, const_cast<T41SQLiteArray*>(this), POINTER_TYPE, nullptr);
+}
+
+size_t T41SQLiteArray::getCount() const
+{
+  return m_count;
+}
+
+int T41SQLiteArray::getColumnCount() const
+{
+  return m_columnCount;
+}
+
+const T41SQLiteArray::Column& T41SQLiteArray::getColumn(int in_index) const
+{
+  return m_columns[in_index];
+}
@@ -0,0 +1,410 @@
+#include "teensy41SQLiteCipher.hpp"
+
+#include "sqlite3.h"
+
+static const uint8_t TEENSY_AES_SBOX[256] = {
+  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+  0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+  0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+  0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+  0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+  0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+  0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+  0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+  0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+  0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+  0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+static inline uint8_t teensyAesTimes2(uint8_t x)
+{
+  return static_cast<uint8_t>((x << 1) ^ ((x & 0x80) ? 0x1b : 0x00));
+}
+
+// counter block of the key stream: nonce || 32 bit big-endian block number
+static void teensyCipherCounterBlock(const uint8_t* in_nonce, uint32_t in_block, uint8_t* out_block)
+{
+  memcpy(out_block, in_nonce, T41SQLiteCipher::NONCE_SIZE);
+  out_block[12] = static_cast<uint8_t>(in_block >> 24);
+  out_block[13] = static_cast<uint8_t>(in_block >> 16);
+  out_block[14] = static_cast<uint8_t>(in_block >> 8);
+  out_block[15] = static_cast<uint8_t>(in_block);
+}
+
+/*
+** Nonces: the seed is mixed into the current seed (FNV-1a), so seeding twice never weakens it.
+*/
+void T41SQLiteCipher::seedNonces(const void* in_seed, size_t in_size)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+
+  for (size_t i = 0; i < sizeof(m_nonceSeed); ++i)
+  {
+    hash = (hash ^ m_nonceSeed[i]) * 0x100000001b3ull;
+  }
+
+  for (size_t i = 0; i < in_size; ++i)
+  {
+    hash = (hash ^ static_cast<const uint8_t*>(in_seed)[i]) * 0x100000001b3ull;
+  }
+
+  memcpy(m_nonceSeed, &hash, sizeof(m_nonceSeed));
+  m_nonceCounter = 0;
+  m_isSeeded = m_isSeeded || in_size > 0;
+}
+
+void T41SQLiteCipher::generateNonce(uint8_t* out_nonce)
+{
+  memcpy(out_nonce, m_nonceSeed, sizeof(m_nonceSeed));
+  out_nonce[8] = static_cast<uint8_t>(m_nonceCounter >> 24);
+  out_nonce[9] = static_cast<uint8_t>(m_nonceCounter >> 16);
+  out_nonce[10] = static_cast<uint8_t>(m_nonceCounter >> 8);
+  out_nonce[11] = static_cast<uint8_t>(m_nonceCounter);
+
+  if (++m_nonceCounter == 0)
+  {
+    // 2^32 nonces of this seed are used, continue with the next seed
+    for (size_t i = 0; i < sizeof(m_nonceSeed) && ++m_nonceSeed[i] == 0; ++i)
+    {
+    }
+  }
+}
+
+/*
+** Software AES-128 (FIPS-197), encryption only: counter mode never needs the inverse cipher.
+*/
+int T41SQLiteSoftwareCipher::setKey(const uint8_t* in_key, size_t in_size)
+{
+  if (in_size != KEY_SIZE)
+  {
+    return SQLITE_MISUSE;
+  }
+
+  memcpy(m_roundKeys, in_key, KEY_SIZE);
+  uint8_t rcon = 0x01;
+
+  for (size_t i = KEY_SIZE; i < sizeof(m_roundKeys); i += 4)
+  {
+    uint8_t t[4] = { m_roundKeys[i - 4], m_roundKeys[i - 3], m_roundKeys[i - 2], m_roundKeys[i - 1] };
+
+    if (i % KEY_SIZE == 0)
+    {
+      uint8_t first = t[0];
+      t[0] = static_cast<uint8_t>(TEENSY_AES_SBOX[t[1]] ^ rcon);
+      t[1] = TEENSY_AES_SBOX[t[2]];
+      t[2] = TEENSY_AES_SBOX[t[3]];
+      t[3] = TEENSY_AES_SBOX[first];
+      rcon = teensyAesTimes2(rcon);
+    }
+
+    for (size_t j = 0; j < 4; ++j)
+    {
+      m_roundKeys[i + j] = static_cast<uint8_t>(m_roundKeys[i + j - KEY_SIZE] ^ t[j]);
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+void T41SQLiteSoftwareCipher::encryptBlock(const uint8_t* in_block, uint8_t* out_block) const
+{
+  uint8_t s[BLOCK_SIZE];
+
+  for (size_t i = 0; i < BLOCK_SIZE; ++i)
+  {
+    s[i] = static_cast<uint8_t>(in_block[i] ^ m_roundKeys[i]);
+  }
+
+  for (int round = 1; round <= 10; ++round)
+  {
+    // SubBytes and ShiftRows (the state is stored column by column)
+    uint8_t t[BLOCK_SIZE];
+
+    for (int column = 0; column < 4; ++column)
+    {
+      for (int row = 0; row < 4; ++row)
+      {
+        t[column * 4 + row] = TEENSY_AES_SBOX[s[((column + row) % 4) * 4 + row]];
+      }
+    }
+
+    const uint8_t* roundKey = &m_roundKeys[round * BLOCK_SIZE];
+
+    if (round == 10)
+    {
+      for (size_t i = 0; i < BLOCK_SIZE; ++i)
+      {
+        out_block[i] = static_cast<uint8_t>(t[i] ^ roundKey[i]);
+      }
+
+      break;
+    }
+
+    for (int column = 0; column < 4; ++column)
+    {
+      uint8_t* c = &t[column * 4];
+      uint8_t all = static_cast<uint8_t>(c[0] ^ c[1] ^ c[2] ^ c[3]);
+      uint8_t first = c[0];
+
+      s[column * 4 + 0] = static_cast<uint8_t>(c[0] ^ all ^ teensyAesTimes2(c[0] ^ c[1]) ^ roundKey[column * 4 + 0]);
+      s[column * 4 + 1] = static_cast<uint8_t>(c[1] ^ all ^ teensyAesTimes2(c[1] ^ c[2]) ^ roundKey[column * 4 + 1]);
+      s[column * 4 + 2] = static_cast<uint8_t>(c[2] ^ all ^ teensyAesTimes2(c[2] ^ c[3]) ^ roundKey[column * 4 + 2]);
+      s[column * 4 + 3] = static_cast<uint8_t>(c[3] ^ all ^ teensyAesTimes2(c[3] ^ first) ^ roundKey[column * 4 + 3]);
+    }
+  }
+}
+
+int T41SQLiteSoftwareCipher::crypt(const uint8_t* in_nonce, uint8_t* io_data, size_t in_size)
+{
+  uint8_t counter[BLOCK_SIZE];
+  uint8_t stream[BLOCK_SIZE];
+
+  for (size_t offset = 0; offset < in_size; offset += BLOCK_SIZE)
+  {
+    teensyCipherCounterBlock(in_nonce, static_cast<uint32_t>(offset / BLOCK_SIZE), counter);
+    encryptBlock(counter, stream);
+    size_t n = min(BLOCK_SIZE, in_size - offset);
+
+    for (size_t i = 0; i < n; ++i)
+    {
+      io_data[offset + i] ^= stream[i];
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+#if not defined(__IMXRT1062__)
+int T41SQLiteCipher::seedNoncesFromTRNG()
+{
+  return SQLITE_ERROR;
+}
+#else
+/*
+** TRNG and DCP registers of the i.MX RT1062 (reference manual, chapters TRNG and DCP).
+*/
+#define TEENSY_TRNG_REG(offset) (*(volatile uint32_t*)(0x400CC000 + (offset)))
+#define TEENSY_TRNG_MCTL TEENSY_TRNG_REG(0x00)
+#define TEENSY_TRNG_ENT(i) TEENSY_TRNG_REG(0x40 + 4 * (i))
+#define TEENSY_TRNG_MCTL_PRGM (1u << 16)
+#define TEENSY_TRNG_MCTL_ERR (1u << 12)
+#define TEENSY_TRNG_MCTL_ENT_VAL (1u << 10)
+#define TEENSY_TRNG_MCTL_RST_DEF (1u << 6)
+
+#define TEENSY_DCP_REG(offset) (*(volatile uint32_t*)(0x402FC000 + (offset)))
+#define TEENSY_DCP_CTRL TEENSY_DCP_REG(0x000)
+#define TEENSY_DCP_STAT_CLR TEENSY_DCP_REG(0x018)
+#define TEENSY_DCP_CHANNELCTRL TEENSY_DCP_REG(0x020)
+#define TEENSY_DCP_CH0CMDPTR TEENSY_DCP_REG(0x100)
+#define TEENSY_DCP_CH0SEMA TEENSY_DCP_REG(0x110)
+#define TEENSY_DCP_CH0STAT TEENSY_DCP_REG(0x120)
+#define TEENSY_DCP_CH0STAT_CLR TEENSY_DCP_REG(0x128)
+
+#define TEENSY_DCP_CTRL_GATHER_RESIDUAL_WRITES (1u << 23)
+#define TEENSY_DCP_CH0SEMA_VALUE (0xFFu << 16)
+#define TEENSY_DCP_CH0STAT_ERROR 0x7Eu
+
+#define TEENSY_DCP_PACKET_DECR_SEMAPHORE (1u << 1)
+#define TEENSY_DCP_PACKET_ENABLE_CIPHER (1u << 5)
+#define TEENSY_DCP_PACKET_CIPHER_ENCRYPT (1u << 8)
+#define TEENSY_DCP_PACKET_CIPHER_INIT (1u << 9)
+#define TEENSY_DCP_PACKET_PAYLOAD_KEY (1u << 11)
+#define TEENSY_DCP_PACKET_KEY_BYTESWAP (1u << 18)
+#define TEENSY_DCP_PACKET_KEY_WORDSWAP (1u << 19)
+
+// counter blocks encrypted by one work packet (one 4096 byte page)
+static const size_t TEENSY_DCP_CHUNK_SIZE = 4096;
+
+struct TeensyDCPPacket
+{
+  uint32_t next;
+  uint32_t control0;
+  uint32_t control1; // AES-128, ECB: 0
+  uint32_t source;
+  uint32_t destination;
+  uint32_t size;
+  uint32_t payload;
+  uint32_t status;
+};
+
+// the DCP is a bus master, which cannot reach DTCM, so its buffers are in OCRAM
+static DMAMEM TeensyDCPPacket teensyDCPPacket __attribute__((aligned(32)));
+static DMAMEM uint8_t teensyDCPKey[32] __attribute__((aligned(32)));
+static DMAMEM uint8_t teensyDCPInput[TEENSY_DCP_CHUNK_SIZE] __attribute__((aligned(32)));
+static DMAMEM uint8_t teensyDCPOutput[TEENSY_DCP_CHUNK_SIZE] __attribute__((aligned(32)));
+static bool teensyDCPIsReady = false;
+
+static void teensyDCPBegin()
+{
+  if (teensyDCPIsReady)
+  {
+    return;
+  }
+
+  CCM_CCGR0 |= CCM_CCGR0_DCP(CCM_CCGR_ON);
+  TEENSY_DCP_CTRL = 0xF0800000u; // reset value
+  TEENSY_DCP_CTRL = 0x30800000u; // out of reset, clock running
+  TEENSY_DCP_STAT_CLR = 0xFFFFFFFFu;
+  TEENSY_DCP_CH0STAT_CLR = 0xFFFFFFFFu;
+  TEENSY_DCP_CTRL = TEENSY_DCP_CTRL_GATHER_RESIDUAL_WRITES;
+  TEENSY_DCP_CHANNELCTRL = 0x01; // channel 0
+  teensyDCPIsReady = true;
+}
+
+int T41SQLiteCipher::seedNoncesFromTRNG()
+{
+  CCM_CCGR6 |= CCM_CCGR6_TRNG(CCM_CCGR_ON);
+  TEENSY_TRNG_MCTL = TEENSY_TRNG_MCTL_PRGM | TEENSY_TRNG_MCTL_RST_DEF;
+  TEENSY_TRNG_MCTL &= ~TEENSY_TRNG_MCTL_PRGM; // run mode starts the generation
+
+  elapsedMillis timeout;
+
+  while ((TEENSY_TRNG_MCTL & (TEENSY_TRNG_MCTL_ENT_VAL | TEENSY_TRNG_MCTL_ERR)) == 0)
+  {
+    if (timeout > 100)
+    {
+      return SQLITE_ERROR;
+    }
+  }
+
+  if (TEENSY_TRNG_MCTL & TEENSY_TRNG_MCTL_ERR)
+  {
+    return SQLITE_ERROR;
+  }
+
+  uint32_t entropy[16];
+
+  for (int i = 0; i < 16; ++i)
+  {
+    entropy[i] = TEENSY_TRNG_ENT(i); // reading the last word starts the next generation
+  }
+
+  seedNonces(entropy, sizeof(entropy));
+
+  return SQLITE_OK;
+}
+
+int T41SQLiteDCPCipher::encryptBlocks(const uint8_t* in_blocks, uint8_t* out_blocks, size_t in_size, uint32_t in_keySwap)
+{
+  teensyDCPBegin();
+
+  memcpy(teensyDCPKey, m_key, KEY_SIZE);
+  teensyDCPPacket.next = 0;
+  teensyDCPPacket.control0 = TEENSY_DCP_PACKET_DECR_SEMAPHORE | TEENSY_DCP_PACKET_ENABLE_CIPHER |
+                             TEENSY_DCP_PACKET_CIPHER_ENCRYPT | TEENSY_DCP_PACKET_CIPHER_INIT |
+                             TEENSY_DCP_PACKET_PAYLOAD_KEY | in_keySwap;
+  teensyDCPPacket.control1 = 0;
+  teensyDCPPacket.source = reinterpret_cast<uint32_t>(in_blocks);
+  teensyDCPPacket.destination = reinterpret_cast<uint32_t>(out_blocks);
+  teensyDCPPacket.size = static_cast<uint32_t>(in_size);
+  teensyDCPPacket.payload = reinterpret_cast<uint32_t>(teensyDCPKey);
+  teensyDCPPacket.status = 0;
+
+  arm_dcache_flush(teensyDCPKey, sizeof(teensyDCPKey));
+  arm_dcache_flush(&teensyDCPPacket, sizeof(teensyDCPPacket));
+  arm_dcache_flush(const_cast<uint8_t*>(in_blocks), in_size);
+  arm_dcache_delete(out_blocks, in_size);
+
+  TEENSY_DCP_CH0STAT_CLR = 0xFFFFFFFFu;
+  TEENSY_DCP_CH0CMDPTR = reinterpret_cast<uint32_t>(&teensyDCPPacket);
+  TEENSY_DCP_CH0SEMA = 1;
+
+  elapsedMicros timeout;
+
+  while (TEENSY_DCP_CH0SEMA & TEENSY_DCP_CH0SEMA_VALUE)
+  {
+    if (timeout > 10000)
+    {
+      return SQLITE_ERROR;
+    }
+  }
+
+  arm_dcache_delete(out_blocks, in_size);
+  memset(teensyDCPKey, 0, sizeof(teensyDCPKey));
+  arm_dcache_flush(teensyDCPKey, sizeof(teensyDCPKey));
+
+  return (TEENSY_DCP_CH0STAT & TEENSY_DCP_CH0STAT_ERROR) ? SQLITE_ERROR : SQLITE_OK;
+}
+
+/*
+** The byte order of a payload key is checked with a known answer: the key is accepted with the first key
+** swap, for which the DCP encrypts a block like the software implementation.
+*/
+int T41SQLiteDCPCipher::setKey(const uint8_t* in_key, size_t in_size)
+{
+  static const uint32_t keySwaps[] = {
+    0,
+    TEENSY_DCP_PACKET_KEY_BYTESWAP | TEENSY_DCP_PACKET_KEY_WORDSWAP,
+    TEENSY_DCP_PACKET_KEY_BYTESWAP,
+    TEENSY_DCP_PACKET_KEY_WORDSWAP
+  };
+
+  m_hasKey = false;
+
+  if (in_size != KEY_SIZE)
+  {
+    return SQLITE_MISUSE;
+  }
+
+  T41SQLiteSoftwareCipher software;
+  software.setKey(in_key, in_size);
+  memcpy(m_key, in_key, KEY_SIZE);
+
+  uint8_t expected[BLOCK_SIZE];
+  teensyCipherCounterBlock(reinterpret_cast<const uint8_t*>("T41SQLite KAT"), 1, teensyDCPInput);
+  software.encryptBlock(teensyDCPInput, expected);
+
+  for (uint32_t keySwap : keySwaps)
+  {
+    if (encryptBlocks(teensyDCPInput, teensyDCPOutput, BLOCK_SIZE, keySwap) == SQLITE_OK &&
+        memcmp(teensyDCPOutput, expected, BLOCK_SIZE) == 0)
+    {
+      m_keySwap = keySwap;
+      m_hasKey = true;
+      return SQLITE_OK;
+    }
+  }
+
+  memset(m_key, 0, KEY_SIZE);
+
+  return SQLITE_ERROR;
+}
+
+int T41SQLiteDCPCipher::crypt(const uint8_t* in_nonce, uint8_t* io_data, size_t in_size)
+{
+  if (not m_hasKey)
+  {
+    return SQLITE_MISUSE;
+  }
+
+  for (size_t offset = 0; offset < in_size; offset += TEENSY_DCP_CHUNK_SIZE)
+  {
+    size_t n = min(TEENSY_DCP_CHUNK_SIZE, in_size - offset);
+    size_t nBlock = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    for (size_t i = 0; i < nBlock; ++i)
+    {
+      teensyCipherCounterBlock(in_nonce, static_cast<uint32_t>(offset / BLOCK_SIZE + i), &teensyDCPInput[i * BLOCK_SIZE]);
+    }
+
+    int rc = encryptBlocks(teensyDCPInput, teensyDCPOutput, nBlock * BLOCK_SIZE, m_keySwap);
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+      io_data[offset + i] ^= teensyDCPOutput[i];
+    }
+  }
+
+  return SQLITE_OK;
+}
+#endif
@@ -0,0 +1,248 @@
+#include "teensy41SQLiteCommitQueue.hpp"
+
+T41SQLiteCommitQueue::~T41SQLiteCommitQueue()
+{
+  end();
+}
+
+int T41SQLiteCommitQueue::begin(sqlite3* io_db, uint32_t in_maxPending, uint32_t in_maxDelayMillis)
+{
+  if (m_db || not io_db || in_maxPending == 0)
+  {
+    return SQLITE_MISUSE;
+  }
+
+  m_db = io_db;
+  m_maxPending = in_maxPending;
+  m_maxDelayMillis = in_maxDelayMillis;
+
+  return SQLITE_OK;
+}
+
+int T41SQLiteCommitQueue::end()
+{
+  if (not m_db)
+  {
+    return SQLITE_OK;
+  }
+
+  int result = flush();
+  m_db = nullptr;
+
+  return result;
+}
+
+void T41SQLiteCommitQueue::setCommitCallback(CommitCallback in_callback, void* in_forUseInCallback)
+{
+  m_commitCallback = in_callback;
+  m_commitCallbackArg = in_forUseInCallback;
+}
+
+int T41SQLiteCommitQueue::submit(sqlite3_stmt* io_stmt, uint32_t* out_sequence)
+{
+  int result = beginTransaction();
+
+  if (result != SQLITE_OK)
+  {
+    return result;
+  }
+
+  result = sqlite3_step(io_stmt);
+  sqlite3_reset(io_stmt);
+
+  if (result != SQLITE_DONE && result != SQLITE_ROW)
+  {
+    if (sqlite3_get_autocommit(m_db))
+    {
+      // the error rolled back the whole transaction, including the pending submissions
+      finishTransaction(result);
+    }
+
+    return result;
+  }
+
+  return accept(out_sequence);
+}
+
+int T41SQLiteCommitQueue::submit(const char* in_sql, uint32_t* out_sequence)
+{
+  int result = beginTransaction();
+
+  if (result != SQLITE_OK)
+  {
+    return result;
+  }
+
+  result = sqlite3_exec(m_db, in_sql, nullptr, nullptr, nullptr);
+
+  if (result != SQLITE_OK)
+  {
+    if (sqlite3_get_autocommit(m_db))
+    {
+      finishTransaction(result);
+    }
+
+    return result;
+  }
+
+  return accept(out_sequence);
+}
+
+int T41SQLiteCommitQueue::poll()
+{
+  if (m_isInTransaction && millis() - m_transactionBeginMillis >= m_maxDelayMillis)
+  {
+    return flush();
+  }
+
+  return SQLITE_OK;
+}
+
+int T41SQLiteCommitQueue::flush()
+{
+  if (not m_isInTransaction)
+  {
+    return SQLITE_OK;
+  }
+
+  int result = sqlite3_exec(m_db, "COMMIT;", nullptr, nullptr, nullptr);
+
+  if (result != SQLITE_OK && not sqlite3_get_autocommit(m_db))
+  {
+    sqlite3_exec(m_db, "ROLLBACK;", nullptr, nullptr, nullptr);
+  }
+
+  finishTransaction(result);
+
+  return result;
+}
+
+uint32_t T41SQLiteCommitQueue::getPendingCount() const
+{
+  return m_pendingCount;
+}
+
+uint32_t T41SQLiteCommitQueue::getLastSequence() const
+{
+  return m_lastSequence;
+}
+
+uint32_t T41SQLiteCommitQueue::getDurableSequence() const
+{
+  return m_durableSequence;
+}
+
+T41SQLiteCommitQueue::Durability T41SQLiteCommitQueue::getDurability(uint32_t in_sequence) const
+{
+  if (in_sequence == 0 || in_sequence > m_lastSequence)
+  {
+    return Durability::Pending;
+  }
+
+  uint32_t keptCount = min(m_lostRangeCount, static_cast<uint32_t>(TEENSY_41_SQLITE_COMMIT_QUEUE_LOST_RANGES));
+
+  for (uint32_t i = 0; i < keptCount; ++i)
+  {
+    if (in_sequence >= m_lostRanges[i].firstSequence && in_sequence <= m_lostRanges[i].lastSequence)
+    {
+      return Durability::Lost;
+    }
+  }
+
+  if (in_sequence <= m_lowWaterSequence)
+  {
+    return Durability::Unknown;
+  }
+
+  return in_sequence <= m_durableSequence ? Durability::Durable : Durability::Pending;
+}
+
+bool T41SQLiteCommitQueue::isDurable(uint32_t in_sequence) const
+{
+  return getDurability(in_sequence) == Durability::Durable;
+}
+
+uint32_t T41SQLiteCommitQueue::getLowWaterSequence() const
+{
+  return m_lowWaterSequence;
+}
+
+uint32_t T41SQLiteCommitQueue::getCommitCount() const
+{
+  return m_commitCount;
+}
+
+int T41SQLiteCommitQueue::beginTransaction()
+{
+  if (not m_db)
+  {
+    return SQLITE_MISUSE;
+  }
+
+  if (m_isInTransaction)
+  {
+    return SQLITE_OK;
+  }
+
+  int result = sqlite3_exec(m_db, "BEGIN;", nullptr, nullptr, nullptr);
+
+  if (result == SQLITE_OK)
+  {
+    m_isInTransaction = true;
+    m_transactionBeginMillis = millis();
+  }
+
+  return result;
+}
+
+int T41SQLiteCommitQueue::accept(uint32_t* out_sequence)
+{
+  ++m_lastSequence;
+  ++m_pendingCount;
+
+  if (out_sequence)
+  {
+    *out_sequence = m_lastSequence;
+  }
+
+  if (m_pendingCount >= m_maxPending)
+  {
+    return flush();
+  }
+
+  return poll();
+}
+
+void T41SQLiteCommitQueue::finishTransaction(int in_result)
+{
+  uint32_t firstSequence = m_lastSequence - m_pendingCount + 1;
+  uint32_t pendingCount = m_pendingCount;
+
+  m_isInTransaction = false;
+  m_pendingCount = 0;
+
+  if (in_result == SQLITE_OK)
+  {
+    m_durableSequence = m_lastSequence;
+    ++m_commitCount;
+  }
+  else if (pendingCount > 0)
+  {
+    // the durable sequence moves over this range with the next commit, isDurable skips it
+    LostRange& range = m_lostRanges[m_lostRangeCount % TEENSY_41_SQLITE_COMMIT_QUEUE_LOST_RANGES];
+
+    if (m_lostRangeCount >= TEENSY_41_SQLITE_COMMIT_QUEUE_LOST_RANGES)
+    {
+      m_lowWaterSequence = range.lastSequence;
+    }
+
+    range.firstSequence = firstSequence;
+    range.lastSequence = m_lastSequence;
+    ++m_lostRangeCount;
+  }
+
+  if (m_commitCallback && pendingCount > 0)
+  {
+    m_commitCallback(m_commitCallbackArg, firstSequence, m_lastSequence, in_result);
+  }
+}
@@ -0,0 +1,248 @@
+#include "teensy41SQLiteCursor.hpp"
+
+#if defined(__arm__)
+
+/*
+** Saves the callee-saved registers on the current stack, stores the stack pointer in *out_fromSp,
+** then continues on in_toSp (the stack saved by a previous switch or prepared by switchToCursor).
+*/
+extern "C" __attribute__((naked, noinline)) void t41CursorSwitch(void** out_fromSp, void* in_toSp)
+{
+  __asm__ volatile(
+    "push {r4-r11, lr}\n"
+#if defined(__ARM_PCS_VFP)
+    "vpush {s16-s31}\n"
+#endif
+    "mov r2, sp\n"
+    "str r2, [r0]\n"
+    "mov sp, r1\n"
+#if defined(__ARM_PCS_VFP)
+    "vpop {s16-s31}\n"
+#endif
+    "pop {r4-r11, pc}\n"
+  );
+}
+
+#if defined(__ARM_PCS_VFP)
+static const int SWITCH_FRAME_WORDS = 16 + 9; // s16-s31, r4-r11, pc
+#else
+static const int SWITCH_FRAME_WORDS = 9; // r4-r11, pc
+#endif
+
+struct T41SQLiteCursor::Context
+{
+  unsigned char* stack = nullptr;
+  void* cursorSp = nullptr;
+  void* callerSp = nullptr;
+  bool isStarted = false;
+};
+
+#else // host builds
+
+#include <ucontext.h>
+
+struct T41SQLiteCursor::Context
+{
+  unsigned char* stack = nullptr;
+  ucontext_t cursor;
+  ucontext_t caller;
+  bool isStarted = false;
+};
+
+#endif
+
+// cursor started by the next switchToCursor (run() takes no arguments)
+static T41SQLiteCursor* s_startingCursor = nullptr;
+
+T41SQLiteCursor::T41SQLiteCursor(size_t in_stackSize) : m_stackSize(in_stackSize)
+{
+  m_context = new Context();
+
+  if (m_context)
+  {
+    m_context->stack = static_cast<unsigned char*>(malloc(m_stackSize));
+
+    if (not m_context->stack)
+    {
+      delete m_context;
+      m_context = nullptr;
+    }
+  }
+}
+
+T41SQLiteCursor::~T41SQLiteCursor()
+{
+  end();
+
+  if (m_context)
+  {
+    free(m_context->stack);
+    delete m_context;
+  }
+}
+
+int T41SQLiteCursor::begin(sqlite3_stmt* io_stmt)
+{
+  if (m_isStepPending)
+  {
+    return SQLITE_BUSY;
+  }
+
+  m_stmt = io_stmt;
+
+  return SQLITE_OK;
+}
+
+/*
+** Runs sqlite3_step for about in_budgetMicros (0: no limit). Returns STEP_PENDING, if the step
+** is not finished yet. The next call continues it.
+*/
+int T41SQLiteCursor::step(uint32_t in_budgetMicros)
+{
+  if (not m_context)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  if (not m_stmt)
+  {
+    return SQLITE_MISUSE;
+  }
+
+  if (not m_isStepPending)
+  {
+    m_isStepPending = true;
+    m_isCancelRequested = false;
+    m_sliceCount = 0;
+    sqlite3_progress_handler(sqlite3_db_handle(m_stmt), TEENSY_41_SQLITE_CURSOR_PROGRESS_OPS, progressHandler, this);
+  }
+
+  m_budgetMicros = in_budgetMicros;
+  m_sliceBeginMicros = micros();
+  switchToCursor();
+
+  if (m_isStepPending)
+  {
+    ++m_sliceCount;
+    return STEP_PENDING;
+  }
+
+  sqlite3_progress_handler(sqlite3_db_handle(m_stmt), 0, nullptr, nullptr);
+
+  return m_stepResult;
+}
+
+int T41SQLiteCursor::cancel()
+{
+  if (not m_isStepPending)
+  {
+    return SQLITE_OK;
+  }
+
+  m_isCancelRequested = true;
+
+  return step(0);
+}
+
+int T41SQLiteCursor::end()
+{
+  int result = cancel();
+  m_stmt = nullptr;
+
+  return result;
+}
+
+bool T41SQLiteCursor::isStepPending() const
+{
+  return m_isStepPending;
+}
+
+sqlite3_stmt* T41SQLiteCursor::getStatement() const
+{
+  return m_stmt;
+}
+
+uint32_t T41SQLiteCursor::getSliceCount() const
+{
+  return m_sliceCount;
+}
+
+/*
+** Entry of the cursor stack. Each resume after a finished step runs the next sqlite3_step.
+*/
+void T41SQLiteCursor::run()
+{
+  T41SQLiteCursor* cursor = s_startingCursor;
+
+  while (true)
+  {
+    cursor->m_stepResult = sqlite3_step(cursor->m_stmt);
+    cursor->m_isStepPending = false;
+    cursor->switchToCaller();
+  }
+}
+
+int T41SQLiteCursor::progressHandler(void* io_cursor)
+{
+  T41SQLiteCursor* cursor = static_cast<T41SQLiteCursor*>(io_cursor);
+
+  if (not cursor->m_isCancelRequested && cursor->m_budgetMicros > 0 &&
+      micros() - cursor->m_sliceBeginMicros >= cursor->m_budgetMicros)
+  {
+    cursor->switchToCaller();
+  }
+
+  // a non-zero result interrupts the statement
+  return cursor->m_isCancelRequested ? 1 : 0;
+}
+
+#if defined(__arm__)
+
+void T41SQLiteCursor::switchToCaller()
+{
+  t41CursorSwitch(&m_context->cursorSp, m_context->callerSp);
+}
+
+void T41SQLiteCursor::switchToCursor()
+{
+  if (not m_context->isStarted)
+  {
+    // frame popped by t41CursorSwitch: the callee-saved registers are zero, pc is run()
+    uintptr_t top = (reinterpret_cast<uintptr_t>(m_context->stack) + m_stackSize) & ~static_cast<uintptr_t>(7);
+    uint32_t* frame = reinterpret_cast<uint32_t*>(top) - SWITCH_FRAME_WORDS;
+    memset(frame, 0, SWITCH_FRAME_WORDS * sizeof(uint32_t));
+    frame[SWITCH_FRAME_WORDS - 1] = reinterpret_cast<uint32_t>(&T41SQLiteCursor::run);
+
+    m_context->cursorSp = frame;
+    m_context->isStarted = true;
+    s_startingCursor = this;
+  }
+
+  t41CursorSwitch(&m_context->callerSp, m_context->cursorSp);
+}
+
+#else // host builds
+
+void T41SQLiteCursor::switchToCaller()
+{
+  swapcontext(&m_context->cursor, &m_context->caller);
+}
+
+void T41SQLiteCursor::switchToCursor()
+{
+  if (not m_context->isStarted)
+  {
+    getcontext(&m_context->cursor);
+    m_context->cursor.uc_stack.ss_sp = m_context->stack;
+    m_context->cursor.uc_stack.ss_size = m_stackSize;
+    m_context->cursor.uc_link = nullptr;
+    makecontext(&m_context->cursor, &T41SQLiteCursor::run, 0);
+
+    m_context->isStarted = true;
+    s_startingCursor = this;
+  }
+
+  swapcontext(&m_context->caller, &m_context->cursor);
+}
+
+#endif
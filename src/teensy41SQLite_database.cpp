@@ -0,0 +1,392 @@
+#include "teensy41SQLiteDatabase.hpp"
+
+T41SQLiteDatabase::~T41SQLiteDatabase()
+{
+  close();
+}
+
+T41SQLiteDatabase::T41SQLiteDatabase(T41SQLiteDatabase&& io_other) noexcept : m_db(io_other.m_db)
+{
+  io_other.m_db = nullptr;
+}
+
+T41SQLiteDatabase& T41SQLiteDatabase::operator=(T41SQLiteDatabase&& io_other) noexcept
+{
+  if (this != &io_other)
+  {
+    close();
+    m_db = io_other.m_db;
+    io_other.m_db = nullptr;
+  }
+
+  return *this;
+}
+
+int T41SQLiteDatabase::open(const char* in_filename, int in_flags, const char* in_vfsName)
+{
+  if (m_db)
+  {
+    return SQLITE_MISUSE;
+  }
+
+  int result = sqlite3_open_v2(in_filename, &m_db, in_flags, in_vfsName);
+
+  if (result != SQLITE_OK)
+  {
+    sqlite3_close(m_db);
+    m_db = nullptr;
+  }
+
+  return result;
+}
+
+int T41SQLiteDatabase::close()
+{
+  if (not m_db)
+  {
+    return SQLITE_OK;
+  }
+
+  int result = sqlite3_close(m_db);
+
+  if (result == SQLITE_OK)
+  {
+    m_db = nullptr;
+  }
+
+  return result;
+}
+
+int T41SQLiteDatabase::execute(const char* in_sql)
+{
+  return sqlite3_exec(m_db, in_sql, nullptr, nullptr, nullptr);
+}
+
+int T41SQLiteDatabase::prepare(const char* in_sql, T41SQLiteStatement& out_statement, unsigned int in_prepareFlags)
+{
+  return out_statement.prepare(m_db, in_sql, in_prepareFlags);
+}
+
+bool T41SQLiteDatabase::isOpen() const
+{
+  return m_db != nullptr;
+}
+
+sqlite3* T41SQLiteDatabase::getHandle() const
+{
+  return m_db;
+}
+
+const char* T41SQLiteDatabase::getErrorMessage() const
+{
+  return sqlite3_errmsg(m_db);
+}
+
+sqlite3_int64 T41SQLiteDatabase::getLastInsertRowId() const
+{
+  return sqlite3_last_insert_rowid(m_db);
+}
+
+int T41SQLiteDatabase::getChanges() const
+{
+  return sqlite3_changes(m_db);
+}
+
+T41SQLiteStatement::~T41SQLiteStatement()
+{
+  finalize();
+}
+
+T41SQLiteStatement::T41SQLiteStatement(T41SQLiteStatement&& io_other) noexcept : m_stmt(io_other.m_stmt)
+{
+  io_other.m_stmt = nullptr;
+}
+
+T41SQLiteStatement& T41SQLiteStatement::operator=(T41SQLiteStatement&& io_other) noexcept
+{
+  if (this != &io_other)
+  {
+    finalize();
+    m_stmt = io_other.m_stmt;
+    io_other.m_stmt = nullptr;
+  }
+
+  return *this;
+}
+
+int T41SQLiteStatement::prepare(sqlite3* io_db, const char* in_sql, unsigned int in_prepareFlags)
+{
+  finalize();
+
+  return sqlite3_prepare_v3(io_db, in_sql, -1, in_prepareFlags, &m_stmt, nullptr);
+}
+
+int T41SQLiteStatement::finalize()
+{
+  int result = sqlite3_finalize(m_stmt);
+  m_stmt = nullptr;
+
+  return result;
+}
+
+int T41SQLiteStatement::step()
+{
+  return sqlite3_step(m_stmt);
+}
+
+int T41SQLiteStatement::execute()
+{
+  int result;
+
+  do
+  {
+    result = sqlite3_step(m_stmt);
+  }
+  while (result == SQLITE_ROW);
+
+  sqlite3_reset(m_stmt);
+
+  return result == SQLITE_DONE ? SQLITE_OK : result;
+}
+
+int T41SQLiteStatement::reset()
+{
+  return sqlite3_reset(m_stmt);
+}
+
+int T41SQLiteStatement::clearBindings()
+{
+  return sqlite3_clear_bindings(m_stmt);
+}
+
+int T41SQLiteStatement::bind(int in_index, const char* in_text, int in_size)
+{
+  return sqlite3_bind_text(m_stmt, in_index, in_text, in_size, SQLITE_STATIC);
+}
+
+int T41SQLiteStatement::bind(int in_index, const void* in_blob, int in_size)
+{
+  return sqlite3_bind_blob(m_stmt, in_index, in_blob, in_size, SQLITE_STATIC);
+}
+
+int T41SQLiteStatement::bind(int in_index, decltype(nullptr))
+{
+  return sqlite3_bind_null(m_stmt, in_index);
+}
+
+int T41SQLiteStatement::getInt(int in_index) const
+{
+  return sqlite3_column_int(m_stmt, in_index);
+}
+
+sqlite3_int64 T41SQLiteStatement::getInt64(int in_index) const
+{
+  return sqlite3_column_int64(m_stmt, in_index);
+}
+
+double T41SQLiteStatement::getDouble(int in_index) const
+{
+  return sqlite3_column_double(m_stmt, in_index);
+}
+
+T41SQLiteText T41SQLiteStatement::getText(int in_index) const
+{
+  T41SQLiteText text;
+  text.data = reinterpret_cast<const char*>(sqlite3_column_text(m_stmt, in_index));
+  text.size = sqlite3_column_bytes(m_stmt, in_index); // after sqlite3_column_text (conversion)
+
+  return text;
+}
+
+T41SQLiteBlob T41SQLiteStatement::getBlob(int in_index) const
+{
+  T41SQLiteBlob blob;
+  blob.data = sqlite3_column_blob(m_stmt, in_index);
+  blob.size = sqlite3_column_bytes(m_stmt, in_index);
+
+  return blob;
+}
+
+bool T41SQLiteStatement::isNull(int in_index) const
+{
+  return sqlite3_column_type(m_stmt, in_index) == SQLITE_NULL;
+}
+
+int T41SQLiteStatement::getColumnType(int in_index) const
+{
+  return sqlite3_column_type(m_stmt, in_index);
+}
+
+int T41SQLiteStatement::getColumnCount() const
+{
+  return sqlite3_column_count(m_stmt);
+}
+
+bool T41SQLiteStatement::isPrepared() const
+{
+  return m_stmt != nullptr;
+}
+
+sqlite3_stmt* T41SQLiteStatement::getHandle() const
+{
+  return m_stmt;
+}
+
+static const char* const s_beginSql[] = { "BEGIN DEFERRED;", "BEGIN IMMEDIATE;", "BEGIN EXCLUSIVE;" };
+
+T41SQLiteTransaction::T41SQLiteTransaction(sqlite3* io_db, Type in_type)
+{
+  m_beginResult = sqlite3_exec(io_db, s_beginSql[static_cast<int>(in_type)], nullptr, nullptr, nullptr);
+
+  if (m_beginResult == SQLITE_OK)
+  {
+    m_db = io_db;
+  }
+}
+
+T41SQLiteTransaction::T41SQLiteTransaction(T41SQLiteDatabase& io_db, Type in_type) :
+  T41SQLiteTransaction(io_db.getHandle(), in_type)
+{}
+
+T41SQLiteTransaction::~T41SQLiteTransaction()
+{
+  rollback();
+}
+
+T41SQLiteTransaction::T41SQLiteTransaction(T41SQLiteTransaction&& io_other) noexcept :
+  m_db(io_other.m_db), m_beginResult(io_other.m_beginResult)
+{
+  io_other.m_db = nullptr;
+}
+
+int T41SQLiteTransaction::commit()
+{
+  if (not m_db)
+  {
+    return SQLITE_MISUSE;
+  }
+
+  int result = sqlite3_exec(m_db, "COMMIT;", nullptr, nullptr, nullptr);
+
+  // a failed commit (e.g. SQLITE_BUSY) leaves the transaction open, it can be retried or rolled back
+  if (result == SQLITE_OK || sqlite3_get_autocommit(m_db))
+  {
+    m_db = nullptr;
+  }
+
+  return result;
+}
+
+int T41SQLiteTransaction::rollback()
+{
+  if (not m_db)
+  {
+    return SQLITE_OK;
+  }
+
+  int result = SQLITE_OK;
+
+  if (not sqlite3_get_autocommit(m_db))
+  {
+    result = sqlite3_exec(m_db, "ROLLBACK;", nullptr, nullptr, nullptr);
+  }
+
+  m_db = nullptr;
+
+  return result;
+}
+
+bool T41SQLiteTransaction::isActive() const
+{
+  return m_db != nullptr;
+}
+
+int T41SQLiteTransaction::getBeginResult() const
+{
+  return m_beginResult;
+}
+
+T41SQLiteSavepoint::T41SQLiteSavepoint(sqlite3* io_db, const char* in_name) : m_db(io_db), m_name(in_name)
+{
+  m_beginResult = executeWithName("SAVEPOINT \"%w\";");
+
+  if (m_beginResult != SQLITE_OK)
+  {
+    m_db = nullptr;
+  }
+}
+
+T41SQLiteSavepoint::T41SQLiteSavepoint(T41SQLiteDatabase& io_db, const char* in_name) :
+  T41SQLiteSavepoint(io_db.getHandle(), in_name)
+{}
+
+T41SQLiteSavepoint::~T41SQLiteSavepoint()
+{
+  rollback();
+}
+
+T41SQLiteSavepoint::T41SQLiteSavepoint(T41SQLiteSavepoint&& io_other) noexcept :
+  m_db(io_other.m_db), m_name(io_other.m_name), m_beginResult(io_other.m_beginResult)
+{
+  io_other.m_db = nullptr;
+}
+
+int T41SQLiteSavepoint::release()
+{
+  if (not m_db)
+  {
+    return SQLITE_MISUSE;
+  }
+
+  int result = executeWithName("RELEASE \"%w\";");
+
+  if (result == SQLITE_OK || sqlite3_get_autocommit(m_db))
+  {
+    m_db = nullptr;
+  }
+
+  return result;
+}
+
+int T41SQLiteSavepoint::rollback()
+{
+  if (not m_db)
+  {
+    return SQLITE_OK;
+  }
+
+  int result = SQLITE_OK;
+
+  if (not sqlite3_get_autocommit(m_db))
+  {
+    result = executeWithName("ROLLBACK TO \"%w\"; RELEASE \"%w\";");
+  }
+
+  m_db = nullptr;
+
+  return result;
+}
+
+bool T41SQLiteSavepoint::isActive() const
+{
+  return m_db != nullptr;
+}
+
+int T41SQLiteSavepoint::getBeginResult() const
+{
+  return m_beginResult;
+}
+
+int T41SQLiteSavepoint::executeWithName(const char* in_format)
+{
+  char sql[128];
+
+  if (strlen(m_name) > (sizeof(sql) - 40) / 2)
+  {
+    return SQLITE_TOOBIG;
+  }
+
+  sqlite3_snprintf(sizeof(sql), sql, in_format, m_name, m_name);
+
+  return sqlite3_exec(m_db, sql, nullptr, nullptr, nullptr);
+}
@@ -0,0 +1,256 @@
+#include "teensy41SQLiteMutex.hpp"
+
+#if TEENSY_41_SQLITE_MUTEX_BACKEND == TEENSY_41_SQLITE_MUTEX_NONE
+
+const sqlite3_mutex_methods* T41SQLiteMutex::getMethods()
+{
+  return nullptr;
+}
+
+const char* T41SQLiteMutex::getName()
+{
+  return "none";
+}
+
+#else
+
+#if defined(SQLITE_THREADSAFE) && SQLITE_THREADSAFE == 0
+  #error "TEENSY_41_SQLITE_MUTEX_BACKEND needs SQLITE_THREADSAFE=1 or 2"
+#endif
+
+#include <new>
+
+#if TEENSY_41_SQLITE_MUTEX_BACKEND == TEENSY_41_SQLITE_MUTEX_TEENSYTHREADS
+
+#include <TeensyThreads.h>
+
+typedef Threads::Mutex TeensyMutexLock;
+typedef int TeensyThreadId;
+static const TeensyThreadId TEENSY_NO_THREAD = -1;
+static const char* TEENSY_MUTEX_NAME = "TeensyThreads";
+
+static TeensyThreadId teensyThreadSelf() { return threads.id(); }
+static bool teensyLockCreate(TeensyMutexLock* p) { new (p) Threads::Mutex(); return true; }
+static void teensyLockDestroy(TeensyMutexLock*) {}
+static void teensyLockEnter(TeensyMutexLock* p) { p->lock(); }
+static bool teensyLockTry(TeensyMutexLock* p) { return p->try_lock() == 1; }
+static void teensyLockLeave(TeensyMutexLock* p) { p->unlock(); }
+
+#elif TEENSY_41_SQLITE_MUTEX_BACKEND == TEENSY_41_SQLITE_MUTEX_FREERTOS
+
+#include <FreeRTOS.h>
+#include <semphr.h>
+#include <task.h>
+
+typedef SemaphoreHandle_t TeensyMutexLock;
+typedef TaskHandle_t TeensyThreadId;
+static const TeensyThreadId TEENSY_NO_THREAD = nullptr;
+static const char* TEENSY_MUTEX_NAME = "FreeRTOS";
+
+static TeensyThreadId teensyThreadSelf() { return xTaskGetCurrentTaskHandle(); }
+static bool teensyLockCreate(TeensyMutexLock* p) { *p = xSemaphoreCreateMutex(); return *p != nullptr; }
+static void teensyLockDestroy(TeensyMutexLock* p) { vSemaphoreDelete(*p); }
+static void teensyLockEnter(TeensyMutexLock* p) { xSemaphoreTake(*p, portMAX_DELAY); }
+static bool teensyLockTry(TeensyMutexLock* p) { return xSemaphoreTake(*p, 0) == pdTRUE; }
+static void teensyLockLeave(TeensyMutexLock* p) { xSemaphoreGive(*p); }
+
+#elif TEENSY_41_SQLITE_MUTEX_BACKEND == TEENSY_41_SQLITE_MUTEX_PTHREAD
+
+#include <pthread.h>
+
+// pthread_t is an integer on the hosts of the library (Linux, macOS uses a pointer)
+typedef pthread_mutex_t TeensyMutexLock;
+typedef pthread_t TeensyThreadId;
+static const TeensyThreadId TEENSY_NO_THREAD = TeensyThreadId();
+static const char* TEENSY_MUTEX_NAME = "pthread";
+
+static TeensyThreadId teensyThreadSelf() { return pthread_self(); }
+static bool teensyLockCreate(TeensyMutexLock* p) { return pthread_mutex_init(p, nullptr) == 0; }
+static void teensyLockDestroy(TeensyMutexLock* p) { pthread_mutex_destroy(p); }
+static void teensyLockEnter(TeensyMutexLock* p) { pthread_mutex_lock(p); }
+static bool teensyLockTry(TeensyMutexLock* p) { return pthread_mutex_trylock(p) == 0; }
+static void teensyLockLeave(TeensyMutexLock* p) { pthread_mutex_unlock(p); }
+
+#else
+  #error "unknown TEENSY_41_SQLITE_MUTEX_BACKEND"
+#endif
+
+/*
+** The owner is only set by the thread holding the lock and is reset before the lock is released, so a thread
+** reads its own id from owner only while it holds the mutex.
+*/
+struct sqlite3_mutex
+{
+  TeensyMutexLock lock;           /* Lock of the backend */
+  int id;                         /* SQLITE_MUTEX_FAST, SQLITE_MUTEX_RECURSIVE or a static id */
+  volatile TeensyThreadId owner;  /* Thread holding the mutex or TEENSY_NO_THREAD */
+  int nRef;                       /* Number of entries of the owner */
+};
+
+// the static mutexes SQLITE_MUTEX_STATIC_MAIN (2) to SQLITE_MUTEX_STATIC_VFS3 (13)
+static const int TEENSY_STATIC_MUTEX_FIRST = SQLITE_MUTEX_STATIC_MAIN;
+static const int TEENSY_STATIC_MUTEX_LAST = SQLITE_MUTEX_STATIC_VFS3;
+static sqlite3_mutex teensyStaticMutexes[TEENSY_STATIC_MUTEX_LAST - TEENSY_STATIC_MUTEX_FIRST + 1];
+static bool teensyStaticMutexesReady = false;
+
+static bool teensyMutexSetup(sqlite3_mutex* p, int in_id)
+{
+  p->id = in_id;
+  p->owner = TEENSY_NO_THREAD;
+  p->nRef = 0;
+  return teensyLockCreate(&p->lock);
+}
+
+static int teensyMutexInit()
+{
+  if (teensyStaticMutexesReady)
+  {
+    return SQLITE_OK;
+  }
+
+  for (int i = 0; i <= TEENSY_STATIC_MUTEX_LAST - TEENSY_STATIC_MUTEX_FIRST; ++i)
+  {
+    if (not teensyMutexSetup(&teensyStaticMutexes[i], TEENSY_STATIC_MUTEX_FIRST + i))
+    {
+      while (--i >= 0)
+      {
+        teensyLockDestroy(&teensyStaticMutexes[i].lock);
+      }
+
+      return SQLITE_NOMEM;
+    }
+  }
+
+  teensyStaticMutexesReady = true;
+  return SQLITE_OK;
+}
+
+static int teensyMutexEnd()
+{
+  if (teensyStaticMutexesReady)
+  {
+    for (sqlite3_mutex& mutex : teensyStaticMutexes)
+    {
+      teensyLockDestroy(&mutex.lock);
+    }
+
+    teensyStaticMutexesReady = false;
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Dynamic mutexes are not allocated with sqlite3_malloc, which calls sqlite3_initialize in a build without
+** SQLITE_OMIT_AUTOINIT (e.g. the host build), and sqlite3_initialize allocates a mutex.
+*/
+static sqlite3_mutex* teensyMutexAlloc(int in_id)
+{
+  if (in_id == SQLITE_MUTEX_FAST || in_id == SQLITE_MUTEX_RECURSIVE)
+  {
+    sqlite3_mutex* p = new (std::nothrow) sqlite3_mutex;
+
+    if (p && not teensyMutexSetup(p, in_id))
+    {
+      delete p;
+      p = 0;
+    }
+
+    return p;
+  }
+
+  if (in_id < TEENSY_STATIC_MUTEX_FIRST || in_id > TEENSY_STATIC_MUTEX_LAST)
+  {
+    return 0;
+  }
+
+  return &teensyStaticMutexes[in_id - TEENSY_STATIC_MUTEX_FIRST];
+}
+
+static void teensyMutexFree(sqlite3_mutex* p)
+{
+  if (p->id == SQLITE_MUTEX_FAST || p->id == SQLITE_MUTEX_RECURSIVE)
+  {
+    teensyLockDestroy(&p->lock);
+    delete p;
+  }
+}
+
+// SQLite enters a mutex it holds again only if it is recursive
+static void teensyMutexEnter(sqlite3_mutex* p)
+{
+  TeensyThreadId self = teensyThreadSelf();
+
+  if (p->owner == self)
+  {
+    ++p->nRef;
+    return;
+  }
+
+  teensyLockEnter(&p->lock);
+  p->owner = self;
+  p->nRef = 1;
+}
+
+static int teensyMutexTry(sqlite3_mutex* p)
+{
+  TeensyThreadId self = teensyThreadSelf();
+
+  if (p->owner == self)
+  {
+    ++p->nRef;
+    return SQLITE_OK;
+  }
+
+  if (not teensyLockTry(&p->lock))
+  {
+    return SQLITE_BUSY;
+  }
+
+  p->owner = self;
+  p->nRef = 1;
+  return SQLITE_OK;
+}
+
+static void teensyMutexLeave(sqlite3_mutex* p)
+{
+  if (--p->nRef == 0)
+  {
+    p->owner = TEENSY_NO_THREAD;
+    teensyLockLeave(&p->lock);
+  }
+}
+
+static int teensyMutexHeld(sqlite3_mutex* p)
+{
+  return p == 0 || p->owner == teensyThreadSelf();
+}
+
+static int teensyMutexNotheld(sqlite3_mutex* p)
+{
+  return p == 0 || p->owner != teensyThreadSelf();
+}
+
+static const sqlite3_mutex_methods teensyMutexMethods = {
+  teensyMutexInit,
+  teensyMutexEnd,
+  teensyMutexAlloc,
+  teensyMutexFree,
+  teensyMutexEnter,
+  teensyMutexTry,
+  teensyMutexLeave,
+  teensyMutexHeld,
+  teensyMutexNotheld
+};
+
+const sqlite3_mutex_methods* T41SQLiteMutex::getMethods()
+{
+  return &teensyMutexMethods;
+}
+
+const char* T41SQLiteMutex::getName()
+{
+  return TEENSY_MUTEX_NAME;
+}
+
+#endif // TEENSY_41_SQLITE_MUTEX_BACKEND == TEENSY_41_SQLITE_MUTEX_NONE
@@ -0,0 +1,175 @@
+#include "teensy41SQLiteProfile.hpp"
+
+#ifdef USE_TEENSY_41_SQLITE_PROFILE
+
+/*
+** Number of functions the profiler can track. Must be a power of two.
+*/
+#ifndef TEENSY_41_SQLITE_PROFILE_SLOTS
+  #define TEENSY_41_SQLITE_PROFILE_SLOTS 2048
+#endif
+
+/*
+** Maximum tracked call depth. Deeper calls are still counted,
+** but their cycles are attributed to the deepest tracked caller.
+*/
+#ifndef TEENSY_41_SQLITE_PROFILE_STACK_DEPTH
+  #define TEENSY_41_SQLITE_PROFILE_STACK_DEPTH 128
+#endif
+
+static_assert((TEENSY_41_SQLITE_PROFILE_SLOTS & (TEENSY_41_SQLITE_PROFILE_SLOTS - 1)) == 0,
+              "TEENSY_41_SQLITE_PROFILE_SLOTS must be a power of two");
+
+#define T41_PROFILE_HOOK extern "C" __attribute__((no_instrument_function)) FASTRUN
+#define T41_PROFILE_FUNC __attribute__((no_instrument_function))
+
+namespace
+{
+  struct ProfileSlot
+  {
+    uint32_t function;
+    uint32_t calls;
+    uint64_t cycles;
+  };
+
+  struct ProfileFrame
+  {
+    ProfileSlot* slot;
+    uint32_t enterCycles;
+    uint32_t childCycles;
+  };
+
+  ProfileSlot s_slots[TEENSY_41_SQLITE_PROFILE_SLOTS];
+  ProfileFrame s_stack[TEENSY_41_SQLITE_PROFILE_STACK_DEPTH];
+  uint32_t s_depth = 0;
+  uint32_t s_dropped = 0;
+  volatile bool s_isRunning = false;
+
+  T41_PROFILE_FUNC FASTRUN ProfileSlot* findSlot(uint32_t in_function)
+  {
+    uint32_t index = (in_function >> 1) * 2654435761u;
+
+    for (uint32_t probe = 0; probe < TEENSY_41_SQLITE_PROFILE_SLOTS; ++probe)
+    {
+      ProfileSlot* slot = &s_slots[(index + probe) & (TEENSY_41_SQLITE_PROFILE_SLOTS - 1)];
+
+      if (slot->function == in_function)
+      {
+        return slot;
+      }
+
+      if (slot->function == 0)
+      {
+        slot->function = in_function;
+        return slot;
+      }
+    }
+
+    ++s_dropped;
+    return nullptr;
+  }
+}
+
+T41_PROFILE_HOOK void __cyg_profile_func_enter(void* in_function, void* in_callSite)
+{
+  if (not s_isRunning)
+  {
+    return;
+  }
+
+  if (s_depth < TEENSY_41_SQLITE_PROFILE_STACK_DEPTH)
+  {
+    ProfileFrame& frame = s_stack[s_depth];
+    frame.slot = findSlot(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(in_function)));
+    frame.childCycles = 0;
+
+    if (frame.slot)
+    {
+      ++frame.slot->calls;
+    }
+
+    // do not account the time spent in this hook to the function
+    frame.enterCycles = ARM_DWT_CYCCNT;
+  }
+
+  ++s_depth;
+}
+
+T41_PROFILE_HOOK void __cyg_profile_func_exit(void* in_function, void* in_callSite)
+{
+  uint32_t exitCycles = ARM_DWT_CYCCNT;
+
+  if (not s_isRunning || s_depth == 0)
+  {
+    return;
+  }
+
+  --s_depth;
+
+  if (s_depth >= TEENSY_41_SQLITE_PROFILE_STACK_DEPTH)
+  {
+    return;
+  }
+
+  ProfileFrame& frame = s_stack[s_depth];
+  uint32_t elapsed = exitCycles - frame.enterCycles;
+
+  if (frame.slot)
+  {
+    frame.slot->cycles += elapsed > frame.childCycles ? elapsed - frame.childCycles : 0;
+  }
+
+  if (s_depth > 0)
+  {
+    s_stack[s_depth - 1].childCycles += elapsed;
+  }
+}
+
+namespace T41SQLiteProfile
+{
+  T41_PROFILE_FUNC void reset()
+  {
+    s_isRunning = false;
+    memset(s_slots, 0, sizeof(s_slots));
+    s_depth = 0;
+    s_dropped = 0;
+  }
+
+  T41_PROFILE_FUNC void start()
+  {
+    s_depth = 0;
+    s_isRunning = true;
+  }
+
+  T41_PROFILE_FUNC void stop()
+  {
+    s_isRunning = false;
+    s_depth = 0;
+  }
+
+  T41_PROFILE_FUNC bool isRunning()
+  {
+    return s_isRunning;
+  }
+
+  T41_PROFILE_FUNC void print(Print& io_output)
+  {
+    for (const ProfileSlot& slot : s_slots)
+    {
+      if (slot.function != 0 && slot.calls != 0)
+      {
+        io_output.printf("T41SQLITE_PROFILE 0x%08lX %lu %llu\n",
+                         static_cast<unsigned long>(slot.function),
+                         static_cast<unsigned long>(slot.calls),
+                         static_cast<unsigned long long>(slot.cycles));
+      }
+    }
+  }
+
+  T41_PROFILE_FUNC uint32_t getDroppedCount()
+  {
+    return s_dropped;
+  }
+}
+
+#endif // USE_TEENSY_41_SQLITE_PROFILE
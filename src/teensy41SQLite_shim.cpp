@@ -0,0 +1,158 @@
+#include "teensy41SQLiteShim.hpp"
+
+/*
+** The methods of a shim VFS, which do not open files, are passed to the base VFS.
+*/
+static sqlite3_vfs* teensyShimLower(sqlite3_vfs* io_vfs)
+{
+  return reinterpret_cast<T41SQLiteShimVfs*>(io_vfs)->lower;
+}
+
+static int teensyShimDelete(sqlite3_vfs* io_vfs, const char* in_path, int in_dirSync)
+{
+  sqlite3_vfs* lower = teensyShimLower(io_vfs);
+  return lower->xDelete(lower, in_path, in_dirSync);
+}
+
+static int teensyShimAccess(sqlite3_vfs* io_vfs, const char* in_path, int in_flags, int* out_result)
+{
+  sqlite3_vfs* lower = teensyShimLower(io_vfs);
+  return lower->xAccess(lower, in_path, in_flags, out_result);
+}
+
+static int teensyShimFullPathname(sqlite3_vfs* io_vfs, const char* in_path, int in_size, char* out_path)
+{
+  sqlite3_vfs* lower = teensyShimLower(io_vfs);
+  return lower->xFullPathname(lower, in_path, in_size, out_path);
+}
+
+static void* teensyShimDlOpen(sqlite3_vfs* io_vfs, const char* in_path)
+{
+  sqlite3_vfs* lower = teensyShimLower(io_vfs);
+  return lower->xDlOpen(lower, in_path);
+}
+
+static void teensyShimDlError(sqlite3_vfs* io_vfs, int in_size, char* out_message)
+{
+  sqlite3_vfs* lower = teensyShimLower(io_vfs);
+  lower->xDlError(lower, in_size, out_message);
+}
+
+static void (*teensyShimDlSym(sqlite3_vfs* io_vfs, void* io_handle, const char* in_symbol))(void)
+{
+  sqlite3_vfs* lower = teensyShimLower(io_vfs);
+  return lower->xDlSym(lower, io_handle, in_symbol);
+}
+
+static void teensyShimDlClose(sqlite3_vfs* io_vfs, void* io_handle)
+{
+  sqlite3_vfs* lower = teensyShimLower(io_vfs);
+  lower->xDlClose(lower, io_handle);
+}
+
+static int teensyShimRandomness(sqlite3_vfs* io_vfs, int in_size, char* out_data)
+{
+  sqlite3_vfs* lower = teensyShimLower(io_vfs);
+  return lower->xRandomness(lower, in_size, out_data);
+}
+
+static int teensyShimSleep(sqlite3_vfs* io_vfs, int in_micros)
+{
+  sqlite3_vfs* lower = teensyShimLower(io_vfs);
+  return lower->xSleep(lower, in_micros);
+}
+
+static int teensyShimCurrentTime(sqlite3_vfs* io_vfs, double* out_time)
+{
+  sqlite3_vfs* lower = teensyShimLower(io_vfs);
+  return lower->xCurrentTime(lower, out_time);
+}
+
+static int teensyShimGetLastError(sqlite3_vfs* io_vfs, int in_size, char* out_message)
+{
+  sqlite3_vfs* lower = teensyShimLower(io_vfs);
+  return lower->xGetLastError ? lower->xGetLastError(lower, in_size, out_message) : 0;
+}
+
+/*
+** Registers a shim VFS named in_name over the VFS in_baseName, which must be registered and stays registered
+** as long as the shim VFS. The name is copied.
+*/
+int T41SQLiteShim::registerVfs(const char* in_name, const char* in_baseName, bool in_makeDefault, void* in_context,
+                               int in_lowerOffset, int (*in_open)(sqlite3_vfs*, const char*, sqlite3_file*, int, int*))
+{
+  sqlite3_vfs* lower = sqlite3_vfs_find(in_baseName);
+
+  if (lower == nullptr || in_name == nullptr)
+  {
+    return SQLITE_NOTFOUND;
+  }
+
+  if (sqlite3_vfs_find(in_name) != nullptr)
+  {
+    return SQLITE_MISUSE;
+  }
+
+  size_t nameSize = strlen(in_name) + 1;
+  T41SQLiteShimVfs* shimVfs = static_cast<T41SQLiteShimVfs*>(sqlite3_malloc64(sizeof(T41SQLiteShimVfs) + nameSize));
+
+  if (shimVfs == nullptr)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  memset(shimVfs, 0, sizeof(T41SQLiteShimVfs));
+  char* name = reinterpret_cast<char*>(&shimVfs[1]);
+  memcpy(name, in_name, nameSize);
+
+  shimVfs->lower = lower;
+  shimVfs->context = in_context;
+  shimVfs->vfs.iVersion = 1;
+  shimVfs->vfs.szOsFile = in_lowerOffset + lower->szOsFile;
+  shimVfs->vfs.mxPathname = lower->mxPathname;
+  shimVfs->vfs.zName = name;
+  shimVfs->vfs.pAppData = in_context;
+  shimVfs->vfs.xOpen = in_open;
+  shimVfs->vfs.xDelete = teensyShimDelete;
+  shimVfs->vfs.xAccess = teensyShimAccess;
+  shimVfs->vfs.xFullPathname = teensyShimFullPathname;
+  shimVfs->vfs.xDlOpen = teensyShimDlOpen;
+  shimVfs->vfs.xDlError = teensyShimDlError;
+  shimVfs->vfs.xDlSym = teensyShimDlSym;
+  shimVfs->vfs.xDlClose = teensyShimDlClose;
+  shimVfs->vfs.xRandomness = teensyShimRandomness;
+  shimVfs->vfs.xSleep = teensyShimSleep;
+  shimVfs->vfs.xCurrentTime = teensyShimCurrentTime;
+  shimVfs->vfs.xGetLastError = teensyShimGetLastError;
+
+  int rc = sqlite3_vfs_register(&shimVfs->vfs, in_makeDefault ? 1 : 0);
+
+  if (rc != SQLITE_OK)
+  {
+    sqlite3_free(shimVfs);
+  }
+
+  return rc;
+}
+
+/*
+** Unregisters and frees a shim VFS. No file of it may be open and no other shim VFS may use it as base.
+*/
+int T41SQLiteShim::unregisterVfs(const char* in_name)
+{
+  sqlite3_vfs* vfs = sqlite3_vfs_find(in_name);
+
+  if (vfs == nullptr || vfs->xDelete != teensyShimDelete)
+  {
+    return SQLITE_NOTFOUND;
+  }
+
+  int rc = sqlite3_vfs_unregister(vfs);
+
+  if (rc == SQLITE_OK)
+  {
+    sqlite3_free(vfs);
+  }
+
+  return rc;
+}
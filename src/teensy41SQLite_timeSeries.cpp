@@ -0,0 +1,1072 @@
+#include "teensy41SQLiteTimeSeries.hpp"
+#include "teensy41SQLite.hpp"
+#include "teensy41SQLite_util.hpp"
+
+#include <math.h>
+
+using TeensyFile = T41SQLiteStorage::File;
+
+static const uint32_t TEENSY_TS_HEADER_MAGIC = 0x54343154; // "T41T"
+static const uint32_t TEENSY_TS_FOOTER_MAGIC = 0x42343154; // "T41B"
+static const uint32_t TEENSY_TS_BLOCK_SIZE = TEENSY_41_SQLITE_TIMESERIES_BLOCK_SIZE;
+
+static_assert(TEENSY_TS_BLOCK_SIZE % TEENSY_COMMIT_SECTOR_SIZE == 0 && TEENSY_TS_BLOCK_SIZE >= 2 * TEENSY_COMMIT_SECTOR_SIZE,
+              "TEENSY_41_SQLITE_TIMESERIES_BLOCK_SIZE must be a multiple of 512 (at least 1024)");
+
+enum TeensyTsType
+{
+  TEENSY_TS_REAL,
+  TEENSY_TS_FLOAT,
+  TEENSY_TS_INTEGER,
+  TEENSY_TS_INT
+};
+
+struct TeensyTsColumn
+{
+  TeensyTsType eType;
+  uint32_t iOffset; // in the record, after ts
+};
+
+// commit record, in sector 0 or 1 of the header block (generation % 2)
+struct TeensyTsHeader
+{
+  uint32_t magic;
+  uint32_t blockSize;
+  uint32_t recordSize;
+  uint32_t reserved;
+  uint64_t generation;
+  uint64_t count; // committed records
+  uint32_t checksum;
+  uint32_t padding;
+};
+
+// at the end of each block
+struct TeensyTsFooter
+{
+  uint32_t magic;
+  uint32_t count;
+  int64_t minTs;
+  int64_t maxTs;
+  uint32_t recordSize;
+  uint32_t checksum;
+};
+
+struct TeensyTsRange
+{
+  int64_t minTs;
+  int64_t maxTs;
+};
+
+struct TeensyTsTable
+{
+  sqlite3_vtab base;
+  char* zPath;                    /* sqlite3_malloc'ed */
+  int nPathPrefix;                /* length of zPath without "<table>.ts" */
+  TeensyFile* file;
+  int nColumn;                    /* value columns */
+  TeensyTsColumn aColumn[TEENSY_41_SQLITE_TIMESERIES_MAX_COLUMNS];
+  uint32_t recordSize;
+  uint32_t perBlock;              /* records per block */
+  unsigned char* aTail;           /* records of the last block */
+  TeensyTsRange* aIndex;          /* ts range of each block (the last included) */
+  uint64_t nIndexAlloc;
+  uint64_t nRecord;
+  uint64_t nCommitted;
+  uint64_t generation;            /* of the last commit record */
+  int64_t iDirty;                 /* first record of the last block not written yet, -1: none */
+  uint64_t* aSavepoint;           /* nRecord at each open savepoint (sqlite3_malloc'ed) */
+  int nSavepoint;
+  int nSavepointAlloc;
+  bool isFooterDirty;
+  bool isSorted;                  /* the ts ranges of the blocks are ascending and do not overlap */
+};
+
+struct TeensyTsCursor
+{
+  sqlite3_vtab_cursor base;
+  unsigned char* aBlock;          /* a block read from the file */
+  const unsigned char* aRecords;  /* aBlock or the last block of the table */
+  int64_t lower;
+  int64_t upper;
+  uint64_t iBlock;
+  uint32_t nCount;                /* records in the current block */
+  uint32_t iSlot;
+  bool isEof;
+};
+
+static uint64_t teensyTsBlockCount(const TeensyTsTable* pTab)
+{
+  return (pTab->nRecord + pTab->perBlock - 1) / pTab->perBlock;
+}
+
+static uint64_t teensyTsBlockOffset(uint64_t iBlock)
+{
+  return (iBlock + 1) * TEENSY_TS_BLOCK_SIZE; // block 0 of the file is the header
+}
+
+static int64_t teensyTsRecordTs(const unsigned char* pRecord)
+{
+  int64_t ts;
+  memcpy(&ts, pRecord, sizeof(ts));
+  return ts;
+}
+
+static bool teensyTsOverlaps(const TeensyTsRange& in_range, int64_t lower, int64_t upper)
+{
+  return in_range.maxTs >= lower && in_range.minTs <= upper;
+}
+
+static int teensyTsReserveIndex(TeensyTsTable* pTab, uint64_t nBlock)
+{
+  if (nBlock <= pTab->nIndexAlloc)
+  {
+    return SQLITE_OK;
+  }
+
+  uint64_t nAlloc = max(nBlock, pTab->nIndexAlloc * 2 + 16);
+  TeensyTsRange* aIndex = static_cast<TeensyTsRange*>(sqlite3_realloc64(pTab->aIndex, nAlloc * sizeof(TeensyTsRange)));
+
+  if (not aIndex)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  pTab->aIndex = aIndex;
+  pTab->nIndexAlloc = nAlloc;
+
+  return SQLITE_OK;
+}
+
+/*
+** Writes the records iFirst...nCount-1 of the last block and the footer. A new block is written completely,
+** because the file cannot be seeked beyond its end.
+*/
+static int teensyTsWriteTail(TeensyTsTable* pTab, uint64_t iBlock, uint32_t nCount, uint32_t iFirst)
+{
+  uint64_t iOfst = teensyTsBlockOffset(iBlock);
+  TeensyTsFooter footer;
+  memset(&footer, 0, sizeof(footer));
+  footer.magic = TEENSY_TS_FOOTER_MAGIC;
+  footer.count = nCount;
+  footer.minTs = pTab->aIndex[iBlock].minTs;
+  footer.maxTs = pTab->aIndex[iBlock].maxTs;
+  footer.recordSize = pTab->recordSize;
+  footer.checksum = teensyChecksum(&footer, offsetof(TeensyTsFooter, checksum));
+
+  if (pTab->file->size() < iOfst + TEENSY_TS_BLOCK_SIZE)
+  {
+    memcpy(pTab->aTail + TEENSY_TS_BLOCK_SIZE - sizeof(footer), &footer, sizeof(footer));
+
+    if (not pTab->file->seek(iOfst, SeekSet) ||
+        pTab->file->write(pTab->aTail, TEENSY_TS_BLOCK_SIZE) != TEENSY_TS_BLOCK_SIZE)
+    {
+      return SQLITE_IOERR_WRITE;
+    }
+
+    return SQLITE_OK;
+  }
+
+  size_t nWrite = (nCount - iFirst) * pTab->recordSize;
+
+  if (nWrite > 0 && (not pTab->file->seek(iOfst + iFirst * pTab->recordSize, SeekSet) ||
+      pTab->file->write(pTab->aTail + iFirst * pTab->recordSize, nWrite) != nWrite))
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  if (not pTab->file->seek(iOfst + TEENSY_TS_BLOCK_SIZE - sizeof(footer), SeekSet) ||
+      pTab->file->write(&footer, sizeof(footer)) != sizeof(footer))
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  return SQLITE_OK;
+}
+
+static int teensyTsFlushTail(TeensyTsTable* pTab)
+{
+  uint32_t nTail = pTab->nRecord % pTab->perBlock;
+
+  if (nTail == 0 || (pTab->iDirty < 0 && not pTab->isFooterDirty))
+  {
+    return SQLITE_OK;
+  }
+
+  int rc = teensyTsWriteTail(pTab, pTab->nRecord / pTab->perBlock, nTail,
+                             pTab->iDirty < 0 ? nTail : static_cast<uint32_t>(pTab->iDirty));
+
+  if (rc == SQLITE_OK)
+  {
+    pTab->iDirty = -1;
+    pTab->isFooterDirty = false;
+  }
+
+  return rc;
+}
+
+static int teensyTsWriteHeader(TeensyTsTable* pTab, uint64_t generation, uint64_t count)
+{
+  TeensyTsHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = TEENSY_TS_HEADER_MAGIC;
+  header.blockSize = TEENSY_TS_BLOCK_SIZE;
+  header.recordSize = pTab->recordSize;
+  header.generation = generation;
+  header.count = count;
+
+  int rc = teensyCommitRecordWrite(*pTab->file, &header);
+
+  if (rc == SQLITE_OK)
+  {
+    pTab->generation = generation;
+  }
+
+  return rc;
+}
+
+static bool teensyTsReadHeader(TeensyTsTable* pTab, TeensyTsHeader* pHeader)
+{
+  TeensyTsHeader aHeader[2];
+  bool aIsValid[2];
+  int i = teensyCommitRecordRead(*pTab->file, TEENSY_TS_HEADER_MAGIC, aHeader, aIsValid);
+
+  if (i < 0)
+  {
+    return false;
+  }
+
+  *pHeader = aHeader[i];
+
+  return true;
+}
+
+/*
+** Sets the table to its first nRecord records (the committed state or a savepoint): drops blocks written
+** after them, reloads the last block and rebuilds the index. The records must be on the file.
+*/
+static int teensyTsLoad(TeensyTsTable* pTab, uint64_t nRecord, bool isIndexValid)
+{
+  pTab->nRecord = nRecord;
+  pTab->iDirty = -1;
+  pTab->isFooterDirty = false;
+
+  uint64_t nBlock = teensyTsBlockCount(pTab);
+  uint64_t nSize = teensyTsBlockOffset(nBlock);
+  int rc = teensyTsReserveIndex(pTab, nBlock);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  if (pTab->file->size() > nSize && not pTab->file->truncate(nSize))
+  {
+    return SQLITE_IOERR_TRUNCATE;
+  }
+
+  uint64_t nFull = pTab->nRecord / pTab->perBlock;
+
+  for (uint64_t i = 0; i < nFull && not isIndexValid; ++i)
+  {
+    TeensyTsFooter footer;
+
+    if (pTab->file->seek(teensyTsBlockOffset(i) + TEENSY_TS_BLOCK_SIZE - sizeof(footer), SeekSet) &&
+        pTab->file->read(&footer, sizeof(footer)) == sizeof(footer) &&
+        footer.magic == TEENSY_TS_FOOTER_MAGIC && footer.count == pTab->perBlock &&
+        footer.checksum == teensyChecksum(&footer, offsetof(TeensyTsFooter, checksum)))
+    {
+      pTab->aIndex[i].minTs = footer.minTs;
+      pTab->aIndex[i].maxTs = footer.maxTs;
+    }
+    else
+    {
+      // unknown range: always read
+      pTab->aIndex[i].minTs = INT64_MIN;
+      pTab->aIndex[i].maxTs = INT64_MAX;
+    }
+  }
+
+  uint32_t nTail = pTab->nRecord % pTab->perBlock;
+
+  if (nTail > 0)
+  {
+    size_t nRead = nTail * pTab->recordSize;
+
+    if (not pTab->file->seek(teensyTsBlockOffset(nFull), SeekSet) ||
+        pTab->file->read(pTab->aTail, nRead) != nRead)
+    {
+      return SQLITE_IOERR_READ;
+    }
+
+    pTab->aIndex[nFull].minTs = INT64_MAX;
+    pTab->aIndex[nFull].maxTs = INT64_MIN;
+
+    for (uint32_t i = 0; i < nTail; ++i)
+    {
+      int64_t ts = teensyTsRecordTs(pTab->aTail + i * pTab->recordSize);
+      pTab->aIndex[nFull].minTs = min(pTab->aIndex[nFull].minTs, ts);
+      pTab->aIndex[nFull].maxTs = max(pTab->aIndex[nFull].maxTs, ts);
+    }
+
+    // the footer on the file may count dropped records
+    pTab->isFooterDirty = true;
+  }
+
+  pTab->isSorted = true;
+
+  for (uint64_t i = 1; i < nBlock && pTab->isSorted; ++i)
+  {
+    pTab->isSorted = pTab->aIndex[i - 1].maxTs <= pTab->aIndex[i].minTs;
+  }
+
+  return SQLITE_OK;
+}
+
+static void teensyTsFree(TeensyTsTable* pTab)
+{
+  if (pTab->file)
+  {
+    pTab->file->close();
+    delete pTab->file;
+  }
+
+  sqlite3_free(pTab->aTail);
+  sqlite3_free(pTab->aIndex);
+  sqlite3_free(pTab->aSavepoint);
+  sqlite3_free(pTab->zPath);
+  sqlite3_free(pTab);
+}
+
+static bool teensyTsParseColumn(const char* zArg, TeensyTsColumn* pColumn, char* zName, size_t nName)
+{
+  while (*zArg == ' ')
+  {
+    ++zArg;
+  }
+
+  size_t nLength = strcspn(zArg, " ");
+
+  if (nLength == 0 || nLength >= nName)
+  {
+    return false;
+  }
+
+  memcpy(zName, zArg, nLength);
+  zName[nLength] = '\0';
+  zArg += nLength;
+
+  while (*zArg == ' ')
+  {
+    ++zArg;
+  }
+
+  if (*zArg == '\0' || sqlite3_stricmp(zArg, "REAL") == 0)
+  {
+    pColumn->eType = TEENSY_TS_REAL;
+  }
+  else if (sqlite3_stricmp(zArg, "FLOAT") == 0)
+  {
+    pColumn->eType = TEENSY_TS_FLOAT;
+  }
+  else if (sqlite3_stricmp(zArg, "INTEGER") == 0)
+  {
+    pColumn->eType = TEENSY_TS_INTEGER;
+  }
+  else if (sqlite3_stricmp(zArg, "INT") == 0)
+  {
+    pColumn->eType = TEENSY_TS_INT;
+  }
+  else
+  {
+    return false;
+  }
+
+  return true;
+}
+
+static int teensyTsConnect(sqlite3* db, void*, int argc, const char* const* argv, sqlite3_vtab** ppVtab, char** pzErr)
+{
+  static const uint32_t aTypeSize[] = { sizeof(double), sizeof(float), sizeof(int64_t), sizeof(int32_t) };
+  static const char* const aTypeName[] = { "REAL", "REAL", "INTEGER", "INTEGER" };
+
+  int nColumn = argc - 3;
+
+  if (nColumn < 1 || nColumn > TEENSY_41_SQLITE_TIMESERIES_MAX_COLUMNS)
+  {
+    *pzErr = sqlite3_mprintf("timeseries: 1 to %d value columns expected", TEENSY_41_SQLITE_TIMESERIES_MAX_COLUMNS);
+    return SQLITE_ERROR;
+  }
+
+  TeensyTsTable* pTab = static_cast<TeensyTsTable*>(sqlite3_malloc(sizeof(TeensyTsTable)));
+
+  if (not pTab)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  memset(pTab, 0, sizeof(TeensyTsTable));
+  pTab->nColumn = nColumn;
+  pTab->recordSize = sizeof(int64_t);
+
+  sqlite3_str* pSchema = sqlite3_str_new(db);
+  sqlite3_str_appendall(pSchema, "CREATE TABLE x(ts INTEGER");
+
+  for (int i = 0; i < nColumn; ++i)
+  {
+    char zName[64];
+
+    if (not teensyTsParseColumn(argv[3 + i], &pTab->aColumn[i], zName, sizeof(zName)))
+    {
+      *pzErr = sqlite3_mprintf("timeseries: invalid column \"%s\" (name REAL|FLOAT|INTEGER|INT)", argv[3 + i]);
+      sqlite3_free(sqlite3_str_finish(pSchema));
+      teensyTsFree(pTab);
+      return SQLITE_ERROR;
+    }
+
+    pTab->aColumn[i].iOffset = pTab->recordSize;
+    pTab->recordSize += aTypeSize[pTab->aColumn[i].eType];
+    sqlite3_str_appendf(pSchema, ", \"%w\" %s", zName, aTypeName[pTab->aColumn[i].eType]);
+  }
+
+  sqlite3_str_appendall(pSchema, ")");
+  char* zSql = sqlite3_str_finish(pSchema);
+  int rc = zSql ? sqlite3_declare_vtab(db, zSql) : SQLITE_NOMEM;
+  sqlite3_free(zSql);
+
+  pTab->perBlock = (TEENSY_TS_BLOCK_SIZE - sizeof(TeensyTsFooter)) / pTab->recordSize;
+
+  // "<database>-<table>.ts", "<database directory><table>.ts" for temporary and in-memory databases
+  const char* zDbFile = sqlite3_db_filename(db, argv[1]);
+
+  if (zDbFile && zDbFile[0] != '\0')
+  {
+    pTab->zPath = sqlite3_mprintf("%s-%s.ts", zDbFile, argv[2]);
+    pTab->nPathPrefix = static_cast<int>(strlen(zDbFile)) + 1;
+  }
+  else
+  {
+    pTab->zPath = sqlite3_mprintf("%s%s.ts", T41SQLite::getInstance().getDBDirFullPath().c_str(), argv[2]);
+    pTab->nPathPrefix = static_cast<int>(T41SQLite::getInstance().getDBDirFullPath().length());
+  }
+
+  pTab->aTail = static_cast<unsigned char*>(sqlite3_malloc(TEENSY_TS_BLOCK_SIZE));
+
+  if (rc == SQLITE_OK && (not pTab->zPath || not pTab->aTail))
+  {
+    rc = SQLITE_NOMEM;
+  }
+
+  T41SQLiteStorage::Filesystem* filesystem = T41SQLite::getInstance().getFilesystem();
+
+  if (rc == SQLITE_OK && not filesystem)
+  {
+    rc = SQLITE_CANTOPEN;
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    pTab->file = new TeensyFile(T41SQLiteStorage::open(filesystem, pTab->zPath, FILE_WRITE));
+
+    if (not pTab->file || not *pTab->file)
+    {
+      *pzErr = sqlite3_mprintf("timeseries: cannot open %s", pTab->zPath);
+      rc = SQLITE_CANTOPEN;
+    }
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    TeensyTsHeader header;
+
+    if (teensyTsReadHeader(pTab, &header))
+    {
+      if (header.blockSize != TEENSY_TS_BLOCK_SIZE || header.recordSize != pTab->recordSize)
+      {
+        *pzErr = sqlite3_mprintf("timeseries: the records of %s do not match the columns", pTab->zPath);
+        rc = SQLITE_ERROR;
+      }
+      else
+      {
+        pTab->generation = header.generation;
+        pTab->nCommitted = header.count;
+        rc = teensyTsLoad(pTab, pTab->nCommitted, false);
+      }
+    }
+    else if (pTab->file->size() == 0)
+    {
+      // new file: the header block, then the commit record
+      memset(pTab->aTail, 0, TEENSY_TS_BLOCK_SIZE);
+      rc = pTab->file->write(pTab->aTail, TEENSY_TS_BLOCK_SIZE) == TEENSY_TS_BLOCK_SIZE ? SQLITE_OK : SQLITE_IOERR_WRITE;
+
+      if (rc == SQLITE_OK)
+      {
+        rc = teensyTsWriteHeader(pTab, 0, 0);
+      }
+    }
+    else
+    {
+      *pzErr = sqlite3_mprintf("timeseries: %s is not a time series file", pTab->zPath);
+      rc = SQLITE_CORRUPT;
+    }
+  }
+
+  if (rc != SQLITE_OK)
+  {
+    teensyTsFree(pTab);
+    return rc;
+  }
+
+  *ppVtab = &pTab->base;
+
+  return SQLITE_OK;
+}
+
+static int teensyTsDisconnect(sqlite3_vtab* pVtab)
+{
+  teensyTsFree(reinterpret_cast<TeensyTsTable*>(pVtab));
+  return SQLITE_OK;
+}
+
+static int teensyTsDestroy(sqlite3_vtab* pVtab)
+{
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pVtab);
+  char* zPath = sqlite3_mprintf("%s", pTab->zPath);
+
+  teensyTsFree(pTab);
+
+  if (zPath)
+  {
+    T41SQLiteStorage::remove(T41SQLite::getInstance().getFilesystem(), zPath);
+    sqlite3_free(zPath);
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Range constraints on ts (see teensyRangeBestIndex), they only select the blocks and records to read.
+*/
+static int teensyTsBestIndex(sqlite3_vtab* pVtab, sqlite3_index_info* pInfo)
+{
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pVtab);
+  int iArgv = teensyRangeBestIndex(pInfo, 0);
+
+  double nRow = static_cast<double>(pTab->nRecord) + 1.0;
+  pInfo->estimatedRows = static_cast<sqlite3_int64>((pInfo->idxNum & 4) ? 10 : (iArgv == 2 ? nRow / 16 : (iArgv == 1 ? nRow / 4 : nRow)));
+  pInfo->estimatedCost = static_cast<double>(pInfo->estimatedRows) * 0.1 + 10.0;
+
+  return SQLITE_OK;
+}
+
+static int teensyTsOpen(sqlite3_vtab*, sqlite3_vtab_cursor** ppCursor)
+{
+  TeensyTsCursor* pCur = static_cast<TeensyTsCursor*>(sqlite3_malloc(sizeof(TeensyTsCursor)));
+
+  if (not pCur)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  memset(pCur, 0, sizeof(TeensyTsCursor));
+  pCur->aBlock = static_cast<unsigned char*>(sqlite3_malloc(TEENSY_TS_BLOCK_SIZE));
+
+  if (not pCur->aBlock)
+  {
+    sqlite3_free(pCur);
+    return SQLITE_NOMEM;
+  }
+
+  pCur->isEof = true;
+  *ppCursor = &pCur->base;
+
+  return SQLITE_OK;
+}
+
+static int teensyTsClose(sqlite3_vtab_cursor* pCursor)
+{
+  TeensyTsCursor* pCur = reinterpret_cast<TeensyTsCursor*>(pCursor);
+  sqlite3_free(pCur->aBlock);
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+static int teensyTsLoadBlock(TeensyTsCursor* pCur)
+{
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pCur->base.pVtab);
+  uint64_t nFull = pTab->nRecord / pTab->perBlock;
+
+  pCur->iSlot = 0;
+
+  if (pCur->iBlock == nFull)
+  {
+    pCur->aRecords = pTab->aTail;
+    pCur->nCount = pTab->nRecord % pTab->perBlock;
+    return SQLITE_OK;
+  }
+
+  size_t nRead = pTab->perBlock * pTab->recordSize;
+
+  if (not pTab->file->seek(teensyTsBlockOffset(pCur->iBlock), SeekSet) ||
+      pTab->file->read(pCur->aBlock, nRead) != nRead)
+  {
+    return SQLITE_IOERR_READ;
+  }
+
+  pCur->aRecords = pCur->aBlock;
+  pCur->nCount = pTab->perBlock;
+
+  return SQLITE_OK;
+}
+
+/*
+** Moves to the next record in [lower, upper], starting at the current slot.
+*/
+static int teensyTsSeek(TeensyTsCursor* pCur)
+{
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pCur->base.pVtab);
+  uint64_t nBlock = teensyTsBlockCount(pTab);
+
+  while (true)
+  {
+    for (; pCur->iSlot < pCur->nCount; ++pCur->iSlot)
+    {
+      int64_t ts = teensyTsRecordTs(pCur->aRecords + pCur->iSlot * pTab->recordSize);
+
+      if (ts >= pCur->lower && ts <= pCur->upper)
+      {
+        return SQLITE_OK;
+      }
+
+    }
+
+    do
+    {
+      ++pCur->iBlock;
+    }
+    while (pCur->iBlock < nBlock && not teensyTsOverlaps(pTab->aIndex[pCur->iBlock], pCur->lower, pCur->upper) &&
+           not (pTab->isSorted && pTab->aIndex[pCur->iBlock].minTs > pCur->upper));
+
+    if (pCur->iBlock >= nBlock || (pTab->isSorted && pTab->aIndex[pCur->iBlock].minTs > pCur->upper))
+    {
+      pCur->isEof = true;
+      return SQLITE_OK;
+    }
+
+    int rc = teensyTsLoadBlock(pCur);
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+  }
+}
+
+static int teensyTsFilter(sqlite3_vtab_cursor* pCursor, int idxNum, const char*, int argc, sqlite3_value** argv)
+{
+  TeensyTsCursor* pCur = reinterpret_cast<TeensyTsCursor*>(pCursor);
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pCursor->pVtab);
+
+  teensyRangeFilter(idxNum, argc, argv, &pCur->lower, &pCur->upper);
+
+  pCur->isEof = false;
+  pCur->iBlock = 0;
+  pCur->nCount = 0;
+  pCur->iSlot = 0;
+
+  uint64_t nBlock = teensyTsBlockCount(pTab);
+
+  if (pTab->isSorted && pCur->lower != INT64_MIN)
+  {
+    // first block, which can hold ts >= lower
+    uint64_t iLow = 0;
+    uint64_t iHigh = nBlock;
+
+    while (iLow < iHigh)
+    {
+      uint64_t iMid = iLow + (iHigh - iLow) / 2;
+
+      if (pTab->aIndex[iMid].maxTs < pCur->lower)
+      {
+        iLow = iMid + 1;
+      }
+      else
+      {
+        iHigh = iMid;
+      }
+    }
+
+    pCur->iBlock = iLow;
+  }
+
+  if (pCur->iBlock >= nBlock)
+  {
+    pCur->isEof = true;
+    return SQLITE_OK;
+  }
+
+  if (not teensyTsOverlaps(pTab->aIndex[pCur->iBlock], pCur->lower, pCur->upper))
+  {
+    // teensyTsSeek continues with the next overlapping block
+    return teensyTsSeek(pCur);
+  }
+
+  int rc = teensyTsLoadBlock(pCur);
+
+  return rc == SQLITE_OK ? teensyTsSeek(pCur) : rc;
+}
+
+static int teensyTsNext(sqlite3_vtab_cursor* pCursor)
+{
+  TeensyTsCursor* pCur = reinterpret_cast<TeensyTsCursor*>(pCursor);
+  ++pCur->iSlot;
+  return teensyTsSeek(pCur);
+}
+
+static int teensyTsEof(sqlite3_vtab_cursor* pCursor)
+{
+  return reinterpret_cast<TeensyTsCursor*>(pCursor)->isEof;
+}
+
+static int teensyTsColumn(sqlite3_vtab_cursor* pCursor, sqlite3_context* pContext, int iColumn)
+{
+  TeensyTsCursor* pCur = reinterpret_cast<TeensyTsCursor*>(pCursor);
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pCursor->pVtab);
+  const unsigned char* pRecord = pCur->aRecords + pCur->iSlot * pTab->recordSize;
+
+  if (iColumn == 0)
+  {
+    sqlite3_result_int64(pContext, teensyTsRecordTs(pRecord));
+    return SQLITE_OK;
+  }
+
+  const TeensyTsColumn& column = pTab->aColumn[iColumn - 1];
+  const unsigned char* pValue = pRecord + column.iOffset;
+
+  switch (column.eType)
+  {
+    case TEENSY_TS_REAL:
+      {
+        double value;
+        memcpy(&value, pValue, sizeof(value));
+
+        if (not isnan(value))
+        {
+          sqlite3_result_double(pContext, value);
+        }
+      }
+      break;
+    case TEENSY_TS_FLOAT:
+      {
+        float value;
+        memcpy(&value, pValue, sizeof(value));
+
+        if (not isnan(value))
+        {
+          sqlite3_result_double(pContext, value);
+        }
+      }
+      break;
+    case TEENSY_TS_INTEGER:
+      {
+        int64_t value;
+        memcpy(&value, pValue, sizeof(value));
+        sqlite3_result_int64(pContext, value);
+      }
+      break;
+    case TEENSY_TS_INT:
+      {
+        int32_t value;
+        memcpy(&value, pValue, sizeof(value));
+        sqlite3_result_int(pContext, value);
+      }
+      break;
+  }
+
+  return SQLITE_OK;
+}
+
+static int teensyTsRowid(sqlite3_vtab_cursor* pCursor, sqlite3_int64* pRowid)
+{
+  TeensyTsCursor* pCur = reinterpret_cast<TeensyTsCursor*>(pCursor);
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pCursor->pVtab);
+  *pRowid = static_cast<sqlite3_int64>(pCur->iBlock * pTab->perBlock + pCur->iSlot + 1);
+  return SQLITE_OK;
+}
+
+static int teensyTsUpdate(sqlite3_vtab* pVtab, int argc, sqlite3_value** argv, sqlite3_int64* pRowid)
+{
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pVtab);
+
+  if (argc == 1 || sqlite3_value_type(argv[0]) != SQLITE_NULL)
+  {
+    pVtab->zErrMsg = sqlite3_mprintf("timeseries: rows can only be inserted");
+    return SQLITE_READONLY;
+  }
+
+  if (sqlite3_value_type(argv[2]) == SQLITE_NULL)
+  {
+    pVtab->zErrMsg = sqlite3_mprintf("timeseries: ts must not be NULL");
+    return SQLITE_CONSTRAINT_NOTNULL;
+  }
+
+  uint64_t iBlock = pTab->nRecord / pTab->perBlock;
+  uint32_t iSlot = pTab->nRecord % pTab->perBlock;
+  int rc = teensyTsReserveIndex(pTab, iBlock + 1);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  unsigned char* pRecord = pTab->aTail + iSlot * pTab->recordSize;
+  int64_t ts = sqlite3_value_int64(argv[2]);
+  memcpy(pRecord, &ts, sizeof(ts));
+
+  for (int i = 0; i < pTab->nColumn; ++i)
+  {
+    sqlite3_value* pValue = argv[3 + i];
+    bool isNull = sqlite3_value_type(pValue) == SQLITE_NULL;
+    unsigned char* pField = pRecord + pTab->aColumn[i].iOffset;
+
+    switch (pTab->aColumn[i].eType)
+    {
+      case TEENSY_TS_REAL:
+        {
+          double value = isNull ? NAN : sqlite3_value_double(pValue);
+          memcpy(pField, &value, sizeof(value));
+        }
+        break;
+      case TEENSY_TS_FLOAT:
+        {
+          float value = isNull ? NAN : static_cast<float>(sqlite3_value_double(pValue));
+          memcpy(pField, &value, sizeof(value));
+        }
+        break;
+      case TEENSY_TS_INTEGER:
+        {
+          int64_t value = sqlite3_value_int64(pValue);
+          memcpy(pField, &value, sizeof(value));
+        }
+        break;
+      case TEENSY_TS_INT:
+        {
+          int32_t value = sqlite3_value_int(pValue);
+          memcpy(pField, &value, sizeof(value));
+        }
+        break;
+    }
+  }
+
+  if (iBlock > 0 && ts < pTab->aIndex[iBlock - 1].maxTs)
+  {
+    pTab->isSorted = false;
+  }
+
+  TeensyTsRange& range = pTab->aIndex[iBlock];
+  range.minTs = iSlot == 0 ? ts : min(range.minTs, ts);
+  range.maxTs = iSlot == 0 ? ts : max(range.maxTs, ts);
+
+  if (pTab->iDirty < 0)
+  {
+    pTab->iDirty = iSlot;
+  }
+
+  ++pTab->nRecord;
+  *pRowid = static_cast<sqlite3_int64>(pTab->nRecord);
+
+  if (iSlot + 1 == pTab->perBlock)
+  {
+    // the block is full: write it in one piece, continue with an empty block
+    rc = teensyTsWriteTail(pTab, iBlock, pTab->perBlock, static_cast<uint32_t>(pTab->iDirty));
+    pTab->iDirty = -1;
+    pTab->isFooterDirty = false;
+  }
+
+  return rc;
+}
+
+static int teensyTsBegin(sqlite3_vtab* pVtab)
+{
+  reinterpret_cast<TeensyTsTable*>(pVtab)->nSavepoint = 0;
+  return SQLITE_OK;
+}
+
+static int teensyTsSync(sqlite3_vtab* pVtab)
+{
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pVtab);
+  int rc = teensyTsFlushTail(pTab);
+
+  if (rc == SQLITE_OK)
+  {
+    pTab->file->flush();
+  }
+
+  return rc;
+}
+
+static int teensyTsCommit(sqlite3_vtab* pVtab)
+{
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pVtab);
+
+  if (pTab->nRecord == pTab->nCommitted)
+  {
+    return SQLITE_OK;
+  }
+
+  int rc = teensyTsSync(pVtab);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = teensyTsWriteHeader(pTab, pTab->generation + 1, pTab->nRecord);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    pTab->nCommitted = pTab->nRecord;
+    pTab->nSavepoint = 0;
+  }
+
+  return rc;
+}
+
+static int teensyTsRollback(sqlite3_vtab* pVtab)
+{
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pVtab);
+  pTab->nSavepoint = 0;
+
+  if (pTab->nRecord == pTab->nCommitted)
+  {
+    return SQLITE_OK;
+  }
+
+  // the ranges of the committed full blocks are still valid
+  return teensyTsLoad(pTab, pTab->nCommitted, true);
+}
+
+/*
+** Savepoints, also opened by SQLite for each statement in a transaction: a statement that fails after
+** inserting some of its rows rolls back to its savepoint. A savepoint is the number of records.
+*/
+static int teensyTsSavepoint(sqlite3_vtab* pVtab, int iSavepoint)
+{
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pVtab);
+
+  if (iSavepoint >= pTab->nSavepointAlloc)
+  {
+    int nAlloc = iSavepoint + 8;
+    uint64_t* aSavepoint = static_cast<uint64_t*>(sqlite3_realloc64(pTab->aSavepoint, nAlloc * sizeof(uint64_t)));
+
+    if (not aSavepoint)
+    {
+      return SQLITE_NOMEM;
+    }
+
+    pTab->aSavepoint = aSavepoint;
+    pTab->nSavepointAlloc = nAlloc;
+  }
+
+  // savepoints opened before the table joined the transaction see the same records
+  for (int i = pTab->nSavepoint; i <= iSavepoint; ++i)
+  {
+    pTab->aSavepoint[i] = pTab->nRecord;
+  }
+
+  pTab->nSavepoint = iSavepoint + 1;
+
+  return SQLITE_OK;
+}
+
+static int teensyTsRelease(sqlite3_vtab* pVtab, int iSavepoint)
+{
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pVtab);
+  pTab->nSavepoint = min(pTab->nSavepoint, iSavepoint);
+  return SQLITE_OK;
+}
+
+static int teensyTsRollbackTo(sqlite3_vtab* pVtab, int iSavepoint)
+{
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pVtab);
+
+  if (iSavepoint >= pTab->nSavepoint)
+  {
+    return SQLITE_OK;
+  }
+
+  uint64_t nRecord = pTab->aSavepoint[iSavepoint];
+  pTab->nSavepoint = iSavepoint + 1;
+
+  if (pTab->nRecord == nRecord)
+  {
+    return SQLITE_OK;
+  }
+
+  // the last block is reloaded from the file, the ranges of the full blocks before it are still valid
+  int rc = teensyTsFlushTail(pTab);
+  return rc == SQLITE_OK ? teensyTsLoad(pTab, nRecord, true) : rc;
+}
+
+static int teensyTsRename(sqlite3_vtab* pVtab, const char* zNew)
+{
+  TeensyTsTable* pTab = reinterpret_cast<TeensyTsTable*>(pVtab);
+  char* zPath = sqlite3_mprintf("%.*s%s.ts", pTab->nPathPrefix, pTab->zPath, zNew);
+
+  if (not zPath)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  int rc = teensyTsFlushTail(pTab);
+  T41SQLiteStorage::Filesystem* filesystem = T41SQLite::getInstance().getFilesystem();
+  pTab->file->close();
+
+  if (rc == SQLITE_OK && not T41SQLiteStorage::rename(filesystem, pTab->zPath, zPath))
+  {
+    rc = SQLITE_IOERR;
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    sqlite3_free(pTab->zPath);
+    pTab->zPath = zPath;
+  }
+  else
+  {
+    sqlite3_free(zPath);
+  }
+
+  *pTab->file = T41SQLiteStorage::open(filesystem, pTab->zPath, FILE_WRITE);
+
+  return rc == SQLITE_OK && not *pTab->file ? SQLITE_CANTOPEN : rc;
+}
+
+static sqlite3_module teensyTsModule =
+{
+  2,                      // iVersion
+  teensyTsConnect,        // xCreate
+  teensyTsConnect,        // xConnect
+  teensyTsBestIndex,      // xBestIndex
+  teensyTsDisconnect,     // xDisconnect
+  teensyTsDestroy,        // xDestroy
+  teensyTsOpen,           // xOpen
+  teensyTsClose,          // xClose
+  teensyTsFilter,         // xFilter
+  teensyTsNext,           // xNext
+  teensyTsEof,            // xEof
+  teensyTsColumn,         // xColumn
+  teensyTsRowid,          // xRowid
+  teensyTsUpdate,         // xUpdate
+  teensyTsBegin,          // xBegin
+  teensyTsSync,           // xSync
+  teensyTsCommit,         // xCommit
+  teensyTsRollback,       // xRollback
+  nullptr,                // xFindMethod
+  teensyTsRename,         // xRename
+  teensyTsSavepoint,      // xSavepoint
+  teensyTsRelease,        // xRelease
+  teensyTsRollbackTo      // xRollbackTo
+};
+
+int T41SQLiteTimeSeries::registerModule(sqlite3* io_db)
+{
+  return sqlite3_create_module(io_db, "timeseries", &teensyTsModule, nullptr);
+}
@@ -0,0 +1,216 @@
+#ifndef TEENSY_41_SQLITE_UTIL
+#define TEENSY_41_SQLITE_UTIL
+
+#include "sqlite3.h"
+
+#include "teensy41SQLiteStorage.hpp"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+** Helpers shared by the sources of the library (not part of the public interface).
+*/
+
+static const uint32_t TEENSY_FNV_OFFSET = 2166136261u;
+static const uint32_t TEENSY_FNV_PRIME = 16777619u;
+
+/*
+** One step of FNV-1a. The checksums of the on-disk formats are built from it, do not change it.
+*/
+static inline uint32_t teensyFnvStep(uint32_t hash, uint32_t value)
+{
+  return (hash ^ value) * TEENSY_FNV_PRIME;
+}
+
+/*
+** FNV-1a over nData bytes (checksum of commit records, footers and directories, hash of strings).
+*/
+static inline uint32_t teensyChecksum(const void* pData, size_t nData)
+{
+  const unsigned char* p = static_cast<const unsigned char*>(pData);
+  uint32_t hash = TEENSY_FNV_OFFSET;
+
+  for (size_t i = 0; i < nData; ++i)
+  {
+    hash = teensyFnvStep(hash, p[i]);
+  }
+
+  return hash;
+}
+
+/*
+** Range constraints of a virtual table on one INTEGER column. teensyRangeBestIndex uses the first usable
+** equality, lower bound (>, >=) and upper bound (<, <=) constraint of the column and sets idxNum: 1: lower
+** bound, 2: upper bound, 4: equality, passed to xFilter in this order. The bounds only select what to read,
+** SQLite checks the constraints itself (omit = 0). Returns the number of arguments passed to xFilter.
+*/
+static inline int teensyRangeBestIndex(sqlite3_index_info* pInfo, int iColumn)
+{
+  int iLower = -1;
+  int iUpper = -1;
+  int iEqual = -1;
+
+  for (int i = 0; i < pInfo->nConstraint; ++i)
+  {
+    const sqlite3_index_info::sqlite3_index_constraint& constraint = pInfo->aConstraint[i];
+
+    if (constraint.iColumn != iColumn || not constraint.usable)
+    {
+      continue;
+    }
+
+    switch (constraint.op)
+    {
+      case SQLITE_INDEX_CONSTRAINT_EQ:
+        iEqual = iEqual < 0 ? i : iEqual;
+        break;
+      case SQLITE_INDEX_CONSTRAINT_GT:
+      case SQLITE_INDEX_CONSTRAINT_GE:
+        iLower = iLower < 0 ? i : iLower;
+        break;
+      case SQLITE_INDEX_CONSTRAINT_LT:
+      case SQLITE_INDEX_CONSTRAINT_LE:
+        iUpper = iUpper < 0 ? i : iUpper;
+        break;
+      default:
+        break;
+    }
+  }
+
+  int iArgv = 0;
+  pInfo->idxNum = 0;
+
+  if (iEqual >= 0)
+  {
+    pInfo->aConstraintUsage[iEqual].argvIndex = ++iArgv;
+    pInfo->idxNum = 4;
+  }
+  else
+  {
+    if (iLower >= 0)
+    {
+      pInfo->aConstraintUsage[iLower].argvIndex = ++iArgv;
+      pInfo->idxNum |= 1;
+    }
+
+    if (iUpper >= 0)
+    {
+      pInfo->aConstraintUsage[iUpper].argvIndex = ++iArgv;
+      pInfo->idxNum |= 2;
+    }
+  }
+
+  return iArgv;
+}
+
+/*
+** The INTEGER bound of a constraint value: a REAL is rounded outwards, NULL or TEXT do not bound (SQLite
+** decides).
+*/
+static inline int64_t teensyRangeBound(sqlite3_value* pValue, bool isLower)
+{
+  switch (sqlite3_value_numeric_type(pValue))
+  {
+    case SQLITE_INTEGER:
+      return sqlite3_value_int64(pValue);
+    case SQLITE_FLOAT:
+      {
+        double value = isLower ? floor(sqlite3_value_double(pValue)) : ceil(sqlite3_value_double(pValue));
+
+        if (value <= -9.2e18)
+        {
+          return INT64_MIN;
+        }
+
+        return value >= 9.2e18 ? INT64_MAX : static_cast<int64_t>(value);
+      }
+    default:
+      return isLower ? INT64_MIN : INT64_MAX;
+  }
+}
+
+/*
+** Reads the arguments of xFilter passed by teensyRangeBestIndex into *pLower and *pUpper (inclusive).
+*/
+static inline void teensyRangeFilter(int idxNum, int argc, sqlite3_value** argv, int64_t* pLower, int64_t* pUpper)
+{
+  int iArgv = 0;
+
+  *pLower = INT64_MIN;
+  *pUpper = INT64_MAX;
+
+  if ((idxNum & 4) && iArgv < argc)
+  {
+    *pLower = teensyRangeBound(argv[iArgv], true);
+    *pUpper = teensyRangeBound(argv[iArgv++], false);
+  }
+
+  if ((idxNum & 1) && iArgv < argc)
+  {
+    *pLower = teensyRangeBound(argv[iArgv++], true);
+  }
+
+  if ((idxNum & 2) && iArgv < argc)
+  {
+    *pUpper = teensyRangeBound(argv[iArgv++], false);
+  }
+}
+
+/*
+** Commit records of the time series and archive files: the record of a generation is written to sector
+** generation % 2 of the file, a torn write leaves the record of the previous generation intact. Record is a
+** struct with the members magic, generation and checksum (FNV-1a of the bytes before it).
+*/
+static const uint32_t TEENSY_COMMIT_SECTOR_SIZE = 512;
+
+/*
+** Sets the checksum and writes the record to its sector (zero-padded), then flushes the file.
+*/
+template <typename Record>
+static int teensyCommitRecordWrite(T41SQLiteStorage::File& io_file, Record* pRecord)
+{
+  static_assert(sizeof(Record) <= TEENSY_COMMIT_SECTOR_SIZE, "a commit record must fit in a sector");
+
+  unsigned char aSector[TEENSY_COMMIT_SECTOR_SIZE];
+  pRecord->checksum = teensyChecksum(pRecord, offsetof(Record, checksum));
+  memset(aSector, 0, sizeof(aSector));
+  memcpy(aSector, pRecord, sizeof(Record));
+
+  if (not io_file.seek((pRecord->generation % 2) * TEENSY_COMMIT_SECTOR_SIZE, SeekSet) ||
+      io_file.write(aSector, sizeof(aSector)) != sizeof(aSector))
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  io_file.flush();
+
+  return SQLITE_OK;
+}
+
+/*
+** Reads both records, aIsValid[i]: record i has the magic and a matching checksum. Returns the index of the
+** valid record with the higher generation, -1: none is valid.
+*/
+template <typename Record>
+static int teensyCommitRecordRead(T41SQLiteStorage::File& io_file, uint32_t magic, Record aRecord[2], bool aIsValid[2])
+{
+  for (uint32_t i = 0; i < 2; ++i)
+  {
+    aIsValid[i] = io_file.seek(i * TEENSY_COMMIT_SECTOR_SIZE, SeekSet) &&
+                  io_file.read(&aRecord[i], sizeof(Record)) == sizeof(Record) &&
+                  aRecord[i].magic == magic &&
+                  aRecord[i].checksum == teensyChecksum(&aRecord[i], offsetof(Record, checksum));
+  }
+
+  if (aIsValid[1] && (not aIsValid[0] || aRecord[1].generation > aRecord[0].generation))
+  {
+    return 1;
+  }
+
+  return aIsValid[0] ? 0 : -1;
+}
+
+#endif // TEENSY_41_SQLITE_UTIL
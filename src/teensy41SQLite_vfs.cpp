@@ -26,12 +26,14 @@
 **                 close(), fstat() --> size() (only used to get file size) <FS.h>
 **    Other:       delayMicroseconds(), elapsedMicros <elapsedMillis.h>, now() <TimeLib.h>
 **
+**   <FS.h> stands for the storage backend chosen at compile time
+**   (TEENSY_41_SQLITE_STORAGE_BACKEND, see teensy41SQLiteStorage.hpp):
+**   Arduino FS, SdFat, LittleFS or POSIX.
+**
 **   The following VFS features are omitted:
 **
-**     1. File locking. The user must ensure that there is at most one
-**        connection to each database when using this VFS. Multiple
-**        connections to a single shared-cache count as a single connection
-**        for the purposes of the previous statement.
+**     1. Locking between processes. Database files are only locked against
+**        the other connections of this program (see LOCKING).
 **
 **     2. The loading of dynamic extensions (shared libraries).
 **
@@ -106,20 +108,205 @@
 **
 **   Much more efficient if the underlying OS is not caching write 
 **   operations.
+**
+** MEMORY IMAGES
+**
+**   Database files registered with T41SQLite::addMemoryImage() are resident
+**   in addressable memory (PSRAM or program flash). They are opened read-only,
+**   served by memcpy() and support memory mapped I/O through xFetch() and
+**   xUnfetch(). With "PRAGMA mmap_size=N" SQLite accesses their pages in place
+**   without copying them (requires SQLITE_MAX_MMAP_SIZE > 0).
+**
+**   Images linked into program flash are generated by tools/db2image.py.
+**   The VFS "T41_IMAGE_VFS" serves memory images only and never falls back
+**   to the filesystem.
+**
+** MIRRORED DATABASES
+**
+**   With the URI parameter "mirror" a database file is loaded into an EXTMEM
+**   (PSRAM) buffer, when it is opened. All reads are served from that buffer.
+**
+**     file:data.db?mirror=writethrough
+**       Writes go to the buffer. xSync() writes the dirty sectors to the
+**       file, coalesced into runs of consecutive sectors.
+**
+**     file:data.db?mirror=checkpoint&mirror_interval=60000
+**       Writes go to the buffer only. A checkpoint (T41SQLite::checkpointMirror,
+**       last close or the first commit after mirror_interval ms) writes the
+**       changes into the slot file not holding the last checkpoint ("data.db"
+**       or "data.db-b") and then switches the record "data.db-ab" to it. After
+**       a power loss the database is in the state of the last checkpoint.
+**       Journals of these databases are kept in memory.
+**
+** BATCH ATOMIC WRITES
+**
+**   A database file opened with "file:data.db?batch_atomic=1" reports
+**   SQLITE_IOCAP_BATCH_ATOMIC (requires SQLITE_ENABLE_BATCH_ATOMIC_WRITE).
+**   SQLite then commits most transactions without a rollback journal: the
+**   page writes of a commit are staged in an EXTMEM redo log, which is
+**   written into "data.db-batch" with a single write and one sync, and
+**   applied to the database file with a second sync. A third sync clears
+**   the header of the log, so it is never replayed over later changes
+**   (e.g. by another connection without "batch_atomic"). No journal file is
+**   created, written twice or deleted. A valid log is replayed when the
+**   database is opened read-write. Transactions larger than
+**   TEENSY_41_SQLITE_BATCH_ATOMIC_MAX_SIZE use the rollback journal.
+**
+** COMPRESSED DATABASES
+**
+**   A database file created with "file:data.db?compress=1" is stored as a
+**   container of compressed pages (LZ4 block format). Each page is written as
+**   a record (page number, sequence number, checksum and the compressed page)
+**   into whole units of TEENSY_41_SQLITE_COMPRESS_UNIT_SIZE bytes. A page is
+**   rewritten in place, if it still fits its units, otherwise it moves to the
+**   first free run of units, so the space of moved and truncated pages is
+**   reused. Pages, which do not compress, are stored as they are. The last
+**   TEENSY_41_SQLITE_COMPRESS_CACHE_PAGES decompressed pages are cached.
+**
+**   The page index is held in RAM (8 bytes per page). It is rebuilt by reading
+**   the container once, when it is opened: the newest record of each page is
+**   valid. The first open of a container therefore reads the whole file, its
+**   time grows with the size of the container (further connections share the
+**   index), so keep one connection open instead of opening the database for
+**   every query. xSync() writes the logical file size into one of two alternating
+**   header sectors. Journals and WAL files are not compressed, so the crash
+**   recovery of SQLite is unchanged. Containers are recognized without the
+**   URI parameter. An existing plain database file cannot be opened with
+**   "compress=1", it is converted with "VACUUM INTO 'file:new.db?compress=1'".
+**
+** ENCRYPTED DATABASES
+**
+**   A database file opened with "file:data.db?encrypt=1" is encrypted with the
+**   cipher of T41SQLite::setCipher() (AES-128 in counter mode, see
+**   teensy41SQLiteCipher.hpp). Each page is encrypted on its own with a new
+**   nonce per write, which is stored in the last 12 bytes of the page. These
+**   are reserved bytes, which SQLite does not use: a new database has to be
+**   prepared with T41SQLite::prepareEncryption() before its first table is
+**   created (a plain database is converted with prepareEncryption() and
+**   "VACUUM INTO 'file:new.db?encrypt=1'"). The first 24 bytes of the
+**   database header (page size and reserved bytes) stay in plain text.
+**
+**   The page images in the rollback journal are encrypted the same way, the
+**   page numbers and checksums of the journal are not. WAL mode is not
+**   available, the journal mode stays unchanged. Every open of an encrypted
+**   database needs "encrypt=1", without it the database cannot be read.
+**   Encryption cannot be combined with "mirror" or "compress".
+**
+** WAL MODE
+**
+**   "PRAGMA journal_mode=WAL" is supported. The wal-index (xShmMap) is kept
+**   in EXTMEM, which is sufficient, because all connections are in this
+**   process. Writes to the WAL file are coalesced like journal writes. With
+**   "PRAGMA synchronous=NORMAL" commits append to the WAL without any sync,
+**   only checkpoints sync. The WAL of a checkpoint mirror is kept in memory.
+**
+** LOCKING
+**
+**   Several connections may use the same database file, e.g. a task, which
+**   reads reports, next to a task, which logs. The locks of a database file
+**   are kept in a table in RAM, one entry per full path, with the levels of
+**   SQLite: any number of readers hold SHARED_LOCK, one writer holds
+**   RESERVED_LOCK while it changes pages in its cache, so the readers go on
+**   until it commits. To commit, the writer takes PENDING_LOCK, which keeps
+**   new readers out, and gets EXCLUSIVE_LOCK after the last reader is done.
+**   Until then xLock() returns SQLITE_BUSY and the busy handler of SQLite
+**   (sqlite3_busy_timeout) waits with xSleep(), which calls yield(), so other
+**   tasks keep running.
+**
+**   A writer committing in a loop would keep a reader out for good, its
+**   retries always fall into the next PENDING_LOCK. So while a reader, which
+**   was kept out, is still retrying (its last attempt is less than
+**   TEENSY_LOCK_READER_WAIT ms ago), the connection, which committed last,
+**   gets SQLITE_BUSY for its next SHARED_LOCK. The reader stops waiting when
+**   it gets its lock, gives up (xUnlock) or is closed. SQLite waits for the
+**   SHARED_LOCK at the start of a transaction with the busy handler, the
+**   writer only pauses.
+**
+**   A file object of the storage backend does not see the new size of a file
+**   changed through another file object, so a connection reopens its file,
+**   when it takes SHARED_LOCK after another connection changed the file.
+**
+**   At the start of every transaction SQLite checks whether a journal or a
+**   WAL file exists and reads the change counter in the database header to
+**   find out whether its page cache is still valid, a card access each.
+**   With T41SQLite::setExclusiveOwner(true) the library is the only one
+**   changing the files, so the lock of a database file opened afterwards
+**   keeps the first 100 bytes of the file (updated by every write through
+**   any connection) and whether the journal and the WAL file exist (updated
+**   by xOpen and xDelete). These checks are then answered from memory.
+**
+** THREADS
+**
+**   With SQLITE_THREADSAFE=1 or 2 and a mutex backend (see
+**   teensy41SQLiteMutex.hpp) connections may be used by several threads.
+**   The storage backend (SdFat, LittleFS) and the tables of this file (locks,
+**   wal-indexes, mirrors) are not thread-safe, so the methods, which use
+**   them, hold one recursive VFS mutex. Storage access is serialized, the
+**   work of SQLite between the calls (parsing, B-tree search, sorting) runs
+**   in parallel. xSleep() does not hold the mutex, so a thread waiting for a
+**   lock lets the other threads finish their transactions.
+**
+** HOT PAGES
+**
+**   After a power cycle SQLite reads the root and interior pages of the
+**   B-trees one xRead() at a time, a card access each. A database file opened
+**   with "prefetch=1" (e.g. "file:log.db?prefetch=1") counts the page reads of
+**   all its connections and, when the last connection closes, saves the
+**   TEENSY_41_SQLITE_PREFETCH_MAX_PAGES most read page numbers to
+**   "<database>-hot". The next open loads the list and merges neighboring
+**   pages (gaps of up to two pages are read along) into spans of at most
+**   TEENSY_41_SQLITE_PREFETCH_READ_SIZE bytes. T41SQLite::prefetchHotPages
+**   or the maintenance task Prefetch read the spans in ascending order into
+**   one EXTMEM buffer, from which xRead() serves those pages. SQLite offers
+**   no way to fill its page cache by page number, so the buffer is kept by
+**   the lock of the file and shared by its connections. Writes update it,
+**   a truncate or a discarded batch atomic write drops it. Files served from
+**   a memory image or a RAM mirror do not prefetch.
 */
 
 #include <assert.h>
 
+#include "sqlite_cfg.h"
 #include "teensy41SQLite.hpp"
+#include "teensy41SQLiteCipher.hpp"
+#include "teensy41SQLite_util.hpp"
 
 #include <elapsedMillis.h>
 #include <TimeLib.h>
 
 // define TeensyFile type, which actually interfaces with the storage hardware (e.g. a sd card)
-using TeensyFile = File;
+using TeensyStorage = T41SQLiteStorage;
+using TeensyFile = TeensyStorage::File;
 // Name: Teensy 4.1 VFS
 #define TEENSY_VFS_NAME "T41_VFS" 
 
+/*
+** Mutex of the methods, which use the storage backend or the shared tables of
+** this file (see THREADS). It is entered again by methods calling each other
+** (e.g. xOpen closes a file it cannot set up), so it is recursive.
+** sqlite3_mutex_enter(0) does nothing, so the guard costs nothing until
+** sqlite3_teensy_os_init allocated the mutex, and a build with SQLITE_THREADSAFE=0
+** has no mutex at all.
+*/
+#if !defined(SQLITE_THREADSAFE) || SQLITE_THREADSAFE > 0
+static sqlite3_mutex* teensyVfsMutex = 0;
+
+class TeensyVFSGuard
+{
+  public:
+    TeensyVFSGuard() { sqlite3_mutex_enter(teensyVfsMutex); }
+    ~TeensyVFSGuard() { sqlite3_mutex_leave(teensyVfsMutex); }
+    TeensyVFSGuard(const TeensyVFSGuard&) = delete;
+    TeensyVFSGuard& operator=(const TeensyVFSGuard&) = delete;
+};
+#else
+class TeensyVFSGuard
+{
+  public:
+    TeensyVFSGuard() {}
+};
+#endif
+
 /*
 ** Size of the write buffer used by journal files in bytes.
 */
@@ -127,6 +314,53 @@ using TeensyFile = File;
   #define SQLITE_VFS_JOURNAL_BUFFERSZ 8192
 #endif
 
+#if TEENSY_41_SQLITE_DTCM_JOURNAL_BUFFERS > 0
+/*
+** Journal write buffers in DTCM. They are used before falling back to sqlite3_malloc().
+*/
+static char teensyDTCMJournalBuffers[TEENSY_41_SQLITE_DTCM_JOURNAL_BUFFERS][SQLITE_VFS_JOURNAL_BUFFERSZ]
+  TEENSY_41_SQLITE_DTCM(journal);
+static bool teensyDTCMJournalBufferInUse[TEENSY_41_SQLITE_DTCM_JOURNAL_BUFFERS];
+#endif
+
+/*
+** Get a journal write buffer, either from the DTCM pool or from the heap.
+*/
+static char* teensyAllocJournalBuffer()
+{
+#if TEENSY_41_SQLITE_DTCM_JOURNAL_BUFFERS > 0
+  if (T41SQLite::getInstance().getUseDTCMJournalBuffers())
+  {
+    for (int i = 0; i < TEENSY_41_SQLITE_DTCM_JOURNAL_BUFFERS; ++i)
+    {
+      if (not teensyDTCMJournalBufferInUse[i])
+      {
+        teensyDTCMJournalBufferInUse[i] = true;
+        return teensyDTCMJournalBuffers[i];
+      }
+    }
+  }
+#endif
+
+  return (char*)sqlite3_malloc(SQLITE_VFS_JOURNAL_BUFFERSZ);
+}
+
+static void teensyFreeJournalBuffer(char* aBuf)
+{
+#if TEENSY_41_SQLITE_DTCM_JOURNAL_BUFFERS > 0
+  for (int i = 0; i < TEENSY_41_SQLITE_DTCM_JOURNAL_BUFFERS; ++i)
+  {
+    if (aBuf == teensyDTCMJournalBuffers[i])
+    {
+      teensyDTCMJournalBufferInUse[i] = false;
+      return;
+    }
+  }
+#endif
+
+  sqlite3_free(aBuf);
+}
+
 /*
 ** The maximum pathname length supported by this VFS.
 */
@@ -140,7 +374,24 @@ typedef struct TeensyVFSFile TeensyVFSFile;
 struct TeensyVFSFile
 {
   sqlite3_file sqliteFile;        /* Base class. Must be first. */
-  TeensyFile* teensyFile;         /* File descriptor */
+  TeensyFile* teensyFile;         /* File descriptor (0 for memory images) */
+
+  const unsigned char* aImage;    /* Memory image of the file or 0 */
+  sqlite3_int64 nImage;           /* Size of the memory image in bytes */
+  int nFetchOut;                  /* Number of outstanding xFetch references */
+  struct TeensyMirror* pMirror;   /* RAM mirror of the file or 0 */
+  struct TeensyBatch* pBatch;     /* Batch atomic write state or 0 */
+  struct TeensyCompress* pCompress; /* Compressed container of the file or 0 */
+  struct TeensyCrypt* pCrypt;     /* Encryption state of the file or its database or 0 */
+  const char* zName;              /* Full path of the file (valid until xClose) */
+  struct TeensyShm* pShm;         /* Mapped wal-index or 0 */
+  uint16_t shmSharedMask;         /* Shared wal-index locks held by this connection */
+  uint16_t shmExclMask;           /* Exclusive wal-index locks held by this connection */
+  int flags;                      /* SQLITE_OPEN_XXX flags passed to xOpen */
+  TeensyVFSFile* pNextWal;        /* Next WAL file in teensyWalList */
+  struct TeensyLock* pLock;       /* Lock of the database file or 0 */
+  int eLock;                      /* SQLITE_LOCK_XXX held by this handle */
+  uint32_t iLockGeneration;       /* TeensyLock.iGeneration the file handle is up to date with */
 
   char* aBuffer;                  /* Pointer to malloc'd buffer */
   int nBuffer;                    /* Valid bytes of data in zBuffer */
@@ -210,190 +461,3523 @@ static int teensyFlushBuffer(TeensyVFSFile *p)
 }
 
 /*
-** Close a file.
+** Read data from the memory image of a file (TeensyVFSFile.aImage or a RAM mirror).
 */
-static int teensyClose(sqlite3_file *pFile)
-{
-  TeensyVFSFile *p = (TeensyVFSFile*)pFile;
-  int rc = teensyFlushBuffer(p);
-  sqlite3_free(p->aBuffer);
+static int teensyImageRead(
+  const unsigned char* aImage,    /* Memory image */
+  sqlite3_int64 nImage,           /* Size of the memory image in bytes */
+  void* zBuf,                     /* Buffer to read into */
+  int iAmt,                       /* Size of data to read in bytes */
+  sqlite_int64 iOfst              /* File offset to read from */
+){
+  if (iAmt < 0 || iOfst < 0)
+  {
+    return SQLITE_IOERR_READ;
+  }
 
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_CLOSE");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_CLOSE_FILE ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->teensyFile->name());
+  sqlite3_int64 nRead = 0;
 
-  p->teensyFile->close();
+  if (iOfst < nImage)
+  {
+    nRead = min(static_cast<sqlite3_int64>(iAmt), nImage - iOfst);
+    memcpy(zBuf, &aImage[iOfst], static_cast<size_t>(nRead));
+  }
 
-  return rc;
+  if (nRead < iAmt)
+  {
+    memset(&((char*)zBuf)[nRead], 0, static_cast<size_t>(iAmt - nRead));
+    return SQLITE_IOERR_SHORT_READ;
+  }
+
+  return SQLITE_OK;
 }
 
 /*
-** Read data from a file.
+** RAM-mirrored database files (URI parameter "mirror", see MIRRORED
+** DATABASES above). A mirror holds the whole file in an EXTMEM buffer.
+** Mirrors are shared by all handles opened on the same file name.
 */
-static int teensyRead(
-  sqlite3_file *pFile, 
-  void *zBuf, 
-  int iAmt, 
-  sqlite_int64 iOfst
-)
+#define TEENSY_MIRROR_WRITE_THROUGH 1   /* xSync() writes the dirty sectors to the file */
+#define TEENSY_MIRROR_CHECKPOINT    2   /* checkpoints write the dirty sectors to slot A or B */
+#define TEENSY_MIRROR_MEMORY        3   /* no backing file (journals of checkpoint mirrors) */
+
+#define TEENSY_MIRROR_SECTOR_SIZE 512
+#define TEENSY_MIRROR_GROWTH (64 * 1024)
+#define TEENSY_MIRROR_READ_CHUNK (32 * 1024)
+#define TEENSY_MIRROR_RECORD_MAGIC 0x4D313454 /* "T41M" */
+
+typedef struct TeensyRetiredBuffer TeensyRetiredBuffer;
+struct TeensyRetiredBuffer
 {
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - BEGIN");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_iAMT ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(iAmt);
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_OFFSET ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(iOfst);
+  TeensyRetiredBuffer* pNext;
+  unsigned char* aData;
+};
 
-  TeensyVFSFile *p = (TeensyVFSFile*)pFile;
+typedef struct TeensyMirror TeensyMirror;
+struct TeensyMirror
+{
+  TeensyMirror* pNext;            /* Next mirror in teensyMirrorList */
+  char* zName;                    /* Full path of the file */
+  int eMode;                      /* TEENSY_MIRROR_XXX */
+  int nRef;                       /* Number of open handles */
+  bool bDeleted;                  /* Free on last close (TEENSY_MIRROR_MEMORY only) */
 
-  /* Flush any data in the write buffer to disk in case this operation
-  ** is trying to read data the file-region currently cached in the buffer.
-  ** It would be possible to detect this case and possibly save an 
-  ** unnecessary write here, but in practice SQLite will rarely read from
-  ** a journal file when there is data cached in the write-buffer.
-  */
-  int rc = teensyFlushBuffer(p);
+  unsigned char* aData;           /* Image of the file (EXTMEM) */
+  sqlite3_int64 nData;            /* Size of the file in bytes */
+  sqlite3_int64 nAlloc;           /* Size of aData in bytes */
+  int nFetchOut;                  /* Outstanding xFetch references */
+  TeensyRetiredBuffer* pRetired;  /* Buffers replaced while xFetch references were outstanding */
 
-  if (rc != SQLITE_OK)
+  uint32_t* aDirty[2];            /* Dirty sectors of the file/slot A [0] and slot B [1] */
+  int iSlot;                      /* Slot holding the last checkpoint */
+  uint32_t iGeneration;           /* Generation of the last checkpoint */
+  uint32_t msInterval;            /* Checkpoint interval in ms (0: explicit checkpoints only) */
+  uint32_t msLastCheckpoint;      /* millis() of the last checkpoint */
+};
+
+static TeensyMirror* teensyMirrorList = 0;
+
+/*
+** Record of the active slot of a checkpoint mirror. It is written alternately
+** into the two sectors of "<name>-ab". A torn write therefore only destroys
+** the record being written, never the previous one.
+*/
+struct TeensyMirrorRecord
+{
+  uint32_t magic;
+  uint32_t generation;
+  uint32_t slot;
+  uint32_t reserved;
+  uint64_t size;
+  uint32_t crc;
+};
+
+static uint32_t teensyCrc32(const void* pData, size_t nData)
+{
+  const unsigned char* a = (const unsigned char*)pData;
+  uint32_t crc = 0xFFFFFFFF;
+
+  for (size_t i = 0; i < nData; ++i)
   {
-    return rc;
+    crc ^= a[i];
+
+    for (int bit = 0; bit < 8; ++bit)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
   }
-  
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_FILE_SIZE ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->teensyFile->size());
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_CUR ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->teensyFile->position());
 
-  uint64_t seekPosition = min(static_cast<uint64_t>(iOfst), p->teensyFile->size());
-  if (not p->teensyFile->seek(seekPosition, SeekSet))
+  return ~crc;
+}
+
+static TeensyMirror* teensyMirrorFind(const char* zName)
+{
+  for (TeensyMirror* pMirror = teensyMirrorList; pMirror; pMirror = pMirror->pNext)
   {
-    TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ_SEEK_FAIL");
-    return SQLITE_IOERR_READ;
+    if (strcmp(pMirror->zName, zName) == 0)
+    {
+      return pMirror;
+    }
   }
 
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_CUR_AFTER_SEEK ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->teensyFile->position());
-
-  size_t toRead = static_cast<size_t>(iAmt);
-  size_t nRead = p->teensyFile->read(zBuf, toRead);
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_FILE_READ_RETURN_VALUE ");
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(nRead);
+  return 0;
+}
 
-  if (nRead == toRead)
+static void teensyMirrorFreeRetired(TeensyMirror* pMirror)
+{
+  while (pMirror->pRetired)
   {
-    TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - END (OK)");
-
-    return SQLITE_OK;
+    TeensyRetiredBuffer* pRetired = pMirror->pRetired;
+    pMirror->pRetired = pRetired->pNext;
+    extmem_free(pRetired->aData);
+    sqlite3_free(pRetired);
   }
-  else if (nRead >= 0)
+}
+
+static void teensyMirrorFree(TeensyMirror* pMirror)
+{
+  for (TeensyMirror** pp = &teensyMirrorList; *pp; pp = &(*pp)->pNext)
   {
-    if (nRead < toRead)
+    if (*pp == pMirror)
     {
-      memset(&((char*)zBuf)[nRead], 0, toRead - nRead);
+      *pp = pMirror->pNext;
+      break;
     }
+  }
 
-    TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - END (SQLITE_IOERR_SHORT_READ)");
+  teensyMirrorFreeRetired(pMirror);
+  extmem_free(pMirror->aData);
+  sqlite3_free(pMirror->aDirty[0]);
+  sqlite3_free(pMirror->aDirty[1]);
+  sqlite3_free(pMirror);
+}
 
-    return SQLITE_IOERR_SHORT_READ; // ok
+static TeensyMirror* teensyMirrorAlloc(const char* zName, int eMode)
+{
+  size_t nName = strlen(zName);
+  TeensyMirror* pMirror = (TeensyMirror*)sqlite3_malloc64(sizeof(TeensyMirror) + nName + 1);
+
+  if (not pMirror)
+  {
+    return 0;
   }
-  
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - END (ERROR)");
 
-  return SQLITE_IOERR_READ; // nRead < 0 --> call to p->teensyFile->read(zBuf, iAmt) failed
+  memset(pMirror, 0, sizeof(TeensyMirror));
+  pMirror->zName = (char*)&pMirror[1];
+  memcpy(pMirror->zName, zName, nName + 1);
+  pMirror->eMode = eMode;
+  pMirror->nRef = 1;
+  pMirror->msLastCheckpoint = millis();
+  pMirror->pNext = teensyMirrorList;
+  teensyMirrorList = pMirror;
+
+  return pMirror;
+}
+
+static sqlite3_int64 teensyMirrorSectorCount(sqlite3_int64 nByte)
+{
+  return (nByte + TEENSY_MIRROR_SECTOR_SIZE - 1) / TEENSY_MIRROR_SECTOR_SIZE;
 }
 
 /*
-** Write data to a crash-file.
+** Make sure aData can hold nSize bytes. If xFetch() references into aData are
+** outstanding, the old buffer is kept until they are released.
 */
-static int teensyWrite(
-  sqlite3_file *pFile, 
-  const void *zBuf, 
-  int iAmt, 
-  sqlite_int64 iOfst
-){
-  TeensyVFSFile *p = (TeensyVFSFile*)pFile;
+static int teensyMirrorReserve(TeensyMirror* pMirror, sqlite3_int64 nSize)
+{
+  if (nSize <= pMirror->nAlloc)
+  {
+    return SQLITE_OK;
+  }
 
-  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_WRITE");
-  
-  if (p->aBuffer)
+  sqlite3_int64 nAlloc = ((nSize + TEENSY_MIRROR_GROWTH - 1) / TEENSY_MIRROR_GROWTH) * TEENSY_MIRROR_GROWTH;
+  unsigned char* aData = 0;
+
+  if (pMirror->nFetchOut == 0)
   {
-    char *z = (char *)zBuf;       /* Pointer to remaining data to write */
-    int n = iAmt;                 /* Number of bytes at z */
-    sqlite3_int64 i = iOfst;      /* File offset to write to */
+    aData = (unsigned char*)extmem_realloc(pMirror->aData, static_cast<size_t>(nAlloc));
+  }
+  else
+  {
+    TeensyRetiredBuffer* pRetired = (TeensyRetiredBuffer*)sqlite3_malloc(sizeof(TeensyRetiredBuffer));
+    aData = pRetired ? (unsigned char*)extmem_malloc(static_cast<size_t>(nAlloc)) : 0;
 
-    while (n > 0)
+    if (aData)
     {
-      int nCopy;                  /* Number of bytes to copy into buffer */
+      memcpy(aData, pMirror->aData, static_cast<size_t>(pMirror->nData));
+      pRetired->aData = pMirror->aData;
+      pRetired->pNext = pMirror->pRetired;
+      pMirror->pRetired = pRetired;
+    }
+    else
+    {
+      sqlite3_free(pRetired);
+    }
+  }
 
-      /* If the buffer is full, or if this data is not being written directly
-      ** following the data already buffered, flush the buffer. Flushing
-      ** the buffer is a no-op if it is empty.  
-      */
-      if (p->nBuffer == SQLITE_VFS_JOURNAL_BUFFERSZ ||
-          p->iBufferOfst + p->nBuffer != i)
-      {
-        int rc = teensyFlushBuffer(p);
-        if (rc != SQLITE_OK)
-        {
-          return rc;
-        }
-      }
+  if (not aData)
+  {
+    return SQLITE_NOMEM;
+  }
 
-      assert(p->nBuffer == 0 || p->iBufferOfst + p->nBuffer == i);
-      p->iBufferOfst = i - p->nBuffer;
+  pMirror->aData = aData;
 
-      /* Copy as much data as possible into the buffer. */
-      nCopy = SQLITE_VFS_JOURNAL_BUFFERSZ - p->nBuffer;
-      if (nCopy > n)
+  if (pMirror->eMode != TEENSY_MIRROR_MEMORY)
+  {
+    size_t nOldWords = static_cast<size_t>((teensyMirrorSectorCount(pMirror->nAlloc) + 31) / 32);
+    size_t nWords = static_cast<size_t>((teensyMirrorSectorCount(nAlloc) + 31) / 32);
+
+    for (int i = 0; i < 2; ++i)
+    {
+      uint32_t* aDirty = (uint32_t*)sqlite3_realloc64(pMirror->aDirty[i], nWords * sizeof(uint32_t));
+
+      if (not aDirty)
       {
-        nCopy = n;
+        return SQLITE_NOMEM;
       }
-      memcpy(&p->aBuffer[p->nBuffer], z, nCopy);
-      p->nBuffer += nCopy;
 
-      n -= nCopy;
-      i += nCopy;
-      z += nCopy;
+      memset(&aDirty[nOldWords], 0, (nWords - nOldWords) * sizeof(uint32_t));
+      pMirror->aDirty[i] = aDirty;
     }
   }
-  else
-  {
-    return teensyDirectWrite(p, zBuf, iAmt, iOfst);
-  }
+
+  pMirror->nAlloc = nAlloc;
 
   return SQLITE_OK;
 }
 
-/* (From SQLite documentation:)
-** The xTruncate method truncates a file to be nByte bytes in length. If the file is already nByte bytes or less in length then this method is a no-op.
-** The xTruncate method returns SQLITE_OK on success and SQLITE_IOERR_TRUNCATE if anything goes wrong. 
-*/
-static int teensyTruncate(sqlite3_file *pFile, sqlite_int64 size)
+static void teensyMirrorMarkDirty(TeensyMirror* pMirror, sqlite3_int64 iOfst, sqlite3_int64 nByte)
 {
-  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
-  size_t reducedSize = static_cast<size_t>(size);
+  if (pMirror->eMode == TEENSY_MIRROR_MEMORY || nByte <= 0)
+  {
+    return;
+  }
 
-  if (p->teensyFile->size() > reducedSize)
+  sqlite3_int64 iLast = (iOfst + nByte - 1) / TEENSY_MIRROR_SECTOR_SIZE;
+
+  for (sqlite3_int64 iSector = iOfst / TEENSY_MIRROR_SECTOR_SIZE; iSector <= iLast; ++iSector)
   {
-    return p->teensyFile->truncate(reducedSize) ? SQLITE_OK : SQLITE_IOERR_TRUNCATE;
+    pMirror->aDirty[0][iSector / 32] |= 1u << (iSector % 32);
+    pMirror->aDirty[1][iSector / 32] |= 1u << (iSector % 32);
   }
+}
 
-  return SQLITE_OK;
+static bool teensyMirrorIsDirty(const TeensyMirror* pMirror, int iBitmap, sqlite3_int64 iSector)
+{
+  return pMirror->aDirty[iBitmap][iSector / 32] & (1u << (iSector % 32));
 }
 
-/*
-** Sync the contents of the file to the persistent media.
-*/
-static int teensySync(sqlite3_file *pFile, int flags)
+static int teensyMirrorWrite(TeensyMirror* pMirror, const void* zBuf, int iAmt, sqlite3_int64 iOfst)
 {
-  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
-  int rc = teensyFlushBuffer(p);
-  
+  int rc = teensyMirrorReserve(pMirror, iOfst + iAmt);
+
   if (rc != SQLITE_OK)
   {
     return rc;
   }
-  
-  p->teensyFile->flush();
+
+  if (iOfst > pMirror->nData)
+  {
+    memset(&pMirror->aData[pMirror->nData], 0, static_cast<size_t>(iOfst - pMirror->nData));
+    teensyMirrorMarkDirty(pMirror, pMirror->nData, iOfst - pMirror->nData);
+  }
+
+  memcpy(&pMirror->aData[iOfst], zBuf, static_cast<size_t>(iAmt));
+  teensyMirrorMarkDirty(pMirror, iOfst, iAmt);
+  pMirror->nData = max(pMirror->nData, iOfst + iAmt);
+
+  return SQLITE_OK;
+}
+
+/*
+** Write the sectors marked in bitmap iBitmap to io_file (coalesced into runs
+** of consecutive sectors), cut io_file to the size of the mirror and flush it.
+*/
+static int teensyMirrorFlushTo(TeensyMirror* pMirror, int iBitmap, TeensyFile& io_file)
+{
+  sqlite3_int64 nSector = teensyMirrorSectorCount(pMirror->nData);
+  sqlite3_int64 iSector = 0;
+
+  while (iSector < nSector)
+  {
+    if (not teensyMirrorIsDirty(pMirror, iBitmap, iSector))
+    {
+      ++iSector;
+      continue;
+    }
+
+    sqlite3_int64 iFirst = iSector;
+
+    while (iSector < nSector && teensyMirrorIsDirty(pMirror, iBitmap, iSector))
+    {
+      pMirror->aDirty[iBitmap][iSector / 32] &= ~(1u << (iSector % 32));
+      ++iSector;
+    }
+
+    sqlite3_int64 iOfst = iFirst * TEENSY_MIRROR_SECTOR_SIZE;
+    size_t toWrite = static_cast<size_t>(min(iSector * TEENSY_MIRROR_SECTOR_SIZE, pMirror->nData) - iOfst);
+
+    if (not io_file.seek(iOfst, SeekSet) || io_file.write(&pMirror->aData[iOfst], toWrite) != toWrite)
+    {
+      return SQLITE_IOERR_WRITE;
+    }
+  }
+
+  // sectors beyond the end of the file are not written
+  for (sqlite3_int64 i = nSector; i < teensyMirrorSectorCount(pMirror->nAlloc); ++i)
+  {
+    pMirror->aDirty[iBitmap][i / 32] &= ~(1u << (i % 32));
+  }
+
+  if (io_file.size() > static_cast<uint64_t>(pMirror->nData) &&
+      not io_file.truncate(static_cast<uint64_t>(pMirror->nData)))
+  {
+    return SQLITE_IOERR_TRUNCATE;
+  }
+
+  io_file.flush();
+
+  return SQLITE_OK;
+}
+
+static String teensyMirrorSlotName(const TeensyMirror* pMirror, int iSlot)
+{
+  String name = pMirror->zName;
+
+  if (iSlot == 1)
+  {
+    name.append("-b");
+  }
+
+  return name;
+}
+
+static String teensyMirrorRecordName(const TeensyMirror* pMirror)
+{
+  String name = pMirror->zName;
+  name.append("-ab");
+  return name;
+}
+
+/*
+** Read the newest valid record of "<name>-ab". Returns false if there is none
+** (slot A is the database file itself, as without a mirror).
+*/
+static bool teensyMirrorReadRecord(const TeensyMirror* pMirror, TeensyMirrorRecord* pRecord)
+{
+  TeensyStorage::Filesystem* filesystem = T41SQLite::getInstance().getFilesystem();
+  String recordName = teensyMirrorRecordName(pMirror);
+
+  if (not TeensyStorage::exists(filesystem, recordName.c_str()))
+  {
+    return false;
+  }
+
+  TeensyFile recordFile = TeensyStorage::open(filesystem, recordName.c_str(), FILE_READ);
+  bool isValid = false;
+
+  for (int i = 0; i < 2 && recordFile; ++i)
+  {
+    TeensyMirrorRecord record;
+
+    if (recordFile.seek(i * TEENSY_MIRROR_SECTOR_SIZE, SeekSet) &&
+        recordFile.read(&record, sizeof(record)) == sizeof(record) &&
+        record.magic == TEENSY_MIRROR_RECORD_MAGIC && record.slot < 2 &&
+        record.crc == teensyCrc32(&record, offsetof(TeensyMirrorRecord, crc)) &&
+        (not isValid || record.generation > pRecord->generation))
+    {
+      *pRecord = record;
+      isValid = true;
+    }
+  }
+
+  recordFile.close();
+
+  return isValid;
+}
+
+static int teensyMirrorWriteRecord(TeensyMirror* pMirror, int iSlot, uint32_t iGeneration)
+{
+  unsigned char aSector[TEENSY_MIRROR_SECTOR_SIZE];
+  TeensyMirrorRecord record;
+
+  memset(aSector, 0, sizeof(aSector));
+  memset(&record, 0, sizeof(record));
+  record.magic = TEENSY_MIRROR_RECORD_MAGIC;
+  record.generation = iGeneration;
+  record.slot = static_cast<uint32_t>(iSlot);
+  record.size = static_cast<uint64_t>(pMirror->nData);
+  record.crc = teensyCrc32(&record, offsetof(TeensyMirrorRecord, crc));
+  memcpy(aSector, &record, sizeof(record));
+
+  TeensyFile recordFile = TeensyStorage::open(T41SQLite::getInstance().getFilesystem(), teensyMirrorRecordName(pMirror).c_str(), FILE_WRITE);
+  int rc = SQLITE_IOERR_WRITE;
+
+  if (recordFile)
+  {
+    // a new record file gets both sectors first, SdFat cannot seek past the end of a file
+    uint64_t nFile = recordFile.size();
+    bool isReady = true;
+
+    if (nFile < 2 * TEENSY_MIRROR_SECTOR_SIZE)
+    {
+      unsigned char aZero[2 * TEENSY_MIRROR_SECTOR_SIZE];
+      size_t nZero = static_cast<size_t>(2 * TEENSY_MIRROR_SECTOR_SIZE - nFile);
+      memset(aZero, 0, sizeof(aZero));
+      isReady = recordFile.seek(nFile, SeekSet) && recordFile.write(aZero, nZero) == nZero;
+    }
+
+    if (isReady && recordFile.seek((iGeneration % 2) * TEENSY_MIRROR_SECTOR_SIZE, SeekSet) &&
+        recordFile.write(aSector, sizeof(aSector)) == sizeof(aSector))
+    {
+      recordFile.flush();
+      rc = SQLITE_OK;
+    }
+
+    recordFile.close();
+  }
+
+  return rc;
+}
+
+/*
+** Make the current image durable: write it into the slot not holding the last
+** checkpoint, then switch the record to that slot. Until the record is
+** written, the previous checkpoint stays valid.
+*/
+static int teensyMirrorCheckpoint(TeensyMirror* pMirror)
+{
+  pMirror->msLastCheckpoint = millis();
+  sqlite3_int64 nWords = (teensyMirrorSectorCount(pMirror->nAlloc) + 31) / 32;
+  bool isDirty = false;
+
+  // aDirty[iSlot] tracks the changes since the last checkpoint
+  for (sqlite3_int64 i = 0; i < nWords && not isDirty; ++i)
+  {
+    isDirty = pMirror->aDirty[pMirror->iSlot][i] != 0;
+  }
+
+  if (not isDirty)
+  {
+    return SQLITE_OK;
+  }
+
+  int iTarget = 1 - pMirror->iSlot;
+  TeensyFile slotFile = TeensyStorage::open(T41SQLite::getInstance().getFilesystem(), teensyMirrorSlotName(pMirror, iTarget).c_str(), FILE_WRITE);
+
+  if (not slotFile)
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  int rc = teensyMirrorFlushTo(pMirror, iTarget, slotFile);
+  slotFile.close();
+
+  if (rc == SQLITE_OK)
+  {
+    rc = teensyMirrorWriteRecord(pMirror, iTarget, pMirror->iGeneration + 1);
+  }
+
+  if (rc != SQLITE_OK)
+  {
+    // the target slot is in an unknown state, rewrite it completely next time
+    memset(pMirror->aDirty[iTarget], 0xFF, static_cast<size_t>(nWords * sizeof(uint32_t)));
+    return rc;
+  }
+
+  pMirror->iSlot = iTarget;
+  pMirror->iGeneration += 1;
+
+  return SQLITE_OK;
+}
+
+/*
+** Load the file (or the slot of the last checkpoint) into the mirror.
+*/
+static int teensyMirrorLoad(TeensyMirror* pMirror)
+{
+  TeensyStorage::Filesystem* filesystem = T41SQLite::getInstance().getFilesystem();
+  TeensyMirrorRecord record;
+  bool hasRecord = teensyMirrorReadRecord(pMirror, &record);
+
+  pMirror->iSlot = hasRecord ? static_cast<int>(record.slot) : 0;
+  pMirror->iGeneration = hasRecord ? record.generation : 0;
+
+  String slotName = teensyMirrorSlotName(pMirror, pMirror->iSlot);
+  TeensyFile slotFile = TeensyStorage::open(filesystem, slotName.c_str(), FILE_READ);
+  sqlite3_int64 nSize = 0;
+
+  if (slotFile)
+  {
+    nSize = hasRecord ? static_cast<sqlite3_int64>(record.size) : static_cast<sqlite3_int64>(slotFile.size());
+  }
+
+  int rc = teensyMirrorReserve(pMirror, max(nSize, static_cast<sqlite3_int64>(1)));
+
+  for (sqlite3_int64 iOfst = 0; rc == SQLITE_OK && iOfst < nSize; iOfst += TEENSY_MIRROR_READ_CHUNK)
+  {
+    size_t toRead = static_cast<size_t>(min(static_cast<sqlite3_int64>(TEENSY_MIRROR_READ_CHUNK), nSize - iOfst));
+
+    if (slotFile.read(&pMirror->aData[iOfst], toRead) != toRead)
+    {
+      rc = SQLITE_IOERR_READ;
+    }
+  }
+
+  if (slotFile)
+  {
+    slotFile.close();
+  }
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  pMirror->nData = nSize;
+
+  // the other slot (or the file itself, if the last checkpoint is in slot B) has unknown content
+  int iStale = 1 - pMirror->iSlot;
+  memset(pMirror->aDirty[iStale], 0xFF, static_cast<size_t>(((teensyMirrorSectorCount(pMirror->nAlloc) + 31) / 32) * sizeof(uint32_t)));
+
+  if (pMirror->eMode == TEENSY_MIRROR_WRITE_THROUGH && pMirror->iSlot == 1)
+  {
+    // switch back to a plain database file
+    TeensyFile file = TeensyStorage::open(filesystem, pMirror->zName, FILE_WRITE);
+    rc = file ? teensyMirrorFlushTo(pMirror, 0, file) : SQLITE_IOERR_WRITE;
+
+    if (file)
+    {
+      file.close();
+    }
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+
+    TeensyStorage::remove(filesystem, teensyMirrorRecordName(pMirror).c_str());
+    TeensyStorage::remove(filesystem, teensyMirrorSlotName(pMirror, 1).c_str());
+    pMirror->iSlot = 0;
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Release one handle of a mirror. The last handle of a checkpoint mirror
+** makes the image durable, before the image is freed.
+*/
+static int teensyMirrorRelease(TeensyMirror* pMirror)
+{
+  int rc = SQLITE_OK;
+
+  if (--pMirror->nRef > 0)
+  {
+    return SQLITE_OK;
+  }
+
+  if (pMirror->eMode == TEENSY_MIRROR_CHECKPOINT)
+  {
+    rc = teensyMirrorCheckpoint(pMirror);
+  }
+
+  if (pMirror->eMode != TEENSY_MIRROR_MEMORY || pMirror->bDeleted)
+  {
+    teensyMirrorFree(pMirror);
+  }
+
+  return rc;
+}
+
+/*
+** Returns the journal mirror of zName, if zName is the journal of a checkpoint
+** mirror. Rolling back such a journal from the card would mix pages into the
+** last checkpoint, therefore these journals only live in memory.
+*/
+static bool teensyIsCheckpointMirrorJournal(const char* zName, const char* zSuffix)
+{
+  size_t nName = strlen(zName);
+  size_t nSuffix = strlen(zSuffix);
+
+  if (nName <= nSuffix || strcmp(&zName[nName - nSuffix], zSuffix) != 0)
+  {
+    return false;
+  }
+
+  for (TeensyMirror* pMirror = teensyMirrorList; pMirror; pMirror = pMirror->pNext)
+  {
+    if (pMirror->eMode == TEENSY_MIRROR_CHECKPOINT &&
+        strlen(pMirror->zName) == nName - nSuffix && strncmp(pMirror->zName, zName, nName - nSuffix) == 0)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+** Batch atomic writes (URI parameter "batch_atomic", see BATCH ATOMIC WRITES
+** above). The writes between SQLITE_FCNTL_BEGIN_ATOMIC_WRITE and
+** SQLITE_FCNTL_COMMIT_ATOMIC_WRITE are staged in an EXTMEM redo log.
+*/
+#define TEENSY_BATCH_LOG_MAGIC 0x42313454 /* "T41B" */
+#define TEENSY_BATCH_HEADER_SIZE 512
+#define TEENSY_BATCH_GROWTH (64 * 1024)
+
+/*
+** Header of "<name>-batch". The log is only replayed if the CRCs of the
+** header and of the records match, so a torn write of the log is ignored.
+*/
+struct TeensyBatchHeader
+{
+  uint32_t magic;
+  uint32_t sequence;
+  uint32_t nRecord;
+  uint32_t reserved;
+  uint64_t nPayload;              /* Bytes of records following the header */
+  uint32_t payloadCrc;
+  uint32_t crc;
+};
+
+struct TeensyBatchRecord
+{
+  int64_t iOfst;
+  int32_t iAmt;                   /* Bytes of data following the record */
+  uint32_t reserved;
+};
+
+typedef struct TeensyBatch TeensyBatch;
+struct TeensyBatch
+{
+  TeensyFile logFile;             /* "<name>-batch" */
+  String logName;
+  bool bActive;                   /* Between BEGIN and COMMIT/ROLLBACK_ATOMIC_WRITE */
+  bool bLogValid;                 /* The log on disk may still be replayed */
+  uint32_t iSequence;             /* Sequence number of the last commit */
+  unsigned char* aLog;            /* Header followed by the records (EXTMEM) */
+  size_t nLog;                    /* Valid bytes of aLog */
+  size_t nAlloc;                  /* Size of aLog in bytes */
+  uint32_t nRecord;               /* Number of staged records */
+};
+
+static String teensyBatchLogName(const char* zName)
+{
+  String name = zName;
+  name.append("-batch");
+  return name;
+}
+
+static void teensyBatchReset(TeensyBatch* pBatch)
+{
+  pBatch->nLog = TEENSY_BATCH_HEADER_SIZE;
+  pBatch->nRecord = 0;
+}
+
+/*
+** Stage a write. Transactions exceeding TEENSY_41_SQLITE_BATCH_ATOMIC_MAX_SIZE
+** fail with SQLITE_IOERR_WRITE, which makes SQLite roll the batch back and
+** commit with the rollback journal instead.
+*/
+static int teensyBatchAppend(TeensyBatch* pBatch, const void* zBuf, int iAmt, sqlite3_int64 iOfst)
+{
+  if (iAmt < 0 || iOfst < 0)
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  size_t nNeeded = pBatch->nLog + sizeof(TeensyBatchRecord) + static_cast<size_t>(iAmt);
+
+  if (nNeeded > TEENSY_41_SQLITE_BATCH_ATOMIC_MAX_SIZE)
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  if (nNeeded > pBatch->nAlloc)
+  {
+    size_t nNew = (nNeeded + TEENSY_BATCH_GROWTH - 1) / TEENSY_BATCH_GROWTH * TEENSY_BATCH_GROWTH;
+    unsigned char* aNew = (unsigned char*)extmem_realloc(pBatch->aLog, nNew);
+
+    if (not aNew)
+    {
+      return SQLITE_IOERR_WRITE;
+    }
+
+    pBatch->aLog = aNew;
+    pBatch->nAlloc = nNew;
+  }
+
+  TeensyBatchRecord record;
+  memset(&record, 0, sizeof(record));
+  record.iOfst = iOfst;
+  record.iAmt = iAmt;
+  memcpy(&pBatch->aLog[pBatch->nLog], &record, sizeof(record));
+  memcpy(&pBatch->aLog[pBatch->nLog + sizeof(record)], zBuf, static_cast<size_t>(iAmt));
+  pBatch->nLog = nNeeded;
+  ++pBatch->nRecord;
+
+  return SQLITE_OK;
+}
+
+/*
+** Write the records of a log into the database file and sync it once.
+*/
+static int teensyBatchApply(const unsigned char* aPayload, size_t nPayload, uint32_t nRecord, TeensyFile& io_file)
+{
+  size_t iPos = 0;
+
+  for (uint32_t i = 0; i < nRecord; ++i)
+  {
+    TeensyBatchRecord record;
+
+    if (nPayload - iPos < sizeof(record))
+    {
+      return SQLITE_CORRUPT;
+    }
+
+    memcpy(&record, &aPayload[iPos], sizeof(record));
+    iPos += sizeof(record);
+
+    if (record.iAmt < 0 || record.iOfst < 0 || nPayload - iPos < static_cast<size_t>(record.iAmt))
+    {
+      return SQLITE_CORRUPT;
+    }
+
+    size_t toWrite = static_cast<size_t>(record.iAmt);
+
+    if (not io_file.seek(static_cast<uint64_t>(record.iOfst), SeekSet) ||
+        io_file.write(&aPayload[iPos], toWrite) != toWrite)
+    {
+      return SQLITE_IOERR_WRITE;
+    }
+
+    iPos += toWrite;
+  }
+
+  io_file.flush();
+
+  return SQLITE_OK;
+}
+
+/*
+** Overwrite the header of the log, so it is not replayed again. This has to
+** be durable before the database file is changed by anything but a batch.
+*/
+static int teensyBatchInvalidate(TeensyFile& io_logFile)
+{
+  unsigned char aSector[TEENSY_BATCH_HEADER_SIZE];
+  memset(aSector, 0, sizeof(aSector));
+
+  if (not io_logFile.seek(0, SeekSet) || io_logFile.write(aSector, sizeof(aSector)) != sizeof(aSector))
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  io_logFile.flush();
+
+  return SQLITE_OK;
+}
+
+/*
+** Called before the database file is changed outside of a batch.
+*/
+static int teensyBatchPrepareDirectChange(TeensyBatch* pBatch)
+{
+  if (not pBatch->bLogValid)
+  {
+    return SQLITE_OK;
+  }
+
+  int rc = teensyBatchInvalidate(pBatch->logFile);
+
+  if (rc == SQLITE_OK)
+  {
+    pBatch->bLogValid = false;
+  }
+
+  return rc;
+}
+
+/*
+** Make the staged writes durable:
+**
+**   1. The header and the records are written into "<name>-batch" with a
+**      single write, followed by one sync. From here on the commit survives
+**      a power loss.
+**   2. The records are applied to the database file, followed by one sync.
+**   3. The header of the log is cleared, followed by one sync. Other
+**      connections change the database file without looking at the log, a
+**      log left valid would be replayed over their commits after a power
+**      loss.
+*/
+static int teensyBatchCommit(TeensyBatch* pBatch, TeensyFile& io_file)
+{
+  pBatch->bActive = false;
+
+  if (pBatch->nRecord == 0)
+  {
+    return SQLITE_OK;
+  }
+
+  TeensyBatchHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = TEENSY_BATCH_LOG_MAGIC;
+  header.sequence = ++pBatch->iSequence;
+  header.nRecord = pBatch->nRecord;
+  header.nPayload = pBatch->nLog - TEENSY_BATCH_HEADER_SIZE;
+  header.payloadCrc = teensyCrc32(&pBatch->aLog[TEENSY_BATCH_HEADER_SIZE], static_cast<size_t>(header.nPayload));
+  header.crc = teensyCrc32(&header, offsetof(TeensyBatchHeader, crc));
+  memset(pBatch->aLog, 0, TEENSY_BATCH_HEADER_SIZE);
+  memcpy(pBatch->aLog, &header, sizeof(header));
+
+  // whatever happens from here on, the log has to be invalidated before the next journaled change
+  pBatch->bLogValid = true;
+
+  if (not pBatch->logFile.seek(0, SeekSet) ||
+      pBatch->logFile.write(pBatch->aLog, pBatch->nLog) != pBatch->nLog)
+  {
+    teensyBatchReset(pBatch);
+    return SQLITE_IOERR_WRITE;
+  }
+
+  pBatch->logFile.flush();
+
+  int rc = teensyBatchApply(&pBatch->aLog[TEENSY_BATCH_HEADER_SIZE], static_cast<size_t>(header.nPayload),
+                            header.nRecord, io_file);
+  teensyBatchReset(pBatch);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = teensyBatchPrepareDirectChange(pBatch);
+  }
+
+  return rc;
+}
+
+/*
+** Replay a valid log left behind by a power loss between step 1 and 3 of
+** teensyBatchCommit() (applying the records again is harmless).
+*/
+static int teensyBatchRecover(TeensyFile& io_logFile, TeensyFile& io_file)
+{
+  TeensyBatchHeader header;
+
+  if (not io_logFile.seek(0, SeekSet) ||
+      io_logFile.read(&header, sizeof(header)) != sizeof(header) ||
+      header.magic != TEENSY_BATCH_LOG_MAGIC ||
+      header.crc != teensyCrc32(&header, offsetof(TeensyBatchHeader, crc)) ||
+      header.nPayload > TEENSY_41_SQLITE_BATCH_ATOMIC_MAX_SIZE ||
+      io_logFile.size() < TEENSY_BATCH_HEADER_SIZE + header.nPayload)
+  {
+    return SQLITE_OK; // no (complete) log
+  }
+
+  size_t nPayload = static_cast<size_t>(header.nPayload);
+  unsigned char* aPayload = (unsigned char*)extmem_malloc(nPayload > 0 ? nPayload : 1);
+
+  if (not aPayload)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  int rc = SQLITE_OK;
+
+  if (not io_logFile.seek(TEENSY_BATCH_HEADER_SIZE, SeekSet) || io_logFile.read(aPayload, nPayload) != nPayload)
+  {
+    rc = SQLITE_IOERR_READ;
+  }
+  else if (header.payloadCrc == teensyCrc32(aPayload, nPayload))
+  {
+    rc = teensyBatchApply(aPayload, nPayload, header.nRecord, io_file);
+  }
+
+  extmem_free(aPayload);
+
+  return rc == SQLITE_OK ? teensyBatchInvalidate(io_logFile) : rc;
+}
+
+/*
+** Replay the log of a database file (if there is one), before SQLite reads
+** the file. Called for every read-write open, with or without "batch_atomic".
+*/
+static int teensyBatchRecoverFile(const char* zName, TeensyFile& io_file)
+{
+  TeensyStorage::Filesystem* filesystem = T41SQLite::getInstance().getFilesystem();
+  String logName = teensyBatchLogName(zName);
+
+  if (not TeensyStorage::exists(filesystem, logName.c_str()))
+  {
+    return SQLITE_OK;
+  }
+
+  TeensyFile logFile = TeensyStorage::open(filesystem, logName.c_str(), FILE_WRITE);
+
+  if (not logFile)
+  {
+    return SQLITE_CANTOPEN;
+  }
+
+  int rc = teensyBatchRecover(logFile, io_file);
+  logFile.close();
+
+  return rc;
+}
+
+static TeensyBatch* teensyBatchOpen(const char* zName)
+{
+  TeensyBatch* pBatch = new TeensyBatch();
+  pBatch->logName = teensyBatchLogName(zName);
+  pBatch->logFile = TeensyStorage::open(T41SQLite::getInstance().getFilesystem(), pBatch->logName.c_str(), FILE_WRITE);
+
+  if (not pBatch->logFile)
+  {
+    delete pBatch;
+    return 0;
+  }
+
+  teensyBatchReset(pBatch);
+
+  return pBatch;
+}
+
+/*
+** Invalidate the log and remove it (nothing is left to replay).
+*/
+static int teensyBatchClose(TeensyBatch* pBatch)
+{
+  int rc = teensyBatchPrepareDirectChange(pBatch);
+  pBatch->logFile.close();
+
+  if (rc == SQLITE_OK)
+  {
+    TeensyStorage::remove(T41SQLite::getInstance().getFilesystem(), pBatch->logName.c_str());
+  }
+
+  extmem_free(pBatch->aLog);
+  delete pBatch;
+
+  return rc;
+}
+
+/*
+** Compressed database files (URI parameter "compress", see COMPRESSED
+** DATABASES above). The state of a container (page index, free units, page
+** cache and the file handle) is shared by all handles opened on the same file
+** name.
+*/
+#define TEENSY_COMPRESS_MAGIC 0x5A313454        /* "T41Z" */
+#define TEENSY_COMPRESS_PAGE_MAGIC 0x50313454   /* "T41P" */
+#define TEENSY_COMPRESS_SECTOR_SIZE 512
+#define TEENSY_COMPRESS_DATA_OFFSET (2 * TEENSY_COMPRESS_SECTOR_SIZE)
+#define TEENSY_COMPRESS_UNIT TEENSY_41_SQLITE_COMPRESS_UNIT_SIZE
+#define TEENSY_COMPRESS_SCAN_CHUNK (32 * 1024)
+#define TEENSY_COMPRESS_MAX_PAGE_SIZE 65536
+#define TEENSY_COMPRESS_DEFAULT_PAGE_SIZE 4096
+#define TEENSY_COMPRESS_CODEC_RAW 0
+#define TEENSY_COMPRESS_CODEC_LZ4 1
+
+/*
+** Header of a container. It is written alternately into the first two
+** sectors, a torn write therefore only destroys the header being written.
+*/
+struct TeensyCompressHeader
+{
+  uint32_t magic;
+  uint32_t generation;
+  uint32_t pageSize;              /* 0 until the first page is written */
+  uint32_t unitSize;
+  uint64_t size;                  /* Logical size of the database file in bytes */
+  uint32_t reserved;
+  uint32_t crc;
+};
+
+/*
+** Header of a page record. It starts at a unit boundary and is followed by
+** the payload (the compressed or raw page) and zero padding up to the next
+** unit boundary.
+*/
+struct TeensyCompressRecord
+{
+  uint32_t magic;
+  uint32_t page;                  /* Page number, 0 based */
+  uint64_t sequence;              /* Write sequence number, the newest record of a page is valid */
+  uint32_t nPayload;              /* Size of the payload in bytes */
+  uint32_t codec;                 /* TEENSY_COMPRESS_CODEC_XXX */
+  uint32_t payloadChecksum;
+  uint32_t crc;                   /* CRC of the fields above */
+};
+
+typedef struct TeensyCompressSlot TeensyCompressSlot;
+struct TeensyCompressSlot
+{
+  uint32_t iUnit;                 /* First unit of the record */
+  uint32_t nUnit;                 /* Number of units of the record, 0: page not stored (zeros) */
+};
+
+typedef struct TeensyCompress TeensyCompress;
+struct TeensyCompress
+{
+  TeensyCompress* pNext;          /* Next container in teensyCompressList */
+  char* zName;                    /* Full path of the file */
+  int nRef;                       /* Number of open handles */
+  bool bReadOnly;                 /* Opened read-only */
+  TeensyFile* file;               /* Container file */
+
+  uint32_t pageSize;              /* Size of the pages in bytes (0 until known) */
+  sqlite3_int64 nSize;            /* Logical size of the database file in bytes */
+  uint32_t iGeneration;           /* Generation of the last written header */
+  bool bHeaderDirty;              /* nSize or pageSize changed since the last header */
+  uint64_t iSequence;             /* Sequence number of the next record */
+
+  TeensyCompressSlot* aSlot;      /* Location of the record of each page */
+  uint32_t nSlot;                 /* Number of entries of aSlot */
+  uint32_t* aUsed;                /* Bitmap of the units in use */
+  uint32_t nUsedAlloc;            /* Number of units aUsed can hold (multiple of 32) */
+  uint32_t nUnit;                 /* Number of units of the file */
+  uint32_t iFirstFree;            /* No unit below this one is free */
+
+  unsigned char* aRecord;         /* Record of one page (header, payload, padding) */
+  unsigned char* aPage;           /* Page of a partial write */
+  unsigned char* aCache;          /* TEENSY_41_SQLITE_COMPRESS_CACHE_PAGES decompressed pages */
+  uint32_t aCachePage[TEENSY_41_SQLITE_COMPRESS_CACHE_PAGES]; /* Page number + 1 of each cache entry, 0: empty */
+  uint32_t aCacheUse[TEENSY_41_SQLITE_COMPRESS_CACHE_PAGES];  /* Last use of each cache entry */
+  uint32_t iCacheClock;
+};
+
+static TeensyCompress* teensyCompressList = 0;
+
+// hash table of the LZ4 compressor (positions in the page)
+static uint16_t teensyLz4Table[4096];
+
+static uint32_t teensyLz4Read32(const unsigned char* a)
+{
+  uint32_t value;
+  memcpy(&value, a, sizeof(value));
+  return value;
+}
+
+static bool teensyLz4PutLength(unsigned char* aDst, int nDst, int* piDst, int nLength)
+{
+  for (; nLength >= 255; nLength -= 255)
+  {
+    if (*piDst >= nDst)
+    {
+      return false;
+    }
+
+    aDst[(*piDst)++] = 255;
+  }
+
+  if (*piDst >= nDst)
+  {
+    return false;
+  }
+
+  aDst[(*piDst)++] = static_cast<unsigned char>(nLength);
+
+  return true;
+}
+
+/*
+** Append one LZ4 sequence (literals, then a match of nMatch bytes at iOffset
+** back, or no match, if nMatch is 0) to aDst.
+*/
+static bool teensyLz4PutSequence(
+  unsigned char* aDst, int nDst, int* piDst,
+  const unsigned char* aLiteral, int nLiteral, int iOffset, int nMatch
+){
+  if (*piDst >= nDst)
+  {
+    return false;
+  }
+
+  int iToken = (*piDst)++;
+  int nMatchCode = nMatch > 0 ? nMatch - 4 : 0;
+  aDst[iToken] = static_cast<unsigned char>((min(nLiteral, 15) << 4) | min(nMatchCode, 15));
+
+  if (nLiteral >= 15 && not teensyLz4PutLength(aDst, nDst, piDst, nLiteral - 15))
+  {
+    return false;
+  }
+
+  if (*piDst + nLiteral > nDst)
+  {
+    return false;
+  }
+
+  memcpy(&aDst[*piDst], aLiteral, nLiteral);
+  *piDst += nLiteral;
+
+  if (nMatch == 0)
+  {
+    return true;
+  }
+
+  if (*piDst + 2 > nDst)
+  {
+    return false;
+  }
+
+  aDst[(*piDst)++] = static_cast<unsigned char>(iOffset & 0xFF);
+  aDst[(*piDst)++] = static_cast<unsigned char>(iOffset >> 8);
+
+  return nMatchCode < 15 || teensyLz4PutLength(aDst, nDst, piDst, nMatchCode - 15);
+}
+
+/*
+** Compress aSrc into aDst (LZ4 block format, greedy matching). Returns the
+** compressed size or 0, if it does not fit into nDst bytes.
+*/
+static int teensyLz4Compress(const unsigned char* aSrc, int nSrc, unsigned char* aDst, int nDst)
+{
+  // the last match starts 12 bytes and ends 5 bytes before the end of the input
+  int iLastMatch = nSrc - 12;
+  int iSrc = 0;
+  int iAnchor = 0;
+  int iDst = 0;
+
+  memset(teensyLz4Table, 0, sizeof(teensyLz4Table));
+
+  while (iSrc < iLastMatch)
+  {
+    uint32_t sequence = teensyLz4Read32(&aSrc[iSrc]);
+    uint32_t iHash = (sequence * 2654435761u) >> 20;
+    int iRef = teensyLz4Table[iHash];
+    teensyLz4Table[iHash] = static_cast<uint16_t>(iSrc);
+
+    if (iRef >= iSrc || iSrc - iRef > 65535 || teensyLz4Read32(&aSrc[iRef]) != sequence)
+    {
+      ++iSrc;
+      continue;
+    }
+
+    int nMatch = 4;
+    int nMaxMatch = nSrc - 5 - iSrc;
+
+    while (nMatch < nMaxMatch && aSrc[iRef + nMatch] == aSrc[iSrc + nMatch])
+    {
+      ++nMatch;
+    }
+
+    if (not teensyLz4PutSequence(aDst, nDst, &iDst, &aSrc[iAnchor], iSrc - iAnchor, iSrc - iRef, nMatch))
+    {
+      return 0;
+    }
+
+    iSrc += nMatch;
+    iAnchor = iSrc;
+  }
+
+  if (not teensyLz4PutSequence(aDst, nDst, &iDst, &aSrc[iAnchor], nSrc - iAnchor, 0, 0))
+  {
+    return 0;
+  }
+
+  return iDst;
+}
+
+static bool teensyLz4GetLength(const unsigned char* aSrc, int nSrc, int* piSrc, int* pnLength)
+{
+  unsigned char byte;
+
+  do
+  {
+    if (*piSrc >= nSrc)
+    {
+      return false;
+    }
+
+    byte = aSrc[(*piSrc)++];
+    *pnLength += byte;
+  }
+  while (byte == 255);
+
+  return true;
+}
+
+/*
+** Decompress an LZ4 block, which must decompress to exactly nDst bytes.
+*/
+static bool teensyLz4Decompress(const unsigned char* aSrc, int nSrc, unsigned char* aDst, int nDst)
+{
+  int iSrc = 0;
+  int iDst = 0;
+
+  while (iSrc < nSrc)
+  {
+    unsigned char token = aSrc[iSrc++];
+    int nLiteral = token >> 4;
+
+    if ((nLiteral == 15 && not teensyLz4GetLength(aSrc, nSrc, &iSrc, &nLiteral)) ||
+        iSrc + nLiteral > nSrc || iDst + nLiteral > nDst)
+    {
+      return false;
+    }
+
+    memcpy(&aDst[iDst], &aSrc[iSrc], nLiteral);
+    iSrc += nLiteral;
+    iDst += nLiteral;
+
+    if (iSrc == nSrc)
+    {
+      break; // the last sequence has no match
+    }
+
+    if (iSrc + 2 > nSrc)
+    {
+      return false;
+    }
+
+    int iOffset = aSrc[iSrc] | (aSrc[iSrc + 1] << 8);
+    int nMatch = token & 15;
+    iSrc += 2;
+
+    if ((nMatch == 15 && not teensyLz4GetLength(aSrc, nSrc, &iSrc, &nMatch)) ||
+        iOffset == 0 || iOffset > iDst || iDst + nMatch + 4 > nDst)
+    {
+      return false;
+    }
+
+    // the match may overlap the output
+    for (int i = 0; i < nMatch + 4; ++i, ++iDst)
+    {
+      aDst[iDst] = aDst[iDst - iOffset];
+    }
+  }
+
+  return iDst == nDst;
+}
+
+/*
+** Checksum of a payload (FNV-1a over 32 bit words, much cheaper than a CRC).
+*/
+static uint32_t teensyCompressChecksum(const unsigned char* a, uint32_t n)
+{
+  uint32_t hash = TEENSY_FNV_OFFSET;
+  uint32_t i = 0;
+
+  for (; i + 4 <= n; i += 4)
+  {
+    hash = teensyFnvStep(hash, teensyLz4Read32(&a[i]));
+  }
+
+  for (; i < n; ++i)
+  {
+    hash = teensyFnvStep(hash, a[i]);
+  }
+
+  return hash;
+}
+
+static uint32_t teensyCompressUnitCount(uint32_t nByte)
+{
+  return (nByte + TEENSY_COMPRESS_UNIT - 1) / TEENSY_COMPRESS_UNIT;
+}
+
+static bool teensyCompressIsUsed(const TeensyCompress* pCompress, uint32_t iUnit)
+{
+  return iUnit < pCompress->nUsedAlloc && (pCompress->aUsed[iUnit / 32] & (1u << (iUnit % 32)));
+}
+
+static void teensyCompressMarkUnits(TeensyCompress* pCompress, uint32_t iUnit, uint32_t nUnit, bool isUsed)
+{
+  for (uint32_t i = iUnit; i < iUnit + nUnit; ++i)
+  {
+    if (isUsed)
+    {
+      pCompress->aUsed[i / 32] |= 1u << (i % 32);
+    }
+    else
+    {
+      pCompress->aUsed[i / 32] &= ~(1u << (i % 32));
+    }
+  }
+
+  if (not isUsed && nUnit > 0)
+  {
+    pCompress->iFirstFree = min(pCompress->iFirstFree, iUnit);
+  }
+}
+
+static int teensyCompressReserveUnits(TeensyCompress* pCompress, uint32_t nUnit)
+{
+  if (nUnit <= pCompress->nUsedAlloc)
+  {
+    return SQLITE_OK;
+  }
+
+  uint32_t nAlloc = ((max(nUnit, pCompress->nUsedAlloc * 2) + 1023) / 1024) * 1024;
+  uint32_t* aUsed = (uint32_t*)extmem_realloc(pCompress->aUsed, nAlloc / 8);
+
+  if (not aUsed)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  memset(&aUsed[pCompress->nUsedAlloc / 32], 0, (nAlloc - pCompress->nUsedAlloc) / 8);
+  pCompress->aUsed = aUsed;
+  pCompress->nUsedAlloc = nAlloc;
+
+  return SQLITE_OK;
+}
+
+static int teensyCompressReserveSlots(TeensyCompress* pCompress, uint32_t nSlot)
+{
+  if (nSlot <= pCompress->nSlot)
+  {
+    return SQLITE_OK;
+  }
+
+  uint32_t nAlloc = max(nSlot, pCompress->nSlot + pCompress->nSlot / 2 + 64);
+  TeensyCompressSlot* aSlot = (TeensyCompressSlot*)extmem_realloc(pCompress->aSlot, nAlloc * sizeof(TeensyCompressSlot));
+
+  if (not aSlot)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  memset(&aSlot[pCompress->nSlot], 0, (nAlloc - pCompress->nSlot) * sizeof(TeensyCompressSlot));
+  pCompress->aSlot = aSlot;
+  pCompress->nSlot = nAlloc;
+
+  return SQLITE_OK;
+}
+
+/*
+** Find nUnit consecutive free units (first fit), possibly extending the file.
+*/
+static uint32_t teensyCompressAllocUnits(TeensyCompress* pCompress, uint32_t nUnit)
+{
+  uint32_t nRun = 0;
+  uint32_t iUnit = pCompress->iFirstFree;
+
+  while (iUnit < pCompress->nUnit)
+  {
+    if (nRun == 0 && iUnit % 32 == 0 && pCompress->aUsed[iUnit / 32] == 0xFFFFFFFF)
+    {
+      iUnit += 32;
+      continue;
+    }
+
+    if (teensyCompressIsUsed(pCompress, iUnit))
+    {
+      nRun = 0;
+    }
+    else if (++nRun == nUnit)
+    {
+      return iUnit + 1 - nUnit;
+    }
+
+    ++iUnit;
+  }
+
+  return min(iUnit, pCompress->nUnit) - nRun;
+}
+
+/*
+** Allocate the record, partial write and cache buffers for the page size.
+*/
+static int teensyCompressSetPageSize(TeensyCompress* pCompress, uint32_t pageSize)
+{
+  uint32_t nRecord = teensyCompressUnitCount(sizeof(TeensyCompressRecord) + pageSize) * TEENSY_COMPRESS_UNIT;
+
+  pCompress->pageSize = pageSize;
+  pCompress->aRecord = (unsigned char*)sqlite3_malloc64(nRecord);
+  pCompress->aPage = (unsigned char*)sqlite3_malloc64(pageSize);
+  pCompress->aCache = (unsigned char*)extmem_malloc(static_cast<size_t>(pageSize) * TEENSY_41_SQLITE_COMPRESS_CACHE_PAGES);
+
+  return pCompress->aRecord && pCompress->aPage && pCompress->aCache ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+static TeensyCompress* teensyCompressFind(const char* zName)
+{
+  for (TeensyCompress* pCompress = teensyCompressList; pCompress; pCompress = pCompress->pNext)
+  {
+    if (strcmp(pCompress->zName, zName) == 0)
+    {
+      return pCompress;
+    }
+  }
+
+  return 0;
+}
+
+static void teensyCompressFree(TeensyCompress* pCompress)
+{
+  for (TeensyCompress** pp = &teensyCompressList; *pp; pp = &(*pp)->pNext)
+  {
+    if (*pp == pCompress)
+    {
+      *pp = pCompress->pNext;
+      break;
+    }
+  }
+
+  if (pCompress->file)
+  {
+    pCompress->file->close();
+    delete pCompress->file;
+  }
+
+  extmem_free(pCompress->aSlot);
+  extmem_free(pCompress->aUsed);
+  extmem_free(pCompress->aCache);
+  sqlite3_free(pCompress->aRecord);
+  sqlite3_free(pCompress->aPage);
+  sqlite3_free(pCompress);
+}
+
+static int teensyCompressWriteHeader(TeensyCompress* pCompress)
+{
+  unsigned char aSector[TEENSY_COMPRESS_SECTOR_SIZE];
+  TeensyCompressHeader header;
+
+  memset(aSector, 0, sizeof(aSector));
+  memset(&header, 0, sizeof(header));
+  header.magic = TEENSY_COMPRESS_MAGIC;
+  header.generation = pCompress->iGeneration + 1;
+  header.pageSize = pCompress->pageSize;
+  header.unitSize = TEENSY_COMPRESS_UNIT;
+  header.size = static_cast<uint64_t>(pCompress->nSize);
+  header.crc = teensyCrc32(&header, offsetof(TeensyCompressHeader, crc));
+  memcpy(aSector, &header, sizeof(header));
+
+  // the records referenced by the header are written first
+  pCompress->file->flush();
+
+  if (not pCompress->file->seek((header.generation % 2) * TEENSY_COMPRESS_SECTOR_SIZE, SeekSet) ||
+      pCompress->file->write(aSector, sizeof(aSector)) != sizeof(aSector))
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  pCompress->file->flush();
+  pCompress->iGeneration = header.generation;
+  pCompress->bHeaderDirty = false;
+
+  return SQLITE_OK;
+}
+
+static bool teensyCompressReadHeader(TeensyFile& io_file, TeensyCompressHeader* pHeader)
+{
+  bool isValid = false;
+
+  for (int i = 0; i < 2; ++i)
+  {
+    TeensyCompressHeader header;
+
+    if (io_file.seek(i * TEENSY_COMPRESS_SECTOR_SIZE, SeekSet) &&
+        io_file.read(&header, sizeof(header)) == sizeof(header) &&
+        header.magic == TEENSY_COMPRESS_MAGIC &&
+        header.crc == teensyCrc32(&header, offsetof(TeensyCompressHeader, crc)) &&
+        (not isValid || header.generation > pHeader->generation))
+    {
+      *pHeader = header;
+      isValid = true;
+    }
+  }
+
+  return isValid;
+}
+
+/*
+** Returns true, if zName is an existing container (opened without "compress").
+*/
+static bool teensyCompressIsContainer(const char* zName)
+{
+  TeensyStorage::Filesystem* filesystem = T41SQLite::getInstance().getFilesystem();
+
+  if (not TeensyStorage::exists(filesystem, zName))
+  {
+    return false;
+  }
+
+  TeensyFile file = TeensyStorage::open(filesystem, zName, FILE_READ);
+  TeensyCompressHeader header;
+  bool isContainer = file && teensyCompressReadHeader(file, &header);
+
+  if (file)
+  {
+    file.close();
+  }
+
+  return isContainer;
+}
+
+struct TeensyCompressCandidate
+{
+  uint64_t sequence;
+  uint32_t page;
+};
+
+static int teensyCompressCompareCandidates(const void* pLeft, const void* pRight)
+{
+  uint64_t left = ((const TeensyCompressCandidate*)pLeft)->sequence;
+  uint64_t right = ((const TeensyCompressCandidate*)pRight)->sequence;
+  return left < right ? 1 : (left > right ? -1 : 0);
+}
+
+/*
+** Rebuild the page index: read the container once and take the newest valid
+** record of each page. Records of pages beyond the logical size are free
+** space. Should two chosen records overlap (a record, which was replaced,
+** but whose replacement was torn), the older one is dropped; its page was
+** being written and is restored from the journal.
+*/
+static int teensyCompressScan(TeensyCompress* pCompress)
+{
+  uint32_t pageSize = pCompress->pageSize;
+  uint32_t nPage = pageSize ? static_cast<uint32_t>((pCompress->nSize + pageSize - 1) / pageSize) : 0;
+  uint32_t nChunkUnit = TEENSY_COMPRESS_SCAN_CHUNK / TEENSY_COMPRESS_UNIT;
+
+  int rc = teensyCompressReserveUnits(pCompress, pCompress->nUnit + 1);
+  rc = rc == SQLITE_OK ? teensyCompressReserveSlots(pCompress, nPage) : rc;
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  TeensyCompressCandidate* aCandidate = (TeensyCompressCandidate*)extmem_malloc((nPage + 1) * sizeof(TeensyCompressCandidate));
+  unsigned char* aChunk = (unsigned char*)extmem_malloc(TEENSY_COMPRESS_SCAN_CHUNK);
+
+  if (not aCandidate || not aChunk)
+  {
+    extmem_free(aCandidate);
+    extmem_free(aChunk);
+    return SQLITE_NOMEM;
+  }
+
+  memset(aCandidate, 0, nPage * sizeof(TeensyCompressCandidate));
+
+  if (not pCompress->file->seek(TEENSY_COMPRESS_DATA_OFFSET, SeekSet))
+  {
+    rc = SQLITE_IOERR_READ;
+  }
+
+  for (uint32_t iChunk = 0; rc == SQLITE_OK && iChunk < pCompress->nUnit; iChunk += nChunkUnit)
+  {
+    uint32_t nUnit = min(nChunkUnit, pCompress->nUnit - iChunk);
+    size_t toRead = static_cast<size_t>(nUnit) * TEENSY_COMPRESS_UNIT;
+
+    if (pCompress->file->read(aChunk, toRead) != toRead)
+    {
+      rc = SQLITE_IOERR_READ;
+      break;
+    }
+
+    // every unit is checked, records of other pages may start inside of a replaced record
+    for (uint32_t i = 0; i < nUnit; ++i)
+    {
+      TeensyCompressRecord record;
+      memcpy(&record, &aChunk[i * TEENSY_COMPRESS_UNIT], sizeof(record));
+
+      if (record.magic != TEENSY_COMPRESS_PAGE_MAGIC ||
+          record.crc != teensyCrc32(&record, offsetof(TeensyCompressRecord, crc)))
+      {
+        continue;
+      }
+
+      // new records must be newer than all records in the file, including the stale ones
+      pCompress->iSequence = max(pCompress->iSequence, record.sequence + 1);
+
+      if (record.codec > TEENSY_COMPRESS_CODEC_LZ4 || record.nPayload == 0 || record.nPayload > pageSize)
+      {
+        continue;
+      }
+
+      uint32_t iUnit = iChunk + i;
+      uint32_t nRecordUnit = teensyCompressUnitCount(sizeof(record) + record.nPayload);
+
+      if (record.page < nPage && iUnit + nRecordUnit <= pCompress->nUnit &&
+          (aCandidate[record.page].sequence == 0 || record.sequence > aCandidate[record.page].sequence))
+      {
+        aCandidate[record.page].sequence = record.sequence;
+        aCandidate[record.page].page = record.page;
+        pCompress->aSlot[record.page].iUnit = iUnit;
+        pCompress->aSlot[record.page].nUnit = nRecordUnit;
+      }
+    }
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    qsort(aCandidate, nPage, sizeof(TeensyCompressCandidate), teensyCompressCompareCandidates);
+
+    for (uint32_t i = 0; i < nPage && aCandidate[i].sequence > 0; ++i)
+    {
+      TeensyCompressSlot* pSlot = &pCompress->aSlot[aCandidate[i].page];
+      bool isOverlapping = false;
+
+      for (uint32_t iUnit = pSlot->iUnit; iUnit < pSlot->iUnit + pSlot->nUnit && not isOverlapping; ++iUnit)
+      {
+        isOverlapping = teensyCompressIsUsed(pCompress, iUnit);
+      }
+
+      if (isOverlapping)
+      {
+        pSlot->nUnit = 0;
+      }
+      else
+      {
+        teensyCompressMarkUnits(pCompress, pSlot->iUnit, pSlot->nUnit, true);
+      }
+    }
+  }
+
+  extmem_free(aCandidate);
+  extmem_free(aChunk);
+
+  return rc;
+}
+
+/*
+** Open the container zName (a new one, if the file is empty).
+*/
+static int teensyCompressOpen(const char* zName, bool isReadOnly, TeensyCompress** ppCompress)
+{
+  size_t nName = strlen(zName);
+  TeensyCompress* pCompress = (TeensyCompress*)sqlite3_malloc64(sizeof(TeensyCompress) + nName + 1);
+
+  if (not pCompress)
+  {
+    return SQLITE_NOMEM;
+  }
+
+  memset(pCompress, 0, sizeof(TeensyCompress));
+  pCompress->zName = (char*)&pCompress[1];
+  memcpy(pCompress->zName, zName, nName + 1);
+  pCompress->nRef = 1;
+  pCompress->bReadOnly = isReadOnly;
+  pCompress->iSequence = 1;
+  pCompress->file = new TeensyFile(TeensyStorage::open(T41SQLite::getInstance().getFilesystem(), zName, isReadOnly ? FILE_READ : FILE_WRITE));
+
+  int rc = SQLITE_OK;
+  uint64_t nFile = *pCompress->file ? pCompress->file->size() : 0;
+  TeensyCompressHeader header;
+
+  if (not *pCompress->file)
+  {
+    rc = SQLITE_CANTOPEN;
+  }
+  else if (nFile == 0 && not isReadOnly)
+  {
+    unsigned char aZero[TEENSY_COMPRESS_DATA_OFFSET];
+    memset(aZero, 0, sizeof(aZero));
+    rc = pCompress->file->write(aZero, sizeof(aZero)) == sizeof(aZero) ? teensyCompressWriteHeader(pCompress) : SQLITE_IOERR_WRITE;
+  }
+  else if (not teensyCompressReadHeader(*pCompress->file, &header) || header.unitSize != TEENSY_COMPRESS_UNIT ||
+           header.pageSize > TEENSY_COMPRESS_MAX_PAGE_SIZE || (header.size > 0 && header.pageSize == 0))
+  {
+    // a plain database file or a container of another unit size
+    rc = SQLITE_CANTOPEN;
+  }
+  else
+  {
+    pCompress->iGeneration = header.generation;
+    pCompress->nSize = static_cast<sqlite3_int64>(header.size);
+    pCompress->nUnit = nFile > TEENSY_COMPRESS_DATA_OFFSET ? static_cast<uint32_t>((nFile - TEENSY_COMPRESS_DATA_OFFSET) / TEENSY_COMPRESS_UNIT) : 0;
+    rc = header.pageSize ? teensyCompressSetPageSize(pCompress, header.pageSize) : SQLITE_OK;
+    rc = rc == SQLITE_OK ? teensyCompressScan(pCompress) : rc;
+  }
+
+  if (rc != SQLITE_OK)
+  {
+    teensyCompressFree(pCompress);
+    return rc;
+  }
+
+  pCompress->pNext = teensyCompressList;
+  teensyCompressList = pCompress;
+  *ppCompress = pCompress;
+
+  return SQLITE_OK;
+}
+
+/*
+** Returns the decompressed page iPage (from the cache, if possible).
+*/
+static int teensyCompressReadPage(TeensyCompress* pCompress, uint32_t iPage, const unsigned char** ppPage)
+{
+  int iEntry = 0;
+
+  for (int i = 0; i < TEENSY_41_SQLITE_COMPRESS_CACHE_PAGES; ++i)
+  {
+    if (pCompress->aCachePage[i] == iPage + 1)
+    {
+      pCompress->aCacheUse[i] = ++pCompress->iCacheClock;
+      *ppPage = &pCompress->aCache[static_cast<size_t>(i) * pCompress->pageSize];
+      return SQLITE_OK;
+    }
+
+    if (pCompress->aCacheUse[i] < pCompress->aCacheUse[iEntry])
+    {
+      iEntry = i;
+    }
+  }
+
+  unsigned char* aPage = &pCompress->aCache[static_cast<size_t>(iEntry) * pCompress->pageSize];
+  TeensyCompressSlot slot = iPage < pCompress->nSlot ? pCompress->aSlot[iPage] : TeensyCompressSlot{ 0, 0 };
+  pCompress->aCachePage[iEntry] = 0;
+
+  if (slot.nUnit == 0)
+  {
+    memset(aPage, 0, pCompress->pageSize);
+  }
+  else
+  {
+    size_t toRead = static_cast<size_t>(slot.nUnit) * TEENSY_COMPRESS_UNIT;
+
+    if (not pCompress->file->seek(TEENSY_COMPRESS_DATA_OFFSET + static_cast<uint64_t>(slot.iUnit) * TEENSY_COMPRESS_UNIT, SeekSet) ||
+        pCompress->file->read(pCompress->aRecord, toRead) != toRead)
+    {
+      return SQLITE_IOERR_READ;
+    }
+
+    TeensyCompressRecord record;
+    memcpy(&record, pCompress->aRecord, sizeof(record));
+    const unsigned char* aPayload = &pCompress->aRecord[sizeof(record)];
+
+    if (record.magic != TEENSY_COMPRESS_PAGE_MAGIC || record.page != iPage ||
+        record.crc != teensyCrc32(&record, offsetof(TeensyCompressRecord, crc)) ||
+        sizeof(record) + record.nPayload > toRead ||
+        record.payloadChecksum != teensyCompressChecksum(aPayload, record.nPayload))
+    {
+      return SQLITE_CORRUPT;
+    }
+
+    if (record.codec == TEENSY_COMPRESS_CODEC_RAW && record.nPayload == pCompress->pageSize)
+    {
+      memcpy(aPage, aPayload, pCompress->pageSize);
+    }
+    else if (record.codec != TEENSY_COMPRESS_CODEC_LZ4 ||
+             not teensyLz4Decompress(aPayload, static_cast<int>(record.nPayload), aPage, static_cast<int>(pCompress->pageSize)))
+    {
+      return SQLITE_CORRUPT;
+    }
+  }
+
+  pCompress->aCachePage[iEntry] = iPage + 1;
+  pCompress->aCacheUse[iEntry] = ++pCompress->iCacheClock;
+  *ppPage = aPage;
+
+  return SQLITE_OK;
+}
+
+/*
+** Compress page iPage and write its record: in place, if it fits the units of
+** the previous record, otherwise into the first free run of units.
+*/
+static int teensyCompressWritePage(TeensyCompress* pCompress, uint32_t iPage, const unsigned char* aData)
+{
+  TeensyCompressRecord record;
+  unsigned char* aPayload = &pCompress->aRecord[sizeof(record)];
+  int pageSize = static_cast<int>(pCompress->pageSize);
+  int nPayload = teensyLz4Compress(aData, pageSize, aPayload, pageSize - 1);
+
+  memset(&record, 0, sizeof(record));
+  record.codec = TEENSY_COMPRESS_CODEC_LZ4;
+
+  if (nPayload == 0)
+  {
+    memcpy(aPayload, aData, pageSize);
+    nPayload = pageSize;
+    record.codec = TEENSY_COMPRESS_CODEC_RAW;
+  }
+
+  uint32_t nUnit = teensyCompressUnitCount(sizeof(record) + nPayload);
+  memset(&aPayload[nPayload], 0, nUnit * TEENSY_COMPRESS_UNIT - sizeof(record) - nPayload);
+
+  record.magic = TEENSY_COMPRESS_PAGE_MAGIC;
+  record.page = iPage;
+  record.sequence = pCompress->iSequence++;
+  record.nPayload = static_cast<uint32_t>(nPayload);
+  record.payloadChecksum = teensyCompressChecksum(aPayload, record.nPayload);
+  record.crc = teensyCrc32(&record, offsetof(TeensyCompressRecord, crc));
+  memcpy(pCompress->aRecord, &record, sizeof(record));
+
+  int rc = teensyCompressReserveSlots(pCompress, iPage + 1);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  TeensyCompressSlot* pSlot = &pCompress->aSlot[iPage];
+  uint32_t iUnit;
+
+  if (pSlot->nUnit >= nUnit)
+  {
+    iUnit = pSlot->iUnit;
+    teensyCompressMarkUnits(pCompress, iUnit + nUnit, pSlot->nUnit - nUnit, false);
+  }
+  else
+  {
+    teensyCompressMarkUnits(pCompress, pSlot->iUnit, pSlot->nUnit, false);
+    iUnit = teensyCompressAllocUnits(pCompress, nUnit);
+  }
+
+  rc = teensyCompressReserveUnits(pCompress, iUnit + nUnit);
+
+  if (rc != SQLITE_OK)
+  {
+    pSlot->nUnit = 0;
+    return rc;
+  }
+
+  teensyCompressMarkUnits(pCompress, iUnit, nUnit, true);
+  pSlot->iUnit = iUnit;
+  pSlot->nUnit = nUnit;
+  pCompress->nUnit = max(pCompress->nUnit, iUnit + nUnit);
+
+  while (pCompress->iFirstFree < pCompress->nUnit && teensyCompressIsUsed(pCompress, pCompress->iFirstFree))
+  {
+    ++pCompress->iFirstFree;
+  }
+
+  size_t toWrite = static_cast<size_t>(nUnit) * TEENSY_COMPRESS_UNIT;
+
+  if (not pCompress->file->seek(TEENSY_COMPRESS_DATA_OFFSET + static_cast<uint64_t>(iUnit) * TEENSY_COMPRESS_UNIT, SeekSet) ||
+      pCompress->file->write(pCompress->aRecord, toWrite) != toWrite)
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  for (int i = 0; i < TEENSY_41_SQLITE_COMPRESS_CACHE_PAGES; ++i)
+  {
+    if (pCompress->aCachePage[i] == iPage + 1 && &pCompress->aCache[static_cast<size_t>(i) * pageSize] != aData)
+    {
+      memcpy(&pCompress->aCache[static_cast<size_t>(i) * pageSize], aData, pageSize);
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+static int teensyCompressRead(TeensyCompress* pCompress, void* zBuf, int iAmt, sqlite3_int64 iOfst)
+{
+  if (iAmt < 0 || iOfst < 0)
+  {
+    return SQLITE_IOERR_READ;
+  }
+
+  unsigned char* z = (unsigned char*)zBuf;
+  sqlite3_int64 nRead = max(static_cast<sqlite3_int64>(0), min(static_cast<sqlite3_int64>(iAmt), pCompress->nSize - iOfst));
+
+  for (sqlite3_int64 i = 0; i < nRead;)
+  {
+    uint32_t iPage = static_cast<uint32_t>((iOfst + i) / pCompress->pageSize);
+    uint32_t iInPage = static_cast<uint32_t>((iOfst + i) % pCompress->pageSize);
+    sqlite3_int64 nCopy = min(nRead - i, static_cast<sqlite3_int64>(pCompress->pageSize - iInPage));
+    const unsigned char* aPage;
+    int rc = teensyCompressReadPage(pCompress, iPage, &aPage);
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+
+    memcpy(&z[i], &aPage[iInPage], static_cast<size_t>(nCopy));
+    i += nCopy;
+  }
+
+  if (nRead < iAmt)
+  {
+    memset(&z[nRead], 0, static_cast<size_t>(iAmt - nRead));
+    return SQLITE_IOERR_SHORT_READ;
+  }
+
+  return SQLITE_OK;
+}
+
+static int teensyCompressWrite(TeensyCompress* pCompress, const void* zBuf, int iAmt, sqlite3_int64 iOfst)
+{
+  if (pCompress->bReadOnly)
+  {
+    return SQLITE_READONLY;
+  }
+
+  if (iAmt < 0 || iOfst < 0)
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  if (pCompress->pageSize == 0)
+  {
+    // SQLite writes whole pages, the first write tells the page size
+    bool isPageWrite = iAmt >= 512 && iAmt <= TEENSY_COMPRESS_MAX_PAGE_SIZE && (iAmt & (iAmt - 1)) == 0 && iOfst % iAmt == 0;
+    int rc = teensyCompressSetPageSize(pCompress, isPageWrite ? static_cast<uint32_t>(iAmt) : TEENSY_COMPRESS_DEFAULT_PAGE_SIZE);
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+
+    pCompress->bHeaderDirty = true;
+  }
+
+  const unsigned char* z = (const unsigned char*)zBuf;
+
+  for (int i = 0; i < iAmt;)
+  {
+    uint32_t iPage = static_cast<uint32_t>((iOfst + i) / pCompress->pageSize);
+    uint32_t iInPage = static_cast<uint32_t>((iOfst + i) % pCompress->pageSize);
+    int nCopy = min(iAmt - i, static_cast<int>(pCompress->pageSize - iInPage));
+    int rc;
+
+    if (nCopy == static_cast<int>(pCompress->pageSize))
+    {
+      rc = teensyCompressWritePage(pCompress, iPage, &z[i]);
+    }
+    else
+    {
+      const unsigned char* aPage;
+      rc = teensyCompressReadPage(pCompress, iPage, &aPage);
+
+      if (rc == SQLITE_OK)
+      {
+        memcpy(pCompress->aPage, aPage, pCompress->pageSize);
+        memcpy(&pCompress->aPage[iInPage], &z[i], nCopy);
+        rc = teensyCompressWritePage(pCompress, iPage, pCompress->aPage);
+      }
+    }
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+
+    i += nCopy;
+  }
+
+  if (iOfst + iAmt > pCompress->nSize)
+  {
+    pCompress->nSize = iOfst + iAmt;
+    pCompress->bHeaderDirty = true;
+  }
+
+  return SQLITE_OK;
+}
+
+static int teensyCompressTruncate(TeensyCompress* pCompress, sqlite3_int64 size)
+{
+  if (size >= pCompress->nSize)
+  {
+    return SQLITE_OK;
+  }
+
+  if (pCompress->bReadOnly)
+  {
+    return SQLITE_IOERR_TRUNCATE;
+  }
+
+  pCompress->nSize = size;
+  pCompress->bHeaderDirty = true;
+
+  uint32_t nPage = static_cast<uint32_t>((size + pCompress->pageSize - 1) / pCompress->pageSize);
+
+  for (uint32_t iPage = nPage; iPage < pCompress->nSlot; ++iPage)
+  {
+    teensyCompressMarkUnits(pCompress, pCompress->aSlot[iPage].iUnit, pCompress->aSlot[iPage].nUnit, false);
+    pCompress->aSlot[iPage].nUnit = 0;
+  }
+
+  for (int i = 0; i < TEENSY_41_SQLITE_COMPRESS_CACHE_PAGES; ++i)
+  {
+    if (pCompress->aCachePage[i] > nPage)
+    {
+      pCompress->aCachePage[i] = 0;
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Cut free units from the end of the file and write the header, if the
+** logical size changed.
+*/
+static int teensyCompressSync(TeensyCompress* pCompress)
+{
+  if (pCompress->bReadOnly)
+  {
+    return SQLITE_OK;
+  }
+
+  while (pCompress->nUnit > 0 && not teensyCompressIsUsed(pCompress, pCompress->nUnit - 1))
+  {
+    --pCompress->nUnit;
+  }
+
+  uint64_t nFile = TEENSY_COMPRESS_DATA_OFFSET + static_cast<uint64_t>(pCompress->nUnit) * TEENSY_COMPRESS_UNIT;
+
+  if (pCompress->file->size() > nFile && not pCompress->file->truncate(nFile))
+  {
+    return SQLITE_IOERR_TRUNCATE;
+  }
+
+  if (pCompress->bHeaderDirty)
+  {
+    return teensyCompressWriteHeader(pCompress);
+  }
+
+  pCompress->file->flush();
+
+  return SQLITE_OK;
+}
+
+/*
+** Release one handle of a container. The last handle writes the header.
+*/
+static int teensyCompressRelease(TeensyCompress* pCompress)
+{
+  if (--pCompress->nRef > 0)
+  {
+    return SQLITE_OK;
+  }
+
+  int rc = teensyCompressSync(pCompress);
+  teensyCompressFree(pCompress);
+
+  return rc;
+}
+
+/*
+** Shared memory of WAL databases (see WAL MODE above). The wal-index lives in
+** EXTMEM regions, which are shared by all connections of this process to the
+** same database. There is no "-shm" file.
+*/
+typedef struct TeensyShm TeensyShm;
+struct TeensyShm
+{
+  TeensyShm* pNext;               /* Next region list in teensyShmList */
+  char* zName;                    /* Full path of the database file */
+  int nRef;                       /* Number of mapping connections */
+  int szRegion;                   /* Size of each region in bytes */
+  int nRegion;                    /* Number of regions in apRegion */
+  unsigned char** apRegion;       /* Regions (EXTMEM) */
+  int aLock[SQLITE_SHM_NLOCK];    /* Number of shared locks or -1 for an exclusive lock */
+};
+
+static TeensyShm* teensyShmList = 0;
+
+/*
+** Open WAL files. The WAL write buffer of one connection has to be flushed
+** before another connection reads the frames it references (with
+** "PRAGMA synchronous=NORMAL" commits do not call xSync on the WAL).
+*/
+static TeensyVFSFile* teensyWalList = 0;
+
+static int teensyFlushWalBuffers()
+{
+  for (TeensyVFSFile* pWal = teensyWalList; pWal; pWal = pWal->pNextWal)
+  {
+    int rc = teensyFlushBuffer(pWal);
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+static TeensyShm* teensyShmAcquire(const char* zName)
+{
+  for (TeensyShm* pShm = teensyShmList; pShm; pShm = pShm->pNext)
+  {
+    if (strcmp(pShm->zName, zName) == 0)
+    {
+      ++pShm->nRef;
+      return pShm;
+    }
+  }
+
+  size_t nName = strlen(zName);
+  TeensyShm* pShm = (TeensyShm*)sqlite3_malloc64(sizeof(TeensyShm) + nName + 1);
+
+  if (not pShm)
+  {
+    return 0;
+  }
+
+  memset(pShm, 0, sizeof(TeensyShm));
+  pShm->zName = (char*)&pShm[1];
+  memcpy(pShm->zName, zName, nName + 1);
+  pShm->nRef = 1;
+  pShm->pNext = teensyShmList;
+  teensyShmList = pShm;
+
+  return pShm;
+}
+
+/*
+** Drop the locks and the reference of a connection to its wal-index.
+*/
+static void teensyShmRelease(TeensyVFSFile* p)
+{
+  TeensyShm* pShm = p->pShm;
+  p->pShm = 0;
+
+  for (int i = 0; i < SQLITE_SHM_NLOCK; ++i)
+  {
+    if (p->shmExclMask & (1 << i))
+    {
+      pShm->aLock[i] = 0;
+    }
+    else if (p->shmSharedMask & (1 << i))
+    {
+      --pShm->aLock[i];
+    }
+  }
+
+  p->shmExclMask = 0;
+  p->shmSharedMask = 0;
+
+  if (--pShm->nRef > 0)
+  {
+    return;
+  }
+
+  for (TeensyShm** pp = &teensyShmList; *pp; pp = &(*pp)->pNext)
+  {
+    if (*pp == pShm)
+    {
+      *pp = pShm->pNext;
+      break;
+    }
+  }
+
+  for (int i = 0; i < pShm->nRegion; ++i)
+  {
+    extmem_free(pShm->apRegion[i]);
+  }
+
+  sqlite3_free(pShm->apRegion);
+  sqlite3_free(pShm);
+}
+
+/*
+** Read data from the file of a handle (not a memory image, mirror or container).
+*/
+static int teensyReadFile(TeensyVFSFile* p, void* zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  /* Flush any data in the write buffer to disk in case this operation
+  ** is trying to read data the file-region currently cached in the buffer.
+  ** It would be possible to detect this case and possibly save an 
+  ** unnecessary write here, but in practice SQLite will rarely read from
+  ** a journal file when there is data cached in the write-buffer.
+  ** WAL files are shared by the connections, so all of their buffers are flushed.
+  */
+  int rc = (p->flags & SQLITE_OPEN_WAL) ? teensyFlushWalBuffers() : teensyFlushBuffer(p);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+  
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_FILE_SIZE ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->teensyFile->size());
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_CUR ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->teensyFile->position());
+
+  uint64_t seekPosition = min(static_cast<uint64_t>(iOfst), p->teensyFile->size());
+  if (not p->teensyFile->seek(seekPosition, SeekSet))
+  {
+    TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ_SEEK_FAIL");
+    return SQLITE_IOERR_READ;
+  }
+
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_CUR_AFTER_SEEK ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->teensyFile->position());
+
+  size_t toRead = static_cast<size_t>(iAmt);
+  size_t nRead = p->teensyFile->read(zBuf, toRead);
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_FILE_READ_RETURN_VALUE ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(nRead);
+
+  if (nRead == toRead)
+  {
+    TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - END (OK)");
+
+    return SQLITE_OK;
+  }
+  else if (nRead >= 0)
+  {
+    if (nRead < toRead)
+    {
+      memset(&((char*)zBuf)[nRead], 0, toRead - nRead);
+    }
+
+    TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - END (SQLITE_IOERR_SHORT_READ)");
+
+    return SQLITE_IOERR_SHORT_READ; // ok
+  }
+  
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - END (ERROR)");
+
+  return SQLITE_IOERR_READ; // nRead < 0 --> call to p->teensyFile->read(zBuf, iAmt) failed
+}
+
+/*
+** Write data to the file of a handle through its batch or its write buffer.
+*/
+static int teensyWriteFile(TeensyVFSFile* p, const void* zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  if (p->pBatch)
+  {
+    if (p->pBatch->bActive)
+    {
+      return teensyBatchAppend(p->pBatch, zBuf, iAmt, iOfst);
+    }
+
+    int rc = teensyBatchPrepareDirectChange(p->pBatch);
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+  }
+  
+  if (p->aBuffer)
+  {
+    char *z = (char *)zBuf;       /* Pointer to remaining data to write */
+    int n = iAmt;                 /* Number of bytes at z */
+    sqlite3_int64 i = iOfst;      /* File offset to write to */
+
+    while (n > 0)
+    {
+      int nCopy;                  /* Number of bytes to copy into buffer */
+
+      /* If the buffer is full, or if this data is not being written directly
+      ** following the data already buffered, flush the buffer. Flushing
+      ** the buffer is a no-op if it is empty.  
+      */
+      if (p->nBuffer == SQLITE_VFS_JOURNAL_BUFFERSZ ||
+          p->iBufferOfst + p->nBuffer != i)
+      {
+        int rc = teensyFlushBuffer(p);
+        if (rc != SQLITE_OK)
+        {
+          return rc;
+        }
+      }
+
+      assert(p->nBuffer == 0 || p->iBufferOfst + p->nBuffer == i);
+      p->iBufferOfst = i - p->nBuffer;
+
+      /* Copy as much data as possible into the buffer. */
+      nCopy = SQLITE_VFS_JOURNAL_BUFFERSZ - p->nBuffer;
+      if (nCopy > n)
+      {
+        nCopy = n;
+      }
+      memcpy(&p->aBuffer[p->nBuffer], z, nCopy);
+      p->nBuffer += nCopy;
+
+      n -= nCopy;
+      i += nCopy;
+      z += nCopy;
+    }
+  }
+  else
+  {
+    return teensyDirectWrite(p, zBuf, iAmt, iOfst);
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Encrypted database files (see ENCRYPTED DATABASES above). The state is
+** shared by all handles of a database and by the handles of its rollback
+** journal.
+*/
+typedef struct TeensyCrypt TeensyCrypt;
+struct TeensyCrypt
+{
+  TeensyCrypt* pNext;             /* Next entry of teensyCryptList */
+  char* zName;                    /* Full path of the database file */
+  int nRef;                       /* Number of handles (databases and journals) */
+  T41SQLiteCipher* pCipher;       /* Backend, T41SQLite::getCipher() at the first open */
+  uint32_t pageSize;              /* Page size, 0 until the header was read or written */
+  uint32_t nReserve;              /* Reserved bytes at the end of each page */
+  unsigned char* aPage;           /* Page buffer (pageSize bytes) */
+};
+
+static TeensyCrypt* teensyCryptList = 0;
+
+/*
+** Returns the state of the encrypted database, whose name is zName without
+** zSuffix ("" for the database itself, "-journal" or "-wal").
+*/
+static TeensyCrypt* teensyCryptFind(const char* zName, const char* zSuffix)
+{
+  size_t nName = strlen(zName);
+  size_t nSuffix = strlen(zSuffix);
+
+  if (nName <= nSuffix || strcmp(&zName[nName - nSuffix], zSuffix) != 0)
+  {
+    return 0;
+  }
+
+  for (TeensyCrypt* pCrypt = teensyCryptList; pCrypt; pCrypt = pCrypt->pNext)
+  {
+    if (strlen(pCrypt->zName) == nName - nSuffix && strncmp(pCrypt->zName, zName, nName - nSuffix) == 0)
+    {
+      return pCrypt;
+    }
+  }
+
+  return 0;
+}
+
+static TeensyCrypt* teensyCryptAcquire(const char* zName, T41SQLiteCipher* pCipher)
+{
+  TeensyCrypt* pCrypt = teensyCryptFind(zName, "");
+
+  if (pCrypt)
+  {
+    ++pCrypt->nRef;
+    return pCrypt;
+  }
+
+  size_t nName = strlen(zName);
+  pCrypt = (TeensyCrypt*)sqlite3_malloc64(sizeof(TeensyCrypt) + nName + 1);
+
+  if (not pCrypt)
+  {
+    return 0;
+  }
+
+  memset(pCrypt, 0, sizeof(TeensyCrypt));
+  pCrypt->zName = (char*)&pCrypt[1];
+  memcpy(pCrypt->zName, zName, nName + 1);
+  pCrypt->nRef = 1;
+  pCrypt->pCipher = pCipher;
+  pCrypt->pNext = teensyCryptList;
+  teensyCryptList = pCrypt;
+
+  return pCrypt;
+}
+
+static void teensyCryptRelease(TeensyCrypt* pCrypt)
+{
+  if (--pCrypt->nRef > 0)
+  {
+    return;
+  }
+
+  for (TeensyCrypt** pp = &teensyCryptList; *pp; pp = &(*pp)->pNext)
+  {
+    if (*pp == pCrypt)
+    {
+      *pp = pCrypt->pNext;
+      break;
+    }
+  }
+
+  sqlite3_free(pCrypt->aPage);
+  sqlite3_free(pCrypt);
+}
+
+/*
+** Take the page size and the number of reserved bytes from the first 24
+** bytes of the database header (stored in plain text).
+*/
+static int teensyCryptSetPageSize(TeensyCrypt* pCrypt, const unsigned char* aHeader)
+{
+  uint32_t pageSize = (static_cast<uint32_t>(aHeader[16]) << 8) | aHeader[17];
+  pageSize = pageSize == 1 ? 65536 : pageSize;
+
+  if (pageSize < 512 || pageSize > 65536 || (pageSize & (pageSize - 1)) != 0)
+  {
+    return SQLITE_NOTADB;
+  }
+
+  if (aHeader[20] < T41SQLiteCipher::NONCE_SIZE)
+  {
+    sqlite3_log(SQLITE_NOTADB, "T41_VFS: %s has no reserved bytes for nonces (see T41SQLite::prepareEncryption)",
+                pCrypt->zName);
+    return SQLITE_NOTADB;
+  }
+
+  if (pageSize != pCrypt->pageSize)
+  {
+    unsigned char* aPage = (unsigned char*)sqlite3_realloc64(pCrypt->aPage, pageSize);
+
+    if (not aPage)
+    {
+      return SQLITE_NOMEM;
+    }
+
+    pCrypt->aPage = aPage;
+    pCrypt->pageSize = pageSize;
+  }
+
+  pCrypt->nReserve = aHeader[20];
+
+  return SQLITE_OK;
+}
+
+/*
+** Encrypt or decrypt a page with the nonce in its last NONCE_SIZE bytes. The
+** first 24 bytes of the database header stay in plain text.
+*/
+static int teensyCryptPage(TeensyCrypt* pCrypt, unsigned char* aPage, bool isHeaderPage)
+{
+  size_t nData = pCrypt->pageSize - T41SQLiteCipher::NONCE_SIZE;
+  unsigned char aHeader[24];
+
+  if (isHeaderPage)
+  {
+    memcpy(aHeader, aPage, sizeof(aHeader));
+  }
+
+  int rc = pCrypt->pCipher->crypt(&aPage[nData], aPage, nData);
+
+  if (isHeaderPage)
+  {
+    memcpy(aPage, aHeader, sizeof(aHeader));
+  }
+
+  return rc == SQLITE_OK ? SQLITE_OK : SQLITE_IOERR;
+}
+
+/*
+** Page images in a rollback journal follow the 4 byte page number of their
+** record, journal headers start at sector boundaries (multiples of 32).
+*/
+static bool teensyCryptIsJournalPage(const TeensyCrypt* pCrypt, int iAmt, sqlite_int64 iOfst)
+{
+  return pCrypt->pageSize > 0 && static_cast<uint32_t>(iAmt) == pCrypt->pageSize && iOfst % 8 == 4;
+}
+
+/*
+** Read and decrypt page iPage of a database file into aPage. A page beyond
+** the end of the file is zero filled (SQLITE_IOERR_SHORT_READ).
+*/
+static int teensyCryptReadPage(TeensyVFSFile* p, uint32_t iPage, unsigned char* aPage)
+{
+  TeensyCrypt* pCrypt = p->pCrypt;
+  int rc = teensyReadFile(p, aPage, static_cast<int>(pCrypt->pageSize),
+                          static_cast<sqlite_int64>(iPage) * pCrypt->pageSize);
+
+  if (rc == SQLITE_IOERR_SHORT_READ)
+  {
+    memset(aPage, 0, pCrypt->pageSize);
+    return rc;
+  }
+
+  return rc == SQLITE_OK ? teensyCryptPage(pCrypt, aPage, iPage == 0) : rc;
+}
+
+static int teensyCryptRead(TeensyVFSFile* p, void* zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  TeensyCrypt* pCrypt = p->pCrypt;
+
+  if (p->flags & SQLITE_OPEN_MAIN_JOURNAL)
+  {
+    int rc = teensyReadFile(p, zBuf, iAmt, iOfst);
+
+    if (rc == SQLITE_OK && teensyCryptIsJournalPage(pCrypt, iAmt, iOfst))
+    {
+      rc = teensyCryptPage(pCrypt, (unsigned char*)zBuf, false);
+    }
+
+    return rc;
+  }
+
+  if (pCrypt->pageSize == 0)
+  {
+    unsigned char aHeader[24];
+    int rc = teensyReadFile(p, aHeader, sizeof(aHeader), 0);
+
+    if (rc == SQLITE_IOERR_SHORT_READ)
+    {
+      // new database, nothing to decrypt yet
+      return teensyReadFile(p, zBuf, iAmt, iOfst);
+    }
+
+    rc = rc == SQLITE_OK ? teensyCryptSetPageSize(pCrypt, aHeader) : rc;
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+  }
+
+  unsigned char* z = (unsigned char*)zBuf;
+  int rcRead = SQLITE_OK;
+
+  while (iAmt > 0)
+  {
+    uint32_t iPage = static_cast<uint32_t>(iOfst / pCrypt->pageSize);
+    uint32_t iInPage = static_cast<uint32_t>(iOfst % pCrypt->pageSize);
+    int nCopy = static_cast<int>(min(static_cast<uint32_t>(iAmt), pCrypt->pageSize - iInPage));
+    int rc;
+
+    if (nCopy == static_cast<int>(pCrypt->pageSize))
+    {
+      rc = teensyCryptReadPage(p, iPage, z);
+    }
+    else
+    {
+      rc = teensyCryptReadPage(p, iPage, pCrypt->aPage);
+      memcpy(z, &pCrypt->aPage[iInPage], nCopy);
+    }
+
+    if (rc == SQLITE_IOERR_SHORT_READ)
+    {
+      rcRead = rc;
+    }
+    else if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+
+    z += nCopy;
+    iAmt -= nCopy;
+    iOfst += nCopy;
+  }
+
+  return rcRead;
+}
+
+/*
+** Every page is written with a new nonce. Page images in the journal get
+** their own nonce as well: SQLite keeps the reserved bytes of a page in its
+** cache, so they do not hold the nonce of the latest write. The journal
+** checksum does not cover the last 200 bytes of a page, so it still matches.
+*/
+static int teensyCryptWrite(TeensyVFSFile* p, const void* zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  TeensyCrypt* pCrypt = p->pCrypt;
+  uint32_t nData = pCrypt->pageSize - T41SQLiteCipher::NONCE_SIZE;
+
+  if (p->flags & SQLITE_OPEN_MAIN_JOURNAL)
+  {
+    if (not teensyCryptIsJournalPage(pCrypt, iAmt, iOfst))
+    {
+      return teensyWriteFile(p, zBuf, iAmt, iOfst);
+    }
+
+    memcpy(pCrypt->aPage, zBuf, pCrypt->pageSize);
+    pCrypt->pCipher->generateNonce(&pCrypt->aPage[nData]);
+    int rc = teensyCryptPage(pCrypt, pCrypt->aPage, false);
+
+    return rc == SQLITE_OK ? teensyWriteFile(p, pCrypt->aPage, iAmt, iOfst) : rc;
+  }
+
+  if (iOfst == 0 && iAmt >= 24)
+  {
+    // the header is written with page 1, it may change the page size (VACUUM)
+    int rc = teensyCryptSetPageSize(pCrypt, (const unsigned char*)zBuf);
+
+    if (rc != SQLITE_OK)
+    {
+      return rc == SQLITE_NOMEM ? rc : SQLITE_IOERR_WRITE;
+    }
+
+    nData = pCrypt->pageSize - T41SQLiteCipher::NONCE_SIZE;
+  }
+
+  if (pCrypt->pageSize == 0)
+  {
+    return SQLITE_IOERR_WRITE;
+  }
+
+  const unsigned char* z = (const unsigned char*)zBuf;
+
+  while (iAmt > 0)
+  {
+    uint32_t iPage = static_cast<uint32_t>(iOfst / pCrypt->pageSize);
+    uint32_t iInPage = static_cast<uint32_t>(iOfst % pCrypt->pageSize);
+    int nCopy = static_cast<int>(min(static_cast<uint32_t>(iAmt), pCrypt->pageSize - iInPage));
+
+    if (nCopy != static_cast<int>(pCrypt->pageSize))
+    {
+      int rc = teensyCryptReadPage(p, iPage, pCrypt->aPage);
+
+      if (rc != SQLITE_OK && rc != SQLITE_IOERR_SHORT_READ)
+      {
+        return rc;
+      }
+    }
+
+    memcpy(&pCrypt->aPage[iInPage], z, nCopy);
+    pCrypt->pCipher->generateNonce(&pCrypt->aPage[nData]);
+    int rc = teensyCryptPage(pCrypt, pCrypt->aPage, iPage == 0);
+
+    rc = rc == SQLITE_OK ? teensyWriteFile(p, pCrypt->aPage, static_cast<int>(pCrypt->pageSize),
+                                           static_cast<sqlite_int64>(iPage) * pCrypt->pageSize) : rc;
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+
+    z += nCopy;
+    iAmt -= nCopy;
+    iOfst += nCopy;
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Hot page prefetch (URI parameter "prefetch", see HOT PAGES above). The
+** reads of each page are counted while a database file is open. The most
+** read pages (space saving: a new page replaces the least read page and
+** inherits its count) are saved to the sidecar file "<database>-hot". When
+** the file is opened again, the saved pages are merged into spans of
+** neighboring pages, which are read with one call each.
+*/
+#define TEENSY_HOT_MAGIC 0x48313454 /* "T41H" */
+#define TEENSY_HOT_TRACKED (2 * TEENSY_41_SQLITE_PREFETCH_MAX_PAGES)
+#define TEENSY_HOT_MAX_GAP 2        /* pages between two hot pages read along */
+
+typedef struct TeensyHotHeader TeensyHotHeader;
+struct TeensyHotHeader
+{
+  uint32_t magic;                 /* TEENSY_HOT_MAGIC */
+  uint32_t pageSize;              /* Page size of the saved pages */
+  uint32_t nPage;                 /* Number of page numbers after the header */
+  uint32_t crc;                   /* teensyCrc32 of the page numbers */
+};
+
+typedef struct TeensyHotPage TeensyHotPage;
+struct TeensyHotPage
+{
+  uint32_t iPage;                 /* Page number, the first page is 1 */
+  uint32_t nRead;                 /* Counted reads */
+};
+
+typedef struct TeensyPrefetchSpan TeensyPrefetchSpan;
+struct TeensyPrefetchSpan
+{
+  uint32_t iFirst;                /* First page of the span */
+  uint32_t nPage;                 /* Number of pages, 0 if the read failed */
+  unsigned char* aData;           /* Pages of the span in aBuffer */
+  bool bLoaded;                   /* aData holds the pages */
+};
+
+typedef struct TeensyPrefetch TeensyPrefetch;
+struct TeensyPrefetch
+{
+  uint32_t pageSize;              /* Page size of the spans */
+  TeensyPrefetchSpan aSpan[TEENSY_41_SQLITE_PREFETCH_MAX_PAGES]; /* Sorted by page */
+  int nSpan;                      /* Number of spans */
+  int iNextSpan;                  /* Next span to read */
+  unsigned char* aBuffer;         /* Pages of all spans (EXTMEM) */
+  uint32_t hotPageSize;           /* Page size of the counted reads */
+  TeensyHotPage aHot[TEENSY_HOT_TRACKED]; /* Most read pages */
+  int nHot;                       /* Number of entries of aHot */
+};
+
+static int teensyHotCompareReads(const void* pLeft, const void* pRight)
+{
+  uint32_t left = ((const TeensyHotPage*)pLeft)->nRead;
+  uint32_t right = ((const TeensyHotPage*)pRight)->nRead;
+  return left < right ? 1 : (left > right ? -1 : 0);
+}
+
+static int teensyHotComparePages(const void* pLeft, const void* pRight)
+{
+  uint32_t left = *(const uint32_t*)pLeft;
+  uint32_t right = *(const uint32_t*)pRight;
+  return left < right ? -1 : (left > right ? 1 : 0);
+}
+
+/*
+** Count a read of SQLite. Reads of a whole page have the size of a page
+** (a power of two) and start at a multiple of it.
+*/
+static void teensyPrefetchCount(TeensyPrefetch* pPrefetch, int iAmt, sqlite_int64 iOfst)
+{
+  if (iAmt < 512 || (iAmt & (iAmt - 1)) != 0 || iOfst % iAmt != 0)
+  {
+    return;
+  }
+
+  if (pPrefetch->hotPageSize != static_cast<uint32_t>(iAmt))
+  {
+    pPrefetch->hotPageSize = static_cast<uint32_t>(iAmt);
+    pPrefetch->nHot = 0;
+  }
+
+  uint32_t iPage = static_cast<uint32_t>(iOfst / iAmt) + 1;
+  int iLeast = 0;
+
+  for (int i = 0; i < pPrefetch->nHot; ++i)
+  {
+    if (pPrefetch->aHot[i].iPage == iPage)
+    {
+      ++pPrefetch->aHot[i].nRead;
+      return;
+    }
+
+    if (pPrefetch->aHot[i].nRead < pPrefetch->aHot[iLeast].nRead)
+    {
+      iLeast = i;
+    }
+  }
+
+  if (pPrefetch->nHot < TEENSY_HOT_TRACKED)
+  {
+    iLeast = pPrefetch->nHot++;
+    pPrefetch->aHot[iLeast].nRead = 0;
+  }
+
+  pPrefetch->aHot[iLeast].iPage = iPage;
+  ++pPrefetch->aHot[iLeast].nRead;
+}
+
+static String teensyPrefetchHotName(const char* zName)
+{
+  String name = zName;
+  name.append("-hot");
+  return name;
+}
+
+/*
+** Read the hot page list of zName and lay out the spans. A missing or
+** invalid list leaves the prefetch without spans.
+*/
+static void teensyPrefetchLoad(TeensyPrefetch* pPrefetch, const char* zName)
+{
+  TeensyStorage::Filesystem* filesystem = T41SQLite::getInstance().getFilesystem();
+  String hotName = teensyPrefetchHotName(zName);
+
+  if (not TeensyStorage::exists(filesystem, hotName.c_str()))
+  {
+    return;
+  }
+
+  TeensyFile file = TeensyStorage::open(filesystem, hotName.c_str(), FILE_READ);
+
+  if (not file)
+  {
+    return;
+  }
+
+  TeensyHotHeader header;
+  uint32_t aPage[TEENSY_41_SQLITE_PREFETCH_MAX_PAGES];
+  bool isValid = file.read(&header, sizeof(header)) == sizeof(header) && header.magic == TEENSY_HOT_MAGIC &&
+                 header.pageSize >= 512 && header.pageSize <= 65536 &&
+                 header.nPage <= TEENSY_41_SQLITE_PREFETCH_MAX_PAGES &&
+                 file.read(aPage, header.nPage * sizeof(uint32_t)) == header.nPage * sizeof(uint32_t) &&
+                 header.crc == teensyCrc32(aPage, header.nPage * sizeof(uint32_t));
+  file.close();
+
+  if (not isValid || header.nPage == 0)
+  {
+    return;
+  }
+
+  qsort(aPage, header.nPage, sizeof(uint32_t), teensyHotComparePages);
+  uint32_t maxSpanPages = max(1u, static_cast<uint32_t>(TEENSY_41_SQLITE_PREFETCH_READ_SIZE) / header.pageSize);
+  uint32_t nTotal = 0;
+  int nSpan = 0;
+
+  for (uint32_t i = 0; i < header.nPage; ++i)
+  {
+    if (nSpan > 0)
+    {
+      TeensyPrefetchSpan* pLast = &pPrefetch->aSpan[nSpan - 1];
+      uint32_t iEnd = pLast->iFirst + pLast->nPage;
+
+      if (aPage[i] < iEnd)
+      {
+        continue; // the same page twice
+      }
+
+      uint32_t nAfter = aPage[i] - iEnd;
+
+      if (nAfter <= TEENSY_HOT_MAX_GAP && pLast->nPage + nAfter + 1 <= maxSpanPages)
+      {
+        pLast->nPage += nAfter + 1;
+        nTotal += nAfter + 1;
+        continue;
+      }
+    }
+
+    TeensyPrefetchSpan* pSpan = &pPrefetch->aSpan[nSpan++];
+    pSpan->iFirst = aPage[i];
+    pSpan->nPage = 1;
+    pSpan->bLoaded = false;
+    nTotal += 1;
+  }
+
+  pPrefetch->aBuffer = (unsigned char*)extmem_malloc(static_cast<size_t>(nTotal) * header.pageSize);
+
+  if (not pPrefetch->aBuffer)
+  {
+    return; // the prefetch is only an optimization
+  }
+
+  unsigned char* aData = pPrefetch->aBuffer;
+
+  for (int i = 0; i < nSpan; ++i)
+  {
+    pPrefetch->aSpan[i].aData = aData;
+    aData += static_cast<size_t>(pPrefetch->aSpan[i].nPage) * header.pageSize;
+  }
+
+  pPrefetch->pageSize = header.pageSize;
+  pPrefetch->nSpan = nSpan;
+}
+
+/*
+** Save the most read pages of this run to the hot page list of zName. A run,
+** which read no page, keeps the list of the last run.
+*/
+static int teensyPrefetchSave(TeensyPrefetch* pPrefetch, const char* zName)
+{
+  if (pPrefetch->nHot == 0)
+  {
+    return SQLITE_OK;
+  }
+
+  TeensyHotPage aHot[TEENSY_HOT_TRACKED];
+  memcpy(aHot, pPrefetch->aHot, pPrefetch->nHot * sizeof(TeensyHotPage));
+  qsort(aHot, pPrefetch->nHot, sizeof(TeensyHotPage), teensyHotCompareReads);
+
+  TeensyHotHeader header;
+  uint32_t aPage[TEENSY_41_SQLITE_PREFETCH_MAX_PAGES];
+  header.magic = TEENSY_HOT_MAGIC;
+  header.pageSize = pPrefetch->hotPageSize;
+  header.nPage = static_cast<uint32_t>(min(pPrefetch->nHot, TEENSY_41_SQLITE_PREFETCH_MAX_PAGES));
+
+  for (uint32_t i = 0; i < header.nPage; ++i)
+  {
+    aPage[i] = aHot[i].iPage;
+  }
+
+  qsort(aPage, header.nPage, sizeof(uint32_t), teensyHotComparePages);
+  header.crc = teensyCrc32(aPage, header.nPage * sizeof(uint32_t));
+
+  TeensyFile file = TeensyStorage::open(T41SQLite::getInstance().getFilesystem(), teensyPrefetchHotName(zName).c_str(), FILE_WRITE_BEGIN);
+  size_t nList = header.nPage * sizeof(uint32_t);
+  bool isWritten = file && file.write(&header, sizeof(header)) == sizeof(header) &&
+                   file.write(aPage, nList) == nList && file.truncate(sizeof(header) + nList);
+  file.close();
+
+  return isWritten ? SQLITE_OK : SQLITE_IOERR_WRITE;
+}
+
+/*
+** Serve a page read from a loaded span.
+*/
+static bool teensyPrefetchRead(TeensyPrefetch* pPrefetch, void* zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  if (pPrefetch->nSpan == 0 || static_cast<uint32_t>(iAmt) != pPrefetch->pageSize || iOfst % iAmt != 0)
+  {
+    return false;
+  }
+
+  uint32_t iPage = static_cast<uint32_t>(iOfst / iAmt) + 1;
+  int iLow = 0;
+  int iHigh = pPrefetch->nSpan - 1;
+
+  while (iLow <= iHigh)
+  {
+    int iMid = (iLow + iHigh) / 2;
+    TeensyPrefetchSpan* pSpan = &pPrefetch->aSpan[iMid];
+
+    if (iPage < pSpan->iFirst)
+    {
+      iHigh = iMid - 1;
+    }
+    else if (iPage >= pSpan->iFirst + pSpan->nPage)
+    {
+      iLow = iMid + 1;
+    }
+    else
+    {
+      if (not pSpan->bLoaded)
+      {
+        return false;
+      }
+
+      memcpy(zBuf, &pSpan->aData[static_cast<size_t>(iPage - pSpan->iFirst) * iAmt], iAmt);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void teensyPrefetchDrop(TeensyPrefetch* pPrefetch)
+{
+  extmem_free(pPrefetch->aBuffer);
+  pPrefetch->aBuffer = 0;
+  pPrefetch->nSpan = 0;
+  pPrefetch->iNextSpan = 0;
+}
+
+/*
+** Keep the loaded spans up to date with a write to the file. zBuf is 0 for a
+** failed write or a discarded batch, the spans are dropped then.
+*/
+static void teensyPrefetchWrite(TeensyPrefetch* pPrefetch, const void* zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  if (not zBuf)
+  {
+    teensyPrefetchDrop(pPrefetch);
+    return;
+  }
+
+  for (int i = 0; i < pPrefetch->nSpan; ++i)
+  {
+    TeensyPrefetchSpan* pSpan = &pPrefetch->aSpan[i];
+    sqlite_int64 iStart = static_cast<sqlite_int64>(pSpan->iFirst - 1) * pPrefetch->pageSize;
+    sqlite_int64 iEnd = iStart + static_cast<sqlite_int64>(pSpan->nPage) * pPrefetch->pageSize;
+    sqlite_int64 iFrom = max(iStart, iOfst);
+    sqlite_int64 iTo = min(iEnd, iOfst + iAmt);
+
+    if (pSpan->bLoaded && iFrom < iTo)
+    {
+      memcpy(&pSpan->aData[iFrom - iStart], &((const unsigned char*)zBuf)[iFrom - iOfst], iTo - iFrom);
+    }
+  }
+}
+
+/*
+** Locks of the database files, one entry per file for all connections of
+** this process (see LOCKING). The writer is the handle holding RESERVED_LOCK
+** or more. In exclusive owner mode the entry also keeps the database header
+** and whether the journal and the WAL file exist. With "prefetch" it keeps
+** the read counts and the prefetched pages of the file.
+*/
+#define TEENSY_LOCK_HEADER_SIZE 100
+#define TEENSY_LOCK_JOURNAL 0
+#define TEENSY_LOCK_WAL 1
+#define TEENSY_LOCK_READER_WAIT 100 /* ms after the last attempt of a waiting reader */
+
+#define TEENSY_EXISTS_UNKNOWN 0   /* ask the storage backend */
+#define TEENSY_EXISTS_NO 1
+#define TEENSY_EXISTS_YES 2
+
+typedef struct TeensyLock TeensyLock;
+struct TeensyLock
+{
+  TeensyLock* pNext;              /* Next entry of teensyLockList */
+  char* zName;                    /* Full path of the database file */
+  int nRef;                       /* Number of open handles */
+  int nShared;                    /* Number of handles holding SHARED_LOCK or more */
+  TeensyVFSFile* pWriter;         /* Handle holding RESERVED_LOCK or more or 0 */
+  TeensyVFSFile* pLastWriter;     /* Handle, which released RESERVED_LOCK last, or 0 */
+  TeensyVFSFile* pReaderWaiting;  /* Handle refused SHARED_LOCK because of PENDING_LOCK or 0 */
+  uint32_t msReaderWaiting;       /* millis() of its last refused SHARED_LOCK */
+  uint32_t iGeneration;           /* Incremented by every change of the file */
+  bool bExclusiveOwner;           /* Opened in exclusive owner mode */
+  bool bHeader;                   /* aHeader holds the start of the file */
+  unsigned char aHeader[TEENSY_LOCK_HEADER_SIZE]; /* Database header (exclusive owner mode) */
+  int aExists[2];                 /* TEENSY_EXISTS_* of the journal and the WAL file */
+  TeensyPrefetch* pPrefetch;      /* Hot pages ("prefetch") or 0 */
+};
+
+static TeensyLock* teensyLockList = 0;
+
+static TeensyLock* teensyLockAcquire(const char* zName)
+{
+  for (TeensyLock* pLock = teensyLockList; pLock; pLock = pLock->pNext)
+  {
+    if (strcmp(pLock->zName, zName) == 0)
+    {
+      ++pLock->nRef;
+      return pLock;
+    }
+  }
+
+  size_t nName = strlen(zName);
+  TeensyLock* pLock = (TeensyLock*)sqlite3_malloc64(sizeof(TeensyLock) + nName + 1);
+
+  if (not pLock)
+  {
+    return 0;
+  }
+
+  memset(pLock, 0, sizeof(TeensyLock));
+  pLock->zName = (char*)&pLock[1];
+  memcpy(pLock->zName, zName, nName + 1);
+  pLock->nRef = 1;
+  pLock->bExclusiveOwner = T41SQLite::getInstance().isExclusiveOwner();
+  pLock->pNext = teensyLockList;
+  teensyLockList = pLock;
+
+  return pLock;
+}
+
+/*
+** Returns the lock of the database file, whose journal (zSuffix "-journal")
+** or WAL file (zSuffix "-wal") is zName.
+*/
+static TeensyLock* teensyLockFind(const char* zName, const char* zSuffix)
+{
+  size_t nName = strlen(zName);
+  size_t nSuffix = strlen(zSuffix);
+
+  if (nName <= nSuffix || strcmp(&zName[nName - nSuffix], zSuffix) != 0)
+  {
+    return 0;
+  }
+
+  for (TeensyLock* pLock = teensyLockList; pLock; pLock = pLock->pNext)
+  {
+    if (strlen(pLock->zName) == nName - nSuffix && strncmp(pLock->zName, zName, nName - nSuffix) == 0)
+    {
+      return pLock;
+    }
+  }
+
+  return 0;
+}
+
+/*
+** Returns the TEENSY_EXISTS_* state of zName, if zName is the journal or the
+** WAL file of a database file opened in exclusive owner mode, otherwise 0.
+*/
+static int* teensyLockExists(const char* zName)
+{
+  TeensyLock* pLock = teensyLockFind(zName, "-journal");
+
+  if (pLock && pLock->bExclusiveOwner)
+  {
+    return &pLock->aExists[TEENSY_LOCK_JOURNAL];
+  }
+
+  pLock = teensyLockFind(zName, "-wal");
+
+  if (pLock && pLock->bExclusiveOwner)
+  {
+    return &pLock->aExists[TEENSY_LOCK_WAL];
+  }
+
+  return 0;
+}
+
+/*
+** Drop the locks and the reference of a handle to the lock of its file.
+*/
+static void teensyLockRelease(TeensyVFSFile* p)
+{
+  TeensyLock* pLock = p->pLock;
+  p->pLock = 0;
+
+  if (pLock->pWriter == p)
+  {
+    pLock->pWriter = 0;
+  }
+
+  if (pLock->pLastWriter == p)
+  {
+    pLock->pLastWriter = 0;
+  }
+
+  if (pLock->pReaderWaiting == p)
+  {
+    pLock->pReaderWaiting = 0;
+  }
+
+  if (p->eLock >= SQLITE_LOCK_SHARED)
+  {
+    --pLock->nShared;
+  }
+
+  p->eLock = SQLITE_LOCK_NONE;
+
+  if (--pLock->nRef > 0)
+  {
+    return;
+  }
+
+  if (pLock->pPrefetch)
+  {
+    // the list of this run is saved for the next open, a failed save keeps the old list
+    teensyPrefetchSave(pLock->pPrefetch, pLock->zName);
+    teensyPrefetchDrop(pLock->pPrefetch);
+    sqlite3_free(pLock->pPrefetch);
+  }
+
+  for (TeensyLock** pp = &teensyLockList; *pp; pp = &(*pp)->pNext)
+  {
+    if (*pp == pLock)
+    {
+      *pp = pLock->pNext;
+      break;
+    }
+  }
+
+  sqlite3_free(pLock);
+}
+
+/*
+** Called by every change of a database file. The handle, which changes the
+** file, stays up to date.
+*/
+static void teensyLockNoteChange(TeensyVFSFile* p)
+{
+  TeensyLock* pLock = p->pLock;
+
+  if (pLock)
+  {
+    bool isUpToDate = p->iLockGeneration == pLock->iGeneration;
+    ++pLock->iGeneration;
+
+    if (isUpToDate)
+    {
+      p->iLockGeneration = pLock->iGeneration;
+    }
+  }
+}
+
+/*
+** Keep the database header of the lock up to date with a write to the file.
+** zBuf is 0 for a failed write, the header is read again then.
+*/
+static void teensyLockWriteHeader(TeensyVFSFile* p, const void* zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  TeensyLock* pLock = p->pLock;
+
+  if (not pLock || not pLock->bHeader || iOfst >= TEENSY_LOCK_HEADER_SIZE)
+  {
+    return;
+  }
+
+  if (not zBuf)
+  {
+    pLock->bHeader = false;
+    return;
+  }
+
+  int nCopy = min(iAmt, TEENSY_LOCK_HEADER_SIZE - static_cast<int>(iOfst));
+  memcpy(&pLock->aHeader[iOfst], zBuf, nCopy);
+}
+
+/*
+** Reopen the file of a handle, if another connection changed the file since
+** the handle was opened or reopened: a file object of the storage backend
+** does not see the new size of a file changed through another file object.
+*/
+static int teensyLockRefresh(TeensyVFSFile* p)
+{
+  if (p->iLockGeneration == p->pLock->iGeneration || not p->teensyFile)
+  {
+    return SQLITE_OK;
+  }
+
+  uint8_t openMode = (p->flags & SQLITE_OPEN_READONLY) ? FILE_READ : FILE_WRITE;
+  p->teensyFile->close();
+  *p->teensyFile = TeensyStorage::open(T41SQLite::getInstance().getFilesystem(), p->zName, openMode);
+
+  if (not *p->teensyFile)
+  {
+    return SQLITE_IOERR_LOCK;
+  }
+
+  p->iLockGeneration = p->pLock->iGeneration;
+  return SQLITE_OK;
+}
+
+/*
+** Close a file.
+*/
+static int teensyClose(sqlite3_file *pFile)
+{
+  TeensyVFSGuard guard;
+  TeensyVFSFile *p = (TeensyVFSFile*)pFile;
+  int rc = teensyFlushBuffer(p);
+  teensyFreeJournalBuffer(p->aBuffer);
+
+  for (TeensyVFSFile** pp = &teensyWalList; *pp; pp = &(*pp)->pNextWal)
+  {
+    if (*pp == p)
+    {
+      *pp = p->pNextWal;
+      break;
+    }
+  }
+
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_CLOSE");
+
+  if (p->pMirror)
+  {
+    if (p->pMirror->eMode == TEENSY_MIRROR_WRITE_THROUGH && p->teensyFile && rc == SQLITE_OK)
+    {
+      rc = teensyMirrorFlushTo(p->pMirror, 0, *p->teensyFile);
+    }
+
+    int rcRelease = teensyMirrorRelease(p->pMirror);
+    rc = rc == SQLITE_OK ? rcRelease : rc;
+    p->pMirror = 0;
+  }
+
+  if (p->pShm)
+  {
+    teensyShmRelease(p);
+  }
+
+  if (p->pLock)
+  {
+    teensyLockRelease(p);
+  }
+
+  if (p->pCompress)
+  {
+    int rcCompress = teensyCompressRelease(p->pCompress);
+    rc = rc == SQLITE_OK ? rcCompress : rc;
+    p->pCompress = 0;
+  }
+
+  if (p->pCrypt)
+  {
+    teensyCryptRelease(p->pCrypt);
+    p->pCrypt = 0;
+  }
+
+  if (p->pBatch)
+  {
+    int rcBatch = teensyBatchClose(p->pBatch);
+    rc = rc == SQLITE_OK ? rcBatch : rc;
+    p->pBatch = 0;
+  }
+
+  if (p->teensyFile)
+  {
+    TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_CLOSE_FILE ");
+    TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(p->zName);
+
+    p->teensyFile->close();
+    delete p->teensyFile;
+    p->teensyFile = nullptr;
+  }
+
+  return rc;
+}
+
+/*
+** Read data from the storage of a file (container, cipher or plain file).
+*/
+static int teensyReadStorage(TeensyVFSFile* p, void* zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  if (p->pCompress)
+  {
+    return teensyCompressRead(p->pCompress, zBuf, iAmt, iOfst);
+  }
+
+  if (p->pCrypt)
+  {
+    return teensyCryptRead(p, zBuf, iAmt, iOfst);
+  }
+
+  return teensyReadFile(p, zBuf, iAmt, iOfst);
+}
+
+/*
+** Read the next span of hot pages with one read of the storage. *pnLeft is
+** set to the number of spans still to read. A span beyond the end of the
+** file (it shrank since the list was saved) stays unloaded.
+*/
+static int teensyPrefetchStep(TeensyVFSFile* p, int* pnLeft)
+{
+  TeensyPrefetch* pPrefetch = p->pLock->pPrefetch;
+  int rc = teensyLockRefresh(p);
+
+  if (rc == SQLITE_OK && pPrefetch->iNextSpan < pPrefetch->nSpan)
+  {
+    TeensyPrefetchSpan* pSpan = &pPrefetch->aSpan[pPrefetch->iNextSpan++];
+    sqlite_int64 iOfst = static_cast<sqlite_int64>(pSpan->iFirst - 1) * pPrefetch->pageSize;
+    rc = teensyReadStorage(p, pSpan->aData, static_cast<int>(pSpan->nPage * pPrefetch->pageSize), iOfst);
+    pSpan->bLoaded = rc == SQLITE_OK;
+    rc = rc == SQLITE_IOERR_SHORT_READ ? SQLITE_OK : rc;
+  }
+
+  *pnLeft = pPrefetch->nSpan - pPrefetch->iNextSpan;
+  return rc;
+}
+
+/*
+** Read from the database header kept by the lock in exclusive owner mode. At
+** the start of every transaction SQLite reads the change counter (offset 24)
+** to find out, whether its page cache is still valid, which costs a card
+** access without the copy. A file shorter than the header is not kept.
+*/
+static int teensyLockReadHeader(TeensyVFSFile* p, void* zBuf, int iAmt, sqlite_int64 iOfst)
+{
+  TeensyLock* pLock = p->pLock;
+
+  if (not pLock->bHeader)
+  {
+    if (teensyReadStorage(p, pLock->aHeader, TEENSY_LOCK_HEADER_SIZE, 0) != SQLITE_OK)
+    {
+      return teensyReadStorage(p, zBuf, iAmt, iOfst);
+    }
+
+    pLock->bHeader = true;
+  }
+
+  memcpy(zBuf, &pLock->aHeader[iOfst], iAmt);
+  return SQLITE_OK;
+}
+
+/*
+** Read data from a file.
+*/
+static int teensyRead(
+  sqlite3_file *pFile, 
+  void *zBuf, 
+  int iAmt, 
+  sqlite_int64 iOfst
+)
+{
+  TeensyVFSGuard guard;
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_READ - BEGIN");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_iAMT ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(iAmt);
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_READ_OFFSET ");
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(iOfst);
+
+  TeensyVFSFile *p = (TeensyVFSFile*)pFile;
+
+  if (p->pMirror)
+  {
+    return teensyImageRead(p->pMirror->aData, p->pMirror->nData, zBuf, iAmt, iOfst);
+  }
+
+  if (p->aImage)
+  {
+    return teensyImageRead(p->aImage, p->nImage, zBuf, iAmt, iOfst);
+  }
+
+  if (p->pLock && p->pLock->bExclusiveOwner && iOfst + iAmt <= TEENSY_LOCK_HEADER_SIZE)
+  {
+    return teensyLockReadHeader(p, zBuf, iAmt, iOfst);
+  }
+
+  if (p->pLock && p->pLock->pPrefetch)
+  {
+    teensyPrefetchCount(p->pLock->pPrefetch, iAmt, iOfst);
+
+    if (teensyPrefetchRead(p->pLock->pPrefetch, zBuf, iAmt, iOfst))
+    {
+      return SQLITE_OK;
+    }
+  }
+
+  return teensyReadStorage(p, zBuf, iAmt, iOfst);
+}
+
+/*
+** Write data to a crash-file.
+*/
+static int teensyWrite(
+  sqlite3_file *pFile, 
+  const void *zBuf, 
+  int iAmt, 
+  sqlite_int64 iOfst
+){
+  TeensyVFSGuard guard;
+  TeensyVFSFile *p = (TeensyVFSFile*)pFile;
+
+  TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_WRITE");
+  teensyLockNoteChange(p);
+
+  if (p->pMirror)
+  {
+    return teensyMirrorWrite(p->pMirror, zBuf, iAmt, iOfst);
+  }
+
+  if (p->aImage)
+  {
+    return SQLITE_READONLY;
+  }
+
+  int rc;
+
+  if (p->pCompress)
+  {
+    rc = teensyCompressWrite(p->pCompress, zBuf, iAmt, iOfst);
+  }
+  else if (p->pCrypt)
+  {
+    rc = teensyCryptWrite(p, zBuf, iAmt, iOfst);
+  }
+  else
+  {
+    rc = teensyWriteFile(p, zBuf, iAmt, iOfst);
+  }
+
+  teensyLockWriteHeader(p, rc == SQLITE_OK ? zBuf : 0, iAmt, iOfst);
+
+  if (p->pLock && p->pLock->pPrefetch)
+  {
+    teensyPrefetchWrite(p->pLock->pPrefetch, rc == SQLITE_OK ? zBuf : 0, iAmt, iOfst);
+  }
+
+  return rc;
+}
+
+/* (From SQLite documentation:)
+** The xTruncate method truncates a file to be nByte bytes in length. If the file is already nByte bytes or less in length then this method is a no-op.
+** The xTruncate method returns SQLITE_OK on success and SQLITE_IOERR_TRUNCATE if anything goes wrong. 
+*/
+static int teensyTruncate(sqlite3_file *pFile, sqlite_int64 size)
+{
+  TeensyVFSGuard guard;
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+  size_t reducedSize = static_cast<size_t>(size);
+  teensyLockNoteChange(p);
+
+  if (p->pLock && size < TEENSY_LOCK_HEADER_SIZE)
+  {
+    p->pLock->bHeader = false;
+  }
+
+  if (p->pLock && p->pLock->pPrefetch)
+  {
+    teensyPrefetchWrite(p->pLock->pPrefetch, 0, 0, 0);
+  }
+
+  if (p->pMirror)
+  {
+    p->pMirror->nData = min(p->pMirror->nData, static_cast<sqlite3_int64>(size));
+    return SQLITE_OK;
+  }
+
+  if (p->aImage)
+  {
+    return size >= p->nImage ? SQLITE_OK : SQLITE_IOERR_TRUNCATE;
+  }
+
+  if (p->pCompress)
+  {
+    return teensyCompressTruncate(p->pCompress, size);
+  }
+
+  // a buffered write flushed after the truncate would extend the file again (WAL buffers of all connections)
+  int rc = (p->flags & SQLITE_OPEN_WAL) ? teensyFlushWalBuffers() : teensyFlushBuffer(p);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  if (p->teensyFile->size() > reducedSize)
+  {
+    if (p->pBatch && teensyBatchPrepareDirectChange(p->pBatch) != SQLITE_OK)
+    {
+      return SQLITE_IOERR_TRUNCATE;
+    }
+
+    return p->teensyFile->truncate(reducedSize) ? SQLITE_OK : SQLITE_IOERR_TRUNCATE;
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Sync the contents of the file to the persistent media.
+*/
+static int teensySync(sqlite3_file *pFile, int flags)
+{
+  TeensyVFSGuard guard;
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+  int rc = teensyFlushBuffer(p);
+  
+  if (rc != SQLITE_OK || p->aImage)
+  {
+    return rc;
+  }
+
+  if (p->pMirror)
+  {
+    TeensyMirror* pMirror = p->pMirror;
+
+    if (pMirror->eMode == TEENSY_MIRROR_WRITE_THROUGH)
+    {
+      return teensyMirrorFlushTo(pMirror, 0, *p->teensyFile);
+    }
+
+    if (pMirror->eMode == TEENSY_MIRROR_CHECKPOINT && pMirror->msInterval > 0 &&
+        millis() - pMirror->msLastCheckpoint >= pMirror->msInterval)
+    {
+      // xSync() of the database file completes a commit, so the image is consistent here
+      return teensyMirrorCheckpoint(pMirror);
+    }
+
+    return SQLITE_OK;
+  }
+
+  if (p->pCompress)
+  {
+    return teensyCompressSync(p->pCompress);
+  }
+  
+  p->teensyFile->flush();
 
   return SQLITE_OK;
 }
@@ -403,13 +3987,33 @@ static int teensySync(sqlite3_file *pFile, int flags)
 */
 static int teensyFileSize(sqlite3_file *pFile, sqlite_int64 *pSize)
 {
+  TeensyVFSGuard guard;
   TeensyVFSFile *p = (TeensyVFSFile*)pFile;
+
+  if (p->pMirror)
+  {
+    *pSize = p->pMirror->nData;
+    return SQLITE_OK;
+  }
+
+  if (p->aImage)
+  {
+    *pSize = p->nImage;
+    return SQLITE_OK;
+  }
+
+  if (p->pCompress)
+  {
+    *pSize = p->pCompress->nSize;
+    return SQLITE_OK;
+  }
+
   /* Flush the contents of the buffer to disk. As with the flush in the
   ** teensyRead() method, it would be possible to avoid this and save a write
   ** here and there. But in practice this comes up so infrequently it is
   ** not worth the trouble.
   */
-  int rc = teensyFlushBuffer(p);
+  int rc = (p->flags & SQLITE_OPEN_WAL) ? teensyFlushWalBuffers() : teensyFlushBuffer(p);
 
   if (rc != SQLITE_OK)
   {
@@ -422,46 +4026,502 @@ static int teensyFileSize(sqlite3_file *pFile, sqlite_int64 *pSize)
 }
 
 /*
-** Locking functions. The xLock() and xUnlock() methods are both no-ops.
-** The xCheckReservedLock() always indicates that no other process holds
-** a reserved lock on the database file. This ensures that if a hot-journal
-** file is found in the file-system it is rolled back.
+** Locking functions (see LOCKING). SQLite requests SHARED_LOCK from
+** NO_LOCK, RESERVED_LOCK from SHARED_LOCK and EXCLUSIVE_LOCK from SHARED_LOCK
+** or more. EXCLUSIVE_LOCK takes PENDING_LOCK first, which keeps new readers
+** out, and returns SQLITE_BUSY as long as other handles hold SHARED_LOCK.
+** The last writer lets a reader kept out this way in first.
+** Files without a lock (journals, WAL files, memory images) are not locked.
 */
 static int teensyLock(sqlite3_file *pFile, int eLock)
 {
+  TeensyVFSGuard guard;
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+  TeensyLock* pLock = p->pLock;
+
+  if (not pLock || p->eLock >= eLock)
+  {
+    return SQLITE_OK;
+  }
+
+  if (eLock == SQLITE_LOCK_SHARED)
+  {
+    if (pLock->pWriter && pLock->pWriter->eLock >= SQLITE_LOCK_PENDING)
+    {
+      if (p != pLock->pLastWriter)
+      {
+        pLock->pReaderWaiting = p;
+        pLock->msReaderWaiting = millis();
+      }
+
+      return SQLITE_BUSY;
+    }
+
+    if (pLock->pReaderWaiting && p == pLock->pLastWriter)
+    {
+      if (millis() - pLock->msReaderWaiting < TEENSY_LOCK_READER_WAIT)
+      {
+        return SQLITE_BUSY;
+      }
+
+      pLock->pReaderWaiting = 0; /* it stopped retrying */
+    }
+
+    int rc = teensyLockRefresh(p);
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+
+    ++pLock->nShared;
+    p->eLock = SQLITE_LOCK_SHARED;
+
+    if (p != pLock->pLastWriter)
+    {
+      pLock->pReaderWaiting = 0;
+    }
+
+    return SQLITE_OK;
+  }
+
+  if (pLock->pWriter && pLock->pWriter != p)
+  {
+    return SQLITE_BUSY;
+  }
+
+  pLock->pWriter = p;
+
+  if (eLock == SQLITE_LOCK_RESERVED)
+  {
+    p->eLock = SQLITE_LOCK_RESERVED;
+    return SQLITE_OK;
+  }
+
+  p->eLock = SQLITE_LOCK_PENDING;
+
+  if (pLock->nShared > 1)
+  {
+    return SQLITE_BUSY;
+  }
+
+  p->eLock = SQLITE_LOCK_EXCLUSIVE;
   return SQLITE_OK;
 }
+
 static int teensyUnlock(sqlite3_file *pFile, int eLock)
 {
+  TeensyVFSGuard guard;
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+  TeensyLock* pLock = p->pLock;
+
+  if (pLock && pLock->pReaderWaiting == p)
+  {
+    pLock->pReaderWaiting = 0; /* gave up waiting for SHARED_LOCK */
+  }
+
+  if (not pLock || p->eLock <= eLock)
+  {
+    return SQLITE_OK;
+  }
+
+  if (pLock->pWriter == p)
+  {
+    pLock->pWriter = 0;
+    pLock->pLastWriter = p;
+  }
+
+  if (eLock == SQLITE_LOCK_NONE)
+  {
+    --pLock->nShared;
+  }
+
+  p->eLock = eLock;
   return SQLITE_OK;
 }
+
+/*
+** A RESERVED_LOCK held by any handle means, that a journal of the file
+** belongs to a transaction in progress and is not a hot journal.
+*/
 static int teensyCheckReservedLock(sqlite3_file *pFile, int *pResOut)
 {
-  *pResOut = 0;
+  TeensyVFSGuard guard;
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+  *pResOut = p->pLock && p->pLock->pWriter ? 1 : 0;
   return SQLITE_OK;
 }
 
 /*
-** No xFileControl() verbs are implemented by this VFS.
+** xFileControl() verbs implemented by this VFS:
+**
+**   TEENSY_41_SQLITE_FCNTL_MIRROR_CHECKPOINT: make a RAM mirror durable
+**   (see T41SQLite::checkpointMirror).
+**
+**   SQLITE_FCNTL_BEGIN/COMMIT/ROLLBACK_ATOMIC_WRITE: batch atomic writes of
+**   database files opened with "batch_atomic=1". SQLite only calls xWrite()
+**   and SQLITE_FCNTL_SIZE_HINT between BEGIN and COMMIT/ROLLBACK.
+**
+**   SQLITE_FCNTL_SIZE_HINT: an empty database file gets the hinted size
+**   as one contiguous range of zeroed clusters, if the storage backend can
+**   preallocate (a crash before the pages are written leaves zeros, not
+**   old data of the card, inside the file).
+**
+**   TEENSY_41_SQLITE_FCNTL_PREFETCH: read the next span of hot pages of a
+**   file opened with "prefetch=1", *(int*)pArg is set to the number of spans
+**   still to read (see T41SQLite::prefetchHotPages).
+**
+**   TEENSY_41_SQLITE_FCNTL_SAVE_HOT_PAGES: save the hot page list now instead
+**   of at the last close (see T41SQLite::saveHotPages).
 */
 static int teensyFileControl(sqlite3_file *pFile, int op, void *pArg)
 {
+  TeensyVFSGuard guard;
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+
+  if (p->pBatch)
+  {
+    switch (op)
+    {
+      case SQLITE_FCNTL_BEGIN_ATOMIC_WRITE:
+        teensyBatchReset(p->pBatch);
+        p->pBatch->bActive = true;
+        return SQLITE_OK;
+      case SQLITE_FCNTL_COMMIT_ATOMIC_WRITE:
+        teensyLockNoteChange(p);
+        return teensyBatchCommit(p->pBatch, *p->teensyFile);
+      case SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE:
+        // the header and the prefetched pages may hold writes of the batch
+        teensyLockWriteHeader(p, 0, 0, 0);
+
+        if (p->pLock && p->pLock->pPrefetch)
+        {
+          teensyPrefetchWrite(p->pLock->pPrefetch, 0, 0, 0);
+        }
+
+        teensyBatchReset(p->pBatch);
+        p->pBatch->bActive = false;
+        return SQLITE_OK;
+      default:
+        break;
+    }
+  }
+
+  if (op == SQLITE_FCNTL_SIZE_HINT && (p->flags & SQLITE_OPEN_MAIN_DB) && p->teensyFile && not p->pCompress &&
+      TeensyStorage::preallocate(*p->teensyFile, static_cast<uint64_t>(*static_cast<sqlite3_int64*>(pArg))))
+  {
+    return SQLITE_OK;
+  }
+
+  if (op == TEENSY_41_SQLITE_FCNTL_PREFETCH && p->pLock && p->pLock->pPrefetch)
+  {
+    return teensyPrefetchStep(p, static_cast<int*>(pArg));
+  }
+
+  if (op == TEENSY_41_SQLITE_FCNTL_SAVE_HOT_PAGES && p->pLock && p->pLock->pPrefetch)
+  {
+    return teensyPrefetchSave(p->pLock->pPrefetch, p->pLock->zName);
+  }
+
+  if (op == TEENSY_41_SQLITE_FCNTL_MIRROR_CHECKPOINT && p->pMirror)
+  {
+    if (p->pMirror->eMode == TEENSY_MIRROR_CHECKPOINT)
+    {
+      return teensyMirrorCheckpoint(p->pMirror);
+    }
+
+    if (p->pMirror->eMode == TEENSY_MIRROR_WRITE_THROUGH)
+    {
+      return teensyMirrorFlushTo(p->pMirror, 0, *p->teensyFile);
+    }
+  }
+
   return SQLITE_NOTFOUND;
 }
 
-/*
-** The xSectorSize() and xDeviceCharacteristics() methods. These two
-** may return special values allowing SQLite to optimize file-system 
-** access to some extent. But it is also safe to simply return 0.
-*/
-static int teensySectorSize(sqlite3_file *pFile)
-{
-  return T41SQLite::getInstance().getSectorSize();
-}
+/*
+** The xSectorSize() and xDeviceCharacteristics() methods. These two
+** may return special values allowing SQLite to optimize file-system 
+** access to some extent. But it is also safe to simply return 0.
+*/
+static int teensySectorSize(sqlite3_file *pFile)
+{
+  return T41SQLite::getInstance().getSectorSize();
+}
+
+static int teensyDeviceCharacteristics(sqlite3_file *pFile)
+{
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+
+  if (p->aImage)
+  {
+    // memory images are read-only and cannot be changed by anyone else
+    return SQLITE_IOCAP_IMMUTABLE;
+  }
+
+  if (p->pBatch)
+  {
+    return T41SQLite::getInstance().getDeviceCharacteristics() | SQLITE_IOCAP_BATCH_ATOMIC;
+  }
+
+  if (p->pCompress)
+  {
+    // a page record spans several sectors, so sector writes are not atomic anymore
+    return T41SQLite::getInstance().getDeviceCharacteristics() &
+           ~(SQLITE_IOCAP_ATOMIC | SQLITE_IOCAP_ATOMIC512 | SQLITE_IOCAP_ATOMIC1K | SQLITE_IOCAP_ATOMIC2K |
+             SQLITE_IOCAP_ATOMIC4K | SQLITE_IOCAP_ATOMIC8K | SQLITE_IOCAP_ATOMIC16K | SQLITE_IOCAP_ATOMIC32K |
+             SQLITE_IOCAP_ATOMIC64K);
+  }
+
+  return T41SQLite::getInstance().getDeviceCharacteristics();
+}
+
+/*
+** Memory mapped I/O (PRAGMA mmap_size). Only files with a memory image can be
+** mapped, because their content is already addressable. For all other files
+** *pp is set to 0 and SQLite falls back to xRead().
+*/
+static int teensyFetch(sqlite3_file *pFile, sqlite3_int64 iOfst, int iAmt, void **pp)
+{
+  TeensyVFSGuard guard;
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+  *pp = 0;
+
+  if (p->pMirror)
+  {
+    if (iOfst >= 0 && iOfst + iAmt <= p->pMirror->nData)
+    {
+      *pp = (void*)&p->pMirror->aData[iOfst];
+      ++p->pMirror->nFetchOut;
+      ++p->nFetchOut;
+    }
+  }
+  else if (p->aImage && iOfst >= 0 && iOfst + iAmt <= p->nImage)
+  {
+    *pp = (void*)&p->aImage[iOfst];
+    ++p->nFetchOut;
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Release a reference obtained by xFetch(). If p is 0, SQLite asks to unmap
+** the whole file. This is a no-op, because memory images are never remapped
+** (RAM mirrors keep replaced buffers until all references are released).
+*/
+static int teensyUnfetch(sqlite3_file *pFile, sqlite3_int64 iOfst, void *p)
+{
+  TeensyVFSGuard guard;
+  TeensyVFSFile* pTeensyFile = (TeensyVFSFile*)pFile;
+
+  if (p)
+  {
+    assert(pTeensyFile->nFetchOut > 0);
+    --pTeensyFile->nFetchOut;
+
+    if (pTeensyFile->pMirror && --pTeensyFile->pMirror->nFetchOut == 0)
+    {
+      teensyMirrorFreeRetired(pTeensyFile->pMirror);
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Map region iRegion of the wal-index. Regions are zero filled, when they are
+** created (bExtend). If the region does not exist and bExtend is 0, *pp is
+** set to 0.
+*/
+static int teensyShmMap(sqlite3_file *pFile, int iRegion, int szRegion, int bExtend, void volatile **pp)
+{
+  TeensyVFSGuard guard;
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+  *pp = 0;
+
+  if (not p->pShm)
+  {
+    p->pShm = teensyShmAcquire(p->zName);
+
+    if (not p->pShm)
+    {
+      return SQLITE_IOERR_NOMEM;
+    }
+  }
+
+  TeensyShm* pShm = p->pShm;
+
+  if (pShm->nRegion > 0 && pShm->szRegion != szRegion)
+  {
+    return SQLITE_IOERR_SHMSIZE;
+  }
+
+  if (iRegion >= pShm->nRegion)
+  {
+    if (not bExtend)
+    {
+      return SQLITE_OK;
+    }
+
+    unsigned char** apNew = (unsigned char**)sqlite3_realloc64(pShm->apRegion, (iRegion + 1) * sizeof(unsigned char*));
+
+    if (not apNew)
+    {
+      return SQLITE_IOERR_NOMEM;
+    }
+
+    pShm->apRegion = apNew;
+    pShm->szRegion = szRegion;
+
+    while (pShm->nRegion <= iRegion)
+    {
+      unsigned char* aRegion = (unsigned char*)extmem_malloc(static_cast<size_t>(szRegion));
+
+      if (not aRegion)
+      {
+        return SQLITE_IOERR_NOMEM;
+      }
+
+      memset(aRegion, 0, static_cast<size_t>(szRegion));
+      pShm->apRegion[pShm->nRegion++] = aRegion;
+    }
+  }
+
+  *pp = pShm->apRegion[iRegion];
+
+  return SQLITE_OK;
+}
+
+/*
+** Acquire or release wal-index locks. All connections are in this process,
+** so the locks are plain counters (see TeensyShm.aLock).
+*/
+static int teensyShmLock(sqlite3_file *pFile, int ofst, int n, int flags)
+{
+  TeensyVFSGuard guard;
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+  TeensyShm* pShm = p->pShm;
+  uint16_t mask = static_cast<uint16_t>((1 << (ofst + n)) - (1 << ofst));
+
+  if (not pShm || ofst < 0 || n < 1 || ofst + n > SQLITE_SHM_NLOCK)
+  {
+    return SQLITE_IOERR_SHMLOCK;
+  }
+
+  if (flags & SQLITE_SHM_UNLOCK)
+  {
+    for (int i = ofst; i < ofst + n; ++i)
+    {
+      if (p->shmExclMask & (1 << i))
+      {
+        pShm->aLock[i] = 0;
+      }
+      else if (p->shmSharedMask & (1 << i))
+      {
+        --pShm->aLock[i];
+      }
+    }
+
+    p->shmExclMask &= ~mask;
+    p->shmSharedMask &= ~mask;
+  }
+  else if (flags & SQLITE_SHM_SHARED)
+  {
+    assert(n == 1);
+
+    if ((p->shmSharedMask & mask) == 0)
+    {
+      if (pShm->aLock[ofst] < 0)
+      {
+        return SQLITE_BUSY;
+      }
+
+      ++pShm->aLock[ofst];
+      p->shmSharedMask |= mask;
+    }
+  }
+  else
+  {
+    // a shared lock of this connection is upgraded, only the locks of other connections conflict
+    for (int i = ofst; i < ofst + n; ++i)
+    {
+      int nOwnShared = (p->shmSharedMask & (1 << i)) ? 1 : 0;
+
+      if ((p->shmExclMask & (1 << i)) == 0 && pShm->aLock[i] - nOwnShared != 0)
+      {
+        return SQLITE_BUSY;
+      }
+    }
+
+    for (int i = ofst; i < ofst + n; ++i)
+    {
+      pShm->aLock[i] = -1;
+    }
+
+    p->shmSharedMask &= ~mask;
+    p->shmExclMask |= mask;
+  }
+
+  return SQLITE_OK;
+}
+
+static void teensyShmBarrier(sqlite3_file *pFile)
+{
+  __sync_synchronize();
+}
+
+/*
+** Release the wal-index of this connection. The regions are freed with the
+** last connection (deleteFlag is irrelevant, nothing is stored in a file).
+*/
+static int teensyShmUnmap(sqlite3_file *pFile, int deleteFlag)
+{
+  TeensyVFSGuard guard;
+  TeensyVFSFile* p = (TeensyVFSFile*)pFile;
+
+  if (p->pShm)
+  {
+    teensyShmRelease(p);
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Attach the lock of its file to an opened database file handle.
+*/
+static int teensyLockOpen(TeensyVFSFile* p)
+{
+  if (not (p->flags & SQLITE_OPEN_MAIN_DB) || p->aImage)
+  {
+    return SQLITE_OK;
+  }
+
+  p->pLock = teensyLockAcquire(p->zName);
+
+  if (not p->pLock)
+  {
+    teensyClose(&p->sqliteFile);
+    p->sqliteFile.pMethods = 0;
+    return SQLITE_NOMEM;
+  }
+
+  p->iLockGeneration = p->pLock->iGeneration;
 
-static int teensyDeviceCharacteristics(sqlite3_file *pFile)
-{
-  return T41SQLite::getInstance().getDeviceCharacteristics();
+  // files served from a memory image or a RAM mirror have nothing to prefetch
+  if (not p->pLock->pPrefetch && not p->pMirror && sqlite3_uri_boolean(p->zName, "prefetch", 0))
+  {
+    p->pLock->pPrefetch = (TeensyPrefetch*)sqlite3_malloc64(sizeof(TeensyPrefetch));
+
+    if (p->pLock->pPrefetch)
+    {
+      memset(p->pLock->pPrefetch, 0, sizeof(TeensyPrefetch));
+      teensyPrefetchLoad(p->pLock->pPrefetch, p->pLock->zName);
+    }
+  }
+
+  return SQLITE_OK;
 }
 
 /*
@@ -475,7 +4535,30 @@ static int teensyOpen(
   int *pOutFlags                  /* Output SQLITE_OPEN_XXX flags (or NULL) */
 ){
   static const sqlite3_io_methods teensyio = {
-    1,                            /* iVersion */
+    3,                            /* iVersion */
+    teensyClose,                    /* xClose */
+    teensyRead,                     /* xRead */
+    teensyWrite,                    /* xWrite */
+    teensyTruncate,                 /* xTruncate */
+    teensySync,                     /* xSync */
+    teensyFileSize,                 /* xFileSize */
+    teensyLock,                     /* xLock */
+    teensyUnlock,                   /* xUnlock */
+    teensyCheckReservedLock,        /* xCheckReservedLock */
+    teensyFileControl,              /* xFileControl */
+    teensySectorSize,               /* xSectorSize */
+    teensyDeviceCharacteristics,    /* xDeviceCharacteristics */
+    teensyShmMap,                   /* xShmMap */
+    teensyShmLock,                  /* xShmLock */
+    teensyShmBarrier,               /* xShmBarrier */
+    teensyShmUnmap,                 /* xShmUnmap */
+    teensyFetch,                    /* xFetch */
+    teensyUnfetch                   /* xUnfetch */
+  };
+
+  // without xShmMap SQLite does not switch encrypted databases to WAL mode
+  static const sqlite3_io_methods teensyCryptIo = {
+    1,                              /* iVersion */
     teensyClose,                    /* xClose */
     teensyRead,                     /* xRead */
     teensyWrite,                    /* xWrite */
@@ -487,11 +4570,19 @@ static int teensyOpen(
     teensyCheckReservedLock,        /* xCheckReservedLock */
     teensyFileControl,              /* xFileControl */
     teensySectorSize,               /* xSectorSize */
-    teensyDeviceCharacteristics     /* xDeviceCharacteristics */
+    teensyDeviceCharacteristics,    /* xDeviceCharacteristics */
+    0,                              /* xShmMap */
+    0,                              /* xShmLock */
+    0,                              /* xShmBarrier */
+    0,                              /* xShmUnmap */
+    0,                              /* xFetch */
+    0                               /* xUnfetch */
   };
 
   TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN("VFS_DEBUG_OPEN");
 
+  TeensyVFSGuard guard;
+
   TeensyVFSFile* p = (TeensyVFSFile*)pFile; /* Populate this structure */
   char* aBuf = 0;
 
@@ -503,9 +4594,168 @@ static int teensyOpen(
   TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_OPEN_FILE ");
   TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(zName);
 
-  if (flags & SQLITE_OPEN_MAIN_JOURNAL)
+  const T41SQLite::MemoryImage* image = T41SQLite::getInstance().findMemoryImage(zName);
+
+  if (image)
+  {
+    memset(p, 0, sizeof(TeensyVFSFile));
+    p->aImage = image->data;
+    p->nImage = static_cast<sqlite3_int64>(image->size);
+
+    if (pOutFlags)
+    {
+      *pOutFlags = (flags & ~(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)) | SQLITE_OPEN_READONLY;
+    }
+
+    p->zName = zName;
+    p->sqliteFile.pMethods = &teensyio;
+
+    return teensyLockOpen(p);
+  }
+
+  int eMirror = 0;
+
+  if (flags & SQLITE_OPEN_MAIN_DB)
+  {
+    const char* zMirror = sqlite3_uri_parameter(zName, "mirror");
+
+    if (zMirror && strcmp(zMirror, "writethrough") == 0)
+    {
+      eMirror = TEENSY_MIRROR_WRITE_THROUGH;
+    }
+    else if (zMirror && strcmp(zMirror, "checkpoint") == 0)
+    {
+      eMirror = TEENSY_MIRROR_CHECKPOINT;
+    }
+    else if (zMirror)
+    {
+      return SQLITE_CANTOPEN;
+    }
+  }
+  else if (((flags & SQLITE_OPEN_MAIN_JOURNAL) && teensyIsCheckpointMirrorJournal(zName, "-journal")) ||
+           ((flags & SQLITE_OPEN_WAL) && teensyIsCheckpointMirrorJournal(zName, "-wal")))
+  {
+    eMirror = TEENSY_MIRROR_MEMORY;
+  }
+
+  bool isCompressRequested = (flags & SQLITE_OPEN_MAIN_DB) && sqlite3_uri_boolean(zName, "compress", 0);
+
+  if (isCompressRequested && (eMirror || sqlite3_uri_boolean(zName, "batch_atomic", 0)))
+  {
+    return SQLITE_CANTOPEN;
+  }
+
+  bool isEncryptRequested = (flags & SQLITE_OPEN_MAIN_DB) && sqlite3_uri_boolean(zName, "encrypt", 0);
+  T41SQLiteCipher* pCipher = T41SQLite::getInstance().getCipher();
+
+  if ((isEncryptRequested && (eMirror || isCompressRequested || not pCipher)) ||
+      ((flags & SQLITE_OPEN_WAL) && teensyCryptFind(zName, "-wal")))
+  {
+    return SQLITE_CANTOPEN;
+  }
+
+  if (isEncryptRequested && not pCipher->isSeeded())
+  {
+    return SQLITE_MISUSE; /* the nonces would repeat those of the last start */
+  }
+
+  bool isCompressAllowed = (flags & SQLITE_OPEN_MAIN_DB) && not eMirror && not isEncryptRequested;
+  TeensyCompress* pCompress = isCompressAllowed ? teensyCompressFind(zName) : 0;
+
+  if (pCompress)
+  {
+    if (pCompress->bReadOnly && not (flags & SQLITE_OPEN_READONLY))
+    {
+      return SQLITE_CANTOPEN;
+    }
+
+    ++pCompress->nRef;
+  }
+  else if (isCompressAllowed && (isCompressRequested || teensyCompressIsContainer(zName)))
+  {
+    int rc = teensyCompressOpen(zName, flags & SQLITE_OPEN_READONLY, &pCompress);
+
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+  }
+
+  if (pCompress)
+  {
+    // served from the container only, which has its own file handle
+    memset(p, 0, sizeof(TeensyVFSFile));
+    p->pCompress = pCompress;
+    p->flags = flags;
+
+    if (pOutFlags)
+    {
+      *pOutFlags = flags;
+    }
+
+    p->zName = zName;
+    p->sqliteFile.pMethods = &teensyio;
+
+    return teensyLockOpen(p);
+  }
+
+  TeensyMirror* pMirror = eMirror ? teensyMirrorFind(zName) : 0;
+
+  if (pMirror)
+  {
+    if (pMirror->eMode != eMirror)
+    {
+      return SQLITE_CANTOPEN;
+    }
+
+    if (pMirror->bDeleted)
+    {
+      pMirror->bDeleted = false;
+      pMirror->nData = 0;
+    }
+
+    ++pMirror->nRef;
+  }
+  else if (eMirror)
+  {
+    pMirror = teensyMirrorAlloc(zName, eMirror);
+
+    if (not pMirror)
+    {
+      return SQLITE_NOMEM;
+    }
+
+    pMirror->msInterval = static_cast<uint32_t>(sqlite3_uri_int64(zName, "mirror_interval", 0));
+    int rc = eMirror == TEENSY_MIRROR_MEMORY ? SQLITE_OK : teensyMirrorLoad(pMirror);
+
+    if (rc != SQLITE_OK)
+    {
+      teensyMirrorFree(pMirror);
+      return rc;
+    }
+  }
+
+  if (eMirror && eMirror != TEENSY_MIRROR_WRITE_THROUGH)
+  {
+    // served from memory only, checkpoints open the slot files themselves
+    memset(p, 0, sizeof(TeensyVFSFile));
+    p->pMirror = pMirror;
+
+    if (pOutFlags)
+    {
+      *pOutFlags = flags;
+    }
+
+    p->zName = zName;
+    p->sqliteFile.pMethods = &teensyio;
+
+    return teensyLockOpen(p);
+  }
+
+  if (flags & (SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL))
   {
-    aBuf = (char*)sqlite3_malloc(SQLITE_VFS_JOURNAL_BUFFERSZ);
+    // the WAL is appended sequentially as well
+    aBuf = teensyAllocJournalBuffer();
     
     if (not aBuf)
     {
@@ -515,24 +4765,84 @@ static int teensyOpen(
   
   uint8_t openMode = (flags & SQLITE_OPEN_READONLY) ? FILE_READ : FILE_WRITE;
   memset(p, 0, sizeof(TeensyVFSFile));
-  p->teensyFile = new TeensyFile(T41SQLite::getInstance().getFilesystem()->open(zName, openMode));
+  p->teensyFile = new TeensyFile(TeensyStorage::open(T41SQLite::getInstance().getFilesystem(), zName, openMode));
   
   if (not p->teensyFile) // check if file is open
   {
-    sqlite3_free(aBuf);
+    if (pMirror)
+    {
+      teensyMirrorRelease(pMirror);
+    }
+
+    teensyFreeJournalBuffer(aBuf);
     return SQLITE_CANTOPEN;
   }
 
   p->aBuffer = aBuf;
+  p->pMirror = pMirror;
+  p->flags = flags;
+
+  int* pExists = (flags & (SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL)) ? teensyLockExists(zName) : 0;
+
+  if (pExists)
+  {
+    *pExists = *p->teensyFile ? TEENSY_EXISTS_YES : TEENSY_EXISTS_UNKNOWN;
+  }
+
+  if (flags & SQLITE_OPEN_WAL)
+  {
+    p->pNextWal = teensyWalList;
+    teensyWalList = p;
+  }
+
+  if ((flags & SQLITE_OPEN_MAIN_DB) && not pMirror && openMode == FILE_WRITE)
+  {
+    int rc = teensyBatchRecoverFile(zName, *p->teensyFile);
+
+    if (rc == SQLITE_OK && sqlite3_uri_boolean(zName, "batch_atomic", 0))
+    {
+      p->pBatch = teensyBatchOpen(zName);
+      rc = p->pBatch ? SQLITE_OK : SQLITE_CANTOPEN;
+    }
+
+    if (rc != SQLITE_OK)
+    {
+      p->teensyFile->close();
+      delete p->teensyFile;
+      p->teensyFile = nullptr;
+      return rc;
+    }
+  }
+
+  if (isEncryptRequested)
+  {
+    p->pCrypt = teensyCryptAcquire(zName, pCipher);
+
+    if (not p->pCrypt)
+    {
+      teensyClose(pFile);
+      return SQLITE_NOMEM;
+    }
+  }
+  else if (flags & SQLITE_OPEN_MAIN_JOURNAL)
+  {
+    p->pCrypt = teensyCryptFind(zName, "-journal");
+
+    if (p->pCrypt)
+    {
+      ++p->pCrypt->nRef;
+    }
+  }
 
   if (pOutFlags)
   {
     *pOutFlags = flags;
   }
 
-  p->sqliteFile.pMethods = &teensyio;
+  p->zName = zName;
+  p->sqliteFile.pMethods = p->pCrypt && (flags & SQLITE_OPEN_MAIN_DB) ? &teensyCryptIo : &teensyio;
 
-  return SQLITE_OK;
+  return teensyLockOpen(p);
 }
 
 /*
@@ -543,13 +4853,42 @@ static int teensyOpen(
 */
 static int teensyDelete(sqlite3_vfs *pVfs, const char *zPath, int dirSync)
 {
+  TeensyVFSGuard guard;
   TEENSY_41_SQLITE_DEBUG_SERIAL_PRINT("VFS_DEBUG_DELETE_PATH ");
   TEENSY_41_SQLITE_DEBUG_SERIAL_PRINTLN(zPath);
 
-  if (not T41SQLite::getInstance().getFilesystem()->remove(zPath))
+  TeensyMirror* pMirror = teensyMirrorFind(zPath);
+
+  if (pMirror && pMirror->eMode == TEENSY_MIRROR_MEMORY)
+  {
+    if (pMirror->nRef == 0)
+    {
+      teensyMirrorFree(pMirror);
+    }
+    else
+    {
+      pMirror->bDeleted = true;
+    }
+
+    return SQLITE_OK;
+  }
+
+  int* pExists = teensyLockExists(zPath);
+
+  if (not TeensyStorage::remove(T41SQLite::getInstance().getFilesystem(), zPath))
   {
+    if (pExists)
+    {
+      *pExists = TEENSY_EXISTS_UNKNOWN;
+    }
+
     return SQLITE_IOERR_DELETE;
   }
+
+  if (pExists)
+  {
+    *pExists = TEENSY_EXISTS_NO;
+  }
   
   return SQLITE_OK;
 }
@@ -564,6 +4903,7 @@ static int teensyAccess(
   int flags, 
   int *pResOut
 ){
+  TeensyVFSGuard guard;
   assert(flags==SQLITE_ACCESS_EXISTS ||
          flags==SQLITE_ACCESS_READ ||
          flags==SQLITE_ACCESS_READWRITE);
@@ -571,7 +4911,24 @@ static int teensyAccess(
   // Because we cannot/don't need to check access permissions,
   // we will set *pResOut to T41SQLite::ACCESS_SUCCESFUL,
   // if a file with the given name exists.
-  if (T41SQLite::getInstance().getFilesystem()->exists(zPath))
+  // SQLite asks for the journal and the WAL file at the start of every
+  // transaction, in exclusive owner mode the lock of the database knows
+  TeensyMirror* pMirror = teensyMirrorFind(zPath);
+  int* pExists = 0;
+
+  if (pMirror && pMirror->eMode == TEENSY_MIRROR_MEMORY)
+  {
+    *pResOut = pMirror->bDeleted ? T41SQLite::ACCESS_FAILED : T41SQLite::ACCESS_SUCCESFUL;
+  }
+  else if (T41SQLite::getInstance().findMemoryImage(zPath))
+  {
+    *pResOut = flags == SQLITE_ACCESS_READWRITE ? T41SQLite::ACCESS_FAILED : T41SQLite::ACCESS_SUCCESFUL;
+  }
+  else if ((pExists = teensyLockExists(zPath)) && *pExists != TEENSY_EXISTS_UNKNOWN)
+  {
+    *pResOut = *pExists == TEENSY_EXISTS_YES ? T41SQLite::ACCESS_SUCCESFUL : T41SQLite::ACCESS_FAILED;
+  }
+  else if (TeensyStorage::exists(T41SQLite::getInstance().getFilesystem(), zPath))
   {
     *pResOut = T41SQLite::ACCESS_SUCCESFUL;
   }
@@ -579,6 +4936,11 @@ static int teensyAccess(
   {
     *pResOut = T41SQLite::ACCESS_FAILED;
   }
+
+  if (pExists)
+  {
+    *pExists = *pResOut == T41SQLite::ACCESS_SUCCESFUL ? TEENSY_EXISTS_YES : TEENSY_EXISTS_NO;
+  }
   
   return SQLITE_OK;
 }
@@ -662,7 +5024,13 @@ static int teensyRandomness(sqlite3_vfs *pVfs, int nByte, char *zByte)
 static int teensySleep(sqlite3_vfs *pVfs, int nMicro)
 {
   elapsedMicros elapsedMicroseconds;
-  delayMicroseconds(nMicro);
+
+  // SQLite sleeps while it waits for a lock, other tasks (e.g. the one holding the lock) keep running
+  while (elapsedMicroseconds < static_cast<unsigned long>(nMicro))
+  {
+    yield();
+  }
+
   return elapsedMicroseconds;
 }
 
@@ -684,6 +5052,49 @@ static int teensyCurrentTime(sqlite3_vfs *pVfs, double *pTime)
   return SQLITE_OK;
 }
 
+/*
+** xOpen() and xAccess() of the image VFS (TEENSY_41_SQLITE_IMAGE_VFS_NAME). It only serves
+** memory images and never touches the filesystem, e.g.
+**
+**   sqlite3_open_v2("file:calib.db?immutable=1", &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, "T41_IMAGE_VFS");
+*/
+static int teensyImageOpen(
+  sqlite3_vfs *pVfs,
+  const char *zName,
+  sqlite3_file *pFile,
+  int flags,
+  int *pOutFlags
+){
+  if (zName == 0 || not T41SQLite::getInstance().findMemoryImage(zName))
+  {
+    pFile->pMethods = 0;
+    return SQLITE_CANTOPEN;
+  }
+
+  return teensyOpen(pVfs, zName, pFile, flags, pOutFlags);
+}
+
+static int teensyImageAccess(
+  sqlite3_vfs *pVfs, 
+  const char *zPath, 
+  int flags, 
+  int *pResOut
+){
+  *pResOut = T41SQLite::ACCESS_FAILED;
+
+  if (flags != SQLITE_ACCESS_READWRITE && T41SQLite::getInstance().findMemoryImage(zPath))
+  {
+    *pResOut = T41SQLite::ACCESS_SUCCESFUL;
+  }
+
+  return SQLITE_OK;
+}
+
+static int teensyImageDelete(sqlite3_vfs *pVfs, const char *zPath, int dirSync)
+{
+  return SQLITE_IOERR_DELETE;
+}
+
 /*
 ** This function returns a pointer to the VFS implemented in this file.
 ** To make the VFS available to SQLite:
@@ -715,13 +5126,77 @@ sqlite3_vfs* sqlite3_teensy_vfs(void)
   return &teensyvfs;
 }
 
+/*
+** This function returns a pointer to the read-only image VFS (see teensyImageOpen).
+*/
+sqlite3_vfs* sqlite3_teensy_image_vfs(void)
+{
+  static sqlite3_vfs teensyimagevfs = {
+    1,                            /* iVersion */
+    sizeof(TeensyVFSFile),        /* szOsFile */
+    MAXPATHNAME,                  /* mxPathname */
+    0,                            /* pNext */
+    TEENSY_41_SQLITE_IMAGE_VFS_NAME, /* zName */
+    0,                            /* pAppData */
+    teensyImageOpen,                /* xOpen */
+    teensyImageDelete,              /* xDelete */
+    teensyImageAccess,              /* xAccess */
+    teensyFullPathname,             /* xFullPathname */
+    teensyDlOpen,                   /* xDlOpen */
+    teensyDlError,                  /* xDlError */
+    teensyDlSym,                    /* xDlSym */
+    teensyDlClose,                  /* xDlClose */
+    teensyRandomness,               /* xRandomness */
+    teensySleep,                    /* xSleep */
+    teensyCurrentTime,              /* xCurrentTime */
+  };
+
+  return &teensyimagevfs;
+}
+
+int sqlite3_teensy_os_init(void)
+{
+#if !defined(SQLITE_THREADSAFE) || SQLITE_THREADSAFE > 0
+  if (sqlite3_threadsafe() && not teensyVfsMutex)
+  {
+    teensyVfsMutex = sqlite3_mutex_alloc(SQLITE_MUTEX_RECURSIVE);
+
+    if (not teensyVfsMutex)
+    {
+      return SQLITE_NOMEM;
+    }
+  }
+#endif
+
+  int rc = sqlite3_vfs_register(sqlite3_teensy_vfs(), T41SQLite::IS_DEFAULT_VFS);
+
+  if (rc != SQLITE_OK)
+  {
+    return rc;
+  }
+
+  return sqlite3_vfs_register(sqlite3_teensy_image_vfs(), 0);
+}
+
+int sqlite3_teensy_os_end(void)
+{
+  // undo what sqlite3_teensy_os_init did (e.g. free resources)
+#if !defined(SQLITE_THREADSAFE) || SQLITE_THREADSAFE > 0
+  sqlite3_mutex_free(teensyVfsMutex);
+  teensyVfsMutex = 0;
+#endif
+
+  return SQLITE_OK;
+}
+
+#if defined(SQLITE_OS_OTHER) && SQLITE_OS_OTHER
 int sqlite3_os_init(void)
 {
-  return sqlite3_vfs_register(sqlite3_teensy_vfs(), T41SQLite::IS_DEFAULT_VFS);
+  return sqlite3_teensy_os_init();
 }
 
 int sqlite3_os_end(void)
 {
-  // undo what sqlite3_os_init did (e.g. free resources)
-  return SQLITE_OK;
+  return sqlite3_teensy_os_end();
 }
+#endif
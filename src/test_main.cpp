@@ -1,11 +1,31 @@
 #include <Arduino.h>
 
 #include "teensy41SQLite.hpp"
+#include "teensy41SQLiteArchive.hpp"
+#include "teensy41SQLiteArray.hpp"
+#include "teensy41SQLiteCipher.hpp"
+#include "teensy41SQLiteCommitQueue.hpp"
+#include "teensy41SQLiteCursor.hpp"
+#include "teensy41SQLiteDatabase.hpp"
+#include "teensy41SQLiteIngest.hpp"
+#include "teensy41SQLiteMutex.hpp"
+#include "teensy41SQLiteProfile.hpp"
+#include "teensy41SQLiteSchema.hpp"
+#include "teensy41SQLiteShim.hpp"
+#include "teensy41SQLiteTimeSeries.hpp"
 
 #include <SD.h>
 
+#if TEENSY_41_SQLITE_MUTEX_BACKEND == TEENSY_41_SQLITE_MUTEX_TEENSYTHREADS
+  #include <TeensyThreads.h>
+#endif
+
 const char* dbName = "test.db";
 const char* dbJournalName = "test.db-journal";
+const char* dbMirrorSlotName = "test.db-b";
+const char* dbMirrorRecordName = "test.db-ab";
+const char* dbBatchLogName = "test.db-batch";
+const char* dbWalName = "test.db-wal";
 
 void setupSerial(long in_serialBaudrate, unsigned long in_timeoutInSeconds = 15)
 {
@@ -110,28 +130,1631 @@ void testSQLite()
   Serial.println("---- testSQLite - sqlite3_close - end ----");
 }
 
-void setup()
+void benchmarkPrepareAndLookup(sqlite3* in_db, const char* in_label, int in_iterations = 1000)
 {
-  setupSerial(115200);
-  delaySetup(3);
+  elapsedMicros prepareTime;
 
-  if (not SD.begin(BUILTIN_SDCARD))
+  for (int i = 0; i < in_iterations; ++i)
   {
-    Serial.println("SD.begin() failed! - Halting!");
-    while (true) { delay(1000); }
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(in_db, "SELECT value FROM Bench WHERE id = ?1;", -1, &stmt, 0);
+    sqlite3_finalize(stmt);
   }
 
-  if (SD.exists(dbName)) { if (not SD.remove(dbName)) { Serial.printf("Remove %s failed!", dbName); } }
-  if (SD.exists(dbJournalName)) { if (not SD.remove(dbJournalName)) { Serial.printf("Remove %s failed!", dbJournalName); } }
+  uint32_t prepareMicros = prepareTime;
 
-  T41SQLite::getInstance().setLogCallback(errorLogCallback);
-  int resultBegin = T41SQLite::getInstance().begin(&SD);
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(in_db, "SELECT value FROM Bench WHERE id = ?1;", -1, &stmt, 0);
+  elapsedMicros lookupTime;
 
-  if (resultBegin == SQLITE_OK)
+  for (int i = 0; i < in_iterations; ++i)
   {
-    Serial.println("T41SQLite::getInstance().begin() succeded!");
+    sqlite3_bind_int(stmt, 1, (i * 7919) % in_iterations);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+
+  uint32_t lookupMicros = lookupTime;
+  sqlite3_finalize(stmt);
+
+  Serial.printf("benchmark %s: prepare %.2f us, point lookup %.2f us\n", in_label,
+                static_cast<double>(prepareMicros) / in_iterations, static_cast<double>(lookupMicros) / in_iterations);
+}
+
+void benchmarkDTCM()
+{
+  Serial.println("---- benchmarkDTCM - begin ----");
+  Serial.printf("DTCM page cache: %d, DTCM journal buffers: %d\n",
+                T41SQLite::getInstance().getUseDTCMPageCache(), T41SQLite::getInstance().getUseDTCMJournalBuffers());
+
+  sqlite3* db;
+  sqlite3_open(dbName, &db);
+  sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS Bench(id INTEGER PRIMARY KEY, value INT);", NULL, 0, NULL);
+  sqlite3_exec(db, "BEGIN; WITH RECURSIVE c(x) AS (SELECT 0 UNION ALL SELECT x + 1 FROM c WHERE x < 999) "
+                   "INSERT OR REPLACE INTO Bench SELECT x, x * 3 FROM c; COMMIT;", NULL, 0, NULL);
+  benchmarkPrepareAndLookup(db, "heap lookaside");
+  sqlite3_close(db);
+
+  sqlite3_open(dbName, &db);
+  int rc = T41SQLite::getInstance().useDTCMLookaside(db);
+
+  if (rc == SQLITE_OK)
+  {
+    benchmarkPrepareAndLookup(db, "DTCM lookaside");
+  }
+  else
+  {
+    Serial.printf("useDTCMLookaside() failed: %d\n", rc);
+  }
+
+  sqlite3_close(db);
+  Serial.println("---- benchmarkDTCM - end ----");
+}
+
+void benchmarkMirror(int in_lookups = 10000)
+{
+  Serial.println("---- benchmarkMirror - begin ----");
+  const char* uris[] = { "test.db", "file:test.db?mirror=writethrough", "file:test.db?mirror=checkpoint" };
+
+  for (const char* uri : uris)
+  {
+    sqlite3* db;
+    elapsedMicros openTime;
+    int rc = sqlite3_open(uri, &db);
+    uint32_t openMicros = openTime;
+
+    if (rc != SQLITE_OK)
+    {
+      checkSQLiteError(db, rc);
+      sqlite3_close(db);
+      continue;
+    }
+
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, "SELECT value FROM Bench WHERE id = ?1;", -1, &stmt, 0);
+    elapsedMicros queryTime;
+
+    for (int i = 0; i < in_lookups; ++i)
+    {
+      sqlite3_bind_int(stmt, 1, (i * 7919) % 1000);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
+    }
+
+    uint32_t queryMicros = queryTime;
+    sqlite3_finalize(stmt);
+
+    elapsedMicros commitTime;
+    sqlite3_exec(db, "UPDATE Bench SET value = value + 1 WHERE id = 1;", NULL, 0, NULL);
+    uint32_t commitMicros = commitTime;
+
+    sqlite3_close(db);
+    Serial.printf("benchmark %s: open/load %lu us, point lookup %.2f us, commit %lu us\n", uri,
+                  openMicros, static_cast<double>(queryMicros) / in_lookups, commitMicros);
+  }
+
+  Serial.println("---- benchmarkMirror - end ----");
+}
+
+void benchmarkBatchAtomic(int in_commits = 100)
+{
+  Serial.println("---- benchmarkBatchAtomic - begin ----");
+  const char* uris[] = { "test.db", "file:test.db?batch_atomic=1" };
+
+  for (const char* uri : uris)
+  {
+    sqlite3* db;
+    int rc = sqlite3_open(uri, &db);
+
+    if (rc != SQLITE_OK)
+    {
+      checkSQLiteError(db, rc);
+      sqlite3_close(db);
+      continue;
+    }
+
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, "UPDATE Bench SET value = value + 1 WHERE id = ?1;", -1, &stmt, 0);
+    elapsedMicros commitTime;
+
+    for (int i = 0; i < in_commits; ++i)
+    {
+      sqlite3_bind_int(stmt, 1, (i * 7919) % 1000);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
+    }
+
+    uint32_t commitMicros = commitTime;
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    Serial.printf("benchmark %s: %.1f us per commit\n", uri, static_cast<double>(commitMicros) / in_commits);
+  }
+
+  Serial.println("---- benchmarkBatchAtomic - end ----");
+}
+
+void benchmarkWAL(int in_commits = 100)
+{
+  Serial.println("---- benchmarkWAL - begin ----");
+  const char* journalModes[] = { "DELETE", "WAL" };
+
+  for (const char* journalMode : journalModes)
+  {
+    sqlite3* db;
+    int rc = sqlite3_open(dbName, &db);
+
+    if (rc != SQLITE_OK)
+    {
+      checkSQLiteError(db, rc);
+      sqlite3_close(db);
+      continue;
+    }
+
+    String pragma = String("PRAGMA journal_mode=") + journalMode + ";";
+    sqlite3_exec(db, pragma.c_str(), NULL, 0, NULL);
+    sqlite3_exec(db, "PRAGMA synchronous=NORMAL;", NULL, 0, NULL);
+
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, "UPDATE Bench SET value = value + 1 WHERE id = ?1;", -1, &stmt, 0);
+    elapsedMicros commitTime;
+
+    for (int i = 0; i < in_commits; ++i)
+    {
+      sqlite3_bind_int(stmt, 1, (i * 7919) % 1000);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
+    }
+
+    uint32_t commitMicros = commitTime;
+    sqlite3_finalize(stmt);
+
+    elapsedMicros checkpointTime;
+    sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE);", NULL, 0, NULL);
+    uint32_t checkpointMicros = checkpointTime;
+
+    sqlite3_exec(db, "PRAGMA journal_mode=DELETE;", NULL, 0, NULL);
+    sqlite3_close(db);
+    Serial.printf("benchmark journal_mode=%s: %.1f us per commit, checkpoint %lu us\n", journalMode,
+                  static_cast<double>(commitMicros) / in_commits, checkpointMicros);
+  }
+
+  Serial.println("---- benchmarkWAL - end ----");
+}
+
+void benchmarkGroupCommit(int in_rows = 500)
+{
+  Serial.println("---- benchmarkGroupCommit - begin ----");
+  sqlite3* db;
+  int rc = sqlite3_open(dbName, &db);
+
+  if (rc != SQLITE_OK)
+  {
+    checkSQLiteError(db, rc);
+    sqlite3_close(db);
+    return;
+  }
+
+  sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS Samples (time INTEGER, value REAL);", NULL, 0, NULL);
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "INSERT INTO Samples VALUES (?1, ?2);", -1, &stmt, 0);
+
+  elapsedMicros singleTime;
+
+  for (int i = 0; i < in_rows; ++i)
+  {
+    sqlite3_bind_int(stmt, 1, micros());
+    sqlite3_bind_double(stmt, 2, i * 0.5);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+
+  uint32_t singleMicros = singleTime;
+
+  T41SQLiteCommitQueue queue;
+  queue.begin(db, 100, 250);
+  elapsedMicros groupTime;
+
+  for (int i = 0; i < in_rows; ++i)
+  {
+    sqlite3_bind_int(stmt, 1, micros());
+    sqlite3_bind_double(stmt, 2, i * 0.5);
+    queue.submit(stmt);
+  }
+
+  queue.end();
+  uint32_t groupMicros = groupTime;
+
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  Serial.printf("benchmark one transaction per row: %.0f rows/s\n", in_rows * 1000000.0 / singleMicros);
+  Serial.printf("benchmark group commit (100 rows/250 ms): %.0f rows/s, %lu commits\n",
+                in_rows * 1000000.0 / groupMicros, queue.getCommitCount());
+  Serial.println("---- benchmarkGroupCommit - end ----");
+}
+
+void benchmarkCursor(uint32_t in_budgetMicros = 1000)
+{
+  Serial.println("---- benchmarkCursor - begin ----");
+  sqlite3* db;
+  int rc = sqlite3_open(dbName, &db);
+
+  if (rc != SQLITE_OK)
+  {
+    checkSQLiteError(db, rc);
+    sqlite3_close(db);
+    return;
+  }
+
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "SELECT count(*), sum(value), avg(length(value)) FROM Samples, Bench;", -1, &stmt, 0);
+
+  T41SQLiteCursor cursor;
+  cursor.begin(stmt);
+  uint32_t maxSliceMicros = 0;
+  elapsedMicros totalTime;
+
+  do
+  {
+    elapsedMicros sliceTime;
+    rc = cursor.step(in_budgetMicros);
+    maxSliceMicros = max(maxSliceMicros, static_cast<uint32_t>(sliceTime));
+    // the main loop keeps running here (e.g. motor control, USB)
+  }
+  while (rc == T41SQLiteCursor::STEP_PENDING);
+
+  uint32_t totalMicros = totalTime;
+  Serial.printf("benchmark cursor (budget %lu us): result %d, %lu slices, longest slice %lu us, total %lu us\n",
+                in_budgetMicros, rc, cursor.getSliceCount(), maxSliceMicros, totalMicros);
+
+  cursor.end();
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  Serial.println("---- benchmarkCursor - end ----");
+}
+
+void benchmarkMaintenance(uint32_t in_budgetMicros = 2000, int in_tables = 4, int in_rows = 2000)
+{
+  Serial.println("---- benchmarkMaintenance - begin ----");
+  if (SD.exists("maintenance.db")) { SD.remove("maintenance.db"); }
+  sqlite3* db;
+  int rc = sqlite3_open("maintenance.db", &db);
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, "PRAGMA auto_vacuum=INCREMENTAL; CREATE TABLE Log(time INTEGER, text TEXT); BEGIN;", 0, 0, 0);
+  }
+
+  for (int t = 0; t < in_tables && rc == SQLITE_OK; ++t)
+  {
+    char* sql = sqlite3_mprintf("CREATE TABLE Data%d(id INTEGER PRIMARY KEY, value INTEGER); "
+                                "CREATE INDEX DataValue%d ON Data%d(value); "
+                                "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < %d) "
+                                "INSERT INTO Data%d(value) SELECT x %% 97 FROM c; "
+                                "INSERT INTO Log SELECT value, hex(randomblob(16)) FROM Data%d;",
+                                t, t, t, in_rows, t, t);
+    rc = sql ? sqlite3_exec(db, sql, 0, 0, 0) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+  }
+
+  T41SQLite& t41SQLite = T41SQLite::getInstance();
+  int ids[3] = {};
+
+  if (rc == SQLITE_OK)
+  {
+    rc = t41SQLite.addMaintenanceTask(db, T41SQLite::MaintenanceTask::Sql, 0,
+                                      "DELETE FROM Log WHERE rowid IN (SELECT rowid FROM Log WHERE time < 90 LIMIT 50);",
+                                      &ids[0]);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = t41SQLite.addMaintenanceTask(db, T41SQLite::MaintenanceTask::IncrementalVacuum, 0, nullptr, &ids[1]);
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    rc = t41SQLite.addMaintenanceTask(db, T41SQLite::MaintenanceTask::Optimize, 0, nullptr, &ids[2]);
+  }
+
+  bool isDone = false;
+  bool isWithinBudget = true;
+  int calls = 0;
+  uint32_t maxCallMicros = 0;
+
+  // a call may only exceed the budget by the slice it started last
+  while (rc == SQLITE_OK && not isDone && calls < 10000)
+  {
+    elapsedMicros callTime;
+    rc = t41SQLite.runMaintenance(in_budgetMicros);
+    uint32_t callMicros = callTime;
+    uint32_t maxSliceMicros = 0;
+    isDone = true;
+    ++calls;
+
+    for (int id : ids)
+    {
+      const T41SQLite::MaintenanceStats* stats = t41SQLite.getMaintenanceStats(id);
+      maxSliceMicros = max(maxSliceMicros, stats->maxMicros);
+      isDone = isDone && stats->completions > 0;
+    }
+
+    isWithinBudget = isWithinBudget && callMicros <= in_budgetMicros + maxSliceMicros;
+    maxCallMicros = max(maxCallMicros, callMicros);
+  }
+
+  checkSQLiteError(db, rc);
+
+  const char* names[] = { "rolling delete", "incremental vacuum", "optimize" };
+
+  for (int i = 0; i < 3 && rc == SQLITE_OK; ++i)
+  {
+    const T41SQLite::MaintenanceStats* stats = t41SQLite.getMaintenanceStats(ids[i]);
+    Serial.printf("benchmark maintenance %s: %lu slices, longest slice %lu us, total %lu us\n", names[i],
+                  stats->slices, stats->maxMicros, static_cast<uint32_t>(stats->totalMicros));
+  }
+
+  Serial.printf("benchmark maintenance (budget %lu us): %d calls, longest call %lu us, %s\n", in_budgetMicros, calls,
+                maxCallMicros, isDone && isWithinBudget ? "within budget" : "BUDGET EXCEEDED");
+
+  t41SQLite.removeMaintenanceTasks(db);
+  sqlite3_close(db);
+  SD.remove("maintenance.db");
+  Serial.println("---- benchmarkMaintenance - end ----");
+}
+
+struct IngestSample
+{
+  uint32_t time;
+  uint32_t sequence;
+};
+
+T41SQLiteIngest<IngestSample, 4096> ingest;
+volatile uint32_t ingestSequence = 0;
+
+void ingestTimerISR()
+{
+  ingest.push({ micros(), ingestSequence });
+  ingestSequence = ingestSequence + 1;
+}
+
+int bindIngestSample(sqlite3_stmt* io_stmt, const IngestSample& in_sample)
+{
+  sqlite3_bind_int64(io_stmt, 1, in_sample.time);
+  return sqlite3_bind_int64(io_stmt, 2, in_sample.sequence);
+}
+
+void benchmarkIngest(uint32_t in_rateHz = 5000, uint32_t in_seconds = 3)
+{
+  Serial.println("---- benchmarkIngest - begin ----");
+  sqlite3* db;
+  int rc = sqlite3_open(dbName, &db);
+
+  if (rc != SQLITE_OK)
+  {
+    checkSQLiteError(db, rc);
+    sqlite3_close(db);
+    return;
+  }
+
+  sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS Ingest (time INTEGER, sequence INTEGER);", NULL, 0, NULL);
+  ingest.begin(db, "INSERT INTO Ingest VALUES (?1, ?2);", bindIngestSample, 1024);
+
+  IntervalTimer timer;
+  timer.begin(ingestTimerISR, 1000000.0f / in_rateHz);
+  elapsedMillis runTime;
+
+  while (runTime < in_seconds * 1000)
+  {
+    ingest.drain(2000);
+  }
+
+  timer.end();
+  ingest.end();
+
+  Serial.printf("benchmark ingest %lu Hz: produced %lu, inserted %lu, overflows %lu, batches %lu, "
+                "longest drain %lu us, high water mark %lu\n",
+                in_rateHz, ingestSequence, ingest.getInsertedCount(), ingest.getOverflowCount(), ingest.getBatchCount(),
+                ingest.getMaxDrainMicros(), ingest.getBuffer().getHighWaterMark());
+
+  sqlite3_close(db);
+  Serial.println("---- benchmarkIngest - end ----");
+}
+
+void benchmarkStatementCache(int in_lookups = 10000)
+{
+  Serial.println("---- benchmarkStatementCache - begin ----");
+  sqlite3* db;
+  int rc = sqlite3_open(dbName, &db);
+
+  if (rc != SQLITE_OK)
+  {
+    checkSQLiteError(db, rc);
+    sqlite3_close(db);
+    return;
+  }
+
+  const char* sql = "SELECT value FROM Bench WHERE id = ?1;";
+  elapsedMicros prepareTime;
+
+  for (int i = 0; i < in_lookups; ++i)
+  {
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+    sqlite3_bind_int(stmt, 1, (i * 7919) % 1000);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+  }
+
+  uint32_t prepareMicros = prepareTime;
+  elapsedMicros cacheTime;
+
+  for (int i = 0; i < in_lookups; ++i)
+  {
+    sqlite3_stmt* stmt = T41SQLite::getInstance().getStatement(db, sql);
+    sqlite3_bind_int(stmt, 1, (i * 7919) % 1000);
+    sqlite3_step(stmt);
+    T41SQLite::getInstance().releaseStatement(stmt);
+  }
+
+  uint32_t cacheMicros = cacheTime;
+
+  Serial.printf("benchmark prepare per lookup: %.2f us, statement cache: %.2f us (hits %lu, misses %lu)\n",
+                static_cast<double>(prepareMicros) / in_lookups, static_cast<double>(cacheMicros) / in_lookups,
+                T41SQLite::getInstance().getStatementCacheHits(), T41SQLite::getInstance().getStatementCacheMisses());
+
+  T41SQLite::getInstance().clearStatementCache(db);
+  sqlite3_close(db);
+  Serial.println("---- benchmarkStatementCache - end ----");
+}
+
+struct Reading
+{
+  int64_t time;
+  double value;
+  char unit[8];
+};
+
+template <>
+struct T41SQLiteTable<Reading>
+{
+  static constexpr const char* name = "Readings";
+  static constexpr auto columns = std::make_tuple(
+    T41SQLiteColumn<Reading, int64_t>("time", &Reading::time, "PRIMARY KEY"),
+    T41SQLiteColumn<Reading, double>("value", &Reading::value),
+    T41SQLiteColumn<Reading, char[8]>("unit", &Reading::unit));
+};
+
+void benchmarkSchema(int in_rows = 1000)
+{
+  Serial.println("---- benchmarkSchema - begin ----");
+  sqlite3* db;
+  int rc = sqlite3_open(dbName, &db);
+
+  if (rc != SQLITE_OK)
+  {
+    checkSQLiteError(db, rc);
+    sqlite3_close(db);
+    return;
+  }
+
+  Serial.println(T41SQLiteSql<Reading>::create);
+  sqlite3_exec(db, T41SQLiteSql<Reading>::create, nullptr, nullptr, nullptr);
+  sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+  elapsedMicros stringTime;
+
+  for (int i = 0; i < in_rows; ++i)
+  {
+    String sql = String("INSERT INTO Readings (time, value, unit) VALUES (") + i + ", " + String(i * 0.25, 2) + ", 'degC');";
+    sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr);
+  }
+
+  uint32_t stringMicros = stringTime;
+  sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v3(db, T41SQLiteSql<Reading>::insert, -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr);
+  sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+  elapsedMicros typedTime;
+  Reading reading = { 0, 0.0, "degC" };
+
+  for (int i = 0; i < in_rows; ++i)
+  {
+    reading.time = i;
+    reading.value = i * 0.25;
+    T41SQLiteRow<Reading>::insert(stmt, reading);
+  }
+
+  uint32_t typedMicros = typedTime;
+  sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+  sqlite3_finalize(stmt);
+
+  int readCount = 0;
+  sqlite3_prepare_v2(db, T41SQLiteSql<Reading>::select, -1, &stmt, nullptr);
+
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    T41SQLiteRow<Reading>::read(stmt, reading);
+    ++readCount;
+  }
+
+  sqlite3_finalize(stmt);
+
+  Serial.printf("benchmark String insert: %.0f rows/s, typed insert: %.0f rows/s, read back %d rows\n",
+                in_rows * 1000000.0 / stringMicros, in_rows * 1000000.0 / typedMicros, readCount);
+
+  sqlite3_exec(db, "DROP TABLE Readings;", nullptr, nullptr, nullptr);
+  sqlite3_close(db);
+  Serial.println("---- benchmarkSchema - end ----");
+}
+
+void benchmarkWrappers(int in_rows = 1000)
+{
+  Serial.println("---- benchmarkWrappers - begin ----");
+  sqlite3* db;
+  int rc = sqlite3_open(dbName, &db);
+
+  if (rc != SQLITE_OK)
+  {
+    checkSQLiteError(db, rc);
+    sqlite3_close(db);
+    return;
+  }
+
+  sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS Labels (id INTEGER PRIMARY KEY, label TEXT);", nullptr, nullptr, nullptr);
+
+  // String based
+  elapsedMicros stringTime;
+  sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+
+  for (int i = 0; i < in_rows; ++i)
+  {
+    String sql = String("INSERT INTO Labels (id, label) VALUES (") + i + ", 'label " + i + "');";
+    sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr);
+  }
+
+  size_t stringLength = 0;
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "SELECT label FROM Labels;", -1, &stmt, nullptr);
+
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    String label = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+    stringLength += label.length();
+  }
+
+  sqlite3_finalize(stmt);
+  sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+  uint32_t stringMicros = stringTime;
+
+  // wrappers
+  elapsedMicros wrapperTime;
+  size_t wrapperLength = 0;
+  {
+    T41SQLiteStatement insert;
+    T41SQLiteStatement select;
+    insert.prepare(db, "INSERT INTO Labels (id, label) VALUES (?1, ?2);", SQLITE_PREPARE_PERSISTENT);
+    select.prepare(db, "SELECT label FROM Labels;");
+
+    T41SQLiteTransaction transaction(db);
+    char label[16];
 
+    for (int i = 0; i < in_rows; ++i)
+    {
+      snprintf(label, sizeof(label), "label %d", i);
+      insert.bindValues(i, label);
+      insert.execute();
+    }
+
+    while (select.step() == SQLITE_ROW)
+    {
+      wrapperLength += select.getText(0).size;
+    }
+  } // rolled back
+  uint32_t wrapperMicros = wrapperTime;
+
+  Serial.printf("benchmark String: %.0f rows/s, wrappers: %.0f rows/s (%s)\n",
+                in_rows * 1000000.0 / stringMicros, in_rows * 1000000.0 / wrapperMicros,
+                stringLength == wrapperLength ? "same result" : "different result");
+
+  sqlite3_exec(db, "DROP TABLE Labels;", nullptr, nullptr, nullptr);
+  sqlite3_close(db);
+  Serial.println("---- benchmarkWrappers - end ----");
+}
+
+void benchmarkArray(int in_rows = 1000)
+{
+  Serial.println("---- benchmarkArray - begin ----");
+  sqlite3* db;
+  int rc = sqlite3_open(dbName, &db);
+
+  if (rc != SQLITE_OK)
+  {
+    checkSQLiteError(db, rc);
+    sqlite3_close(db);
+    return;
+  }
+
+  T41SQLiteArray::registerModule(db);
+  sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS Series (time INTEGER PRIMARY KEY, value REAL);"
+                   "CREATE VIRTUAL TABLE temp.SeriesArray USING carray(time, value);", nullptr, nullptr, nullptr);
+
+  int64_t* times = static_cast<int64_t*>(malloc(in_rows * sizeof(int64_t)));
+  double* values = static_cast<double*>(malloc(in_rows * sizeof(double)));
+
+  if (not times || not values)
+  {
+    free(times);
+    free(values);
+    sqlite3_close(db);
+    return;
+  }
+
+  for (int i = 0; i < in_rows; ++i)
+  {
+    times[i] = i;
+    values[i] = i * 0.5;
+  }
+
+  // one bind/step/reset per row
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "INSERT INTO Series VALUES (?1, ?2);", -1, &stmt, nullptr);
+  sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+  elapsedMicros rowTime;
+
+  for (int i = 0; i < in_rows; ++i)
+  {
+    sqlite3_bind_int64(stmt, 1, times[i]);
+    sqlite3_bind_double(stmt, 2, values[i]);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+
+  uint32_t rowMicros = rowTime;
+  sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+  sqlite3_finalize(stmt);
+
+  // one statement for all rows
+  T41SQLiteArray series(in_rows);
+  series.addColumn(times);
+  series.addColumn(values);
+  sqlite3_prepare_v2(db, "INSERT INTO Series SELECT * FROM SeriesArray(?1);", -1, &stmt, nullptr);
+  sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+  elapsedMicros arrayTime;
+  series.bind(stmt, 1);
+  sqlite3_step(stmt);
+  uint32_t arrayMicros = arrayTime;
+  sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+  sqlite3_finalize(stmt);
+
+  // IN list of every 10th time
+  T41SQLiteArray lookup(in_rows / 10);
+  lookup.addColumn(T41SQLiteArray::Type::Int64, times, 10 * sizeof(int64_t));
+  sqlite3_prepare_v2(db, "SELECT count(*) FROM Series WHERE time IN carray(?1);", -1, &stmt, nullptr);
+  elapsedMicros inTime;
+  lookup.bind(stmt, 1);
+  sqlite3_step(stmt);
+  uint32_t inMicros = inTime;
+  int inCount = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  Serial.printf("benchmark per row insert: %.0f rows/s, carray insert: %.0f rows/s, IN carray: %d rows in %lu us\n",
+                in_rows * 1000000.0 / rowMicros, in_rows * 1000000.0 / arrayMicros, inCount, inMicros);
+
+  free(times);
+  free(values);
+  sqlite3_exec(db, "DROP TABLE SeriesArray; DROP TABLE Series;", nullptr, nullptr, nullptr);
+  sqlite3_close(db);
+  Serial.println("---- benchmarkArray - end ----");
+}
+
+void benchmarkTimeSeries(int in_rows = 10000)
+{
+  Serial.println("---- benchmarkTimeSeries - begin ----");
+  sqlite3* db;
+  int rc = sqlite3_open(dbName, &db);
+
+  if (rc != SQLITE_OK)
+  {
+    checkSQLiteError(db, rc);
+    sqlite3_close(db);
+    return;
+  }
+
+  T41SQLiteTimeSeries::registerModule(db);
+  sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS TreeSamples (ts INTEGER PRIMARY KEY, temperature REAL, pressure REAL);"
+                   "CREATE VIRTUAL TABLE LogSamples USING timeseries(temperature FLOAT, pressure FLOAT);",
+               nullptr, nullptr, nullptr);
+
+  const char* tables[] = { "TreeSamples", "LogSamples" };
+
+  for (const char* table : tables)
+  {
+    char sql[128];
+    snprintf(sql, sizeof(sql), "INSERT INTO %s VALUES (?1, ?2, ?3);", table);
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+    elapsedMicros insertTime;
+
+    for (int i = 0; i < in_rows; ++i)
+    {
+      if (i % 500 == 0)
+      {
+        sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+      }
+
+      sqlite3_bind_int64(stmt, 1, i * 10LL);
+      sqlite3_bind_double(stmt, 2, 20.0 + (i % 100) * 0.01);
+      sqlite3_bind_double(stmt, 3, 1013.0 - (i % 50) * 0.1);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
+
+      if (i % 500 == 499 || i == in_rows - 1)
+      {
+        sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+      }
+    }
+
+    uint32_t insertMicros = insertTime;
+    sqlite3_finalize(stmt);
+
+    snprintf(sql, sizeof(sql), "SELECT avg(temperature) FROM %s WHERE ts BETWEEN ?1 AND ?2;", table);
+    sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+    sqlite3_bind_int64(stmt, 1, in_rows * 5LL);
+    sqlite3_bind_int64(stmt, 2, in_rows * 5LL + 10000);
+    elapsedMicros queryTime;
+    sqlite3_step(stmt);
+    uint32_t queryMicros = queryTime;
+    sqlite3_finalize(stmt);
+
+    Serial.printf("benchmark %s: insert %.0f rows/s, 1000 rows range query %lu us\n", table,
+                  in_rows * 1000000.0 / insertMicros, queryMicros);
+  }
+
+  sqlite3_exec(db, "DROP TABLE LogSamples; DROP TABLE TreeSamples;", nullptr, nullptr, nullptr);
+  sqlite3_close(db);
+  Serial.println("---- benchmarkTimeSeries - end ----");
+}
+
+void benchmarkArchive(int in_rows = 20000)
+{
+  Serial.println("---- benchmarkArchive - begin ----");
+  const char* archiveName = "history.arc";
+  sqlite3* db;
+  int rc = sqlite3_open(dbName, &db);
+
+  if (rc != SQLITE_OK)
+  {
+    checkSQLiteError(db, rc);
+    sqlite3_close(db);
+    return;
+  }
+
+  if (SD.exists(archiveName)) { SD.remove(archiveName); }
+
+  T41SQLiteArchive::registerModule(db);
+  sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS History (ts INTEGER, temperature REAL, state TEXT);",
+               nullptr, nullptr, nullptr);
+  sqlite3_int64 pagesBefore = 0;
+  sqlite3_int64 pagesAfter = 0;
+  sqlite3_int64 pageSize = 0;
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "PRAGMA page_count;", -1, &stmt, nullptr);
+  sqlite3_step(stmt);
+  pagesBefore = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  const char* states[] = { "idle", "heating", "cooling" };
+  sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+  sqlite3_prepare_v2(db, "INSERT INTO History VALUES (?1, ?2, ?3);", -1, &stmt, nullptr);
+
+  for (int i = 0; i < in_rows; ++i)
+  {
+    sqlite3_bind_int64(stmt, 1, 1700000000000LL + i * 1000LL);
+    sqlite3_bind_double(stmt, 2, 20.0 + (i % 100) * 0.05);
+    sqlite3_bind_text(stmt, 3, states[(i / 100) % 3], -1, SQLITE_STATIC);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+
+  sqlite3_finalize(stmt);
+  sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+
+  sqlite3_prepare_v2(db, "PRAGMA page_count;", -1, &stmt, nullptr);
+  sqlite3_step(stmt);
+  pagesAfter = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+  sqlite3_prepare_v2(db, "PRAGMA page_size;", -1, &stmt, nullptr);
+  sqlite3_step(stmt);
+  pageSize = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  uint32_t rowCount = 0;
+  elapsedMicros appendTime;
+  rc = T41SQLiteArchive::append(db, archiveName, "SELECT ts, temperature, state FROM History;", &rowCount);
+  uint32_t appendMicros = appendTime;
+
+  if (rc != SQLITE_OK)
+  {
+    checkSQLiteError(db, rc);
+  }
+
+  File archive = SD.open(archiveName, FILE_READ);
+  uint64_t archiveSize = archive ? archive.size() : 0;
+  archive.close();
+
+  sqlite3_exec(db, "CREATE VIRTUAL TABLE ArchivedHistory USING archive(history.arc);", nullptr, nullptr, nullptr);
+  const char* tables[] = { "History", "ArchivedHistory" };
+
+  for (const char* table : tables)
+  {
+    char sql[128];
+    snprintf(sql, sizeof(sql), "SELECT avg(temperature) FROM %s;", table);
+    sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+    elapsedMicros scanTime;
+    sqlite3_step(stmt);
+    uint32_t scanMicros = scanTime;
+    sqlite3_finalize(stmt);
+
+    Serial.printf("benchmark %s: scan of one column %lu us\n", table, scanMicros);
+  }
+
+  Serial.printf("benchmark archive: %lu rows appended in %lu us, table %llu bytes, archive %llu bytes\n", rowCount,
+                appendMicros, (pagesAfter - pagesBefore) * pageSize, archiveSize);
+
+  sqlite3_exec(db, "DROP TABLE ArchivedHistory; DROP TABLE History;", nullptr, nullptr, nullptr);
+  sqlite3_close(db);
+  SD.remove(archiveName);
+  Serial.println("---- benchmarkArchive - end ----");
+}
+
+void benchmarkCompression(int in_rows = 20000, int in_lookups = 1000)
+{
+  Serial.println("---- benchmarkCompression - begin ----");
+  const char* names[] = { "plain.db", "packed.db" };
+  const char* uris[] = { "plain.db", "file:packed.db?compress=1" };
+
+  for (int i = 0; i < 2; ++i)
+  {
+    if (SD.exists(names[i])) { SD.remove(names[i]); }
+
+    sqlite3* db;
+    int rc = sqlite3_open(uris[i], &db);
+
+    if (rc != SQLITE_OK)
+    {
+      checkSQLiteError(db, rc);
+      sqlite3_close(db);
+      continue;
+    }
+
+    sqlite3_exec(db, "CREATE TABLE Samples (ts INTEGER PRIMARY KEY, temperature REAL, pressure REAL, state TEXT);",
+                 nullptr, nullptr, nullptr);
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, "INSERT INTO Samples VALUES (?1, ?2, ?3, ?4);", -1, &stmt, nullptr);
+    elapsedMicros insertTime;
+    sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+
+    for (int row = 0; row < in_rows; ++row)
+    {
+      sqlite3_bind_int64(stmt, 1, 1700000000000LL + row * 1000LL);
+      sqlite3_bind_double(stmt, 2, 20.0 + (row % 100) * 0.05);
+      sqlite3_bind_double(stmt, 3, 1013.0 - (row % 50) * 0.1);
+      sqlite3_bind_text(stmt, 4, row % 10 == 0 ? "heating" : "idle", -1, SQLITE_STATIC);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
+    }
+
+    sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+    uint32_t insertMicros = insertTime;
+    sqlite3_finalize(stmt);
+
+    sqlite3_prepare_v2(db, "SELECT page_count * page_size FROM pragma_page_count, pragma_page_size;", -1, &stmt, nullptr);
+    sqlite3_step(stmt);
+    sqlite3_int64 logicalSize = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    // lookups with a cold page cache
+    sqlite3_open(uris[i], &db);
+    sqlite3_exec(db, "PRAGMA cache_size=8;", nullptr, nullptr, nullptr);
+    sqlite3_prepare_v2(db, "SELECT temperature FROM Samples WHERE ts = ?1;", -1, &stmt, nullptr);
+    elapsedMicros lookupTime;
+
+    for (int lookup = 0; lookup < in_lookups; ++lookup)
+    {
+      sqlite3_bind_int64(stmt, 1, 1700000000000LL + ((lookup * 7919LL) % in_rows) * 1000LL);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
+    }
+
+    uint32_t lookupMicros = lookupTime;
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    File file = SD.open(names[i], FILE_READ);
+    uint64_t fileSize = file ? file.size() : 0;
+    file.close();
+
+    Serial.printf("benchmark %s: %llu bytes of pages in %llu bytes (ratio %.2f), write %.2f MB/s, lookup %.1f us\n",
+                  uris[i], logicalSize, fileSize, fileSize ? static_cast<double>(logicalSize) / fileSize : 0.0,
+                  static_cast<double>(logicalSize) / insertMicros, static_cast<double>(lookupMicros) / in_lookups);
+    SD.remove(names[i]);
+  }
+
+  Serial.println("---- benchmarkCompression - end ----");
+}
+
+void benchmarkEncryption(int in_pages = 256, int in_rows = 20000, int in_lookups = 1000)
+{
+  Serial.println("---- benchmarkEncryption - begin ----");
+  static const uint8_t key[T41SQLiteCipher::KEY_SIZE] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+                                                          0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+  static T41SQLiteSoftwareCipher softwareCipher;
+#if defined(__IMXRT1062__)
+  static T41SQLiteDCPCipher dcpCipher;
+  T41SQLiteCipher* ciphers[] = { &softwareCipher, &dcpCipher };
+#else
+  T41SQLiteCipher* ciphers[] = { &softwareCipher, &softwareCipher };
+#endif
+  static uint8_t page[4096];
+
+  for (T41SQLiteCipher* cipher : ciphers)
+  {
+    if (cipher->setKey(key, sizeof(key)) != SQLITE_OK)
+    {
+      Serial.printf("benchmark %s: setKey failed\n", cipher->getName());
+      continue;
+    }
+
+    cipher->seedNoncesFromTRNG();
+    uint8_t nonce[T41SQLiteCipher::NONCE_SIZE];
+    elapsedMicros cryptTime;
+
+    for (int i = 0; i < in_pages; ++i)
+    {
+      cipher->generateNonce(nonce);
+      cipher->crypt(nonce, page, sizeof(page));
+    }
+
+    uint32_t cryptMicros = cryptTime;
+    Serial.printf("benchmark %s cipher: %.2f MB/s\n", cipher->getName(),
+                  static_cast<double>(in_pages) * sizeof(page) / cryptMicros);
+  }
+
+  const char* uris[] = { "plain.db", "file:secret.db?encrypt=1", "file:secret.db?encrypt=1" };
+  const char* names[] = { "plain.db", "secret.db", "secret.db" };
+  T41SQLiteCipher* databaseCiphers[] = { nullptr, ciphers[0], ciphers[1] };
+
+  for (int i = 0; i < 3; ++i)
+  {
+    if (SD.exists(names[i])) { SD.remove(names[i]); }
+
+    T41SQLite::getInstance().setCipher(databaseCiphers[i]);
+    sqlite3* db;
+    int rc = sqlite3_open(uris[i], &db);
+
+    if (rc != SQLITE_OK)
+    {
+      checkSQLiteError(db, rc);
+      sqlite3_close(db);
+      continue;
+    }
+
+    T41SQLite::getInstance().prepareEncryption(db);
+    sqlite3_exec(db, "CREATE TABLE Samples (ts INTEGER PRIMARY KEY, temperature REAL, state TEXT);", nullptr, nullptr, nullptr);
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, "INSERT INTO Samples VALUES (?1, ?2, ?3);", -1, &stmt, nullptr);
+    elapsedMicros insertTime;
+    sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+
+    for (int row = 0; row < in_rows; ++row)
+    {
+      sqlite3_bind_int64(stmt, 1, 1700000000000LL + row * 1000LL);
+      sqlite3_bind_double(stmt, 2, 20.0 + (row % 100) * 0.05);
+      sqlite3_bind_text(stmt, 3, row % 10 == 0 ? "heating" : "idle", -1, SQLITE_STATIC);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
+    }
+
+    sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+    uint32_t insertMicros = insertTime;
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    // lookups with a cold page cache
+    sqlite3_open(uris[i], &db);
+    sqlite3_exec(db, "PRAGMA cache_size=8;", nullptr, nullptr, nullptr);
+    sqlite3_prepare_v2(db, "SELECT temperature FROM Samples WHERE ts = ?1;", -1, &stmt, nullptr);
+    elapsedMicros lookupTime;
+
+    for (int lookup = 0; lookup < in_lookups; ++lookup)
+    {
+      sqlite3_bind_int64(stmt, 1, 1700000000000LL + ((lookup * 7919LL) % in_rows) * 1000LL);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
+    }
+
+    uint32_t lookupMicros = lookupTime;
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    Serial.printf("benchmark %s (%s): insert %.1f ms, lookup %.1f us\n", uris[i],
+                  databaseCiphers[i] ? databaseCiphers[i]->getName() : "none", insertMicros / 1000.0,
+                  static_cast<double>(lookupMicros) / in_lookups);
+    SD.remove(names[i]);
+  }
+
+  T41SQLite::getInstance().setCipher(nullptr);
+  Serial.println("---- benchmarkEncryption - end ----");
+}
+
+using T41SQLiteNoopStack = T41SQLiteShimLayer<T41SQLiteShimLayer<T41SQLiteShimLayer<T41SQLiteShimLayer<T41SQLiteShimBase>>>>;
+
+void benchmarkShim(int in_rows = 20000, int in_lookups = 1000, int in_calls = 100000)
+{
+  Serial.println("---- benchmarkShim - begin ----");
+  static T41SQLiteShimStats stats;
+  T41SQLiteShim::registerVfs<T41SQLiteNoopStack>("T41_NOOP");
+  T41SQLiteShim::registerVfs<T41SQLiteStatsShim<T41SQLiteShimBase>>("T41_STATS", "T41_VFS", false, &stats);
+  const char* vfsNames[] = { "T41_VFS", "T41_NOOP", "T41_STATS" };
+
+  for (const char* vfsName : vfsNames)
+  {
+    if (SD.exists("shim.db")) { SD.remove("shim.db"); }
+
+    sqlite3* db;
+    int rc = sqlite3_open_v2("shim.db", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, vfsName);
+
+    if (rc != SQLITE_OK)
+    {
+      checkSQLiteError(db, rc);
+      sqlite3_close(db);
+      continue;
+    }
+
+    sqlite3_exec(db, "CREATE TABLE Samples (ts INTEGER PRIMARY KEY, temperature REAL);", nullptr, nullptr, nullptr);
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, "INSERT INTO Samples VALUES (?1, ?2);", -1, &stmt, nullptr);
+    elapsedMicros insertTime;
+    sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+
+    for (int row = 0; row < in_rows; ++row)
+    {
+      sqlite3_bind_int64(stmt, 1, row);
+      sqlite3_bind_double(stmt, 2, 20.0 + (row % 100) * 0.05);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
+    }
+
+    sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+    uint32_t insertMicros = insertTime;
+    sqlite3_finalize(stmt);
+
+    // lookups with a small page cache, so most of them read a page
+    sqlite3_exec(db, "PRAGMA cache_size=8;", nullptr, nullptr, nullptr);
+    sqlite3_prepare_v2(db, "SELECT temperature FROM Samples WHERE ts = ?1;", -1, &stmt, nullptr);
+    elapsedMicros lookupTime;
+
+    for (int lookup = 0; lookup < in_lookups; ++lookup)
+    {
+      sqlite3_bind_int64(stmt, 1, (lookup * 7919LL) % in_rows);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
+    }
+
+    uint32_t lookupMicros = lookupTime;
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    // cost of the io method dispatch alone: calls of a method, which does no I/O
+    sqlite3_vfs* vfs = sqlite3_vfs_find(vfsName);
+    sqlite3_file* file = static_cast<sqlite3_file*>(sqlite3_malloc(vfs->szOsFile));
+    memset(file, 0, vfs->szOsFile);
+    char path[256];
+    vfs->xFullPathname(vfs, "shim.db", sizeof(path), path);
+    int outFlags = 0;
+    int characteristics = 0;
+    uint32_t callMicros = 0;
+
+    if (vfs->xOpen(vfs, path, file, SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE, &outFlags) == SQLITE_OK)
+    {
+      elapsedMicros callTime;
+
+      for (int call = 0; call < in_calls; ++call)
+      {
+        characteristics |= file->pMethods->xDeviceCharacteristics(file);
+      }
+
+      callMicros = callTime;
+      file->pMethods->xClose(file);
+    }
+
+    sqlite3_free(file);
+
+    Serial.printf("benchmark %s: insert %.1f ms, lookup %.1f us, io method call %.1f ns (%x)\n", vfsName,
+                  insertMicros / 1000.0, static_cast<double>(lookupMicros) / in_lookups,
+                  callMicros * 1000.0 / in_calls, characteristics);
+    SD.remove("shim.db");
+  }
+
+  Serial.printf("benchmark T41_STATS: %u reads (%.1f ms), %u writes (%.1f ms), %u syncs (%.1f ms)\n", stats.reads,
+                stats.readMicros / 1000.0, stats.writes, stats.writeMicros / 1000.0, stats.syncs,
+                stats.syncMicros / 1000.0);
+  T41SQLiteShim::unregisterVfs("T41_STATS");
+  T41SQLiteShim::unregisterVfs("T41_NOOP");
+  Serial.println("---- benchmarkShim - end ----");
+}
+
+template <typename Storage>
+void benchmarkStorageCalls(typename Storage::Filesystem* io_filesystem, int in_calls)
+{
+  typename Storage::File file = Storage::open(io_filesystem, "storage.bin", FILE_READ);
+
+  if (not file)
+  {
+    Serial.printf("benchmark %s: open failed\n", Storage::NAME);
+    return;
+  }
+
+  static uint8_t buffer[64];
+  uint64_t total = 0;
+  elapsedMicros sizeTime;
+
+  for (int call = 0; call < in_calls; ++call)
+  {
+    total += file.size();
+  }
+
+  uint32_t sizeMicros = sizeTime;
+  elapsedMicros readTime;
+
+  // small reads within one sector, so the file cache serves them and the call overhead dominates
+  for (int call = 0; call < in_calls; ++call)
+  {
+    file.seek((call * sizeof(buffer)) % 512, SeekSet);
+    total += file.read(buffer, sizeof(buffer));
+  }
+
+  uint32_t readMicros = readTime;
+  file.close();
+
+  Serial.printf("benchmark %s: size() %.1f ns, seek() + read(64) %.1f ns (%lu)\n", Storage::NAME,
+                sizeMicros * 1000.0 / in_calls, readMicros * 1000.0 / in_calls, static_cast<unsigned long>(total));
+}
+
+void benchmarkStorage(int in_calls = 100000)
+{
+  Serial.println("---- benchmarkStorage - begin ----");
+  static uint8_t data[4096];
+  File file = SD.open("storage.bin", FILE_WRITE_BEGIN);
+  file.write(data, sizeof(data));
+  file.close();
+
+  benchmarkStorageCalls<T41SQLiteArduinoStorage<FS>>(&SD, in_calls);
+  benchmarkStorageCalls<T41SQLiteSdFatStorage>(&SD.sdfs, in_calls);
+  SD.remove("storage.bin");
+
+  // contiguous clusters for a new file, as the VFS requests them for SQLITE_FCNTL_SIZE_HINT
+  T41SQLiteSdFatStorage::File preallocated = T41SQLiteSdFatStorage::open(&SD.sdfs, "prealloc.bin", FILE_WRITE);
+  uint32_t firstSector = 0;
+  uint32_t lastSector = 0;
+  bool isPreallocated = T41SQLiteSdFatStorage::preallocate(preallocated, 1024 * 1024);
+  bool isContiguous = T41SQLiteSdFatStorage::contiguousRange(preallocated, &firstSector, &lastSector);
+  preallocated.close();
+  SD.remove("prealloc.bin");
+
+  Serial.printf("benchmark SdFat preallocate 1 MiB: %s, contiguous %s (sectors %lu - %lu)\n",
+                isPreallocated ? "ok" : "failed", isContiguous ? "yes" : "no",
+                static_cast<unsigned long>(firstSector), static_cast<unsigned long>(lastSector));
+  Serial.println("---- benchmarkStorage - end ----");
+}
+
+void benchmarkLocking(int in_batches = 100, int in_batchRows = 50)
+{
+  Serial.println("---- benchmarkLocking - begin ----");
+  const int readerCounts[] = { 0, 3 };
+
+  // a logger commits batches of rows, reporting connections query the same database between its inserts
+  for (int readerCount : readerCounts)
+  {
+    if (SD.exists("locking.db")) { SD.remove("locking.db"); }
+
+    sqlite3* writer;
+    int rc = sqlite3_open("locking.db", &writer);
+
+    if (rc != SQLITE_OK)
+    {
+      checkSQLiteError(writer, rc);
+      sqlite3_close(writer);
+      continue;
+    }
+
+    sqlite3_exec(writer, "CREATE TABLE Samples (ts INTEGER PRIMARY KEY, temperature REAL);", nullptr, nullptr, nullptr);
+    sqlite3* readers[3];
+    sqlite3_stmt* queries[3];
+
+    for (int i = 0; i < readerCount; ++i)
+    {
+      sqlite3_open("locking.db", &readers[i]);
+      sqlite3_prepare_v2(readers[i], "SELECT count(*), avg(temperature) FROM Samples WHERE ts > ?1;", -1, &queries[i], nullptr);
+    }
+
+    sqlite3_stmt* insert;
+    sqlite3_prepare_v2(writer, "INSERT INTO Samples VALUES (?1, ?2);", -1, &insert, nullptr);
+    int queryCount = 0;
+    int busyCount = 0;
+    elapsedMicros runTime;
+
+    for (int batch = 0; batch < in_batches; ++batch)
+    {
+      sqlite3_exec(writer, "BEGIN;", nullptr, nullptr, nullptr);
+
+      for (int row = 0; row < in_batchRows; ++row)
+      {
+        sqlite3_bind_int(insert, 1, batch * in_batchRows + row);
+        sqlite3_bind_double(insert, 2, 20.0 + row * 0.05);
+        sqlite3_step(insert);
+        sqlite3_reset(insert);
+      }
+
+      // the readers hold SHARED_LOCK next to the RESERVED_LOCK of the writer
+      for (int i = 0; i < readerCount; ++i)
+      {
+        sqlite3_bind_int(queries[i], 1, batch * in_batchRows / 2);
+
+        if (sqlite3_step(queries[i]) == SQLITE_ROW)
+        {
+          ++queryCount;
+        }
+
+        sqlite3_reset(queries[i]);
+      }
+
+      while (sqlite3_exec(writer, "COMMIT;", nullptr, nullptr, nullptr) == SQLITE_BUSY)
+      {
+        ++busyCount;
+      }
+    }
+
+    uint32_t runMicros = runTime;
+    sqlite3_finalize(insert);
+
+    for (int i = 0; i < readerCount; ++i)
+    {
+      sqlite3_finalize(queries[i]);
+      sqlite3_close(readers[i]);
+    }
+
+    sqlite3_close(writer);
+    Serial.printf("benchmark %d readers: %.1f ms per commit, %d queries, %d busy commits\n", readerCount,
+                  runMicros / 1000.0 / in_batches, queryCount, busyCount);
+    SD.remove("locking.db");
+  }
+
+  Serial.println("---- benchmarkLocking - end ----");
+}
+
+void benchmarkExclusiveOwner(int in_rows = 1000, int in_transactions = 2000)
+{
+  Serial.println("---- benchmarkExclusiveOwner - begin ----");
+  const bool modes[] = { false, true };
+
+  // every lookup is a read-only transaction of its own, all pages stay in the page cache
+  for (bool isExclusiveOwner : modes)
+  {
+    if (SD.exists("exclusive.db")) { SD.remove("exclusive.db"); }
+
+    T41SQLite::getInstance().setExclusiveOwner(isExclusiveOwner);
+    sqlite3* db;
+    int rc = sqlite3_open("exclusive.db", &db);
+
+    if (rc != SQLITE_OK)
+    {
+      checkSQLiteError(db, rc);
+      sqlite3_close(db);
+      continue;
+    }
+
+    String setup = String("CREATE TABLE Samples (ts INTEGER PRIMARY KEY, temperature REAL);"
+                          "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < ") + in_rows + ") "
+                   "INSERT INTO Samples SELECT i, 20.0 + i % 100 * 0.05 FROM n;";
+    sqlite3_exec(db, setup.c_str(), nullptr, nullptr, nullptr);
+
+    sqlite3_stmt* query;
+    sqlite3_prepare_v2(db, "SELECT temperature FROM Samples WHERE ts = ?1;", -1, &query, nullptr);
+    double sum = 0.0;
+    elapsedMicros runTime;
+
+    for (int i = 0; i < in_transactions; ++i)
+    {
+      sqlite3_bind_int(query, 1, i % in_rows + 1);
+
+      if (sqlite3_step(query) == SQLITE_ROW)
+      {
+        sum += sqlite3_column_double(query, 0);
+      }
+
+      sqlite3_reset(query);
+    }
+
+    uint32_t runMicros = runTime;
+    sqlite3_finalize(query);
+    sqlite3_close(db);
+    Serial.printf("benchmark exclusive owner %s: %.1f us per read-only transaction (%.1f)\n",
+                  isExclusiveOwner ? "on" : "off", static_cast<double>(runMicros) / in_transactions, sum);
+    SD.remove("exclusive.db");
+  }
+
+  T41SQLite::getInstance().setExclusiveOwner(false);
+  Serial.println("---- benchmarkExclusiveOwner - end ----");
+}
+
+void benchmarkPrefetch(int in_rows = 20000, int in_lookups = 100)
+{
+  Serial.println("---- benchmarkPrefetch - begin ----");
+  const char* uris[] = { "prefetch.db", "file:prefetch.db?prefetch=1" };
+
+  if (SD.exists("prefetch.db")) { SD.remove("prefetch.db"); }
+  if (SD.exists("prefetch.db-hot")) { SD.remove("prefetch.db-hot"); }
+
+  // the first run with "prefetch" records the hot pages, which are saved at the close
+  for (int run = 0; run < 3; ++run)
+  {
+    const char* uri = uris[run == 0 ? 1 : run - 1];
+    sqlite3* db;
+    int rc = sqlite3_open(uri, &db);
+
+    if (rc != SQLITE_OK)
+    {
+      checkSQLiteError(db, rc);
+      sqlite3_close(db);
+      continue;
+    }
+
+    if (run == 0)
+    {
+      String setup = String("CREATE TABLE Samples (ts INTEGER PRIMARY KEY, sensor INTEGER, temperature REAL);"
+                            "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < ") + in_rows + ") "
+                     "INSERT INTO Samples SELECT i, i * 37 % " + in_rows + ", 20.0 + i % 100 * 0.05 FROM n;"
+                     "CREATE INDEX SamplesSensor ON Samples (sensor);";
+      sqlite3_exec(db, setup.c_str(), nullptr, nullptr, nullptr);
+    }
+
+    elapsedMicros prefetchTime;
+    T41SQLite::getInstance().prefetchHotPages(db);
+    uint32_t prefetchMicros = prefetchTime;
+
+    // the page cache is empty after the open, as after a power cycle
+    sqlite3_stmt* query;
+    sqlite3_prepare_v2(db, "SELECT temperature FROM Samples WHERE sensor = ?1;", -1, &query, nullptr);
+    double sum = 0.0;
+    elapsedMicros runTime;
+
+    for (int i = 0; i < in_lookups; ++i)
+    {
+      sqlite3_bind_int(query, 1, (i * 7919) % in_rows);
+
+      if (sqlite3_step(query) == SQLITE_ROW)
+      {
+        sum += sqlite3_column_double(query, 0);
+      }
+
+      sqlite3_reset(query);
+    }
+
+    uint32_t runMicros = runTime;
+    sqlite3_finalize(query);
+    sqlite3_close(db);
+
+    if (run > 0)
+    {
+      Serial.printf("benchmark %s: prefetch %lu us, first %d cold lookups %.1f us each (%.1f)\n", uri,
+                    prefetchMicros, in_lookups, static_cast<double>(runMicros) / in_lookups, sum);
+    }
+  }
+
+  SD.remove("prefetch.db");
+  SD.remove("prefetch.db-hot");
+  Serial.println("---- benchmarkPrefetch - end ----");
+}
+
+#if TEENSY_41_SQLITE_MUTEX_BACKEND == TEENSY_41_SQLITE_MUTEX_TEENSYTHREADS
+struct ThreadsBenchmark
+{
+  volatile bool stop = false;
+  volatile uint32_t queryCount = 0;
+  volatile uint32_t commitCount = 0;
+  volatile uint32_t errorCount = 0;
+};
+
+void benchmarkThreadsWriter(void* io_benchmark)
+{
+  ThreadsBenchmark* benchmark = static_cast<ThreadsBenchmark*>(io_benchmark);
+  sqlite3* db;
+  sqlite3_open("threads.db", &db);
+  sqlite3_busy_timeout(db, 1000);
+  sqlite3_stmt* insert;
+  sqlite3_prepare_v2(db, "INSERT INTO Samples (temperature) VALUES (?1);", -1, &insert, nullptr);
+
+  while (not benchmark->stop)
+  {
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+      ++benchmark->errorCount;
+      continue;
+    }
+
+    for (int row = 0; row < 10; ++row)
+    {
+      sqlite3_bind_double(insert, 1, 20.0 + row * 0.05);
+      sqlite3_step(insert);
+      sqlite3_reset(insert);
+    }
+
+    if (sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr) == SQLITE_OK)
+    {
+      ++benchmark->commitCount;
+    }
+    else
+    {
+      ++benchmark->errorCount;
+      sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+    }
+  }
+
+  sqlite3_finalize(insert);
+  sqlite3_close(db);
+}
+
+void benchmarkThreadsReader(void* io_benchmark)
+{
+  ThreadsBenchmark* benchmark = static_cast<ThreadsBenchmark*>(io_benchmark);
+  sqlite3* db;
+  sqlite3_open("threads.db", &db);
+  sqlite3_busy_timeout(db, 1000);
+  sqlite3_stmt* query;
+  sqlite3_prepare_v2(db, "SELECT count(*), avg(temperature) FROM Samples WHERE ts > (SELECT max(ts) FROM Samples) - 500;",
+                     -1, &query, nullptr);
+
+  while (not benchmark->stop)
+  {
+    if (sqlite3_step(query) == SQLITE_ROW)
+    {
+      ++benchmark->queryCount;
+    }
+    else
+    {
+      ++benchmark->errorCount;
+    }
+
+    sqlite3_reset(query);
+  }
+
+  sqlite3_finalize(query);
+  sqlite3_close(db);
+}
+
+// each thread has its own connection, the VFS serializes the SD card access, the query work runs in parallel
+void benchmarkThreads(uint32_t in_runMillis = 2000)
+{
+  Serial.println("---- benchmarkThreads - begin ----");
+  Serial.printf("benchmark mutex backend %s, SQLITE_THREADSAFE %d\n", T41SQLiteMutex::getName(), sqlite3_threadsafe());
+  const char* journalModes[] = { "DELETE", "WAL" };
+  const int readerCounts[] = { 0, 1, 2, 4 };
+
+  for (const char* journalMode : journalModes)
+  {
+    if (SD.exists("threads.db")) { SD.remove("threads.db"); }
+
+    sqlite3* db;
+    sqlite3_open("threads.db", &db);
+    String setup = String("PRAGMA journal_mode=") + journalMode + ";"
+                   "CREATE TABLE Samples (ts INTEGER PRIMARY KEY, temperature REAL);"
+                   "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 5000) "
+                   "INSERT INTO Samples (temperature) SELECT 20.0 + i % 100 * 0.05 FROM n;";
+    sqlite3_exec(db, setup.c_str(), nullptr, nullptr, nullptr);
+
+    for (int readerCount : readerCounts)
+    {
+      ThreadsBenchmark benchmark;
+      int threadIds[5];
+      int threadCount = 0;
+      threadIds[threadCount++] = threads.addThread(benchmarkThreadsWriter, &benchmark, 8192);
+
+      for (int i = 0; i < readerCount; ++i)
+      {
+        threadIds[threadCount++] = threads.addThread(benchmarkThreadsReader, &benchmark, 8192);
+      }
+
+      threads.delay(in_runMillis);
+      benchmark.stop = true;
+
+      for (int i = 0; i < threadCount; ++i)
+      {
+        threads.wait(threadIds[i]);
+      }
+
+      Serial.printf("benchmark %s, 1 writer + %d readers: %.1f queries/s, %.1f commits/s, %lu errors\n", journalMode,
+                    readerCount, benchmark.queryCount * 1000.0 / in_runMillis,
+                    benchmark.commitCount * 1000.0 / in_runMillis, benchmark.errorCount);
+    }
+
+    sqlite3_exec(db, "PRAGMA journal_mode=DELETE;", nullptr, nullptr, nullptr);
+    sqlite3_close(db);
+    SD.remove("threads.db");
+  }
+
+  Serial.println("---- benchmarkThreads - end ----");
+}
+#endif
+
+void setup()
+{
+  setupSerial(115200);
+  delaySetup(3);
+
+  if (not SD.begin(BUILTIN_SDCARD))
+  {
+    Serial.println("SD.begin() failed! - Halting!");
+    while (true) { delay(1000); }
+  }
+
+  if (SD.exists(dbName)) { if (not SD.remove(dbName)) { Serial.printf("Remove %s failed!", dbName); } }
+  if (SD.exists(dbJournalName)) { if (not SD.remove(dbJournalName)) { Serial.printf("Remove %s failed!", dbJournalName); } }
+  if (SD.exists(dbMirrorSlotName)) { if (not SD.remove(dbMirrorSlotName)) { Serial.printf("Remove %s failed!", dbMirrorSlotName); } }
+  if (SD.exists(dbMirrorRecordName)) { if (not SD.remove(dbMirrorRecordName)) { Serial.printf("Remove %s failed!", dbMirrorRecordName); } }
+  if (SD.exists(dbBatchLogName)) { if (not SD.remove(dbBatchLogName)) { Serial.printf("Remove %s failed!", dbBatchLogName); } }
+  if (SD.exists(dbWalName)) { if (not SD.remove(dbWalName)) { Serial.printf("Remove %s failed!", dbWalName); } }
+
+  T41SQLite::getInstance().setLogCallback(errorLogCallback);
+#if TEENSY_41_SQLITE_STORAGE_BACKEND == TEENSY_41_SQLITE_BACKEND_SDFAT
+  int resultBegin = T41SQLite::getInstance().begin(&SD.sdfs);
+#else
+  int resultBegin = T41SQLite::getInstance().begin(&SD);
+#endif
+
+  if (resultBegin == SQLITE_OK)
+  {
+    Serial.println("T41SQLite::getInstance().begin() succeded!");
+
+#ifdef USE_TEENSY_41_SQLITE_PROFILE
+    T41SQLiteProfile::reset();
+    T41SQLiteProfile::start();
+    testSQLite();
+    T41SQLiteProfile::stop();
+    T41SQLiteProfile::print(Serial);
+#else
     testSQLite();
+#endif // USE_TEENSY_41_SQLITE_PROFILE
+    benchmarkDTCM();
+    benchmarkMirror();
+    benchmarkBatchAtomic();
+    benchmarkWAL();
+    benchmarkGroupCommit();
+    benchmarkCursor();
+    benchmarkMaintenance();
+    benchmarkIngest();
+    benchmarkStatementCache();
+    benchmarkSchema();
+    benchmarkWrappers();
+    benchmarkArray();
+    benchmarkTimeSeries();
+    benchmarkArchive();
+    benchmarkCompression();
+    benchmarkEncryption();
+    benchmarkShim();
+    benchmarkStorage();
+    benchmarkLocking();
+    benchmarkExclusiveOwner();
+    benchmarkPrefetch();
+#if TEENSY_41_SQLITE_MUTEX_BACKEND == TEENSY_41_SQLITE_MUTEX_TEENSYTHREADS
+    benchmarkThreads();
+#endif
 
     int resultEnd = T41SQLite::getInstance().end();
 
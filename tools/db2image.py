@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+"""
+Converts an SQLite database file into a C++ source file, which links the database as read-only image
+into program flash (section .sqliteImages, see linkerScript/imxrt1062_t41_sqlite3.ld).
+
+The generated file defines a T41SQLite::MemoryImage, which has to be registered before the database is opened:
+
+  extern const T41SQLite::MemoryImage calib_db;
+  T41SQLite::getInstance().addMemoryImage(calib_db);
+  sqlite3_open_v2("file:calib.db?vfs=T41_IMAGE_VFS&immutable=1", &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, nullptr);
+
+Example:
+  python3 tools/db2image.py calib.db src/calib_db.cpp --vacuum
+"""
+
+import argparse
+import os
+import re
+import sqlite3
+import sys
+import tempfile
+
+SQLITE_HEADER_MAGIC = b"SQLite format 3\x00"
+BYTES_PER_LINE = 16
+
+
+def vacuum_copy(path):
+    descriptor, vacuumed = tempfile.mkstemp(suffix=".db")
+    os.close(descriptor)
+    os.remove(vacuumed)
+
+    connection = sqlite3.connect(path)
+    try:
+        connection.execute("VACUUM INTO ?", (vacuumed,))
+    finally:
+        connection.close()
+
+    return vacuumed
+
+
+def read_database(path, vacuum):
+    source = vacuum_copy(path) if vacuum else path
+
+    try:
+        with open(source, "rb") as database:
+            image = database.read()
+    finally:
+        if source != path:
+            os.remove(source)
+
+    if len(image) < 100 or not image.startswith(SQLITE_HEADER_MAGIC):
+        sys.exit("%s is not an SQLite database" % path)
+
+    # bytes 18 and 19: file format write/read version, 2 means WAL, which the image VFS cannot serve
+    if image[18] == 2 or image[19] == 2:
+        sys.exit("%s is in WAL mode, run PRAGMA journal_mode=DELETE (or use --vacuum) first" % path)
+
+    page_size = int.from_bytes(image[16:18], "big")
+    page_size = 65536 if page_size == 1 else page_size
+
+    if len(image) % page_size != 0:
+        sys.exit("size of %s is not a multiple of its page size %d" % (path, page_size))
+
+    return image, page_size
+
+
+def write_source(path, image, page_size, name, symbol, source_name):
+    with open(path, "w") as source:
+        source.write("// generated by tools/db2image.py from %s (%d bytes, page size %d), do not edit\n\n"
+                     % (source_name, len(image), page_size))
+        source.write("#include \"teensy41SQLite.hpp\"\n\n")
+        source.write("TEENSY_41_SQLITE_FLASH_IMAGE static const unsigned char %s_data[%d] =\n{\n" % (symbol, len(image)))
+
+        for offset in range(0, len(image), BYTES_PER_LINE):
+            line = image[offset:offset + BYTES_PER_LINE]
+            source.write("  " + ", ".join("0x%02X" % byte for byte in line) + ",\n")
+
+        source.write("};\n\n")
+        source.write("extern const T41SQLite::MemoryImage %s = { \"%s\", %s_data, sizeof(%s_data) };\n"
+                     % (symbol, name, symbol, symbol))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("database", help="SQLite database file")
+    parser.add_argument("output", help="C++ source file to write (e.g. src/calib_db.cpp)")
+    parser.add_argument("--name", help="file name used to open the image (default: file name of database)")
+    parser.add_argument("--symbol", help="name of the T41SQLite::MemoryImage variable (default: derived from --name)")
+    parser.add_argument("--vacuum", action="store_true", help="compact the database (VACUUM INTO) before converting")
+    arguments = parser.parse_args()
+
+    name = arguments.name or os.path.basename(arguments.database)
+    symbol = arguments.symbol or re.sub(r"\W", "_", name)
+
+    if not re.match(r"^[A-Za-z_]\w*$", symbol):
+        sys.exit("%s is not a valid C++ identifier, use --symbol" % symbol)
+
+    image, page_size = read_database(arguments.database, arguments.vacuum)
+    write_source(arguments.output, image, page_size, name, symbol, os.path.basename(arguments.database))
+
+    print("%s: %d bytes (%d pages) -> %s (%s)" % (name, len(image), len(image) // page_size, arguments.output, symbol))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+"""
+Generates linkerScript/imxrt1062_t41_sqlite3_itcm.ld from a T41SQLiteProfile capture.
+
+The capture contains lines "T41SQLITE_PROFILE <function address> <calls> <exclusive cycles>"
+(printed by T41SQLiteProfile::print). The addresses are resolved against the firmware.elf of the
+profile build. The functions with the most cycles per byte are selected until the ITCM budget is used up.
+
+Example:
+  python3 tools/itcm_hotlist.py --profile profile.txt --elf .pio/build/teensy41_profile/firmware.elf --budget 32768
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+
+DEFAULT_OUTPUT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "linkerScript", "imxrt1062_t41_sqlite3_itcm.ld")
+PROFILE_TAG = "T41SQLITE_PROFILE"
+
+
+def read_profile(path):
+    samples = {}
+
+    with open(path, "r", errors="replace") as profile:
+        for line in profile:
+            fields = line.split()
+
+            if len(fields) != 4 or fields[0] != PROFILE_TAG:
+                continue
+
+            address = int(fields[1], 16) & ~1  # clear thumb bit
+            calls, cycles = samples.get(address, (0, 0))
+            samples[address] = (calls + int(fields[2]), cycles + int(fields[3]))
+
+    return samples
+
+
+def read_symbols(elf, nm):
+    output = subprocess.run([nm, "--print-size", "--defined-only", elf],
+                            check=True, capture_output=True, text=True).stdout
+    symbols = {}
+
+    for line in output.splitlines():
+        fields = line.split()
+
+        # <address> <size> <type> <name>
+        if len(fields) != 4 or fields[2] not in ("t", "T", "w", "W"):
+            continue
+
+        symbols[int(fields[0], 16) & ~1] = (fields[3], int(fields[1], 16))
+
+    return symbols
+
+
+def select_hot_functions(samples, symbols, budget, prefixes):
+    candidates = []
+    unresolved = 0
+
+    for address, (calls, cycles) in samples.items():
+        if address not in symbols:
+            unresolved += 1
+            continue
+
+        name, size = symbols[address]
+
+        if prefixes and not name.startswith(tuple(prefixes)):
+            continue
+
+        candidates.append((name, size, calls, cycles))
+
+    candidates.sort(key=lambda candidate: candidate[3] / max(candidate[1], 1), reverse=True)
+
+    selected = []
+    used = 0
+
+    for name, size, calls, cycles in candidates:
+        aligned_size = (size + 3) & ~3
+
+        if used + aligned_size > budget:
+            continue
+
+        selected.append((name, size, calls, cycles))
+        used += aligned_size
+
+    return selected, used, sum(candidate[3] for candidate in candidates), unresolved
+
+
+def write_linker_fragment(path, selected, used, budget, total_cycles):
+    selected_cycles = sum(function[3] for function in selected)
+
+    with open(path, "w") as fragment:
+        fragment.write("/*\n")
+        fragment.write("** Hot SQLite functions placed in ITCM (included by imxrt1062_t41_sqlite3.ld).\n")
+        fragment.write("** This file is generated by tools/itcm_hotlist.py from a profile run (see teensy41SQLiteProfile.hpp).\n")
+        fragment.write("** Used %d of %d bytes, covering %.1f%% of the profiled cycles.\n"
+                       % (used, budget, 100.0 * selected_cycles / total_cycles if total_cycles else 0.0))
+        fragment.write("*/\n")
+
+        for name, size, calls, cycles in selected:
+            fragment.write("*(.text.%s) /* %d bytes, %d calls, %d cycles */\n"
+                           % (name, size, calls, cycles))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--profile", required=True, help="captured output of T41SQLiteProfile::print")
+    parser.add_argument("--elf", required=True, help="firmware.elf of the profile build")
+    parser.add_argument("--budget", type=int, default=32768, help="ITCM bytes available for SQLite code (default: 32768)")
+    parser.add_argument("--nm", default="arm-none-eabi-nm", help="nm of the toolchain (default: arm-none-eabi-nm)")
+    parser.add_argument("--prefix", action="append", default=[],
+                        help="only place functions with this name prefix (may be repeated, default: all profiled functions)")
+    parser.add_argument("--output", default=DEFAULT_OUTPUT, help="linker fragment to write")
+    arguments = parser.parse_args()
+
+    samples = read_profile(arguments.profile)
+
+    if not samples:
+        sys.exit("no %s lines found in %s" % (PROFILE_TAG, arguments.profile))
+
+    symbols = read_symbols(arguments.elf, arguments.nm)
+    selected, used, total_cycles, unresolved = select_hot_functions(samples, symbols, arguments.budget, arguments.prefix)
+    write_linker_fragment(arguments.output, selected, used, arguments.budget, total_cycles)
+
+    print("placed %d functions (%d of %d bytes) in ITCM, %d addresses unresolved -> %s"
+          % (len(selected), used, arguments.budget, unresolved, arguments.output))
+
+
+if __name__ == "__main__":
+    main()